@@ -2,7 +2,10 @@
 #define _F17FS_H__
 
 #include <sys/types.h>
+#include <time.h>
 #include <block_store.h>
+#include <bitmap.h>
+#include <buffer_cache.h>
 #include <dyn_array.h>
 
 typedef struct F17FS F17FS_t;
@@ -11,6 +14,10 @@ typedef struct inode inode_t;
 typedef struct dir_files dir_files_t;
 typedef struct directory directory_t;
 typedef struct superRoot superRoot_t;
+typedef struct fs_dir fs_dir_t;
+typedef struct fsckWorker fsckWorker_t;
+typedef struct snapshotTable snapshotTable_t;
+typedef struct snapshotHeader snapshotHeader_t;
 
 typedef enum { FS_SEEK_SET, FS_SEEK_CUR, FS_SEEK_END } seek_t;
 
@@ -19,6 +26,94 @@ typedef enum { FS_REGULAR, FS_DIRECTORY } file_t;
 #define FS_FNAME_MAX (64)
 // INCLUDING null terminator
 
+#define FS_FD_MAX (65536)
+// Most descriptors one F17FS object can have open at once
+
+#define FS_JOURNAL_GROUP_COMMIT (64)
+// Metadata operations batched into one journal commit by default
+
+#define FS_CACHE_BYTES (1024 * 1024)
+// Buffer cache budget by default, 2048 blocks
+
+#define FS_WRITEBACK_INTERVAL_MS (100)
+// How often the writeback thread wakes up by default
+
+#define FS_DIRTY_EXPIRE_MS (3000)
+// Age at which dirty data and batched metadata get written back by default
+
+#define FS_DIRTY_BACKGROUND_BLOCKS (4096)
+// Dirty blocks (2MB) that start writeback early by default, whatever their age
+
+#define FS_WRITEBACK_BATCH_BLOCKS (1024)
+// Most blocks one writeback pass flushes by default
+
+#define FS_SCRUB_INTERVAL_MS (100)
+// How often the scrubber wakes up to check its next batch
+
+#define FS_COMPRESS_CHUNK_BYTES (4096)
+// Logical bytes of a compressed file compressed (and read back) as one piece, 8 blocks
+
+#define FS_SNAPSHOT_MAX (6)
+// Most snapshots one image keeps
+
+typedef struct {
+    // Zeroed fields keep the default
+    size_t journalGroupCommit; // Operations per journal commit (1 makes every operation durable on return)
+    bool writeback; // Starts a thread that writes dirty blocks back in the background
+    unsigned writebackIntervalMs; // Time between writeback passes
+    unsigned dirtyExpireMs; // Dirty data and uncommitted metadata older than this are written back
+    size_t dirtyBackgroundBlocks; // More dirty blocks than this are written back whatever their age
+    size_t writebackBatchBlocks; // Most blocks flushed per pass, bounds how long one pass holds the disk
+    size_t cacheBytes; // Buffer cache budget
+    buffer_cache_policy_t cachePolicy; // Buffer cache eviction, ARC by default
+    block_store_checksum_t checksums; // Per-block CRC-32C, checked on every read or lazily, off by default
+    unsigned scrubBlocksPerSecond; // With checksums, starts a thread checking this many allocated blocks a second
+    block_store_mismatch_t checksumCallback; // Told about each block failing its checksum, on read or scrub
+    void *checksumArg; // Passed to checksumCallback
+    bool dedup; // File blocks holding the same bytes share one block, found through an on-image hash index
+    const char *snapshot; // Name of a snapshot to mount read-only instead of the live tree, NULL for the live tree
+    bool punchHoles; // Space of freed blocks goes back to the host file system with each flush or writeback pass
+    bool prefault; // Faults the whole image in at mount, so the first requests after it don't take page faults
+    bool hugePages; // Maps the image at a huge page boundary and asks for transparent huge pages
+    block_store_access_t access; // Readahead hint for the image's mapping
+} fs_mount_options_t;
+
+typedef struct {
+    // One snapshot of an image, see fs_snapshot_list
+    char name[FS_FNAME_MAX];
+    time_t createTime;
+} fs_snapshot_t;
+
+typedef struct {
+    // What dedup found to share, see fs_get_dedup_stats
+    size_t lookups; // Blocks written with dedup on, this mount
+    size_t hits; // Of those, the ones that got shared instead of written
+    size_t sharedBlocks; // File blocks that point at a block another file block already holds: what sharing saves
+    size_t dataBlocks; // Blocks holding the files' data, each counted once however many files share it
+    size_t usedBlocks; // Blocks in use, metadata included
+    double ratio; // Blocks the files would take without sharing over the blocks they take, 1.0 for none
+} fs_dedup_stats_t;
+
+typedef struct {
+    // What fs_fsck found, and fixed when asked to
+    size_t inodesChecked; // Inodes marked in use
+    size_t blocksInUse; // Blocks some inode points at
+    size_t leakedBlocks; // Marked in use in the FBM, but nothing points at them
+    size_t unmarkedBlocks; // Pointed at, but free in the FBM
+    size_t doubleAllocated; // Extra pointers to a block something else already points at
+    size_t badPointers; // Pointers into the superRoot, the inode table, the FBM or past the end
+    size_t danglingEntries; // Directory entries naming a free inode, or the wrong kind of file
+    size_t orphanInodes; // Inodes in use that no directory reaches
+    size_t linkCountErrors; // Link counts that disagree with the names found
+    size_t countErrors; // Free counts saved by a clean unmount that disagree with the maps
+    size_t refcountErrors; // Shared blocks whose owner count disagrees with the pointers to them
+    size_t repaired; // Problems fixed
+    size_t unrepaired; // Problems still there after a repair
+} fs_fsck_report_t;
+
+#define FS_ROOT_DIR (0)
+// Directory handle of the root, always valid
+
 typedef struct {
     // You can add more if you want
     // vvv just don't remove or rename these vvv
@@ -34,6 +129,13 @@ typedef struct {
 ///
 F17FS_t *fs_format(const char *path);
 
+///
+/// Formats (and mounts) an F17FS in memory, for scratch use
+///   Nothing touches the disk; fs_serialize saves it, and it is gone once unmounted
+/// \return Mounted F17FS object, NULL on error
+///
+F17FS_t *fs_format_mem();
+
 ///
 /// Mounts an F17FS object and prepares it for use
 /// \param fname The file to mount
@@ -43,6 +145,15 @@ F17FS_t *fs_format(const char *path);
 ///
 F17FS_t *fs_mount(const char *path);
 
+///
+/// Mounts an F17FS object with non-default options
+///   Like fs_mount, any transactions left in the journal are replayed first
+/// \param fname The file to mount
+/// \param options Mount options, NULL or zeroed fields for the defaults
+/// \return Mounted F17FS object, NULL on error
+///
+F17FS_t *fs_mount_with_options(const char *path, const fs_mount_options_t *options);
+
 ///
 /// Unmounts the given object and frees all related resources
 /// \param fs The F17FS object to unmount
@@ -51,6 +162,15 @@ F17FS_t *fs_mount(const char *path);
 int fs_unmount(F17FS_t *fs);
 
 
+///
+/// Looks up a directory and returns a handle for the *at calls
+///   The handle stays valid until the directory is removed; it never reaches a later directory reusing the inode
+/// \param fs The F17FS containing the directory
+/// \param path Absolute path to the directory
+/// \return directory handle, < 0 on error
+///
+int fs_lookup(F17FS_t *fs, const char *path);
+
 ///
 /// Creates a new file at the specified location
 ///   Directories along the path that do not exist are not created
@@ -61,6 +181,17 @@ int fs_unmount(F17FS_t *fs);
 ///
 int fs_create(F17FS_t *fs, const char *path, file_t type);
 
+///
+/// Creates a new file relative to a directory handle
+///   Same rules as fs_create, but the walk starts in the handle's directory
+/// \param fs The F17FS containing the file
+/// \param directory Handle of the directory the path starts in
+/// \param path Relative path to file to create
+/// \param type Type of file to create (regular/directory)
+/// \return 0 on success, < 0 on failure
+///
+int fs_createat(F17FS_t *fs, int directory, const char *path, file_t type);
+
 ///
 /// Opens the specified file for use
 ///   R/W position is set to the beginning of the file (BOF)
@@ -71,6 +202,15 @@ int fs_create(F17FS_t *fs, const char *path, file_t type);
 ///
 int fs_open(F17FS_t *fs, const char *path);
 
+///
+/// Opens a file relative to a directory handle
+/// \param fs The F17FS containing the file
+/// \param directory Handle of the directory the path starts in
+/// \param path Relative path to the requested file
+/// \return file descriptor to the requested file, < 0 on error
+///
+int fs_openat(F17FS_t *fs, int directory, const char *path);
+
 ///
 /// Closes the given file descriptor
 /// \param fs The F17FS containing the file
@@ -125,6 +265,15 @@ ssize_t fs_write(F17FS_t *fs, int fd, const void *src, size_t nbyte);
 ///
 int fs_remove(F17FS_t *fs, const char *path);
 
+///
+/// Deletes a file relative to a directory handle
+/// \param fs The F17FS containing the file
+/// \param directory Handle of the directory the path starts in
+/// \param path Relative path to file to remove
+/// \return 0 on success, < 0 on error
+///
+int fs_removeat(F17FS_t *fs, int directory, const char *path);
+
 ///
 /// Populates a dyn_array with information about the files in a directory
 ///   Array contains up to 15 file_record_t structures
@@ -134,6 +283,60 @@ int fs_remove(F17FS_t *fs, const char *path);
 ///
 dyn_array_t *fs_get_dir(F17FS_t *fs, const char *path);
 
+///
+/// Populates a dyn_array with information about the files in a directory relative to a handle
+/// \param fs The F17FS containing the file
+/// \param directory Handle of the directory the path starts in
+/// \param path Relative path to the directory to inspect, empty for the handle's own directory
+/// \return dyn_array of file records, NULL on error
+///
+dyn_array_t *fs_get_dirat(F17FS_t *fs, int directory, const char *path);
+
+///
+/// Opens a cursor over the entries of a directory
+///   Entries are those in the directory when it was opened
+/// \param fs The F17FS containing the directory
+/// \param path Absolute path to the directory
+/// \return directory cursor, NULL on error
+///
+fs_dir_t *fs_opendir(F17FS_t *fs, const char *path);
+
+///
+/// Opens a cursor over the entries of a directory relative to a handle
+/// \param fs The F17FS containing the directory
+/// \param directory Handle of the directory the path starts in
+/// \param path Relative path to the directory, empty for the handle's own directory
+/// \return directory cursor, NULL on error
+///
+fs_dir_t *fs_opendirat(F17FS_t *fs, int directory, const char *path);
+
+///
+/// Reads the next entry from a directory cursor
+/// \param fs The F17FS containing the directory
+/// \param dir The cursor to advance
+/// \param record Where the entry is copied
+/// \return 1 when an entry was read, 0 at the end of the directory, < 0 on error
+///
+int fs_readdir(F17FS_t *fs, fs_dir_t *dir, file_record_t *record);
+
+///
+/// Reads up to count entries from a directory cursor into a caller supplied array
+/// \param fs The F17FS containing the directory
+/// \param dir The cursor to advance
+/// \param records Array of at least count records
+/// \param count Most entries to read
+/// \return number of entries read (0 at the end of the directory), < 0 on error
+///
+ssize_t fs_readdir_batch(F17FS_t *fs, fs_dir_t *dir, file_record_t *records, size_t count);
+
+///
+/// Closes a directory cursor
+/// \param fs The F17FS containing the directory
+/// \param dir The cursor to close
+/// \return 0 on success, < 0 on failure
+///
+int fs_closedir(F17FS_t *fs, fs_dir_t *dir);
+
 /// Moves the file from one location to the other
 ///   Moving files does not affect open descriptors
 /// \param fs The F17FS containing the file
@@ -143,18 +346,193 @@ dyn_array_t *fs_get_dir(F17FS_t *fs, const char *path);
 ///
 int fs_move(F17FS_t *fs, const char *src, const char *dst);
 
+///
+/// Makes another name for an existing file or directory
+///   Both names share the inode, it is reclaimed once the last name is removed
+/// \param fs The F17FS containing the file
+/// \param src Absolute path of the existing file
+/// \param dst Absolute path of the new name
+/// \return 0 on success, < 0 on error
+///
+int fs_link(F17FS_t *fs, const char *src, const char *dst);
+
+///
+/// Makes the data and metadata of one file durable
+///   Only the blocks of that file are flushed, neighbouring blocks in one go
+/// \param fs The F17FS containing the file
+/// \param fd The file to flush
+/// \return 0 on success, < 0 on error
+///
+int fs_fsync(F17FS_t *fs, int fd);
+
+///
+/// Makes everything written to the file system so far durable
+/// \param fs The F17FS to flush
+/// \return 0 on success, < 0 on error
+///
+int fs_sync(F17FS_t *fs);
+
+///
+/// Writes a copy of the file system to a file, which mounts like any other image
+///   Everything written before the call goes in, as fs_sync leaves it; keep writers out while it runs.
+///   Only blocks in use are copied, the rest of the file is left sparse
+/// \param fs The F17FS to save
+/// \param path The file to write, overwritten if it exists
+/// \return 0 on success, < 0 on error
+///
+int fs_serialize(F17FS_t *fs, const char *path);
+
+///
+/// Turns transparent compression on or off for a regular file, which has to be empty
+///   A compressed file is stored in chunks of FS_COMPRESS_CHUNK_BYTES, each packed into as few blocks
+///   as it compresses to; all-zero chunks take no blocks, chunks that don't shrink are stored as they are
+/// \param fs The F17FS containing the file
+/// \param fd The file to change
+/// \param compressed true to compress what gets written from now on
+/// \return 0 on success, < 0 on error (including a file that already has data)
+///
+int fs_set_compressed(F17FS_t *fs, int fd, bool compressed);
+
+///
+/// Freezes the tree as it is now under a name, mountable read-only later through fs_mount_options_t.snapshot
+///   Only the inode table is copied: every block the inodes point at gains the snapshot as an owner, and the
+///   live tree copies a shared block before it writes to it, so taking a snapshot costs the same whatever the data
+/// \param fs The F17FS to snapshot, not itself a snapshot
+/// \param name Name for the snapshot, shorter than FS_FNAME_MAX and not taken yet
+/// \return 0 on success, < 0 on error (including no room left for it)
+///
+int fs_snapshot_create(F17FS_t *fs, const char *name);
+
+///
+/// Deletes a snapshot, freeing the blocks nothing else owns anymore
+/// \param fs The F17FS holding the snapshot, not itself a snapshot
+/// \param name The snapshot
+/// \return 0 on success, < 0 on error
+///
+int fs_snapshot_delete(F17FS_t *fs, const char *name);
+
+///
+/// Populates a dyn_array with the snapshots of an image
+/// \param fs The F17FS holding the snapshots
+/// \return dyn_array of fs_snapshot_t, NULL on error
+///
+dyn_array_t *fs_snapshot_list(F17FS_t *fs);
+
+///
+/// Copies out the buffer cache counters (hits, misses, evictions)
+/// \param fs The F17FS to inspect
+/// \param stats Where to put them
+/// \return 0 on success, < 0 on error
+///
+int fs_get_cache_stats(F17FS_t *fs, buffer_cache_stats_t *stats);
+
+///
+/// Counts the blocks still free, without scanning the free block map
+/// \param fs The F17FS to inspect
+/// \return Free blocks, SIZE_MAX on error
+///
+size_t fs_get_free_blocks(F17FS_t *fs);
+
+///
+/// Counts the inodes still free, without scanning the inode bitmap
+/// \param fs The F17FS to inspect
+/// \return Free inodes, SIZE_MAX on error
+///
+size_t fs_get_free_inodes(F17FS_t *fs);
+
+///
+/// Counts the reads and scrubs that found a block not matching its checksum
+/// \param fs The F17FS to inspect
+/// \return Mismatches so far, SIZE_MAX on error
+///
+size_t fs_get_checksum_errors(F17FS_t *fs);
+
+///
+/// Counts the blocks written but not yet flushed to the backing file
+/// \param fs The F17FS to inspect
+/// \return Dirty blocks, SIZE_MAX on error
+///
+size_t fs_get_dirty_blocks(F17FS_t *fs);
+
+///
+/// Copies out how much dedup has found to share
+/// \param fs The F17FS to inspect
+/// \param stats Where to put them
+/// \return 0 on success, < 0 on error
+///
+int fs_get_dedup_stats(F17FS_t *fs, fs_dedup_stats_t *stats);
+
+///
+/// Checks an unmounted image: the FBM, the inode map, every inode's block pointers and every
+///  directory entry, the block walk split across threads by inode range; the inodes of every snapshot are walked
+///  too, but only the live tree is repaired
+///  The journal is replayed first, as a mount would
+/// \param path The image to check
+/// \param repair Fixes what was found: leaks are freed, unmarked blocks marked, doubly allocated
+///  blocks copied for each extra owner, shared blocks given the owner count found, bad pointers and
+///  dangling entries cleared, orphans freed
+/// \param threads Threads to check with, 0 for one per processor
+/// \param report Where to put what was found, may be NULL
+///  The image is checked again after a repair, and whatever that finds is counted in unrepaired
+/// \return 0 if the image is consistent, 1 if it wasn't (see repaired and unrepaired), < 0 if it couldn't be checked
+///
+int fs_fsck(const char *path, bool repair, size_t threads, fs_fsck_report_t *report);
+
 //HelperFunctions
+F17FS_t* mountBlockStore(block_store_t* blockStore, const fs_mount_options_t* options);
+F17FS_t* formatBlockStore(block_store_t* blockStore);
+void loadFreeCounts(F17FS_t* fs);
+void saveFreeCounts(block_store_t* blockStore, superRoot_t* root, size_t freeInodes);
 int traverseFilePath(const char *path, F17FS_t *fs, directory_t* parentDirectory ,inode_t* inode, file_record_t* file);
+int traverseFromDirectory(F17FS_t* fs, int directory, const char* path, directory_t* parentDirectory, inode_t* inode, file_record_t* file);
+int readDirectoryHandle(F17FS_t* fs, int directory, inode_t* inode, directory_t* entries);
+int resolveDirectory(F17FS_t* fs, int directory, const char* path);
+int openDirectoryCursor(F17FS_t* fs, int directory, const char* path, fs_dir_t* cursor);
 int checkBlockInDirectory(directory_t* directory, file_record_t* file);
 void getInodeFromDirectory(F17FS_t* fs,directory_t* parentDirectory, int index, inode_t* inode);
+size_t readMetadataBlock(F17FS_t* fs, size_t blockId, void* buffer);
+size_t writeMetadataBlock(F17FS_t* fs, size_t blockId, const void* buffer);
+void releaseBlock(F17FS_t* fs, size_t blockId);
 void getInodeFromTable(F17FS_t* fs, int index, inode_t* inode);
 void writeInodeIntoTable(F17FS_t* fs, size_t index, inode_t* inode);
 int indexOfNameInDirectoryEntries(directory_t directory, char* fileName);
 off_t calculateOffset(int fileSize, off_t seekLocation);
-ssize_t handleDirectBlocks(block_store_t* blockStore, int fileBlockNumber, int byteAtPositionInFileBlock, inode_t* inode, const char* data, size_t nbytes);
-ssize_t handleIndirectBlock(block_store_t* blockStore, int fileBlockNumber, int byteAtPositionInFileBlock, inode_t* inode, const char* data, size_t nbytes, size_t blockStoreBlockId);
-ssize_t handleDoubleIndirectBlocks(block_store_t* blockStore, int fileBlockNumber, int byteAtPositionInFileBlock, inode_t* inode, const char* data, size_t nbytes);
-ssize_t readDirectBlocks(block_store_t* blockStore, int fileBlockNumber, int byteAtPositionInFileBlock, inode_t* inode,  char* data, size_t nbytes);
-ssize_t readIndirectBlock(block_store_t* blockStore, int fileBlockNumber, int byteAtPositionInFileBlock, inode_t* inode,  char* data, size_t nbytes, size_t blockStoreBlockId);
-ssize_t readDoubleIndirectBlocks(block_store_t* blockStore, int fileBlockNumber, int byteAtPositionInFileBlock, inode_t* inode, char* data, size_t nbytes);
+size_t resolveBlockPointer(F17FS_t* fs, uint16_t* pointer, bool allocate, bool isPointerBlock, size_t* goal);
+size_t resolvePointerInBlock(F17FS_t* fs, size_t pointerBlock, size_t index, bool allocate, bool isPointerBlock, size_t* goal);
+size_t mapFileBlock(F17FS_t* fs, inode_t* inode, size_t fileBlockNumber, bool allocate, size_t* goal);
+fileDescriptor_t* getFileDescriptor(F17FS_t* fs, int fd);
+bool claimFileDescriptor(F17FS_t* fs, int fd, uint8_t from);
+int allocateFileDescriptor(F17FS_t* fs);
+int releaseFileDescriptor(F17FS_t* fs, int fd);
+void releaseInode(F17FS_t* fs, uint8_t inodeNumber, inode_t* inode);
+void releaseFileBlocks(F17FS_t* fs, inode_t* inode);
+void releaseTree(F17FS_t* fs, size_t blockId, int level);
+void countDataBlocks(F17FS_t* fs, size_t blockId, int level, bitmap_t* seen, size_t* fileBlocks, size_t* dataBlocks);
+bool sharedBlock(F17FS_t* fs, size_t blockId);
+size_t privateBlock(F17FS_t* fs, uint16_t* pointer, bool isPointerBlock);
+bool privateDirectory(F17FS_t* fs, int inodeNumber, inode_t* inode);
+bool shareFileBlocks(F17FS_t* fs, const inode_t* inode);
+void unshareFileBlocks(F17FS_t* fs, const inode_t* inode);
+bool readSnapshotTable(F17FS_t* fs, snapshotTable_t* table);
+int findSnapshot(const snapshotTable_t* table, const char* name);
+void closeDescriptorsForInode(F17FS_t* fs, uint8_t inodeNumber);
+int findStagedBlock(F17FS_t* fs, uint8_t inodeNumber, size_t fileBlock);
+bool readStagedBlock(F17FS_t* fs, uint8_t inodeNumber, size_t fileBlock, size_t offset, void* dst, size_t nbyte);
+bool stageFileBlock(F17FS_t* fs, uint8_t inodeNumber, inode_t* inode, size_t fileBlock, size_t offset, const void* src, size_t nbyte, size_t goal);
+int flushStagedBlocks(F17FS_t* fs, uint8_t inodeNumber, inode_t* inode);
+int flushAllStagedBlocks(F17FS_t* fs);
+void dropStagedBlocks(F17FS_t* fs, uint8_t inodeNumber);
+size_t setFileBlock(F17FS_t* fs, inode_t* inode, size_t fileBlockNumber, size_t blockId, size_t* goal);
+size_t writeFileBlock(F17FS_t* fs, inode_t* inode, size_t fileBlockNumber, const void* data, size_t* goal);
+bool readChunk(F17FS_t* fs, inode_t* inode, size_t chunk, void* raw);
+int writeChunk(F17FS_t* fs, inode_t* inode, size_t chunk, const void* raw, size_t* goal);
+int rewriteChunk(F17FS_t* fs, uint8_t inodeNumber, inode_t* inode, size_t fileBlock, size_t offset, const void* src, size_t nbyte, size_t* goal);
+void* writebackMain(void* fs);
+void writebackPass(F17FS_t* fs);
+void* scrubMain(void* fs);
+void monotonicDeadline(struct timespec* deadline, unsigned ms);
+size_t directoryAllocationGoal(F17FS_t* fs, int parentInodeNumber, inode_t* parentInode);
+void* fsckWorkerMain(void* arg);
+void fsckClaimPointer(fsckWorker_t* worker, uint16_t blockId, int level);
+bool fsckRepairPointer(block_store_t* blockStore, uint16_t* pointer, int level, const bitmap_t* duplicated, bitmap_t* seen, bitmap_t* referenced, fs_fsck_report_t* report);
 #endif
@@ -139,6 +139,64 @@ bitmap_t *bitmap_import(const size_t n_bits, const void *const bitmap_data);
 ///
 bitmap_t *bitmap_overlay(const size_t n_bits, void *const bitmap_data);
 
+///
+/// Creates a new bitmap using the provided data, for concurrent use
+///  Same ownership rules as bitmap_overlay, but the buffer must be 8-byte aligned
+///  and sized to a whole number of 64-bit words, since the bitmap_atomic_*
+///  functions operate on it one word at a time
+/// \param n_bits The number of bits in the bitmap
+/// \param bitmap_data The data to use (8-byte aligned)
+/// \return New bitmap pointer, NULL on error
+///
+bitmap_t *bitmap_overlay_atomic(const size_t n_bits, void *const bitmap_data);
+
+// The bitmap_atomic_* functions below are safe to call from many threads at once
+// on the same bitmap. They work on any bitmap from bitmap_create/bitmap_import
+// (storage is word-padded) or bitmap_overlay_atomic.
+// Mixing them with the plain set/reset/flip functions on the same bitmap is a race.
+
+///
+/// Atomically returns bit in bitmap
+/// \param bitmap The bitmap
+/// \param bit The bit to query
+/// \return State of requested bit
+///
+bool bitmap_atomic_test(const bitmap_t *const bitmap, const size_t bit);
+
+///
+/// Atomically sets requested bit in bitmap (test-and-set)
+/// \param bitmap The bitmap
+/// \param bit The bit to set
+/// \return State of the bit before it was set
+///
+bool bitmap_atomic_set(bitmap_t *const bitmap, const size_t bit);
+
+///
+/// Atomically clears requested bit in bitmap (test-and-reset)
+/// \param bitmap The bitmap
+/// \param bit The bit to clear
+/// \return State of the bit before it was cleared
+///
+bool bitmap_atomic_reset(bitmap_t *const bitmap, const size_t bit);
+
+///
+/// Finds a zero bit at or after start (wrapping around to the beginning)
+///  and atomically sets it, so no two callers can claim the same bit
+/// \param bitmap The bitmap
+/// \param start The bit to start searching from (out of range starts at 0)
+/// \return The claimed bit address, SIZE_MAX if the bitmap is full
+///
+size_t bitmap_atomic_claim(bitmap_t *const bitmap, const size_t start);
+
+///
+/// Finds a zero bit in [first, last) and atomically sets it (no wrapping)
+/// \param bitmap The bitmap
+/// \param first The first bit to consider
+/// \param last One past the final bit to consider (clamped to the bitmap size)
+/// \return The claimed bit address, SIZE_MAX if every bit in the range is set
+///
+size_t bitmap_atomic_claim_range(bitmap_t *const bitmap, const size_t first, const size_t last);
+
 ///
 /// Destructs and destroys bitmap object
 /// \param bitmap The bitmap
@@ -7,6 +7,7 @@ extern "C" {
 
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <sys/mman.h>
 
 // Declaring the struct but not implementing in the header allows us to prevent users
@@ -36,6 +37,36 @@ block_store_t *block_store_create(const char *const fname);
 ///// \return a pointer to the new object, NULL on error
 /////
 block_store_t *block_store_open(const char *const fname);
+
+///
+/// Creates a new BS device in memory, backed by an anonymous memory file (memfd) rather than a file on disk
+///  It works like any other device, but flushes have nothing to wait for and it is gone once destroyed;
+///  block_store_serialize saves it to a file, which block_store_open or block_store_deserialize load
+/// \return a pointer to the new object, NULL on error
+///
+block_store_t *block_store_create_mem();
+
+typedef enum {
+    BLOCK_STORE_ACCESS_NORMAL,      // The kernel's default readahead
+    BLOCK_STORE_ACCESS_RANDOM,      // No readahead (MADV_RANDOM), for scattered small requests
+    BLOCK_STORE_ACCESS_SEQUENTIAL,  // Aggressive readahead, pages dropped soon after use (MADV_SEQUENTIAL)
+} block_store_access_t;
+
+typedef struct {
+    // Zeroed fields keep the default
+    bool prefault;                // Faults the whole mapping in on open (MAP_POPULATE), so first accesses don't fault
+    bool hugepages;               // Maps at a huge page boundary and asks for transparent huge pages (MADV_HUGEPAGE)
+    block_store_access_t access;  // Readahead hint for the mapping
+} block_store_map_options_t;
+
+///
+/// Opens the specified back_store file with mapping options
+///  Where the kernel doesn't support a hint (huge pages for the file's file system, say) it is ignored
+/// \param fname the file to open
+/// \param options How the file is mapped, NULL for the defaults
+/// \return a pointer to the new object, NULL on error
+///
+block_store_t *block_store_open_with_options(const char *const fname, const block_store_map_options_t *const options);
 ///
 /// Destroys the provided block storage device
 /// This is an idempotent operation, so there is no return value
@@ -45,11 +76,23 @@ void block_store_destroy(block_store_t *const bs);
 
 ///
 /// Searches for a free block, marks it as in use, and returns the block's id
+///  Safe to call from many threads at once (as are request and release)
+///  Each thread starts searching in its own allocation group
 /// \param bs BS device
 /// \return Allocated block's id, SIZE_MAX on error
 ///
 size_t block_store_allocate(block_store_t *const bs);
 
+///
+/// Searches for a free block near the goal, marks it as in use, and returns the block's id
+///  The goal's allocation group is searched first (forward from the goal, then the rest of
+///  the group) before moving on to the following groups
+/// \param bs BS device
+/// \param goal Block id the new block should be placed close to
+/// \return Allocated block's id, SIZE_MAX on error
+///
+size_t block_store_allocate_near(block_store_t *const bs, const size_t goal);
+
 ///
 /// Attempts to allocate the requested block id
 /// \param bs the block store object
@@ -74,6 +117,7 @@ size_t block_store_get_used_blocks(const block_store_t *const bs);
 
 ///
 /// Counts the number of blocks marked free for use
+///  The FBM's own blocks are in use like any other, so free and used blocks add up to the whole device
 /// \param bs BS device
 /// \return Total blocks free, SIZE_MAX on error
 ///
@@ -86,8 +130,56 @@ size_t block_store_get_free_blocks(const block_store_t *const bs);
 ///
 size_t block_store_get_total_blocks();
 
+///
+/// Returns the number of allocation groups the block space is split into
+/// \return Total groups
+///
+size_t block_store_get_group_count();
+
+///
+/// Returns the number of blocks in each allocation group
+///  (group g covers blocks [g * size, (g + 1) * size))
+/// \return Blocks per group
+///
+size_t block_store_get_group_size();
+
+///
+/// Returns the number of free blocks in an allocation group
+/// \param bs BS device
+/// \param group The group to inspect
+/// \return Free blocks in the group, SIZE_MAX on error
+///
+size_t block_store_get_group_free_blocks(const block_store_t *const bs, const size_t group);
+
+///
+/// Seeds the free-space counters from a copy saved by block_store_get_free_counts, instead of
+///  counting the FBM on first use; only works before anything has needed the counters
+/// \param bs BS device
+/// \param group_free Free blocks of every group, block_store_get_group_count() of them
+/// \return true if the counters were taken, false on error or if they were already known
+///
+bool block_store_set_free_counts(block_store_t *const bs, const size_t *const group_free);
+
+///
+/// Copies out the free-space counters
+/// \param bs BS device
+/// \param group_free Where to put the free blocks of every group, block_store_get_group_count() of them
+/// \return true on success, false on error
+///
+bool block_store_get_free_counts(const block_store_t *const bs, size_t *const group_free);
+
+typedef enum {
+    BLOCK_STORE_CHECKSUM_OFF,     // No checksums kept
+    BLOCK_STORE_CHECKSUM_VERIFY,  // Every read is checked
+    BLOCK_STORE_CHECKSUM_LAZY,    // A block is checked the first time it's read, after that only by the scrubber
+} block_store_checksum_t;
+
+// Told about each block that doesn't match its checksum
+typedef void (*block_store_mismatch_t)(size_t block_id, void *arg);
+
 ///
 /// Reads data from the specified block and writes it to the designated buffer
+///  With checksums on, a block that doesn't match its checksum fails the read
 /// \param bs BS device
 /// \param block_id Source block id
 /// \param buffer Data buffer to write to
@@ -105,20 +197,270 @@ size_t block_store_read(const block_store_t *const bs, const size_t block_id, vo
 size_t block_store_write(block_store_t *const bs, const size_t block_id, const void *buffer);
 
 ///
-/// Imports BS device from the given file - for grads/bonus
-/// \param filename The file to load
+/// Reads one of the blocks holding the free block map
+/// \param bs BS device
+/// \param fbm_block Index of the FBM block (0 to 15)
+/// \param buffer Data buffer to write to
+/// \return Number of bytes read, 0 on error
+///
+size_t block_store_read_fbm(const block_store_t *const bs, const size_t fbm_block, void *buffer);
+
+///
+/// Overwrites one of the blocks holding the free block map
+///  Meant for restoring a saved map (journal replay), not for allocating
+/// \param bs BS device
+/// \param fbm_block Index of the FBM block (0 to 15)
+/// \param buffer Data buffer to read from
+/// \return Number of bytes written, 0 on error
+///
+size_t block_store_write_fbm(block_store_t *const bs, const size_t fbm_block, const void *buffer);
+
+///
+/// Returns the number of blocks in the extension area
+///  The extension sits after the addressable blocks and the FBM and is never allocated from;
+///  it holds on-disk structures of the layers above (the journal, for one)
+///  The block generations, reference words and checksums live past the end of it
+/// \return Total extension blocks
+///
+size_t block_store_get_ext_blocks();
+
+///
+/// Reads a block of the extension area
+/// \param bs BS device
+/// \param ext_block Source extension block
+/// \param buffer Data buffer to write to
+/// \return Number of bytes read, 0 on error
+///
+size_t block_store_ext_read(const block_store_t *const bs, const size_t ext_block, void *buffer);
+
+///
+/// Writes a block of the extension area
+/// \param bs BS device
+/// \param ext_block Destination extension block
+/// \param buffer Data buffer to read from
+/// \return Number of bytes written, 0 on error
+///
+size_t block_store_ext_write(block_store_t *const bs, const size_t ext_block, const void *buffer);
+
+///
+/// Flushes the dirty blocks of a run to the backing file
+///  Only blocks changed since their last flush are written; the rest of the run costs nothing
+/// \param bs BS device
+/// \param first_block First block of the run (FBM blocks may be included)
+/// \param count Number of blocks in the run
+/// \return true once the blocks are durable, false on error
+///
+bool block_store_flush_range(block_store_t *const bs, const size_t first_block, const size_t count);
+
+///
+/// Flushes every block changed since its last flush to the backing file
+///  Writes, requests, releases and allocations mark blocks (or their FBM block) dirty;
+///  neighbouring dirty blocks are coalesced into one msync
+/// \param bs BS device
+/// \return true once the blocks are durable, false on error
+///
+bool block_store_flush(block_store_t *const bs);
+
+///
+/// Flushes at most max_blocks dirty blocks, picking up where the previous call stopped
+///  Meant for background writeback: a bounded batch per call keeps each msync short,
+///  and the rotating start point gets every dirty block out eventually
+/// \param bs BS device
+/// \param max_blocks Most blocks to flush
+/// \return Blocks flushed, SIZE_MAX on error
+///
+size_t block_store_writeback(block_store_t *const bs, const size_t max_blocks);
+
+///
+/// Tells how long the device has had dirty blocks (the age of the oldest possible dirty block)
+/// \param bs BS device
+/// \return Milliseconds since the device went from clean to dirty, 0 if it is clean or on error
+///
+uint64_t block_store_get_dirty_age(const block_store_t *const bs);
+
+///
+/// Counts the blocks changed since they were last flushed
+/// \param bs BS device
+/// \return Dirty blocks, SIZE_MAX on error
+///
+size_t block_store_get_dirty_blocks(const block_store_t *const bs);
+
+///
+/// Waits until a run of extension blocks has reached the backing file
+/// \param bs BS device
+/// \param first_block First extension block of the run
+/// \param count Number of extension blocks in the run
+/// \return true once the blocks are durable, false on error
+///
+bool block_store_ext_flush(const block_store_t *const bs, const size_t first_block, const size_t count);
+
+///
+/// Loads a BS device from an image written by block_store_serialize (or any device file)
+///  The image is mapped privately rather than read in: blocks come in as they are touched, and
+///  changes stay in memory (flushes don't reach the file) until the device is serialized somewhere
+/// \param filename The file to load, left as it is
 /// \return Pointer to new BS device, NULL on error
 ///
 block_store_t *block_store_deserialize(const char *const filename);
 
 ///
-/// Writes the entirety of the BS device to file, overwriting it if it exists - for grads/bonus
+/// Writes the BS device to file as a device image, overwriting it if it exists
+///  Only allocated blocks and extension blocks holding anything are copied, in runs, by the kernel
+///  where it can (copy_file_range, then sendfile); the rest of the image is left as holes. The image
+///  can be opened with block_store_open or loaded with block_store_deserialize
 /// \param bs BS device
 /// \param filename The file to write to
-/// \return Number of bytes written, 0 on error
+/// \return Number of bytes copied, 0 on error
 ///
 size_t block_store_serialize(const block_store_t *const bs, const char *const filename);
 
+///
+/// Returns the generation blocks changed now are stamped with
+///  Every change to a block, its FBM block or its reference word records the current generation
+///  against it, in a table kept in the extension area; an image that never exported is at generation 1
+/// \param bs BS device
+/// \return Current generation, 0 on error
+///
+uint32_t block_store_get_generation(const block_store_t *const bs);
+
+///
+/// Writes the blocks changed since a generation to a delta file, overwriting it if it exists,
+///  and moves the device on to the next generation
+///  Only allocated blocks go in, with the FBM and reference table blocks that changed, as runs of
+///  whole blocks. The next export since the generation this one ends at picks up where it left off
+/// \param bs BS device
+/// \param since_gen Oldest generation to export (the one the previous export ended at), 0 for every allocated block
+/// \param filename The file to write to
+/// \return Number of bytes written, 0 on error
+///
+size_t block_store_export_incremental(block_store_t *const bs, const uint32_t since_gen, const char *const filename);
+
+///
+/// Replays a delta file written by block_store_export_incremental onto an older copy of the device
+///  The copy has to be at the generation the delta was exported since (any, for a delta since 0),
+///  and is at the exporting device's new generation once the blocks are flushed
+/// \param bs BS device
+/// \param filename The file to read
+/// \return Number of blocks applied, SIZE_MAX on error or if the copy is at another generation
+///
+size_t block_store_apply_incremental(block_store_t *const bs, const char *const filename);
+
+
+///
+/// Turns per-block CRC-32C checksums on or off
+///  The checksums sit in the top of the extension area and are updated by every write. A table
+///  left current by the last open is trusted as is; otherwise turning them on computes it from what
+///  the blocks hold now. Any write made with checksums off marks the table stale on disk
+///  Call before the device is shared between threads
+/// \param bs BS device
+/// \param mode How reads are checked, BLOCK_STORE_CHECKSUM_OFF to stop keeping checksums
+/// \param callback Called with each block that fails its check (on read or scrub), may be NULL
+/// \param arg Passed to the callback
+/// \return true on success, false on error
+///
+bool block_store_set_checksums(block_store_t *const bs, const block_store_checksum_t mode, block_store_mismatch_t callback, void *arg);
+
+///
+/// Checks up to max_blocks allocated blocks against their checksums, picking up where the previous call stopped
+///  Meant for a background scrubber: small batches keep it out of the way, the rotating start covers every block
+/// \param bs BS device
+/// \param max_blocks Most allocated blocks to check
+/// \return Mismatches found, SIZE_MAX on error or with checksums off
+///
+size_t block_store_scrub(block_store_t *const bs, const size_t max_blocks);
+
+///
+/// Counts the reads and scrubs that found a block not matching its checksum
+/// \param bs BS device
+/// \return Mismatches so far, SIZE_MAX on error
+///
+size_t block_store_get_checksum_errors(const block_store_t *const bs);
+
+///
+/// Marks an allocated block as one others may share (a data block whose content was indexed)
+///  Reference words live beside the checksums in the extension area; the mark goes away when the
+///  block is freed or made private again
+/// \param bs BS device
+/// \param block_id The block
+/// \return true on success, false on error or if the block is free
+///
+bool block_store_mark_shareable(block_store_t *const bs, const size_t block_id);
+
+///
+/// Adds an owner to a shareable block; block_store_release drops one, only the last one frees the block
+/// \param bs BS device
+/// \param block_id The block
+/// \return true if the block is now shared with the caller, false on error or if it isn't shareable (any more)
+///
+bool block_store_share(block_store_t *const bs, const size_t block_id);
+
+///
+/// Adds an owner to an allocated block whether it is shareable or not, for a snapshot taking its own pointer to it
+///  Released the same way as a shared block
+/// \param bs BS device
+/// \param block_id The block
+/// \return true on success, false on error, if the block is free or if it can't take another owner
+///
+bool block_store_ref(block_store_t *const bs, const size_t block_id);
+
+///
+/// Takes a block its only owner is about to write over out of sharing, atomically with block_store_share
+/// \param bs BS device
+/// \param block_id The block
+/// \return true if the caller may write it in place, false on error or if it is shared (copy it instead)
+///
+bool block_store_make_private(block_store_t *const bs, const size_t block_id);
+
+///
+/// Tells whether a block may be shared
+/// \param bs BS device
+/// \param block_id The block
+/// \return true if it is allocated and marked shareable
+///
+bool block_store_is_shareable(const block_store_t *const bs, const size_t block_id);
+
+///
+/// Counts the owners of a block
+/// \param bs BS device
+/// \param block_id The block
+/// \return Owners (1 unless it is shared), 0 if the block is free or on error
+///
+size_t block_store_get_refs(const block_store_t *const bs, const size_t block_id);
+
+///
+/// Overrides the owner count of an allocated block, for a checker that counted them
+/// \param bs BS device
+/// \param block_id The block
+/// \param refs Owners, at least 1
+/// \return true on success, false on error
+///
+bool block_store_set_refs(block_store_t *const bs, const size_t block_id, const size_t refs);
+
+///
+/// Counts the owners past the first of every shared block: the blocks sharing saves
+/// \param bs BS device
+/// \return Extra owners, SIZE_MAX on error
+///
+size_t block_store_get_extra_refs(const block_store_t *const bs);
+
+///
+/// Turns giving freed blocks' space back to the host file system on or off
+///  Blocks freed while it is on are collected and punched out of the backing file (fallocate
+///  PUNCH_HOLE, or dropped from memory for a device loaded by block_store_deserialize) by the next
+///  block_store_flush or block_store_writeback, neighbouring ones in one call. A punched block reads
+///  as zeros (as what the image holds, for a loaded device). Call before the device is shared between threads
+/// \param bs BS device
+/// \param enabled Whether blocks freed from now on get punched
+/// \return true on success, false on error
+///
+bool block_store_set_hole_punching(block_store_t *const bs, const bool enabled);
+
+///
+/// Counts the blocks whose space was given back to the host
+/// \param bs BS device
+/// \return Blocks punched, SIZE_MAX on error
+///
+size_t block_store_get_punched_blocks(const block_store_t *const bs);
 
 #ifdef __cplusplus
 }
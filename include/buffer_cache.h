@@ -0,0 +1,95 @@
+#ifndef BUFFER_CACHE_H__
+#define BUFFER_CACHE_H__
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "block_store.h"
+
+// Block-level read cache in front of a block store
+//  Writes go through to the block store and refresh a cached copy, they never allocate one,
+//  so the cache never holds anything the block store doesn't
+//  Every buffer is allocated when the cache is created, reads and writes never touch the heap
+typedef struct buffer_cache buffer_cache_t;
+
+typedef enum {
+    BUFFER_CACHE_ARC,    // Adaptive replacement: recency and frequency lists, sized by ghost hits
+    BUFFER_CACHE_LRU,    // Least recently used goes first
+    BUFFER_CACHE_CLOCK,  // Second chance: a hit only sets a bit, the hand clears it on the way round
+} buffer_cache_policy_t;
+
+typedef struct {
+    size_t hits;
+    size_t misses;
+    size_t evictions;
+    size_t capacity;  // Blocks the budget buys
+    size_t resident;  // Blocks cached right now
+} buffer_cache_stats_t;
+
+///
+/// Creates a cache over a block store
+/// \param bs BS device to cache
+/// \param budget_bytes Memory for cached blocks, at least one block's worth
+/// \param policy Eviction policy
+/// \return Pointer to the cache, NULL on error
+///
+buffer_cache_t *buffer_cache_create(block_store_t *const bs, const size_t budget_bytes, const buffer_cache_policy_t policy);
+
+///
+/// Frees the cache (the block store is left alone)
+/// \param cache The cache to free
+///
+void buffer_cache_destroy(buffer_cache_t *const cache);
+
+///
+/// Reads a block, from the cache when it is there
+/// \param cache The cache
+/// \param block_id Source block id
+/// \param buffer Data buffer to write to
+/// \return Number of bytes read, 0 on error
+///
+size_t buffer_cache_read(buffer_cache_t *const cache, const size_t block_id, void *buffer);
+
+///
+/// Reads a block that is unlikely to be read again soon (a sequential scan)
+///  A miss is cached at the cold end of its list, so a long scan recycles its own buffers
+///  instead of pushing out hot blocks such as metadata
+/// \param cache The cache
+/// \param block_id Source block id
+/// \param buffer Data buffer to write to
+/// \return Number of bytes read, 0 on error
+///
+size_t buffer_cache_read_stream(buffer_cache_t *const cache, const size_t block_id, void *buffer);
+
+///
+/// Writes a block through to the block store, refreshing the cached copy if there is one
+/// \param cache The cache
+/// \param block_id Destination block id
+/// \param buffer Data buffer to read from
+/// \return Number of bytes written, 0 on error
+///
+size_t buffer_cache_write(buffer_cache_t *const cache, const size_t block_id, const void *buffer);
+
+///
+/// Drops the cached copy of a block, for blocks the block store changed behind the cache's back
+/// \param cache The cache
+/// \param block_id The block to forget
+///
+void buffer_cache_invalidate(buffer_cache_t *const cache, const size_t block_id);
+
+///
+/// Copies out the counters
+/// \param cache The cache
+/// \param stats Where to put them
+/// \return true on success, false on error
+///
+bool buffer_cache_get_stats(buffer_cache_t *const cache, buffer_cache_stats_t *const stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef CRC32C_H__
+#define CRC32C_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// CRC-32C (Castagnoli), the one iSCSI, ext4 and btrfs use
+// Uses the SSE4.2 crc32 instruction when the CPU has it, slicing-by-8 tables otherwise
+
+///
+/// Computes or extends a CRC-32C
+/// \param crc 0 to start, or the result for the data before this piece
+/// \param data The data
+/// \param length Bytes of data
+/// \return CRC-32C of everything so far
+///
+uint32_t crc32c(uint32_t crc, const void *data, size_t length);
+
+///
+/// Same as crc32c, always with the tables, whatever the CPU has
+/// \param crc 0 to start, or the result for the data before this piece
+/// \param data The data
+/// \param length Bytes of data
+/// \return CRC-32C of everything so far
+///
+uint32_t crc32c_portable(uint32_t crc, const void *data, size_t length);
+
+///
+/// Tells whether crc32c runs on the CPU's crc32 instruction
+/// \return true if it does, false if it uses the tables
+///
+bool crc32c_hardware(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,90 @@
+#ifndef DEDUP_H__
+#define DEDUP_H__
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "block_store.h"
+#include "buffer_cache.h"
+
+// Content index of data blocks, for sharing one physical block between every block holding the same bytes
+//  Blocks are hashed with a 64-bit hash and looked up in an open addressing table kept in the extension area.
+//  The table is only a hint: a match is shared first and byte-compared after, so a stale or colliding
+//  entry costs a read, never a wrong block
+//  Owners are counted by the block store (block_store_share), a shared block is never written in place
+typedef struct dedup dedup_t;
+
+typedef struct {
+    size_t lookups;  // Blocks looked up
+    size_t hits;     // Lookups that found a block to share
+    size_t inserts;  // Blocks added to the index
+} dedup_stats_t;
+
+///
+/// Opens the index of a block store, loading it from the extension area
+/// \param bs BS device holding the blocks and the index
+/// \param cache Cache the blocks are read through when comparing, so dirty data compares as written
+/// \param first_ext_block Extension block the index starts at, dedup_get_index_blocks() of them
+/// \return Pointer to the index, NULL on error
+///
+dedup_t *dedup_open(block_store_t *const bs, buffer_cache_t *const cache, const size_t first_ext_block);
+
+///
+/// Writes the index back and frees it
+/// \param dedup The index
+///
+void dedup_close(dedup_t *const dedup);
+
+///
+/// Writes the changed parts of the index back to the extension area and waits for them
+/// \param dedup The index
+/// \return true on success, false on error
+///
+bool dedup_flush(dedup_t *const dedup);
+
+///
+/// Returns the number of extension blocks the index takes
+/// \return Index blocks
+///
+size_t dedup_get_index_blocks();
+
+///
+/// Hashes a block (XXH64)
+/// \param block The block's bytes
+/// \return 64-bit hash
+///
+uint64_t dedup_hash(const void *const block);
+
+///
+/// Finds a block already holding these bytes and adds the caller as an owner
+/// \param dedup The index
+/// \param hash dedup_hash of the bytes
+/// \param block The bytes
+/// \return The shared block, SIZE_MAX if there is none (or it can't take another owner)
+///
+size_t dedup_share(dedup_t *const dedup, const uint64_t hash, const void *const block);
+
+///
+/// Indexes a data block just written, and marks it shareable
+/// \param dedup The index
+/// \param hash dedup_hash of what the block holds
+/// \param block_id The block
+/// \return true on success, false on error
+///
+bool dedup_insert(dedup_t *const dedup, const uint64_t hash, const size_t block_id);
+
+///
+/// Copies out the lookup counters
+/// \param dedup The index
+/// \param stats Where to put them
+/// \return true on success, false on error
+///
+bool dedup_get_stats(dedup_t *const dedup, dedup_stats_t *const stats);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
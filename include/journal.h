@@ -0,0 +1,126 @@
+#ifndef JOURNAL_H__
+#define JOURNAL_H__
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "block_store.h"
+#include "buffer_cache.h"
+
+// Write-ahead log of metadata blocks, kept in the block store's extension area
+//  Writes made through the journal are held back until their transaction commits:
+//  the new block images go to the log first, one flush makes the whole batch durable,
+//  and only then are the blocks copied to their home locations
+//  Blocks freed through the journal stay allocated until the free is committed too
+//  An operation (everything up to journal_end_op) commits as a whole: its first change commits the
+//  batch first when the operation might not fit behind it, so it must write at most JOURNAL_OP_BLOCKS blocks
+//  Blocks written straight to the block store (file data) are flushed before every commit,
+//  so committed metadata never points at data that didn't make it
+typedef struct journal journal_t;
+
+#define JOURNAL_OP_BLOCKS 1024  // Most distinct blocks one operation may write through the journal
+
+///
+/// Opens the journal of a block store, replaying every committed transaction found in the log
+/// \param bs BS device the journal protects
+/// \param group_commit Operations batched into one commit, 0 commits every operation
+/// \return Pointer to the journal, NULL on error
+///
+journal_t *journal_open(block_store_t *const bs, const size_t group_commit);
+
+///
+/// Commits whatever is pending, checkpoints the log and frees the journal
+/// \param journal The journal to close
+///
+void journal_close(journal_t *const journal);
+
+///
+/// Routes the journal's home block reads and writes through a buffer cache
+///  Needed whenever the cache's owner reads those blocks through the cache too,
+///  or a commit would leave stale copies behind
+/// \param journal The journal
+/// \param cache Cache over the journal's block store, NULL to go straight to the block store
+///
+void journal_set_cache(journal_t *const journal, buffer_cache_t *const cache);
+
+///
+/// Reads a block, as it will be once everything pending commits
+/// \param journal The journal
+/// \param block_id Source block id
+/// \param buffer Data buffer to write to
+/// \return Number of bytes read, 0 on error
+///
+size_t journal_read(journal_t *const journal, const size_t block_id, void *buffer);
+
+///
+/// Adds a new image of a block to the running transaction
+///  Fails, rather than commit half an operation, if the transaction is full (only an operation past JOURNAL_OP_BLOCKS fills it)
+/// \param journal The journal
+/// \param block_id Destination block id
+/// \param buffer Data buffer to read from
+/// \return Number of bytes written, 0 on error
+///
+size_t journal_write(journal_t *const journal, const size_t block_id, const void *buffer);
+
+///
+/// Frees a block once the running transaction has committed
+/// \param journal The journal
+/// \param block_id The block to free
+///
+void journal_release(journal_t *const journal, const size_t block_id);
+
+///
+/// Counts the frees of a block waiting for the running transaction to commit
+///  A shared block's owner count only drops once they do, this tells how many owners are already on their way out
+/// \param journal The journal
+/// \param block_id The block
+/// \return Pending frees of the block, 0 on error
+///
+size_t journal_get_releases(journal_t *const journal, const size_t block_id);
+
+///
+/// Marks the end of one operation, committing when enough have been batched
+/// \param journal The journal
+/// \return 0 on success, < 0 if a commit was due and failed
+///
+int journal_end_op(journal_t *const journal);
+
+///
+/// Commits the running transaction right away
+/// \param journal The journal
+/// \return 0 once everything written so far is durable, < 0 on error
+///
+int journal_commit(journal_t *const journal);
+
+///
+/// Commits the running transaction if it has been open for long enough
+///  Skipped while an operation is halfway through (written, but not yet ended),
+///  so a background caller never commits half of one
+/// \param journal The journal
+/// \param expire_ms Age in milliseconds the transaction must have reached
+/// \return 1 if it committed, 0 if nothing was due, < 0 on error
+///
+int journal_commit_expired(journal_t *const journal, const uint64_t expire_ms);
+
+///
+/// Returns the number of transactions replayed when the journal was opened
+/// \param journal The journal
+/// \return Transactions replayed, SIZE_MAX on error
+///
+size_t journal_get_replayed(const journal_t *const journal);
+
+///
+/// Returns the number of commits (log flushes) made since the journal was opened
+/// \param journal The journal
+/// \return Commits made, SIZE_MAX on error
+///
+size_t journal_get_commits(const journal_t *const journal);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,40 @@
+#ifndef LZ_H__
+#define LZ_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Small, fast LZ77 codec writing the LZ4 block format (no frame, no checksum)
+// Meant for inputs of at most 64KB, such as a file chunk; any LZ4 block decoder can read the output
+
+#define LZ_MAX_INPUT 65535
+
+///
+/// Compresses a buffer
+/// \param src Data to compress, at most LZ_MAX_INPUT bytes
+/// \param length Bytes of data
+/// \param dst Where to put the compressed data
+/// \param capacity Bytes available at dst
+/// \return Compressed size, 0 if it doesn't fit in capacity (or on error)
+///
+size_t lz_compress(const void *src, size_t length, void *dst, size_t capacity);
+
+///
+/// Decompresses a buffer made by lz_compress
+/// \param src Compressed data
+/// \param length Bytes of compressed data
+/// \param dst Where to put the data
+/// \param capacity Bytes available at dst
+/// \return Decompressed size, SIZE_MAX if the input is malformed or doesn't fit in capacity
+///
+size_t lz_decompress(const void *src, size_t length, void *dst, size_t capacity);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
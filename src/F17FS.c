@@ -2,6 +2,12 @@
 #include <block_store.h>
 #include <bitmap.h>
 #include <time.h>
+#include <pthread.h>
+#include <journal.h>
+#include <buffer_cache.h>
+#include <lz.h>
+#include <dedup.h>
+#include <unistd.h>
 
 #define BLOCK_STORE_NUM_BLOCKS 65536   // 2^16 blocks.
 #define BLOCK_STORE_AVAIL_BLOCKS 65520 // Last 16 blocks consumed by the FBM
@@ -9,15 +15,46 @@
 #define BLOCK_SIZE_BYTES 512         // 2^9 BYTES per block
 #define BLOCK_STORE_NUM_BYTES (BLOCK_STORE_NUM_BLOCKS * BLOCK_SIZE_BYTES)  // 2^16 blocks of 2^9 bytes.
 
+#define DIRECT_BLOCKS 6 //File blocks 0-5 live in the inode.
+#define POINTERS_PER_BLOCK (BLOCK_SIZE_BYTES / sizeof(uint16_t)) //256 block ids per indirect block.
+#define INDIRECT_END (DIRECT_BLOCKS + POINTERS_PER_BLOCK) //First file block behind the double indirect.
+#define DOUBLE_INDIRECT_END (INDIRECT_END + POINTERS_PER_BLOCK * POINTERS_PER_BLOCK) //Max file blocks.
+
+#define FD_CHUNK_SIZE 256 //Descriptors are added to the table this many at a time.
+#define FD_MAX_CHUNKS (FS_FD_MAX / FD_CHUNK_SIZE)
+//Free descriptors a thread keeps for itself, 0 turns the per-thread cache off.
+#ifndef FS_FD_CACHE_SIZE
+#define FS_FD_CACHE_SIZE 16
+#endif
+
+//File blocks written but not yet given a physical block, shared by every file of the mount.
+#ifndef FS_DELALLOC_BLOCKS
+#define FS_DELALLOC_BLOCKS 256
+#endif
+//Below this many free blocks writes allocate right away, so staged blocks (and their pointer blocks) always fit.
+#define FS_DELALLOC_RESERVE (FS_DELALLOC_BLOCKS * 4)
+
+typedef enum { FD_FREE, FD_OPEN, FD_CACHED } fd_state_t;
+
+typedef struct {
+    uint8_t inodeNumber;
+    size_t fileBlock;
+    int next; //Next staged block of the same inode (or on the free list), -1 at the end.
+    char data[BLOCK_SIZE_BYTES];
+} stagedBlock_t;
+
 struct fileDescriptor{
     uint8_t inodeNumber;
-    int filePosition;
+    uint8_t state; //fd_state_t, only changed with atomics.
+    off_t filePosition;
+    size_t allocGoal; //Where the next block of this file should go.
+    int nextFree; //Next descriptor on the free list, -1 at the end.
 };
 
 struct inode{ //64 Bytes total
     int fileSize; //4 Bytes
-    int deviceId; //4 Bytes
-    int userId; //4 Bytes
+    int flags; //4 Bytes, INODE_* bits (older images have zeros here)
+    int generation; //4 Bytes, bumped each time the inode is freed so old handles stop matching
     int groupId; //4 Bytes
     int fileMode; //4 Bytes
     int linkCount; //4 Bytes
@@ -34,6 +71,12 @@ struct directory{ //512 Bytes total
     char metadata[57];
 };
 
+struct fs_dir{
+    uint8_t inodeNumber;
+    size_t nextEntry;
+    directory_t block; //The directory block being walked.
+};
+
 struct superRoot{
     //For Inodes
     bitmap_t* bitmap;
@@ -41,15 +84,124 @@ struct superRoot{
     size_t totalBlocks;
     size_t blockSize;
     uint8_t freeInodeMap[256];
+    //Free-space counts as of the last sync, only trusted on mount if the last unmount was clean.
+    uint32_t cleanUnmount; //FS_CLEAN_UNMOUNT after fs_unmount, cleared as soon as the file system is mounted.
+    uint32_t freeInodes;
+    uint16_t groupFree[16]; //Free blocks in each block store allocation group.
+    uint16_t snapshotTable; //Block holding the snapshot table, 0 while the image has no snapshots.
     char metadata[512];
 };
 
+//One snapshot in the table, a header of 0 marks a free entry.
+typedef struct {
+    char name[FS_FNAME_MAX];
+    time_t createTime;
+    uint16_t header;
+} snapshotEntry_t; //80 Bytes with padding
+
+struct snapshotTable{ //512 Bytes total
+    snapshotEntry_t entries[FS_SNAPSHOT_MAX]; //6*80 bytes
+    char metadata[32];
+};
+
+//What a snapshot froze: the inode map, and a copy of the inode table whose pointers it owns a share of.
+struct snapshotHeader{ //512 Bytes total
+    uint8_t freeInodeMap[256];
+    uint16_t inodeBlocks[32]; //Copy of the inode table, 8 inodes a block.
+    char metadata[192];
+};
+
+//Older images have zeros here, which reads as not clean.
+#define FS_CLEAN_UNMOUNT 0x434c4e31u
+
+//inode_t flags.
+#define INODE_COMPRESSED 0x1 //Data is kept in compressed chunks, see readChunk.
+//File blocks per compressed chunk. A chunk with no blocks is a hole, with all of them it is stored as is,
+//with fewer it is a uint16_t compressed length followed by the compressed bytes, over as many blocks as that takes.
+#define COMPRESS_CHUNK_BLOCKS (FS_COMPRESS_CHUNK_BYTES / BLOCK_SIZE_BYTES)
+
+//Blocks 0-32 hold the superRoot and the inode table, file data starts after them.
+#define FIRST_DATA_BLOCK 33
+//A directory handle is the inode number with the inode's generation above it.
+#define HANDLE_INODE(handle) ((handle) & 0xff)
+#define HANDLE_GENERATION(handle) (((handle) >> 8) & 0xffff)
+#define MAKE_HANDLE(inodeNumber, generation) ((int)(((generation) & 0xffff) << 8) | (inodeNumber))
+//The dedup index sits right after the journal's log in the extension area.
+#define DEDUP_INDEX_EXT_BLOCK 4096
+//Most threads fs_fsck splits the inodes across.
+#define FSCK_MAX_THREADS 16
+
+//One fs_fsck thread: walks the block pointers of its range of inodes into its own bitmap.
+struct fsckWorker{
+    block_store_t* blockStore;
+    const inode_t* inodes; //The whole inode table.
+    const bool* walk; //Inodes whose blocks count.
+    size_t first;
+    size_t last; //One past the end.
+    bitmap_t* claimed; //Blocks pointed at by this range.
+    bitmap_t* duplicated; //Blocks pointed at more than once within this range.
+    uint32_t* sharedClaims; //Pointers to each shared block, counted by every worker.
+    size_t doubleAllocated;
+    size_t badPointers;
+};
+
 struct F17FS{
     block_store_t* blockStore;
-    //For fileDescriptors
-    bitmap_t* bitmap;
-    fileDescriptor_t fds[256];
+    //Metadata blocks are read and written through the journal, file data goes straight to the cache.
+    journal_t* journal;
+    //Every block read and write below the journal goes through here.
+    buffer_cache_t* cache;
+    //In-memory copy of block 0, written through on every change.
+    superRoot_t superRoot;
+    size_t freeInodes; //Kept up to date with the inode bitmap, so running out is a check instead of a scan.
+    uint16_t inodeTable[32]; //Blocks holding the inode table: 1-32, or a snapshot's copy.
+    bool readOnly; //A snapshot is mounted, every call that would change it fails.
+    dedup_t* dedup; //Content index of file data, only when the mount asked for dedup.
+    //For fileDescriptors, grown a chunk at a time so a descriptor never moves once handed out.
+    fileDescriptor_t* fdChunks[FD_MAX_CHUNKS];
+    size_t fdChunkCount;
+    int fdFreeList;
+    pthread_mutex_t fdLock;
+    unsigned mountId; //Tells per-thread descriptor caches of different mounts apart.
+    //Background writeback, only set up when the mount asked for it.
+    bool writebackRunning;
+    bool writebackStop; //Guarded by writebackLock.
+    pthread_t writebackThread;
+    pthread_mutex_t writebackLock;
+    pthread_cond_t writebackWake; //Signalled on unmount, and by fs_write once too much is dirty.
+    unsigned writebackIntervalMs;
+    unsigned dirtyExpireMs;
+    size_t dirtyBackgroundBlocks;
+    size_t writebackBatchBlocks;
+    //Background scrubber, only set up when the mount asked for it.
+    bool scrubRunning;
+    bool scrubStop; //Guarded by scrubLock.
+    pthread_t scrubThread;
+    pthread_mutex_t scrubLock;
+    pthread_cond_t scrubWake; //Signalled on unmount.
+    size_t scrubBatchBlocks; //Blocks checked per pass.
+    //Delayed allocation: blocks a write would have allocated wait here, per inode, until the file is flushed.
+    stagedBlock_t* staged; //FS_DELALLOC_BLOCKS of them, allocated at mount.
+    int stagedFree;
+    int stagedHead[256]; //Per inode, -1 when nothing is staged.
+    size_t stagedCount[256];
+    size_t stagedGoal[256]; //Where the inode's batch should start.
+    pthread_mutex_t stageLock;
 };
+
+#if FS_FD_CACHE_SIZE
+//Descriptors freed by this thread, reused without touching fdLock.
+//Entries stay FD_CACHED in the table, so they can still be reclaimed if the thread goes away.
+typedef struct {
+    unsigned mountId;
+    int count;
+    int fds[FS_FD_CACHE_SIZE];
+} fd_cache_t;
+static __thread fd_cache_t fdCache;
+#endif
+static unsigned nextMountId = 0;
+
+#define FD_AT(fs, fd) (&(fs)->fdChunks[(fd) / FD_CHUNK_SIZE][(fd) % FD_CHUNK_SIZE])
 /// Formats (and mounts) an F17FS file for use
 /// \param fname The file to format
 /// \return Mounted F17FS object, NULL on error
@@ -59,81 +211,212 @@ F17FS_t *fs_format(const char *path){
     {
         return NULL;
     }
-    //Creating a blockstore from the given file.
+    //Creating a blockstore from the given file, it starts out sparse and all zeros.
     block_store_t* blockStore = block_store_create(path);
-    //Requesting allocated space for the 0th block in the blockstore to store root.
-    if(!block_store_request(blockStore, 0)){
+    if(blockStore == NULL){
         return NULL;
     }
-    //Creating the superRoot that will be placed in the first block in the blockstore.
-    superRoot_t* root = calloc(1, sizeof(superRoot_t));
-    //Bitmap to keep track of the 32 inodes.
-    root->bitmap = bitmap_overlay(256, root->freeInodeMap);
-    //Marking the 0th block in the blockStore in use because the root is in there.
-    bitmap_set(root->bitmap, 0);
-    root->blockSize = BLOCK_SIZE_BYTES;
-    root->freeBlocks = block_store_get_free_blocks(blockStore);
-    root->totalBlocks = block_store_get_total_blocks();
-    //Writing the root to the blockStore.
-    block_store_write(blockStore, 0, root);
-
-    //Initializing the inodes stored in beginning 32 blocks after the superRoot block.
-    size_t i = 0;
-    for(i = 0; i<32; i++){
-        inode_t* inode = calloc(8, sizeof(inode_t));
-        //Asking for the space in the blockstore.
-        size_t blockId = block_store_allocate(blockStore);
-        block_store_write(blockStore, blockId, inode);
-        free(inode);
-    }
-
-    //Creating root directory so, need first inode in the blockStore.
-    inode_t* inode = calloc(8, sizeof(inode_t));
-    block_store_read(blockStore, 1, inode);
-    //Initializing basic parts for root, might need more.
-    inode[0].fileSize = sizeof(directory_t);
-    inode[0].fileMode = 1777; //Permissions
-    inode[0].accessTime = time(0);
-    inode[0].changeTime = time(0);
-    inode[0].modifcationTime = time(0);
-    //Finding a free block to put the directory.
-    size_t blockId = block_store_allocate(blockStore);
-    inode[0].directBlocks[0] = (uint8_t)blockId;
-
-    //Updating the inode in the blockstore.
-    block_store_write(blockStore, 1, inode);
-
-    //Writing the directory into that found free block.
-    directory_t* directory = calloc(1, sizeof(directory_t));
-    block_store_write(blockStore, blockId, directory);
-
-    //Clean up my allocations
-    block_store_destroy(blockStore);
-    bitmap_destroy(root->bitmap);
-    free(root);
-    free(inode);
-    free(directory);
+    return formatBlockStore(blockStore);
+}
+/// Formats (and mounts) an F17FS in memory, for scratch use
+/// \return Mounted F17FS object, NULL on error
+F17FS_t *fs_format_mem(){
+    block_store_t* blockStore = block_store_create_mem();
+    if(blockStore == NULL){
+        return NULL;
+    }
+    return formatBlockStore(blockStore);
+}
 
-    //Mounting the filesystem now.
-    F17FS_t* fileSystem = fs_mount(path);
-    return fileSystem;
+//Writes an empty file system onto a block store that was just created, and mounts it.
+F17FS_t* formatBlockStore(block_store_t* blockStore){
+    //The superRoot and the inode table sit in blocks 0-32. The table is already zeroed (all inodes free),
+    //so it only needs reserving: its pages stay untouched until an inode in them is first written.
+    size_t i;
+    for(i = 0; i <= 32; i++){
+        block_store_request(blockStore, i);
+    }
+    //Finding a free block to put the root directory, right after the inode table. Zeros are an empty directory.
+    size_t blockId = block_store_allocate_near(blockStore, 33);
+
+    //Creating the superRoot that will be placed in the first block in the blockstore.
+    superRoot_t root;
+    memset(&root, 0, sizeof(root));
+    //Marking inode 0 in use, it is the root directory.
+    root.freeInodeMap[0] = 0x01;
+    root.blockSize = BLOCK_SIZE_BYTES;
+    root.freeBlocks = block_store_get_free_blocks(blockStore);
+    root.totalBlocks = block_store_get_total_blocks();
+    //Nothing has been mounted yet, so the counts are as good as after a clean unmount.
+    saveFreeCounts(blockStore, &root, 255);
+    root.cleanUnmount = FS_CLEAN_UNMOUNT;
+    block_store_write(blockStore, 0, &root);
+
+    //The root directory's inode, the only one format writes.
+    inode_t inodes[8];
+    memset(inodes, 0, sizeof(inodes));
+    inodes[0].fileSize = sizeof(directory_t);
+    inodes[0].fileMode = 1777; //Permissions
+    inodes[0].linkCount = 1;
+    inodes[0].accessTime = time(0);
+    inodes[0].changeTime = time(0);
+    inodes[0].modifcationTime = time(0);
+    inodes[0].directBlocks[0] = (uint16_t)blockId;
+    block_store_write(blockStore, 1, inodes);
+
+    //Mounting the block store we already have open, no need to go through the file again.
+    return mountBlockStore(blockStore, NULL);
 }
 /// Mounts an F17FS object and prepares it for use
 /// \param fname The file to mount
 /// \return Mounted F17FS object, NULL on error
 F17FS_t *fs_mount(const char *path){
+    return fs_mount_with_options(path, NULL);
+}
+/// Mounts an F17FS object with non-default options
+/// \param fname The file to mount
+/// \param options Mount options, NULL or zeroed fields for the defaults
+/// \return Mounted F17FS object, NULL on error
+F17FS_t *fs_mount_with_options(const char *path, const fs_mount_options_t *options){
 
     if(path == NULL || strcmp(path, "") == 0){
         return NULL;
     }
-    block_store_t* blockStore = block_store_open(path);
+    block_store_map_options_t mapOptions;
+    memset(&mapOptions, 0, sizeof(mapOptions));
+    if(options != NULL){
+        mapOptions.prefault = options->prefault;
+        mapOptions.hugepages = options->hugePages;
+        mapOptions.access = options->access;
+    }
+    block_store_t* blockStore = block_store_open_with_options(path, &mapOptions);
     if(blockStore == NULL) {
         return NULL;
     }
+    return mountBlockStore(blockStore, options);
+}
+
+//Sets up everything a mount needs on top of an open block store, which the mount owns from here on.
+F17FS_t* mountBlockStore(block_store_t* blockStore, const fs_mount_options_t* options){
+    //Checksums first, so the journal replay keeps them up to date.
+    if(options != NULL && options->checksums != BLOCK_STORE_CHECKSUM_OFF
+       && !block_store_set_checksums(blockStore, options->checksums, options->checksumCallback, options->checksumArg)){
+        block_store_destroy(blockStore);
+        return NULL;
+    }
+    if(options != NULL && options->punchHoles && !block_store_set_hole_punching(blockStore, true)){
+        block_store_destroy(blockStore);
+        return NULL;
+    }
+    //Replay runs before anything reads the metadata.
+    size_t groupCommit = (options != NULL && options->journalGroupCommit != 0) ? options->journalGroupCommit : FS_JOURNAL_GROUP_COMMIT;
+    journal_t* journal = journal_open(blockStore, groupCommit);
+    if(journal == NULL){
+        block_store_destroy(blockStore);
+        return NULL;
+    }
+
+    size_t cacheBytes = (options != NULL && options->cacheBytes != 0) ? options->cacheBytes : FS_CACHE_BYTES;
+    buffer_cache_t* cache = buffer_cache_create(blockStore, cacheBytes, options != NULL ? options->cachePolicy : BUFFER_CACHE_ARC);
+    if(cache == NULL){
+        journal_close(journal);
+        block_store_destroy(blockStore);
+        return NULL;
+    }
+    journal_set_cache(journal, cache);
 
     F17FS_t* fileSystem = calloc(1, sizeof(F17FS_t));
     fileSystem->blockStore = blockStore;
-    fileSystem->bitmap = bitmap_create(BLOCK_SIZE_BYTES/2);
+    fileSystem->journal = journal;
+    fileSystem->cache = cache;
+    //Keeping the superRoot around saves a read (and a bitmap) on every create and remove.
+    readMetadataBlock(fileSystem, 0, &fileSystem->superRoot);
+    fileSystem->superRoot.bitmap = bitmap_overlay(256, fileSystem->superRoot.freeInodeMap);
+    size_t i;
+    for(i = 0; i < 32; i++){
+        fileSystem->inodeTable[i] = (uint16_t)(i + 1);
+    }
+    fileSystem->readOnly = options != NULL && options->snapshot != NULL;
+    loadFreeCounts(fileSystem);
+    fileSystem->fdFreeList = -1;
+    pthread_mutex_init(&fileSystem->fdLock, NULL);
+    //Never 0, so a zeroed thread cache never matches.
+    fileSystem->mountId = __atomic_add_fetch(&nextMountId, 1, __ATOMIC_RELAXED) | 1u << 31;
+    fileSystem->staged = calloc(FS_DELALLOC_BLOCKS, sizeof(stagedBlock_t));
+    fileSystem->stagedFree = -1;
+    for(i = 0; fileSystem->staged != NULL && i < FS_DELALLOC_BLOCKS; i++){
+        fileSystem->staged[i].next = fileSystem->stagedFree;
+        fileSystem->stagedFree = (int)i;
+    }
+    for(i = 0; i < 256; i++){
+        fileSystem->stagedHead[i] = -1;
+    }
+    pthread_mutex_init(&fileSystem->stageLock, NULL);
+
+    //A snapshot is read through its own inode map and inode table copy, everything below them is shared.
+    if(fileSystem->readOnly){
+        snapshotTable_t table;
+        int entry = readSnapshotTable(fileSystem, &table) ? findSnapshot(&table, options->snapshot) : -1;
+        if(entry < 0){
+            fs_unmount(fileSystem);
+            return NULL;
+        }
+        snapshotHeader_t header;
+        readMetadataBlock(fileSystem, table.entries[entry].header, &header);
+        memcpy(fileSystem->superRoot.freeInodeMap, header.freeInodeMap, sizeof(header.freeInodeMap));
+        memcpy(fileSystem->inodeTable, header.inodeBlocks, sizeof(header.inodeBlocks));
+        fileSystem->freeInodes = 256 - bitmap_total_set(fileSystem->superRoot.bitmap);
+    }
+
+    if(options != NULL && options->dedup){
+        fileSystem->dedup = dedup_open(blockStore, cache, DEDUP_INDEX_EXT_BLOCK);
+        if(fileSystem->dedup == NULL){
+            fs_unmount(fileSystem);
+            return NULL;
+        }
+    }
+
+    if(options != NULL && options->writeback){
+        fileSystem->writebackIntervalMs = options->writebackIntervalMs ? options->writebackIntervalMs : FS_WRITEBACK_INTERVAL_MS;
+        fileSystem->dirtyExpireMs = options->dirtyExpireMs ? options->dirtyExpireMs : FS_DIRTY_EXPIRE_MS;
+        fileSystem->dirtyBackgroundBlocks = options->dirtyBackgroundBlocks ? options->dirtyBackgroundBlocks : FS_DIRTY_BACKGROUND_BLOCKS;
+        fileSystem->writebackBatchBlocks = options->writebackBatchBlocks ? options->writebackBatchBlocks : FS_WRITEBACK_BATCH_BLOCKS;
+        pthread_mutex_init(&fileSystem->writebackLock, NULL);
+        //Monotonic, so the wake-ups don't jump with the wall clock.
+        pthread_condattr_t attributes;
+        pthread_condattr_init(&attributes);
+        pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+        pthread_cond_init(&fileSystem->writebackWake, &attributes);
+        pthread_condattr_destroy(&attributes);
+        if(pthread_create(&fileSystem->writebackThread, NULL, writebackMain, fileSystem) != 0){
+            pthread_cond_destroy(&fileSystem->writebackWake);
+            pthread_mutex_destroy(&fileSystem->writebackLock);
+            fs_unmount(fileSystem);
+            return NULL;
+        }
+        fileSystem->writebackRunning = true;
+    }
+
+    if(options != NULL && options->checksums != BLOCK_STORE_CHECKSUM_OFF && options->scrubBlocksPerSecond != 0){
+        //One pass per interval, sized so the passes add up to the rate.
+        fileSystem->scrubBatchBlocks = (size_t)options->scrubBlocksPerSecond * FS_SCRUB_INTERVAL_MS / 1000;
+        if(fileSystem->scrubBatchBlocks == 0){
+            fileSystem->scrubBatchBlocks = 1;
+        }
+        pthread_mutex_init(&fileSystem->scrubLock, NULL);
+        pthread_condattr_t attributes;
+        pthread_condattr_init(&attributes);
+        pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+        pthread_cond_init(&fileSystem->scrubWake, &attributes);
+        pthread_condattr_destroy(&attributes);
+        if(pthread_create(&fileSystem->scrubThread, NULL, scrubMain, fileSystem) != 0){
+            pthread_cond_destroy(&fileSystem->scrubWake);
+            pthread_mutex_destroy(&fileSystem->scrubLock);
+            fs_unmount(fileSystem);
+            return NULL;
+        }
+        fileSystem->scrubRunning = true;
+    }
 
     return fileSystem;
 }
@@ -144,15 +427,68 @@ int fs_unmount(F17FS_t *fs){
     if(fs == NULL)
     {
         return -1;
-    }else if(fs->blockStore == NULL && fs->bitmap == NULL){
+    }else if(fs->blockStore == NULL){
         return -1;
     }else {
+        if(fs->scrubRunning){
+            pthread_mutex_lock(&fs->scrubLock);
+            fs->scrubStop = true;
+            pthread_cond_signal(&fs->scrubWake);
+            pthread_mutex_unlock(&fs->scrubLock);
+            pthread_join(fs->scrubThread, NULL);
+            pthread_cond_destroy(&fs->scrubWake);
+            pthread_mutex_destroy(&fs->scrubLock);
+        }
+        if(fs->writebackRunning){
+            pthread_mutex_lock(&fs->writebackLock);
+            fs->writebackStop = true;
+            pthread_cond_signal(&fs->writebackWake);
+            pthread_mutex_unlock(&fs->writebackLock);
+            pthread_join(fs->writebackThread, NULL);
+            pthread_cond_destroy(&fs->writebackWake);
+            pthread_mutex_destroy(&fs->writebackLock);
+        }
+        //Staged blocks get their home now, the journal below commits the pointers.
+        pthread_mutex_lock(&fs->stageLock);
+        flushAllStagedBlocks(fs);
+        pthread_mutex_unlock(&fs->stageLock);
+        dedup_close(fs->dedup);
+        //Committing first releases the blocks the batch freed, so the counts saved below are final.
+        journal_commit(fs->journal);
+        //A snapshot mount never wrote the superRoot, and holds the snapshot's inode map in its copy.
+        if(!fs->readOnly){
+            saveFreeCounts(fs->blockStore, &fs->superRoot, __atomic_load_n(&fs->freeInodes, __ATOMIC_RELAXED));
+            fs->superRoot.cleanUnmount = FS_CLEAN_UNMOUNT;
+            writeMetadataBlock(fs, 0, &fs->superRoot);
+        }
+        //Commits whatever is still batched and checkpoints the log, so the next mount replays nothing.
+        journal_close(fs->journal);
+        buffer_cache_destroy(fs->cache);
         block_store_destroy(fs->blockStore);
-        bitmap_destroy(fs->bitmap);
+        bitmap_destroy(fs->superRoot.bitmap);
+        size_t i;
+        for(i = 0; i < fs->fdChunkCount; i++){
+            free(fs->fdChunks[i]);
+        }
+        pthread_mutex_destroy(&fs->fdLock);
+        pthread_mutex_destroy(&fs->stageLock);
+        free(fs->staged);
         free(fs);
         return 0;
     }
 }
+/// Looks up a directory and returns a handle for the *at calls
+///   The handle stays valid until the directory is removed; it never reaches a later directory reusing the inode
+/// \param fs The F17FS containing the directory
+/// \param path Absolute path to the directory
+/// \return directory handle, < 0 on error
+int fs_lookup(F17FS_t *fs, const char *path){
+    if(fs == NULL || path == NULL || path[0] != '/'){
+        return -1;
+    }
+    return resolveDirectory(fs, FS_ROOT_DIR, path + 1);
+}
+
 /// Creates a new file at the specified location
 ///   Directories along the path that do not exist are not created
 /// \param fs The F17FS containing the file
@@ -161,77 +497,83 @@ int fs_unmount(F17FS_t *fs){
 /// \return 0 on success, < 0 on failure
 
 int fs_create(F17FS_t *fs, const char *path, file_t type) {
+    //Absolute paths are relative to the root.
+    if(path == NULL || path[0] != '/'){
+        return -1;
+    }
+    return fs_createat(fs, FS_ROOT_DIR, path + 1, type);
+}
+
+/// Creates a new file relative to a directory handle
+/// \param fs The F17FS containing the file
+/// \param directory Handle of the directory the path starts in
+/// \param path Relative path to file to create
+/// \param type Type of file to create (regular/directory)
+/// \return 0 on success, < 0 on failure
+int fs_createat(F17FS_t *fs, int directory, const char *path, file_t type) {
 
     //Error check file path for Null.
-    if(fs == NULL || path == NULL || strcmp(path, "") == 0 || (type != FS_REGULAR && type != FS_DIRECTORY)) {
+    if(fs == NULL || fs->readOnly || path == NULL || strcmp(path, "") == 0 || (type != FS_REGULAR && type != FS_DIRECTORY)) {
       return -1;
     }
+    //A full inode table turns the create away before the walk.
+    if(__atomic_load_n(&fs->freeInodes, __ATOMIC_RELAXED) == 0){
+        return -1;
+    }
 
-    inode_t* inodeForParent = calloc(1, sizeof(inode_t));
-    directory_t* parentDirectory = calloc(1, sizeof(directory_t));
-    file_record_t* file = calloc(1, sizeof(file_record_t));
+    //Scratch space for the walk lives on the stack, nothing to allocate or free.
+    inode_t parentInodeScratch = {0};
+    directory_t parentDirectoryScratch = {0};
+    file_record_t fileScratch = {0};
+    inode_t* inodeForParent = &parentInodeScratch;
+    directory_t* parentDirectory = &parentDirectoryScratch;
+    file_record_t* file = &fileScratch;
     //Traverse directory structure
-    int succesfullyTraversed = traverseFilePath(path, fs, parentDirectory, inodeForParent, file);
-    if(succesfullyTraversed < 0){
-        free(file);
-        free(parentDirectory);
-        free(inodeForParent);
+    int parentInodeNumber = traverseFromDirectory(fs, directory, path, parentDirectory, inodeForParent, file);
+    if(parentInodeNumber < 0){
         return -1;
     }
 
     int validSpaceToCreate = checkBlockInDirectory(parentDirectory, file);
-    if (validSpaceToCreate < 0){
-        free(inodeForParent);
-        free(parentDirectory);
-        free(file);
+    if (validSpaceToCreate < 0 || !privateDirectory(fs, parentInodeNumber, inodeForParent)){
         return -1;
     }
     //Getting my root for checking Inodes
-    superRoot_t* root = calloc(1, sizeof(superRoot_t));
-    block_store_read(fs->blockStore, 0, root);
-    root->bitmap = bitmap_overlay(256, root->freeInodeMap);
+    superRoot_t* root = &fs->superRoot;
     size_t inodeNumberInInodeTable = bitmap_ffz(root->bitmap);
     if(inodeNumberInInodeTable == SIZE_MAX){
-        bitmap_destroy(root->bitmap);
-        free(inodeForParent);
-        free(parentDirectory);
-        free(file);
-        free(root);
         return -1;
     }
-    inode_t* inodeForDirectoryOrFile = calloc(1, sizeof(inode_t));
+    inode_t newInodeScratch = {0};
+    inode_t* inodeForDirectoryOrFile = &newInodeScratch;
     getInodeFromTable(fs,inodeNumberInInodeTable, inodeForDirectoryOrFile);
     if(type == FS_DIRECTORY){
-        size_t freeDataBlockId = block_store_allocate(fs->blockStore);
+        size_t freeDataBlockId = block_store_allocate_near(fs->blockStore, directoryAllocationGoal(fs, parentInodeNumber, inodeForParent));
         if(freeDataBlockId == SIZE_MAX){
-            bitmap_destroy(root->bitmap);
-            free(inodeForParent);
-            free(parentDirectory);
-            free(file);
-            free(root);
-            free(inodeForDirectoryOrFile);
             return -1;
         }
-        directory_t* requestedNewDirectory = calloc(1, sizeof(directory_t));
+        directory_t newDirectoryScratch = {0};
+        directory_t* requestedNewDirectory = &newDirectoryScratch;
         inodeForDirectoryOrFile[0].fileSize = sizeof(directory_t);
         inodeForDirectoryOrFile[0].fileMode = 1777; //Permissions
+        inodeForDirectoryOrFile[0].linkCount = 1;
         inodeForDirectoryOrFile[0].accessTime = time(0);
         inodeForDirectoryOrFile[0].changeTime = time(0);
         inodeForDirectoryOrFile[0].modifcationTime = time(0);
-        inodeForDirectoryOrFile[0].directBlocks[0] = (uint8_t)freeDataBlockId;
+        inodeForDirectoryOrFile[0].directBlocks[0] = (uint16_t)freeDataBlockId;
         //Writing directory into the directBlock.
-        block_store_write(fs->blockStore, freeDataBlockId, requestedNewDirectory);
+        writeMetadataBlock(fs, freeDataBlockId, requestedNewDirectory);
         //Writing the Inode back into the Inode Table.
         writeInodeIntoTable(fs,inodeNumberInInodeTable, inodeForDirectoryOrFile);
         //Updating the parentDirectory and writing it to back to disc.
         parentDirectory->entries[validSpaceToCreate].inodeNumber = (uint8_t)inodeNumberInInodeTable;
         strcpy(parentDirectory->entries[validSpaceToCreate].name, file->name);
         parentDirectory->entries[validSpaceToCreate].type = FS_DIRECTORY;
-        block_store_write(fs->blockStore, inodeForParent->directBlocks[0], parentDirectory);
-        free(requestedNewDirectory);
+        writeMetadataBlock(fs, inodeForParent->directBlocks[0], parentDirectory);
     }else{
         inodeForDirectoryOrFile[0].fileSize = 0;
         inodeForDirectoryOrFile[0].fileMode = 777; //Permissions
+        inodeForDirectoryOrFile[0].linkCount = 1;
         inodeForDirectoryOrFile[0].accessTime = time(0);
         inodeForDirectoryOrFile[0].changeTime = time(0);
         inodeForDirectoryOrFile[0].modifcationTime = time(0);
@@ -241,21 +583,14 @@ int fs_create(F17FS_t *fs, const char *path, file_t type) {
         parentDirectory->entries[validSpaceToCreate].inodeNumber = (uint8_t)inodeNumberInInodeTable;
         strcpy(parentDirectory->entries[validSpaceToCreate].name, file->name);
         parentDirectory->entries[validSpaceToCreate].type = FS_REGULAR;
-        block_store_write(fs->blockStore, inodeForParent->directBlocks[0], parentDirectory);
+        writeMetadataBlock(fs, inodeForParent->directBlocks[0], parentDirectory);
     }
     //Updating the root after creating a file or directory.
     bitmap_set(root->bitmap, inodeNumberInInodeTable);
-    block_store_write(fs->blockStore, 0, root);
+    __atomic_sub_fetch(&fs->freeInodes, 1, __ATOMIC_RELAXED);
+    writeMetadataBlock(fs, 0, root);
 
-    //CleanUp!
-    bitmap_destroy(root->bitmap);
-    free(inodeForParent);
-    free(parentDirectory);
-    free(file);
-    free(root);
-    free(inodeForDirectoryOrFile);
-
-    return 0;
+    return journal_end_op(fs->journal);
 }
 
 /// Opens the specified file for use
@@ -265,53 +600,56 @@ int fs_create(F17FS_t *fs, const char *path, file_t type) {
 /// \param path path to the requested file
 /// \return file descriptor to the requested file, < 0 on error
 int fs_open(F17FS_t *fs, const char *path) {
+    if(path == NULL || path[0] != '/'){
+        return -1;
+    }
+    return fs_openat(fs, FS_ROOT_DIR, path + 1);
+}
+
+/// Opens a file relative to a directory handle
+/// \param fs The F17FS containing the file
+/// \param directory Handle of the directory the path starts in
+/// \param path Relative path to the requested file
+/// \return file descriptor to the requested file, < 0 on error
+int fs_openat(F17FS_t *fs, int directory, const char *path) {
     if(fs == NULL || path == NULL || strcmp(path, "") == 0){
         return -1;
     }
-    inode_t* inodeForParent = calloc(1, sizeof(inode_t));
-    directory_t* parentDirectory = calloc(1, sizeof(directory_t));
-    file_record_t* file = calloc(1, sizeof(file_record_t));
+    //Scratch space for the walk lives on the stack, nothing to allocate or free.
+    inode_t parentInodeScratch = {0};
+    directory_t parentDirectoryScratch = {0};
+    file_record_t fileScratch = {0};
+    inode_t* inodeForParent = &parentInodeScratch;
+    directory_t* parentDirectory = &parentDirectoryScratch;
+    file_record_t* file = &fileScratch;
     //Traverse directory structure
-    int succesfullyTraversed = traverseFilePath(path, fs, parentDirectory, inodeForParent, file);
+    int succesfullyTraversed = traverseFromDirectory(fs, directory, path, parentDirectory, inodeForParent, file);
     //Check to see if it was found.
     if(succesfullyTraversed < 0){
-        free(file);
-        free(parentDirectory);
-        free(inodeForParent);
         return -1;
     }
     //Check to see if its in the directory entries.
     int fileLocation = indexOfNameInDirectoryEntries(*parentDirectory, file->name);
     if(fileLocation < 0){
-        free(inodeForParent);
-        free(parentDirectory);
-        free(file);
-        return -1;
-    }
-    //Check to see if there is enough fileDescriptors
-    size_t indexOfFileDescriptor = bitmap_ffz(fs->bitmap);
-    if(indexOfFileDescriptor == SIZE_MAX){
-        free(inodeForParent);
-        free(parentDirectory);
-        free(file);
         return -1;
     }
     //Check to see if its directory.
     if(parentDirectory->entries[fileLocation].type == FS_DIRECTORY){
-        free(inodeForParent);
-        free(parentDirectory);
-        free(file);
+        return -1;
+    }
+    //Check to see if there is enough fileDescriptors
+    int indexOfFileDescriptor = allocateFileDescriptor(fs);
+    if(indexOfFileDescriptor < 0){
         return -1;
     }
     //Updating Filedescriptor to being in use.
-    bitmap_set(fs->bitmap, indexOfFileDescriptor);
-    fs->fds[indexOfFileDescriptor].inodeNumber = parentDirectory->entries[fileLocation].inodeNumber;
-    fs->fds[indexOfFileDescriptor].filePosition = 0;
+    fileDescriptor_t* descriptor = FD_AT(fs, indexOfFileDescriptor);
+    descriptor->inodeNumber = parentDirectory->entries[fileLocation].inodeNumber;
+    descriptor->filePosition = 0;
+    //New data goes next to the directory holding the file.
+    descriptor->allocGoal = inodeForParent->directBlocks[0];
     //Cleanup
-    free(inodeForParent);
-    free(parentDirectory);
-    free(file);
-    return (int)indexOfFileDescriptor;
+    return indexOfFileDescriptor;
 }
 
 /// Closes the given file descriptor
@@ -319,17 +657,27 @@ int fs_open(F17FS_t *fs, const char *path) {
 /// \param fd The file to close
 /// \return 0 on success, < 0 on failure
 int fs_close(F17FS_t *fs, int fd){
-    if(fs == NULL || fd <0 || fd > 255){
+    if(fs == NULL){
         return -1;
     }
     //Checking to is if it was actually in us.
-    if(!bitmap_test(fs->bitmap, (size_t)fd)){
+    fileDescriptor_t* descriptor = getFileDescriptor(fs, fd);
+    if(descriptor == NULL){
         return -1;
     }
+    //Whatever the file has staged gets its blocks now, in one contiguous batch.
+    pthread_mutex_lock(&fs->stageLock);
+    int flushed = flushStagedBlocks(fs, descriptor->inodeNumber, NULL);
+    pthread_mutex_unlock(&fs->stageLock);
+    if(flushed > 0 && journal_end_op(fs->journal) < 0){
+        flushed = -1;
+    }
     //Resetting it.
-    bitmap_reset(fs->bitmap, (size_t)fd);
-    fs->fds[fd].filePosition = 0;
-    fs->fds[fd].inodeNumber = '\0';
+    descriptor->filePosition = 0;
+    descriptor->inodeNumber = '\0';
+    if(releaseFileDescriptor(fs, fd) < 0 || flushed < 0){
+        return -1;
+    }
     return 0;
 }
 ///
@@ -340,79 +688,109 @@ int fs_close(F17FS_t *fs, int fd){
 /// \return dyn_array of file records, NULL on error
 ///
 dyn_array_t *fs_get_dir(F17FS_t *fs, const char *path){
-    if(fs == NULL || path == NULL || strcmp(path, "") == 0){
+    if(path == NULL || path[0] != '/'){
         return NULL;
     }
-    inode_t* inodeForParent = calloc(1, sizeof(inode_t));
-    directory_t* parentDirectory = calloc(1, sizeof(directory_t));
-    file_record_t* file = calloc(1, sizeof(file_record_t));
-    dyn_array_t* dynArray = dyn_array_create(7, sizeof(file_record_t), NULL);
-    //Traverse directory structure
-    if(strlen(path) == 1 && path[0] == '/'){
-        //Getting root
-        inode_t* blockSizeOfInodes = calloc(8, sizeof(inode_t));
-        block_store_read(fs->blockStore, 1 , blockSizeOfInodes);
-        //Getting the first Inode.
-        //inodeForParent = &blockSizeOfInodes[0];
-        memcpy(inodeForParent,&blockSizeOfInodes[0], sizeof(inode_t));
-        //Getting the root directory from the dataBlocks of the first inode.
-        block_store_read(fs->blockStore, inodeForParent->directBlocks[0], parentDirectory);
-        int i;
-        for(i = 0; i<7; i++){
-            if(parentDirectory->entries[i].inodeNumber != '\0'){
-                dyn_array_push_front(dynArray, &parentDirectory->entries[i]);
-            }
-        }
-        free(inodeForParent);
-        free(parentDirectory);
-        free(file);
-        free(blockSizeOfInodes);
-        return dynArray;
+    return fs_get_dirat(fs, FS_ROOT_DIR, path + 1);
+}
+
+/// Populates a dyn_array with information about the files in a directory relative to a handle
+/// \param fs The F17FS containing the file
+/// \param directory Handle of the directory the path starts in
+/// \param path Relative path to the directory to inspect, empty for the handle's own directory
+/// \return dyn_array of file records, NULL on error
+dyn_array_t *fs_get_dirat(F17FS_t *fs, int directory, const char *path){
+    if(fs == NULL || path == NULL){
+        return NULL;
+    }
+    fs_dir_t cursor;
+    if(openDirectoryCursor(fs, directory, path, &cursor) < 0){
+        return NULL;
+    }
+    //One batch holds a whole directory, so the array is built in one go instead of entry by entry.
+    file_record_t records[7];
+    ssize_t count = fs_readdir_batch(fs, &cursor, records, 7);
+    if(count < 0){
+        return NULL;
+    }
+    if(count == 0){
+        return dyn_array_create(7, sizeof(file_record_t), NULL);
     }
+    return dyn_array_import(records, (size_t)count, sizeof(file_record_t), NULL);
+}
 
-    int succesfullyTraversed = traverseFilePath(path, fs, parentDirectory, inodeForParent, file);
-    //Check to see if it was found.
-    if(succesfullyTraversed < 0){
-        free(file);
-        free(parentDirectory);
-        free(inodeForParent);
-        dyn_array_destroy(dynArray);
+/// Opens a cursor over the entries of a directory
+///   Entries are those in the directory when it was opened
+/// \param fs The F17FS containing the directory
+/// \param path Absolute path to the directory
+/// \return directory cursor, NULL on error
+fs_dir_t *fs_opendir(F17FS_t *fs, const char *path){
+    if(path == NULL || path[0] != '/'){
         return NULL;
     }
+    return fs_opendirat(fs, FS_ROOT_DIR, path + 1);
+}
 
-    //Check to see if fileLocation exists.
-    int fileLocation = indexOfNameInDirectoryEntries(*parentDirectory, file->name);
-    if(fileLocation < 0){
-        free(inodeForParent);
-        free(parentDirectory);
-        free(file);
-        dyn_array_destroy(dynArray);
+/// Opens a cursor over the entries of a directory relative to a handle
+/// \param fs The F17FS containing the directory
+/// \param directory Handle of the directory the path starts in
+/// \param path Relative path to the directory, empty for the handle's own directory
+/// \return directory cursor, NULL on error
+fs_dir_t *fs_opendirat(F17FS_t *fs, int directory, const char *path){
+    if(fs == NULL || path == NULL){
         return NULL;
     }
-    //Check if its a file and return.
-    if(parentDirectory->entries[fileLocation].type == FS_REGULAR){
-        free(inodeForParent);
-        free(parentDirectory);
-        free(file);
-        dyn_array_destroy(dynArray);
+    fs_dir_t* cursor = calloc(1, sizeof(fs_dir_t));
+    if(cursor == NULL){
         return NULL;
     }
-    //Getting Inode and getting the parent directory.
-    getInodeFromTable(fs,parentDirectory->entries[fileLocation].inodeNumber, inodeForParent);
-    block_store_read(fs->blockStore, inodeForParent->directBlocks[0], parentDirectory);
-    //Looping for all directories and adding them to the dynamic array.
-    int i;
-    for(i = 0; i<7; i++){
-        if(parentDirectory->entries[i].inodeNumber != '\0'){
-            dyn_array_push_front(dynArray, &parentDirectory->entries[i]);
+    if(openDirectoryCursor(fs, directory, path, cursor) < 0){
+        free(cursor);
+        return NULL;
+    }
+    return cursor;
+}
+
+/// Reads the next entry from a directory cursor
+/// \param fs The F17FS containing the directory
+/// \param dir The cursor to advance
+/// \param record Where the entry is copied
+/// \return 1 when an entry was read, 0 at the end of the directory, < 0 on error
+int fs_readdir(F17FS_t *fs, fs_dir_t *dir, file_record_t *record){
+    ssize_t count = fs_readdir_batch(fs, dir, record, 1);
+    return count < 0 ? -1 : (int)count;
+}
+
+/// Reads up to count entries from a directory cursor into a caller supplied array
+/// \param fs The F17FS containing the directory
+/// \param dir The cursor to advance
+/// \param records Array of at least count records
+/// \param count Most entries to read
+/// \return number of entries read (0 at the end of the directory), < 0 on error
+ssize_t fs_readdir_batch(F17FS_t *fs, fs_dir_t *dir, file_record_t *records, size_t count){
+    if(fs == NULL || dir == NULL || records == NULL){
+        return -1;
+    }
+    size_t filled = 0;
+    while(filled < count && dir->nextEntry < 7){
+        file_record_t* entry = &dir->block.entries[dir->nextEntry++];
+        if(entry->inodeNumber != '\0'){
+            memcpy(&records[filled++], entry, sizeof(file_record_t));
         }
     }
-    //CleanUp
-    free(inodeForParent);
-    free(parentDirectory);
-    free(file);
+    return (ssize_t)filled;
+}
 
-    return dynArray;
+/// Closes a directory cursor
+/// \param fs The F17FS containing the directory
+/// \param dir The cursor to close
+/// \return 0 on success, < 0 on failure
+int fs_closedir(F17FS_t *fs, fs_dir_t *dir){
+    if(fs == NULL || dir == NULL){
+        return -1;
+    }
+    free(dir);
+    return 0;
 }
 
 /// Moves the R/W position of the given descriptor to the given location
@@ -428,39 +806,35 @@ off_t fs_seek(F17FS_t *fs, int fd, off_t offset, seek_t whence){
     if(fs == NULL){
         return -1;
     }
-
-    if(fd < 0 || fd > 255){
-        return -1;
-    }
     //See if its in use.
-    if(!bitmap_test(fs->bitmap, fd)){
+    fileDescriptor_t* descriptor = getFileDescriptor(fs, fd);
+    if(descriptor == NULL){
         return -1;
     }
-    uint8_t inodeLocation = fs->fds[fd].inodeNumber;
-    inode_t* fileInode = calloc(1, sizeof(inode_t));
-    getInodeFromTable(fs, inodeLocation, fileInode);
-    int fileSize = fileInode->fileSize;
+    uint8_t inodeLocation = descriptor->inodeNumber;
+    inode_t fileInode;
+    getInodeFromTable(fs, inodeLocation, &fileInode);
+    int fileSize = fileInode.fileSize;
 
-    free(fileInode);
-    int currentFilePosition =0;
+    off_t currentFilePosition =0;
     off_t seekLocation = 0;
     switch (whence) {
         case FS_SEEK_SET:
             seekLocation = calculateOffset(fileSize, offset);
-            fs->fds[fd].filePosition = seekLocation;
+            descriptor->filePosition = seekLocation;
             return seekLocation;
 
         case FS_SEEK_CUR:
-            currentFilePosition = fs->fds[fd].filePosition;
+            currentFilePosition = descriptor->filePosition;
             seekLocation = currentFilePosition + offset;
             seekLocation = calculateOffset(fileSize, seekLocation);
-            fs->fds[fd].filePosition = seekLocation;
+            descriptor->filePosition = seekLocation;
             return seekLocation;
 
         case FS_SEEK_END:
             seekLocation = fileSize + offset;
             seekLocation = calculateOffset(fileSize, seekLocation);
-            fs->fds[fd].filePosition = seekLocation;
+            descriptor->filePosition = seekLocation;
             return seekLocation;
 
         default:
@@ -482,42 +856,83 @@ ssize_t fs_read(F17FS_t *fs, int fd, void *dst, size_t nbyte){
     if(fs == NULL || dst == NULL) {
         return -1;
     }
-    if(fd < 0 || fd > 255){
+    fileDescriptor_t* descriptor = getFileDescriptor(fs, fd);
+    if(descriptor == NULL){
         return -1;
     }
     if(nbyte == 0){
         return 0;
     }
-    if(!bitmap_test(fs->bitmap, fd)){
-        return -1;
-    }
-
-    uint8_t inodeLocation = fs->fds[fd].inodeNumber;
-    inode_t* fileInode = calloc(1, sizeof(inode_t));
-    getInodeFromTable(fs,inodeLocation, fileInode);
-    ssize_t totalBytesRead = 0;
-    size_t requestedReadAmount = nbyte;
 
-    if((int)(requestedReadAmount+fs->fds[fd].filePosition) > fileInode->fileSize){
-        requestedReadAmount = fileInode->fileSize - fs->fds[fd].filePosition;
+    inode_t fileInode;
+    getInodeFromTable(fs, descriptor->inodeNumber, &fileInode);
+    size_t position = (size_t)descriptor->filePosition;
+    if(position >= (size_t)fileInode.fileSize){
+        return 0;
     }
-
-    int currentFilePosition = fs->fds[fd].filePosition;
-    int fileBlockNumber = currentFilePosition/BLOCK_SIZE_BYTES;
-    //Where you are in fileBlock.
-    int byteAtPositionInFileBlock = currentFilePosition % BLOCK_SIZE_BYTES;
-
-    if(fileBlockNumber < 6){
-        totalBytesRead = readDirectBlocks(fs->blockStore, fileBlockNumber, byteAtPositionInFileBlock, fileInode, dst, requestedReadAmount);
-    }else if (fileBlockNumber >= 6 && fileBlockNumber <= 261){
-        totalBytesRead = readIndirectBlock(fs->blockStore, fileBlockNumber, byteAtPositionInFileBlock, fileInode, dst, requestedReadAmount, fileInode->indirectBlock);
-    }else {
-        totalBytesRead = readDoubleIndirectBlocks(fs->blockStore, fileBlockNumber, byteAtPositionInFileBlock, fileInode, dst, requestedReadAmount);
+    //Never read past EOF.
+    if(nbyte > (size_t)fileInode.fileSize - position){
+        nbyte = (size_t)fileInode.fileSize - position;
     }
 
-    fs->fds[fd].filePosition += totalBytesRead;
-    free(fileInode);
+    char* data = dst;
+    ssize_t totalBytesRead = 0;
+    //Compressed files are read a chunk at a time, each chunk the read touches decompressed once.
+    char chunkData[FS_COMPRESS_CHUNK_BYTES];
+    size_t loadedChunk = SIZE_MAX;
+    while(nbyte > 0){
+        size_t byteAtPositionInFileBlock = position % BLOCK_SIZE_BYTES;
+        size_t bytesToRead = BLOCK_SIZE_BYTES - byteAtPositionInFileBlock;
+        if(bytesToRead > nbyte){
+            bytesToRead = nbyte;
+        }
+        if(readStagedBlock(fs, descriptor->inodeNumber, position / BLOCK_SIZE_BYTES, byteAtPositionInFileBlock, data, bytesToRead)){
+            data += bytesToRead;
+            position += bytesToRead;
+            nbyte -= bytesToRead;
+            totalBytesRead += bytesToRead;
+            continue;
+        }
+        if(fileInode.flags & INODE_COMPRESSED){
+            size_t chunk = position / FS_COMPRESS_CHUNK_BYTES;
+            if(chunk != loadedChunk){
+                if(!readChunk(fs, &fileInode, chunk, chunkData)){
+                    descriptor->filePosition = (off_t)position;
+                    return totalBytesRead > 0 ? totalBytesRead : -1;
+                }
+                loadedChunk = chunk;
+            }
+            memcpy(data, chunkData + position % FS_COMPRESS_CHUNK_BYTES, bytesToRead);
+            data += bytesToRead;
+            position += bytesToRead;
+            nbyte -= bytesToRead;
+            totalBytesRead += bytesToRead;
+            continue;
+        }
+        size_t physicalBlock = mapFileBlock(fs, &fileInode, position / BLOCK_SIZE_BYTES, false, NULL);
+        if(physicalBlock == 0){
+            //Never written, reads as zeros.
+            memset(data, 0, bytesToRead);
+        }else{
+            //File data is read as a stream, it only stays cached if it gets read again.
+            char readDataBlock[BLOCK_SIZE_BYTES];
+            char* target = bytesToRead == BLOCK_SIZE_BYTES ? data : readDataBlock;
+            if(buffer_cache_read_stream(fs->cache, physicalBlock, target) == 0){
+                //A block failing its checksum ends the read there.
+                descriptor->filePosition = (off_t)position;
+                return totalBytesRead > 0 ? totalBytesRead : -1;
+            }
+            if(target == readDataBlock){
+                memcpy(data, readDataBlock + byteAtPositionInFileBlock, bytesToRead);
+            }
+        }
+        data += bytesToRead;
+        position += bytesToRead;
+        nbyte -= bytesToRead;
+        totalBytesRead += bytesToRead;
+    }
 
+    descriptor->filePosition = (off_t)position;
     return totalBytesRead;
 }
 
@@ -533,274 +948,161 @@ ssize_t fs_read(F17FS_t *fs, int fd, void *dst, size_t nbyte){
 /// \return number of bytes written (< nbyte IFF out of space), < 0 on error
 ///
 ssize_t fs_write(F17FS_t *fs, int fd, const void *src, size_t nbyte){
-    if(fs == NULL || src == NULL) {
+    if(fs == NULL || fs->readOnly || src == NULL) {
         return -1;
     }
-    if(fd < 0 || fd > 255){
+    fileDescriptor_t* descriptor = getFileDescriptor(fs, fd);
+    if(descriptor == NULL){
         return -1;
     }
     if(nbyte == 0){
         return 0;
     }
-    if(!bitmap_test(fs->bitmap, fd)){
-        return -1;
-    }
-    uint8_t inodeLocation = fs->fds[fd].inodeNumber;
-    inode_t* fileInode = calloc(1, sizeof(inode_t));
-    getInodeFromTable(fs,inodeLocation, fileInode);
-    ssize_t totalBytesWritten = 0;
-    size_t physicalBlock = 0;
-
-    int currentFilePosition = fs->fds[fd].filePosition;
-    int fileBlockNumber = currentFilePosition/BLOCK_SIZE_BYTES;
-    //Where you are in fileBlock.
-    int byteAtPositionInFileBlock = currentFilePosition % BLOCK_SIZE_BYTES;
-
-
-    if(fileBlockNumber < 6){
-        totalBytesWritten = handleDirectBlocks(fs->blockStore, fileBlockNumber, byteAtPositionInFileBlock, fileInode, src, nbyte);
-    }else if (fileBlockNumber >= 6 && fileBlockNumber < 261) {
-
-        uint16_t readIndirectData[256];
-        physicalBlock = fileInode->indirectBlock;
+    inode_t fileInode;
+    getInodeFromTable(fs, descriptor->inodeNumber, &fileInode);
+    size_t position = (size_t)descriptor->filePosition;
 
-        if (physicalBlock == 0) {
-            physicalBlock = block_store_allocate(fs->blockStore);
-            //Making sure I don't run out of space.
-            if(physicalBlock == SIZE_MAX){
-                return 0;
-            }
-            fileInode->indirectBlock = (uint16_t) physicalBlock;
-            memset(readIndirectData, 0, 512);
-            block_store_write(fs->blockStore, physicalBlock, readIndirectData);
+    //Keep the file sequential: the next block goes right after the one before it.
+    size_t goal = descriptor->allocGoal;
+    if(position >= BLOCK_SIZE_BYTES){
+        size_t previousBlock = mapFileBlock(fs, &fileInode, position / BLOCK_SIZE_BYTES - 1, false, NULL);
+        if(previousBlock != 0){
+            goal = previousBlock + 1;
         }
-        totalBytesWritten = handleIndirectBlock(fs->blockStore, fileBlockNumber, byteAtPositionInFileBlock, fileInode, src, nbyte, physicalBlock);
-    }else{
-        totalBytesWritten = handleDoubleIndirectBlocks(fs->blockStore,fileBlockNumber,byteAtPositionInFileBlock, fileInode, src, nbyte);
-    }
-
-    fs->fds[fd].filePosition += totalBytesWritten;
-    fileInode->fileSize += totalBytesWritten;
-    writeInodeIntoTable(fs, fs->fds[fd].inodeNumber, fileInode);
-    free(fileInode);
-
-    return totalBytesWritten;
-}
-
-ssize_t readDirectBlocks(block_store_t* blockStore, int fileBlockNumber, int byteAtPositionInFileBlock, inode_t* inode, char* data, size_t nbytes){
-    size_t physicalBlock = inode->directBlocks[fileBlockNumber];
-    if(physicalBlock == 0){
-        return 0;
-    }
-    size_t bytesToReadFromLocation = (size_t)512 - byteAtPositionInFileBlock;
-    if(bytesToReadFromLocation > nbytes){
-        bytesToReadFromLocation = nbytes;
-    }
-    char readDataBlock[512];
-    block_store_read(blockStore, physicalBlock, readDataBlock);
-    memcpy(data, (readDataBlock + byteAtPositionInFileBlock), bytesToReadFromLocation);
-    nbytes -= bytesToReadFromLocation;
-    if(nbytes > 0 && fileBlockNumber + 1 < 6){
-        return bytesToReadFromLocation + readDirectBlocks(blockStore, fileBlockNumber + 1, 0, inode, (data+bytesToReadFromLocation), nbytes);
-    } else if (nbytes > 0 && fileBlockNumber + 1 >= 6){
-        return bytesToReadFromLocation + readIndirectBlock(blockStore, fileBlockNumber + 1, 0, inode, (data + bytesToReadFromLocation), nbytes, inode->indirectBlock);
-    }else {
-        return bytesToReadFromLocation;
     }
-}
-//Direct Block
-ssize_t handleDirectBlocks(block_store_t* blockStore, int fileBlockNumber, int byteAtPositionInFileBlock, inode_t* inode, const char* data, size_t nbytes){
 
-    size_t physicalBlock = 0;
-    bool needBlock = false;
-    if(inode->directBlocks[fileBlockNumber] == 0){
-        physicalBlock = block_store_allocate(blockStore);
-        if(physicalBlock == SIZE_MAX){
-            return 0;
+    const char* data = src;
+    ssize_t totalBytesWritten = 0;
+    while(nbyte > 0 && position / BLOCK_SIZE_BYTES < DOUBLE_INDIRECT_END){
+        size_t byteAtPositionInFileBlock = position % BLOCK_SIZE_BYTES;
+        size_t bytesToWrite = BLOCK_SIZE_BYTES - byteAtPositionInFileBlock;
+        if(bytesToWrite > nbyte){
+            bytesToWrite = nbyte;
         }
-        inode->directBlocks[fileBlockNumber] = (uint16_t) physicalBlock;
-        needBlock = true;
-    }else{
-        physicalBlock = inode->directBlocks[fileBlockNumber];
-    }
-
-    size_t bytesToWriteFromLocation = (size_t)512 - byteAtPositionInFileBlock;
-    if(bytesToWriteFromLocation > nbytes){
-        bytesToWriteFromLocation = nbytes;
-    }
-
-    char readDataBlock[512];
-    if(needBlock){
-        memset(readDataBlock, '\0', 512);
-        memcpy(readDataBlock, data, 512);
-    }else{
-        block_store_read(blockStore, physicalBlock, readDataBlock);
-        memcpy((readDataBlock + byteAtPositionInFileBlock), data, bytesToWriteFromLocation);
-    }
-
-    block_store_write(blockStore, physicalBlock, readDataBlock);
-    nbytes -= bytesToWriteFromLocation;
-
-    if(nbytes > 0 && fileBlockNumber + 1 < 6){
-        return bytesToWriteFromLocation + handleDirectBlocks(blockStore, fileBlockNumber + 1 , 0 , inode , (data + bytesToWriteFromLocation) ,nbytes);
-    }else if(nbytes > 0 && fileBlockNumber + 1 >= 6){
-
-        uint16_t readIndirectData[256];
-        physicalBlock = inode->indirectBlock;
-        if (physicalBlock == 0) {
-            physicalBlock = block_store_allocate(blockStore);
-            //Making sure I don't run out of space.
-            if(physicalBlock == SIZE_MAX){
-                return 0;
+        //Compressed files are always staged, their blocks only get placed a whole chunk at a time.
+        if(fileInode.flags & INODE_COMPRESSED){
+            if(!stageFileBlock(fs, descriptor->inodeNumber, &fileInode, position / BLOCK_SIZE_BYTES,
+                               byteAtPositionInFileBlock, data, bytesToWrite, goal)
+               && rewriteChunk(fs, descriptor->inodeNumber, &fileInode, position / BLOCK_SIZE_BYTES,
+                               byteAtPositionInFileBlock, data, bytesToWrite, &goal) < 0){
+                break;
             }
-            inode->indirectBlock = (uint16_t) physicalBlock;
-            memset(readIndirectData, 0, 512);
-            block_store_write(blockStore, physicalBlock, readIndirectData);
-        }
-        return bytesToWriteFromLocation + handleIndirectBlock(blockStore, fileBlockNumber + 1 , 0 , inode, (data + bytesToWriteFromLocation) ,nbytes, physicalBlock);
-    }else{
-        return bytesToWriteFromLocation;
-    }
-
-}
-
-//Normal Indirect case
-ssize_t readIndirectBlock(block_store_t* blockStore, int fileBlockNumber, int byteAtPositionInFileBlock, inode_t* inode,  char* data, size_t nbytes, size_t blockStoreBlockId){
-    int indirectBlockLocation = (fileBlockNumber - 6) % 256;
-    ssize_t totalBytesRead = 0;
-    uint16_t readIndirectData[256];
-    if(blockStoreBlockId == 0){
-        return 0;
-    }
-    block_store_read(blockStore, blockStoreBlockId, readIndirectData);
-    while(nbytes > 0 && indirectBlockLocation < 256) {
-
-        char tempBlockdata[512];
-        if(readIndirectData[indirectBlockLocation] == 0){
-            return totalBytesRead;
+            data += bytesToWrite;
+            position += bytesToWrite;
+            nbyte -= bytesToWrite;
+            totalBytesWritten += bytesToWrite;
+            continue;
         }
-        block_store_read(blockStore, readIndirectData[indirectBlockLocation], tempBlockdata);
-        size_t bytesToReadFromLocation = (size_t)512 - byteAtPositionInFileBlock;
-        //Checking for writing an excess amount.
-        if(bytesToReadFromLocation > nbytes){
-            bytesToReadFromLocation = nbytes;
+        //A block without a home is staged rather than allocated, unless space is running low.
+        size_t physicalBlock = mapFileBlock(fs, &fileInode, position / BLOCK_SIZE_BYTES, false, NULL);
+        if(physicalBlock == 0 && stageFileBlock(fs, descriptor->inodeNumber, &fileInode, position / BLOCK_SIZE_BYTES,
+                                                byteAtPositionInFileBlock, data, bytesToWrite, goal)){
+            data += bytesToWrite;
+            position += bytesToWrite;
+            nbyte -= bytesToWrite;
+            totalBytesWritten += bytesToWrite;
+            continue;
         }
-        memcpy(data,tempBlockdata+byteAtPositionInFileBlock ,bytesToReadFromLocation);
-
-        fileBlockNumber++;
-        nbytes -= bytesToReadFromLocation;
-        indirectBlockLocation++;
-        data += bytesToReadFromLocation;
-        totalBytesRead += bytesToReadFromLocation;
-        byteAtPositionInFileBlock = 0;
-    }
-
-    if(nbytes > 0){
-        return totalBytesRead + readDoubleIndirectBlocks(blockStore, fileBlockNumber, 0, inode, data, nbytes);
-    }
-
-    return totalBytesRead;
-
-}
-//Normal Indirect case
-ssize_t handleIndirectBlock(block_store_t* blockStore, int fileBlockNumber, int byteAtPositionInFileBlock, inode_t* inode, const char* data, size_t nbytes, size_t blockStoreBlockId){
-
-    int indirectBlockLocation = (fileBlockNumber - 6) % 256;
-    ssize_t totalBytesWritten = 0;
-    size_t physicalBlock = 0;
-    uint16_t readIndirectData[256];
-    //Have indirect data
-    block_store_read(blockStore, blockStoreBlockId, readIndirectData);
-    while(nbytes > 0 && indirectBlockLocation < 256) {
-
-        if(readIndirectData[indirectBlockLocation] == 0){
-            //Allocating space for the block.
-            physicalBlock = block_store_allocate(blockStore);
-            if(physicalBlock == SIZE_MAX){
-                block_store_write(blockStore, blockStoreBlockId, readIndirectData);
-                return totalBytesWritten;
+        const char* blockData = data;
+        char readDataBlock[BLOCK_SIZE_BYTES];
+        if(bytesToWrite != BLOCK_SIZE_BYTES){
+            if(physicalBlock != 0){
+                buffer_cache_read_stream(fs->cache, physicalBlock, readDataBlock);
+            }else{
+                memset(readDataBlock, 0, BLOCK_SIZE_BYTES);
             }
-            //Setting it the block that was allocated.
-            readIndirectData[indirectBlockLocation] = physicalBlock;
+            memcpy(readDataBlock + byteAtPositionInFileBlock, data, bytesToWrite);
+            blockData = readDataBlock;
         }
-        //Can starting writing to the block.
-        char tempBlockdata[512];
-        block_store_read(blockStore, readIndirectData[indirectBlockLocation], tempBlockdata);
-        size_t bytesToWriteFromLocation = (size_t)512 - byteAtPositionInFileBlock;
-        //Checking for writing an excess amount.
-        if(bytesToWriteFromLocation > nbytes){
-            bytesToWriteFromLocation = nbytes;
+        //Out of space.
+        if(writeFileBlock(fs, &fileInode, position / BLOCK_SIZE_BYTES, blockData, &goal) == SIZE_MAX){
+            break;
         }
-        memcpy(tempBlockdata+byteAtPositionInFileBlock, data, bytesToWriteFromLocation);
-        block_store_write(blockStore, readIndirectData[indirectBlockLocation], tempBlockdata);
-
-        fileBlockNumber++;
-        nbytes -= bytesToWriteFromLocation;
-        indirectBlockLocation++;
-        data += bytesToWriteFromLocation;
-        totalBytesWritten += bytesToWriteFromLocation;
-        byteAtPositionInFileBlock = 0;
+        data += bytesToWrite;
+        position += bytesToWrite;
+        nbyte -= bytesToWrite;
+        totalBytesWritten += bytesToWrite;
     }
 
-    block_store_write(blockStore, blockStoreBlockId, readIndirectData);
-
-    if(nbytes > 0){
-        return totalBytesWritten + handleDoubleIndirectBlocks(blockStore, fileBlockNumber, 0, inode, data, nbytes);
+    descriptor->filePosition = (off_t)position;
+    descriptor->allocGoal = goal;
+    if(position > (size_t)fileInode.fileSize){
+        fileInode.fileSize = (int)position;
+    }
+    writeInodeIntoTable(fs, descriptor->inodeNumber, &fileInode);
+    if(journal_end_op(fs->journal) < 0){
+        return -1;
+    }
+    //Past the background threshold the writer wakes writeback instead of flushing itself.
+    if(fs->writebackRunning && block_store_get_dirty_blocks(fs->blockStore) >= fs->dirtyBackgroundBlocks){
+        pthread_cond_signal(&fs->writebackWake);
     }
 
     return totalBytesWritten;
-
 }
 
-//For double Indirect
-ssize_t readDoubleIndirectBlocks(block_store_t* blockStore, int fileBlockNumber, int byteAtPositionInFileBlock, inode_t* inode, char* data, size_t nbytes){
-    uint16_t readDoubleIndirectData[256];
-    if(inode->doubleIndirectBlock == 0){
-        return 0;
+//Follows (and optionally fills in) one block pointer.
+//New pointer blocks are zeroed so their unused slots read as holes. Allocating goes through a pointer block to change
+//what's below it, so one still shared with a snapshot is copied on the way.
+size_t resolveBlockPointer(F17FS_t* fs, uint16_t* pointer, bool allocate, bool isPointerBlock, size_t* goal){
+    if(*pointer != 0 && allocate && isPointerBlock){
+        return privateBlock(fs, pointer, true);
     }
-    block_store_read(blockStore, inode->doubleIndirectBlock, readDoubleIndirectData);
-    int index = (fileBlockNumber - 261) / 256;
-    if(readDoubleIndirectData[index] == 0){
-        return 0;
+    if(*pointer != 0 || !allocate){
+        return *pointer;
     }
-    return readIndirectBlock(blockStore, fileBlockNumber, byteAtPositionInFileBlock, inode, data, nbytes, readDoubleIndirectData[index]);
-
+    size_t physicalBlock = block_store_allocate_near(fs->blockStore, *goal);
+    if(physicalBlock == SIZE_MAX){
+        return SIZE_MAX;
+    }
+    if(isPointerBlock){
+        uint16_t emptyPointers[POINTERS_PER_BLOCK];
+        memset(emptyPointers, 0, BLOCK_SIZE_BYTES);
+        writeMetadataBlock(fs, physicalBlock, emptyPointers);
+    }
+    *pointer = (uint16_t)physicalBlock;
+    *goal = physicalBlock + 1;
+    return physicalBlock;
 }
-//For double Indirect
-ssize_t handleDoubleIndirectBlocks(block_store_t* blockStore, int fileBlockNumber, int byteAtPositionInFileBlock, inode_t* inode, const char* data, size_t nbytes){
 
-    size_t physicalBlock = 0;
-    uint16_t readDoubleIndirectData[256];
-
-    if(inode->doubleIndirectBlock == 0){
+//Same as resolveBlockPointer, for a slot inside an indirect block on disk.
+size_t resolvePointerInBlock(F17FS_t* fs, size_t pointerBlock, size_t index, bool allocate, bool isPointerBlock, size_t* goal){
+    uint16_t pointers[POINTERS_PER_BLOCK];
+    readMetadataBlock(fs, pointerBlock, pointers);
+    uint16_t before = pointers[index];
+    size_t physicalBlock = resolveBlockPointer(fs, &pointers[index], allocate, isPointerBlock, goal);
+    if(pointers[index] != before){
+        writeMetadataBlock(fs, pointerBlock, pointers);
+    }
+    return physicalBlock;
+}
 
-        physicalBlock = block_store_allocate(blockStore);
-        if(physicalBlock == SIZE_MAX){
-            return 0;
+size_t mapFileBlock(F17FS_t* fs, inode_t* inode, size_t fileBlockNumber, bool allocate, size_t* goal){
+    if(fileBlockNumber < DIRECT_BLOCKS){
+        return resolveBlockPointer(fs, &inode->directBlocks[fileBlockNumber], allocate, false, goal);
+    }
+    if(fileBlockNumber < INDIRECT_END){
+        size_t indirectBlock = resolveBlockPointer(fs, &inode->indirectBlock, allocate, true, goal);
+        if(indirectBlock == 0 || indirectBlock == SIZE_MAX){
+            return indirectBlock;
         }
-        inode->doubleIndirectBlock = physicalBlock;
-        //Clearing out the array.
-        memset(readDoubleIndirectData, 0, 512);
-
-    } else {
-        block_store_read(blockStore, inode->doubleIndirectBlock, readDoubleIndirectData);
+        return resolvePointerInBlock(fs, indirectBlock, fileBlockNumber - DIRECT_BLOCKS, allocate, false, goal);
     }
-    //Where in the doubleIndirect block.
-    int index = (fileBlockNumber - 261) / 256;
-    if(readDoubleIndirectData[index] == 0){
-        physicalBlock = block_store_allocate(blockStore);
-        if(physicalBlock == SIZE_MAX){
-            return 0;
+    if(fileBlockNumber < DOUBLE_INDIRECT_END){
+        size_t doubleIndirectBlock = resolveBlockPointer(fs, &inode->doubleIndirectBlock, allocate, true, goal);
+        if(doubleIndirectBlock == 0 || doubleIndirectBlock == SIZE_MAX){
+            return doubleIndirectBlock;
+        }
+        size_t index = fileBlockNumber - INDIRECT_END;
+        size_t indirectBlock = resolvePointerInBlock(fs, doubleIndirectBlock, index / POINTERS_PER_BLOCK, allocate, true, goal);
+        if(indirectBlock == 0 || indirectBlock == SIZE_MAX){
+            return indirectBlock;
         }
-        readDoubleIndirectData[index] = physicalBlock;
-        block_store_write(blockStore, inode->doubleIndirectBlock, readDoubleIndirectData);
-        return handleIndirectBlock(blockStore, fileBlockNumber, byteAtPositionInFileBlock, inode, data, nbytes, physicalBlock);
-    } else{
-        return handleIndirectBlock(blockStore, fileBlockNumber, byteAtPositionInFileBlock, inode, data, nbytes, readDoubleIndirectData[index]);
+        return resolvePointerInBlock(fs, indirectBlock, index % POINTERS_PER_BLOCK, allocate, false, goal);
     }
+    return allocate ? SIZE_MAX : 0;
 }
 
-
 ///
 /// Deletes the specified file and closes all open descriptors to the file
 ///   Directories can only be removed when empty
@@ -809,143 +1111,122 @@ ssize_t handleDoubleIndirectBlocks(block_store_t* blockStore, int fileBlockNumbe
 /// \return 0 on success, < 0 on error
 ///
 int fs_remove(F17FS_t *fs, const char *path){
+    if(path == NULL || path[0] != '/'){
+        return -1;
+    }
+    return fs_removeat(fs, FS_ROOT_DIR, path + 1);
+}
 
-    if(fs == NULL || path == NULL || strcmp(path, "") == 0){
+/// Deletes a file relative to a directory handle
+/// \param fs The F17FS containing the file
+/// \param directory Handle of the directory the path starts in
+/// \param path Relative path to file to remove
+/// \return 0 on success, < 0 on error
+int fs_removeat(F17FS_t *fs, int directory, const char *path){
+
+    if(fs == NULL || fs->readOnly || path == NULL || strcmp(path, "") == 0){
         return -1;
     }
 
-    inode_t* inodeForParent = calloc(1, sizeof(inode_t));
-    directory_t* parentDirectory = calloc(1, sizeof(directory_t));
-    file_record_t* file = calloc(1, sizeof(file_record_t));
+    //Scratch space for the walk lives on the stack, nothing to allocate or free.
+    inode_t parentInodeScratch = {0};
+    directory_t parentDirectoryScratch = {0};
+    file_record_t fileScratch = {0};
+    inode_t* inodeForParent = &parentInodeScratch;
+    directory_t* parentDirectory = &parentDirectoryScratch;
+    file_record_t* file = &fileScratch;
 
-    int succesfullyTraversed = traverseFilePath(path, fs, parentDirectory, inodeForParent, file);
+    int succesfullyTraversed = traverseFromDirectory(fs, directory, path, parentDirectory, inodeForParent, file);
     if(succesfullyTraversed < 0){
-        free(file);
-        free(parentDirectory);
-        free(inodeForParent);
         return -1;
     }
 
     int fileLocation = indexOfNameInDirectoryEntries(*parentDirectory, file->name);
-    if(fileLocation < 0){
-        free(inodeForParent);
-        free(parentDirectory);
-        free(file);
+    if(fileLocation < 0 || parentDirectory->entries[fileLocation].inodeNumber == '\0'){
         return -1;
     }
-    //Check to see if its directory.
-    if(parentDirectory->entries[fileLocation].type == FS_DIRECTORY){
-        inode_t* temp = calloc(1, sizeof(inode_t));
-        directory_t* checkingDirectory = calloc(1, sizeof(directory_t));
-        getInodeFromTable(fs, parentDirectory->entries[fileLocation].inodeNumber, temp);
-        block_store_read(fs->blockStore, temp->directBlocks[0], checkingDirectory);
+    uint8_t copyOfInodeToUpdate = parentDirectory->entries[fileLocation].inodeNumber;
+    inode_t tempScratch = {0};
+    inode_t* temp = &tempScratch;
+    getInodeFromTable(fs, copyOfInodeToUpdate, temp);
+    //Images made before link counting have 0 here, meaning a single name.
+    int linkCount = temp->linkCount > 0 ? temp->linkCount : 1;
+
+    //Check to see if its directory, only the last name of one has to be empty.
+    if(parentDirectory->entries[fileLocation].type == FS_DIRECTORY && linkCount == 1){
+        directory_t checkingDirectory;
+        readMetadataBlock(fs, temp->directBlocks[0], &checkingDirectory);
         int i = 0;
         for(i = 0; i<7; i++){
-            if(checkingDirectory->entries[i].inodeNumber != '\0'){
-                free(inodeForParent);
-                free(parentDirectory);
-                free(file);
-                free(temp);
-                free(checkingDirectory);
+            if(checkingDirectory.entries[i].inodeNumber != '\0'){
                 return -1;
             }
         }
+    }
 
-        uint8_t copyOfInodeToUpdate = parentDirectory->entries[fileLocation].inodeNumber;
-        //Clears out the directory.
-        memset(checkingDirectory,0, sizeof(directory_t));
-        block_store_write(fs->blockStore, temp->directBlocks[0], checkingDirectory);
-        block_store_release(fs->blockStore, temp->directBlocks[0]);
-        free(checkingDirectory);
-        //Clears out the inode
-        memset(temp, 0, sizeof(inode_t));
-        writeInodeIntoTable(fs,copyOfInodeToUpdate, temp);
-        free(temp);
-
-        //Reseting the parent directory.
-        parentDirectory->entries[fileLocation].inodeNumber = '\0';
-        memset(parentDirectory->entries[fileLocation].name, '\0', 64);
-        block_store_write(fs->blockStore, inodeForParent->directBlocks[0], parentDirectory);
-
-        superRoot_t* root = calloc(1, sizeof(superRoot_t));
-        block_store_read(fs->blockStore,0,root);
-        root->bitmap = bitmap_overlay(256, root->freeInodeMap);
-        bitmap_reset(root->bitmap, copyOfInodeToUpdate);
-        bitmap_destroy(root->bitmap);
-        block_store_write(fs->blockStore,0, root);
-        free(root);
-    } else {
-        inode_t* temp = calloc(1, sizeof(inode_t));
-        getInodeFromTable(fs, parentDirectory->entries[fileLocation].inodeNumber, temp);
-
-        int i = 0;
-        //Dealing with direct blocks.
-        for(i = 0; i<7; i++){
-            if(temp->directBlocks[i] != 0){
-                block_store_release(fs->blockStore, temp->directBlocks[i]);
-            }
-        }
-        //Deals with indirect block.
-        if(temp->indirectBlock != 0){
-            uint16_t indirectData[256];
-            block_store_read(fs->blockStore, temp->indirectBlock, indirectData);
-            for(i = 0; i<256; i++){
-                if(indirectData[i] != 0){
-                    block_store_release(fs->blockStore, indirectData[i]);
-                }
-            }
-            block_store_release(fs->blockStore, temp->indirectBlock);
-        }
-
-        //Deals with double Indirect block.
-        if(temp->doubleIndirectBlock != 0){
-
-            uint16_t doubleIndirectData[256];
-            block_store_read(fs->blockStore, temp->doubleIndirectBlock, doubleIndirectData);
-
-            for(i = 0; i<256; i++){
-
-                if(doubleIndirectData[i] != 0){
+    if(!privateDirectory(fs, succesfullyTraversed, inodeForParent)){
+        return -1;
+    }
+    //Reseting the parent directory.
+    parentDirectory->entries[fileLocation].inodeNumber = '\0';
+    memset(parentDirectory->entries[fileLocation].name, '\0', 64);
+    writeMetadataBlock(fs, inodeForParent->directBlocks[0], parentDirectory);
 
-                    uint16_t indirectData[256];
-                    block_store_read(fs->blockStore, doubleIndirectData[i], indirectData);
-                    int j = 0;
-                    for(j = 0; i<256; i++){
+    //Other names still point at the inode, it lives on.
+    if(linkCount > 1){
+        temp->linkCount = linkCount - 1;
+        temp->changeTime = time(0);
+        writeInodeIntoTable(fs, copyOfInodeToUpdate, temp);
+        return journal_end_op(fs->journal);
+    }
+    releaseInode(fs, copyOfInodeToUpdate, temp);
+    return journal_end_op(fs->journal);
+}
 
-                        if(indirectData[j] != 0){
-                            block_store_release(fs->blockStore, indirectData[j]);
-                        }
-                    }
-                    block_store_release(fs->blockStore, doubleIndirectData[i]);
-                }
-            }
-            block_store_release(fs->blockStore, temp->doubleIndirectBlock);
-        }
-        uint8_t copyOfInodeToUpdate = parentDirectory->entries[fileLocation].inodeNumber;
-
-        memset(temp, 0, sizeof(inode_t));
-        writeInodeIntoTable(fs,copyOfInodeToUpdate, temp);
-        free(temp);
-
-        //Reseting the parent directory.
-        parentDirectory->entries[fileLocation].inodeNumber = '\0';
-        memset(parentDirectory->entries[fileLocation].name, '\0', 64);
-        block_store_write(fs->blockStore, inodeForParent->directBlocks[0], parentDirectory);
-
-        superRoot_t* root = calloc(1, sizeof(superRoot_t));
-        block_store_read(fs->blockStore,0,root);
-        root->bitmap = bitmap_overlay(256, root->freeInodeMap);
-        bitmap_reset(root->bitmap, copyOfInodeToUpdate);
-        bitmap_destroy(root->bitmap);
-        block_store_write(fs->blockStore,0, root);
-        free(root);
+/// Makes another name for an existing file or directory
+///   Both names share the inode, it is reclaimed once the last name is removed
+/// \param fs The F17FS containing the file
+/// \param src Absolute path of the existing file
+/// \param dst Absolute path of the new name
+/// \return 0 on success, < 0 on error
+int fs_link(F17FS_t *fs, const char *src, const char *dst){
+    if(fs == NULL || fs->readOnly || src == NULL || dst == NULL || src[0] != '/' || dst[0] != '/'){
+        return -1;
     }
-
-    free(inodeForParent);
-    free(parentDirectory);
-    free(file);
-
-    return 0;
+    //Scratch space for both walks lives on the stack, nothing to allocate or free.
+    inode_t srcParentInode = {0};
+    inode_t dstParentInode = {0};
+    directory_t srcParent = {0};
+    directory_t dstParent = {0};
+    file_record_t srcFile = {0};
+    file_record_t dstFile = {0};
+    if(traverseFilePath(src, fs, &srcParent, &srcParentInode, &srcFile) < 0){
+        return -1;
+    }
+    int srcLocation = indexOfNameInDirectoryEntries(srcParent, srcFile.name);
+    if(srcLocation < 0 || srcParent.entries[srcLocation].inodeNumber == '\0'){
+        return -1;
+    }
+    int dstParentNumber = traverseFilePath(dst, fs, &dstParent, &dstParentInode, &dstFile);
+    if(dstParentNumber < 0 || dstFile.name[0] == '\0'){
+        return -1;
+    }
+    int dstLocation = checkBlockInDirectory(&dstParent, &dstFile);
+    if(dstLocation < 0 || !privateDirectory(fs, dstParentNumber, &dstParentInode)){
+        return -1;
+    }
+    uint8_t inodeNumber = srcParent.entries[srcLocation].inodeNumber;
+    inode_t inode;
+    getInodeFromTable(fs, inodeNumber, &inode);
+    inode.linkCount = (inode.linkCount > 0 ? inode.linkCount : 1) + 1;
+    inode.changeTime = time(0);
+    //Count goes up before the name shows up, a crash in between leaks rather than frees too early.
+    writeInodeIntoTable(fs, inodeNumber, &inode);
+    dstParent.entries[dstLocation] = srcParent.entries[srcLocation];
+    memset(dstParent.entries[dstLocation].name, '\0', FS_FNAME_MAX);
+    strcpy(dstParent.entries[dstLocation].name, dstFile.name);
+    writeMetadataBlock(fs, dstParentInode.directBlocks[0], &dstParent);
+    return journal_end_op(fs->journal);
 }
 
 /// Moves the file from one location to the other
@@ -956,35 +1237,960 @@ int fs_remove(F17FS_t *fs, const char *path){
 /// \return 0 on success, < 0 on error
 ///
 int fs_move(F17FS_t *fs, const char *src, const char *dst){
-    if(fs == NULL || src == NULL || dst == NULL){
+    if(fs == NULL || fs->readOnly || src == NULL || dst == NULL || src[0] != '/' || dst[0] != '/'){
+        return -1;
+    }
+    //A directory can't be moved into itself.
+    size_t srcLength = strlen(src);
+    if(strncmp(src, dst, srcLength) == 0 && dst[srcLength] == '/'){
+        return -1;
+    }
+    //Scratch space for both walks lives on the stack, nothing to allocate or free.
+    inode_t srcParentInode = {0};
+    inode_t dstParentInode = {0};
+    directory_t srcParent = {0};
+    directory_t dstParent = {0};
+    file_record_t srcFile = {0};
+    file_record_t dstFile = {0};
+    int srcParentNumber = traverseFilePath(src, fs, &srcParent, &srcParentInode, &srcFile);
+    if(srcParentNumber < 0){
+        return -1;
+    }
+    int dstParentNumber = traverseFilePath(dst, fs, &dstParent, &dstParentInode, &dstFile);
+    if(dstParentNumber < 0 || dstFile.name[0] == '\0'){
+        return -1;
+    }
+    int srcLocation = indexOfNameInDirectoryEntries(srcParent, srcFile.name);
+    if(srcLocation < 0 || srcParent.entries[srcLocation].inodeNumber == '\0'){
+        return -1;
+    }
+    //Only the entry moves, the inode and its data blocks stay where they are.
+    if(srcParentNumber == dstParentNumber){
+        if(strcmp(srcFile.name, dstFile.name) == 0){
+            return 0;
+        }
+        if(checkBlockInDirectory(&srcParent, &dstFile) < 0 || !privateDirectory(fs, srcParentNumber, &srcParentInode)){
+            return -1;
+        }
+        memset(srcParent.entries[srcLocation].name, '\0', FS_FNAME_MAX);
+        strcpy(srcParent.entries[srcLocation].name, dstFile.name);
+        writeMetadataBlock(fs, srcParentInode.directBlocks[0], &srcParent);
+        return journal_end_op(fs->journal);
+    }
+    int dstLocation = checkBlockInDirectory(&dstParent, &dstFile);
+    if(dstLocation < 0 || !privateDirectory(fs, dstParentNumber, &dstParentInode)
+       || !privateDirectory(fs, srcParentNumber, &srcParentInode)){
+        return -1;
+    }
+    dstParent.entries[dstLocation] = srcParent.entries[srcLocation];
+    memset(dstParent.entries[dstLocation].name, '\0', FS_FNAME_MAX);
+    strcpy(dstParent.entries[dstLocation].name, dstFile.name);
+    //Linking in the new entry before dropping the old one, so the file is never in neither.
+    writeMetadataBlock(fs, dstParentInode.directBlocks[0], &dstParent);
+    memset(&srcParent.entries[srcLocation], 0, sizeof(file_record_t));
+    writeMetadataBlock(fs, srcParentInode.directBlocks[0], &srcParent);
+    return journal_end_op(fs->journal);
+}
+
+/// Makes the data and metadata of one file durable
+///   Metadata goes out with a journal commit, data blocks are flushed in runs of neighbouring blocks
+/// \param fs The F17FS containing the file
+/// \param fd The file to flush
+/// \return 0 on success, < 0 on error
+int fs_fsync(F17FS_t *fs, int fd){
+    if(fs == NULL){
+        return -1;
+    }
+    fileDescriptor_t* descriptor = getFileDescriptor(fs, fd);
+    if(descriptor == NULL){
+        return -1;
+    }
+    pthread_mutex_lock(&fs->stageLock);
+    int staged = flushStagedBlocks(fs, descriptor->inodeNumber, NULL);
+    pthread_mutex_unlock(&fs->stageLock);
+    //The inode and its pointer blocks are journaled, committing makes them durable through the log.
+    if(staged < 0 || journal_commit(fs->journal) < 0){
+        return -1;
+    }
+    inode_t fileInode;
+    getInodeFromTable(fs, descriptor->inodeNumber, &fileInode);
+    size_t fileBlocks = (fileInode.fileSize + BLOCK_SIZE_BYTES - 1) / BLOCK_SIZE_BYTES;
+    size_t runStart = 0;
+    size_t runLength = 0;
+    bool flushed = true;
+    size_t i;
+    for(i = 0; i < fileBlocks; i++){
+        size_t physicalBlock = mapFileBlock(fs, &fileInode, i, false, NULL);
+        if(physicalBlock == 0 || physicalBlock == SIZE_MAX){
+            continue;
+        }
+        if(runLength > 0 && physicalBlock == runStart + runLength){
+            runLength++;
+            continue;
+        }
+        if(runLength > 0){
+            flushed &= block_store_flush_range(fs->blockStore, runStart, runLength);
+        }
+        runStart = physicalBlock;
+        runLength = 1;
+    }
+    if(runLength > 0){
+        flushed &= block_store_flush_range(fs->blockStore, runStart, runLength);
+    }
+    return flushed ? 0 : -1;
+}
+
+/// Writes a copy of the file system to a file
+/// \param fs The F17FS to save
+/// \param path The file to write
+/// \return 0 on success, < 0 on error
+int fs_serialize(F17FS_t *fs, const char *path){
+    if(fs == NULL || path == NULL || strcmp(path, "") == 0){
+        return -1;
+    }
+    //What the copy gets is what a sync leaves in the block store.
+    if(fs_sync(fs) < 0){
+        return -1;
+    }
+    return block_store_serialize(fs->blockStore, path) != 0 ? 0 : -1;
+}
+
+/// Makes everything written to the file system so far durable
+/// \param fs The F17FS to flush
+/// \return 0 on success, < 0 on error
+int fs_sync(F17FS_t *fs){
+    if(fs == NULL){
+        return -1;
+    }
+    pthread_mutex_lock(&fs->stageLock);
+    int staged = flushAllStagedBlocks(fs);
+    pthread_mutex_unlock(&fs->stageLock);
+    //Not trusted while mounted, but it keeps the on-disk copy close for anything reading the image.
+    if(!fs->readOnly){
+        saveFreeCounts(fs->blockStore, &fs->superRoot, __atomic_load_n(&fs->freeInodes, __ATOMIC_RELAXED));
+        writeMetadataBlock(fs, 0, &fs->superRoot);
+    }
+    if(staged < 0 || journal_commit(fs->journal) < 0){
+        return -1;
+    }
+    if(fs->dedup != NULL && !dedup_flush(fs->dedup)){
+        return -1;
+    }
+    return block_store_flush(fs->blockStore) ? 0 : -1;
+}
+
+/// Turns transparent compression on or off for an empty regular file
+/// \param fs The F17FS containing the file
+/// \param fd The file to change
+/// \param compressed true to compress what gets written from now on
+/// \return 0 on success, < 0 on error
+int fs_set_compressed(F17FS_t *fs, int fd, bool compressed){
+    if(fs == NULL || fs->readOnly){
+        return -1;
+    }
+    fileDescriptor_t* descriptor = getFileDescriptor(fs, fd);
+    if(descriptor == NULL){
+        return -1;
+    }
+    inode_t fileInode;
+    getInodeFromTable(fs, descriptor->inodeNumber, &fileInode);
+    //The blocks of a file with data are laid out one way or the other, switching would mean rewriting them all.
+    if(fileInode.fileSize != 0){
+        return -1;
+    }
+    if(compressed){
+        fileInode.flags |= INODE_COMPRESSED;
+    }else{
+        fileInode.flags &= ~INODE_COMPRESSED;
+    }
+    writeInodeIntoTable(fs, descriptor->inodeNumber, &fileInode);
+    return journal_end_op(fs->journal) < 0 ? -1 : 0;
+}
+
+/// Freezes the tree as it is now under a name
+///   Only the inode table is copied, the blocks its inodes point at gain the snapshot as an owner
+/// \param fs The F17FS to snapshot, not itself a snapshot
+/// \param name Name for the snapshot, not taken yet
+/// \return 0 on success, < 0 on error
+int fs_snapshot_create(F17FS_t *fs, const char *name){
+    if(fs == NULL || fs->readOnly || name == NULL || name[0] == '\0' || strlen(name) >= FS_FNAME_MAX){
+        return -1;
+    }
+    //Staged blocks get their home first, so the snapshot holds everything written so far.
+    pthread_mutex_lock(&fs->stageLock);
+    int staged = flushAllStagedBlocks(fs);
+    pthread_mutex_unlock(&fs->stageLock);
+    snapshotTable_t table;
+    if(staged < 0 || !readSnapshotTable(fs, &table) || findSnapshot(&table, name) >= 0){
+        return -1;
+    }
+    int entry = -1;
+    int i;
+    for(i = 0; i < FS_SNAPSHOT_MAX && entry < 0; i++){
+        if(table.entries[i].header == 0){
+            entry = i;
+        }
+    }
+    if(entry < 0){
+        return -1;
+    }
+    //The table, the header and the inode table copy are all a snapshot takes, kept near the live inode table.
+    size_t tableBlock = fs->superRoot.snapshotTable;
+    if(tableBlock == 0){
+        tableBlock = block_store_allocate_near(fs->blockStore, FIRST_DATA_BLOCK);
+    }
+    size_t headerBlock = block_store_allocate_near(fs->blockStore, FIRST_DATA_BLOCK);
+    snapshotHeader_t header;
+    memset(&header, 0, sizeof(header));
+    bool placed = tableBlock != SIZE_MAX && headerBlock != SIZE_MAX;
+    for(i = 0; i < 32 && placed; i++){
+        size_t copy = block_store_allocate_near(fs->blockStore, headerBlock + 1);
+        placed = copy != SIZE_MAX;
+        header.inodeBlocks[i] = placed ? (uint16_t)copy : 0;
+    }
+    //Every inode in use shares what it points at with its copy; free ones are copied as zeros.
+    int shared = 0;
+    inode_t inodes[8];
+    for(i = 0; i < 256 && placed; i++){
+        if(i % 8 == 0){
+            readMetadataBlock(fs, fs->inodeTable[i / 8], inodes);
+        }
+        if(!bitmap_test(fs->superRoot.bitmap, i)){
+            memset(&inodes[i % 8], 0, sizeof(inode_t));
+        }else if(shareFileBlocks(fs, &inodes[i % 8])){
+            shared = i + 1;
+        }else{
+            placed = false;
+            break;
+        }
+        if(i % 8 == 7){
+            writeMetadataBlock(fs, header.inodeBlocks[i / 8], inodes);
+        }
+    }
+    if(!placed){
+        for(i = 0; i < shared; i++){
+            if(bitmap_test(fs->superRoot.bitmap, i)){
+                getInodeFromTable(fs, i, &inodes[0]);
+                unshareFileBlocks(fs, &inodes[0]);
+            }
+        }
+        //Through the journal, some of them may have copies waiting on a commit.
+        for(i = 0; i < 32 && header.inodeBlocks[i] != 0; i++){
+            releaseBlock(fs, header.inodeBlocks[i]);
+        }
+        if(headerBlock != SIZE_MAX){
+            releaseBlock(fs, headerBlock);
+        }
+        if(tableBlock != SIZE_MAX && tableBlock != fs->superRoot.snapshotTable){
+            releaseBlock(fs, tableBlock);
+        }
+        journal_commit(fs->journal);
+        return -1;
+    }
+    memcpy(header.freeInodeMap, fs->superRoot.freeInodeMap, sizeof(header.freeInodeMap));
+    writeMetadataBlock(fs, headerBlock, &header);
+    memset(&table.entries[entry], 0, sizeof(snapshotEntry_t));
+    strcpy(table.entries[entry].name, name);
+    table.entries[entry].createTime = time(0);
+    table.entries[entry].header = (uint16_t)headerBlock;
+    writeMetadataBlock(fs, tableBlock, &table);
+    if(fs->superRoot.snapshotTable != tableBlock){
+        fs->superRoot.snapshotTable = (uint16_t)tableBlock;
+        writeMetadataBlock(fs, 0, &fs->superRoot);
+    }
+    //Durable on return, like the data it holds.
+    return journal_commit(fs->journal) < 0 ? -1 : 0;
+}
+
+/// Deletes a snapshot, freeing the blocks nothing else owns anymore
+/// \param fs The F17FS holding the snapshot, not itself a snapshot
+/// \param name The snapshot
+/// \return 0 on success, < 0 on error
+int fs_snapshot_delete(F17FS_t *fs, const char *name){
+    if(fs == NULL || fs->readOnly || name == NULL){
+        return -1;
+    }
+    snapshotTable_t table;
+    int entry = readSnapshotTable(fs, &table) ? findSnapshot(&table, name) : -1;
+    if(entry < 0){
+        return -1;
+    }
+    snapshotHeader_t header;
+    readMetadataBlock(fs, table.entries[entry].header, &header);
+    bitmap_t* inodeMap = bitmap_overlay(256, header.freeInodeMap);
+    if(inodeMap == NULL){
+        return -1;
+    }
+    //The snapshot lets go of what its inodes point at, the blocks the live tree still shares stay.
+    inode_t inodes[8];
+    size_t i;
+    for(i = 0; i < 256; i++){
+        if(i % 8 == 0){
+            readMetadataBlock(fs, header.inodeBlocks[i / 8], inodes);
+        }
+        if(bitmap_test(inodeMap, i)){
+            releaseFileBlocks(fs, &inodes[i % 8]);
+        }
+    }
+    bitmap_destroy(inodeMap);
+    for(i = 0; i < 32; i++){
+        releaseBlock(fs, header.inodeBlocks[i]);
+    }
+    releaseBlock(fs, table.entries[entry].header);
+    memset(&table.entries[entry], 0, sizeof(snapshotEntry_t));
+    bool empty = true;
+    for(i = 0; i < FS_SNAPSHOT_MAX; i++){
+        empty &= table.entries[i].header == 0;
+    }
+    //The last snapshot takes the table with it.
+    if(empty){
+        releaseBlock(fs, fs->superRoot.snapshotTable);
+        fs->superRoot.snapshotTable = 0;
+        writeMetadataBlock(fs, 0, &fs->superRoot);
+    }else{
+        writeMetadataBlock(fs, fs->superRoot.snapshotTable, &table);
+    }
+    return journal_commit(fs->journal) < 0 ? -1 : 0;
+}
+
+/// Populates a dyn_array with the snapshots of an image
+/// \param fs The F17FS holding the snapshots
+/// \return dyn_array of fs_snapshot_t, NULL on error
+dyn_array_t *fs_snapshot_list(F17FS_t *fs){
+    if(fs == NULL){
+        return NULL;
+    }
+    snapshotTable_t table;
+    if(!readSnapshotTable(fs, &table)){
+        return NULL;
+    }
+    fs_snapshot_t snapshots[FS_SNAPSHOT_MAX];
+    size_t count = 0;
+    size_t i;
+    for(i = 0; i < FS_SNAPSHOT_MAX; i++){
+        if(table.entries[i].header != 0){
+            memset(&snapshots[count], 0, sizeof(fs_snapshot_t));
+            strncpy(snapshots[count].name, table.entries[i].name, FS_FNAME_MAX - 1);
+            snapshots[count].createTime = table.entries[i].createTime;
+            count++;
+        }
+    }
+    if(count == 0){
+        return dyn_array_create(FS_SNAPSHOT_MAX, sizeof(fs_snapshot_t), NULL);
+    }
+    return dyn_array_import(snapshots, count, sizeof(fs_snapshot_t), NULL);
+}
+
+/// Copies out the buffer cache counters
+/// \param fs The F17FS to inspect
+/// \param stats Where to put them
+/// \return 0 on success, < 0 on error
+int fs_get_cache_stats(F17FS_t *fs, buffer_cache_stats_t *stats){
+    if(fs == NULL || !buffer_cache_get_stats(fs->cache, stats)){
         return -1;
     }
     return 0;
 }
 
+/// Counts the blocks still free for file data and directories, without scanning anything
+/// \param fs The F17FS to inspect
+/// \return Free blocks, SIZE_MAX on error
+size_t fs_get_free_blocks(F17FS_t *fs){
+    if(fs == NULL){
+        return SIZE_MAX;
+    }
+    return block_store_get_free_blocks(fs->blockStore);
+}
+
+/// Counts the inodes still free, without scanning anything
+/// \param fs The F17FS to inspect
+/// \return Free inodes, SIZE_MAX on error
+size_t fs_get_free_inodes(F17FS_t *fs){
+    if(fs == NULL){
+        return SIZE_MAX;
+    }
+    return __atomic_load_n(&fs->freeInodes, __ATOMIC_RELAXED);
+}
+
+/// Counts the reads and scrubs that found a block not matching its checksum
+/// \param fs The F17FS to inspect
+/// \return Mismatches so far, SIZE_MAX on error
+size_t fs_get_checksum_errors(F17FS_t *fs){
+    if(fs == NULL){
+        return SIZE_MAX;
+    }
+    return block_store_get_checksum_errors(fs->blockStore);
+}
+
+/// Counts the blocks written but not yet flushed to the backing file
+/// \param fs The F17FS to inspect
+/// \return Dirty blocks, SIZE_MAX on error
+size_t fs_get_dirty_blocks(F17FS_t *fs){
+    if(fs == NULL){
+        return SIZE_MAX;
+    }
+    return block_store_get_dirty_blocks(fs->blockStore);
+}
+
+/// Copies out how much dedup has found to share
+///   The ratio only looks at the files' data, a snapshot's hold on their blocks isn't sharing
+/// \param fs The F17FS to inspect
+/// \param stats Where to put them
+/// \return 0 on success, < 0 on error
+int fs_get_dedup_stats(F17FS_t *fs, fs_dedup_stats_t *stats){
+    if(fs == NULL || stats == NULL){
+        return -1;
+    }
+    dedup_stats_t lookups = {0, 0, 0};
+    dedup_get_stats(fs->dedup, &lookups);
+    stats->lookups = lookups.lookups;
+    stats->hits = lookups.hits;
+    //Owner counts also take in snapshots, so the live files' data blocks are walked instead.
+    bitmap_t* seen = bitmap_create(BLOCK_STORE_NUM_BLOCKS);
+    if(seen == NULL){
+        return -1;
+    }
+    size_t fileBlocks = 0;
+    size_t dataBlocks = 0;
+    inode_t inodes[8];
+    size_t i, j;
+    for(i = 0; i < 256; i++){
+        if(i % 8 == 0){
+            readMetadataBlock(fs, fs->inodeTable[i / 8], inodes);
+        }
+        inode_t* inode = &inodes[i % 8];
+        if(!bitmap_test(fs->superRoot.bitmap, i) || inode->fileMode >= 1000){
+            continue;
+        }
+        for(j = 0; j < DIRECT_BLOCKS; j++){
+            countDataBlocks(fs, inode->directBlocks[j], 0, seen, &fileBlocks, &dataBlocks);
+        }
+        countDataBlocks(fs, inode->indirectBlock, 1, seen, &fileBlocks, &dataBlocks);
+        countDataBlocks(fs, inode->doubleIndirectBlock, 2, seen, &fileBlocks, &dataBlocks);
+    }
+    bitmap_destroy(seen);
+    stats->sharedBlocks = fileBlocks - dataBlocks;
+    stats->dataBlocks = dataBlocks;
+    stats->usedBlocks = block_store_get_used_blocks(fs->blockStore);
+    stats->ratio = dataBlocks == 0 ? 1.0 : (double)fileBlocks / (double)dataBlocks;
+    return 0;
+}
+
+/// Checks an unmounted image, and repairs it if asked to
+/// \param path The image to check
+/// \param repair Fixes what was found
+/// \param threads Threads to check with, 0 for one per processor
+/// \param report Where to put what was found, may be NULL
+/// \return 0 if the image is consistent, 1 if it wasn't (see unrepaired), < 0 if it couldn't be checked
+int fs_fsck(const char *path, bool repair, size_t threads, fs_fsck_report_t *report){
+    if(path == NULL || strcmp(path, "") == 0){
+        return -1;
+    }
+    block_store_t* blockStore = block_store_open(path);
+    if(blockStore == NULL){
+        return -1;
+    }
+    //Replaying leaves the image as the next mount would see it; checkpointed right away, the log is empty after.
+    journal_t* journal = journal_open(blockStore, 1);
+    if(journal == NULL){
+        block_store_destroy(blockStore);
+        return -1;
+    }
+    journal_close(journal);
+
+    fs_fsck_report_t found;
+    memset(&found, 0, sizeof(found));
+    superRoot_t root;
+    memset(&root, 0, sizeof(root));
+    block_store_read(blockStore, 0, &root);
+    bitmap_t* inodeMap = bitmap_overlay(256, root.freeInodeMap);
+    //The live inode table, then one per snapshot.
+    inode_t* inodes = calloc(256 * (1 + FS_SNAPSHOT_MAX), sizeof(inode_t));
+    directory_t* directories = calloc(256, sizeof(directory_t));
+    uint8_t* fbmData = calloc(BLOCK_STORE_NUM_BLOCKS / 8, 1);
+    uint8_t* referencedData = calloc(BLOCK_STORE_NUM_BLOCKS / 8, 1);
+    uint8_t* duplicatedData = calloc(BLOCK_STORE_NUM_BLOCKS / 8, 1);
+    uint32_t* sharedClaims = calloc(BLOCK_STORE_NUM_BLOCKS, sizeof(uint32_t));
+    bitmap_t* fbm = bitmap_overlay(BLOCK_STORE_NUM_BLOCKS, fbmData);
+    bitmap_t* referenced = bitmap_overlay(BLOCK_STORE_NUM_BLOCKS, referencedData);
+    bitmap_t* duplicated = bitmap_overlay(BLOCK_STORE_NUM_BLOCKS, duplicatedData);
+    bitmap_t* seen = bitmap_create(BLOCK_STORE_NUM_BLOCKS);
+    int result = -1;
+    size_t i;
+    size_t j;
+    if(inodeMap == NULL || inodes == NULL || directories == NULL || fbm == NULL || referenced == NULL || duplicated == NULL || seen == NULL
+       || sharedClaims == NULL){
+        goto done;
+    }
+    for(i = 1; i < FIRST_DATA_BLOCK; i++){
+        block_store_read(blockStore, i, (char*)inodes + (i - 1) * BLOCK_SIZE_BYTES);
+    }
+    for(i = 0; i < BLOCK_STORE_NUM_BLOCKS / BLOCK_SIZE_BITS; i++){
+        block_store_read_fbm(blockStore, i, fbmData + i * BLOCK_SIZE_BYTES);
+    }
+    //Without a root directory there is nothing to check against.
+    if(!bitmap_test(inodeMap, 0) || inodes[0].fileMode < 1000){
+        goto done;
+    }
+
+    //Names first: every directory reachable from the root, counting the names each inode has.
+    bool reachable[256] = {false};
+    bool walk[256 * (1 + FS_SNAPSHOT_MAX)] = {false};
+    int names[256] = {0};
+    bool inodeChanged = false;
+    uint8_t queue[256];
+    size_t head = 0;
+    size_t tail = 0;
+    reachable[0] = true;
+    names[0] = 1;
+    queue[tail++] = 0;
+    while(head < tail){
+        uint8_t directory = queue[head++];
+        uint16_t blockId = inodes[directory].directBlocks[0];
+        if(blockId < FIRST_DATA_BLOCK || blockId >= BLOCK_STORE_AVAIL_BLOCKS){
+            continue; //Counted as a bad pointer by the block walk.
+        }
+        block_store_read(blockStore, blockId, &directories[directory]);
+        bool directoryChanged = false;
+        for(j = 0; j < 7; j++){
+            file_record_t* entry = &directories[directory].entries[j];
+            uint8_t child = entry->inodeNumber;
+            if(child == 0){
+                continue;
+            }
+            bool isDirectory = inodes[child].fileMode >= 1000;
+            if(!bitmap_test(inodeMap, child) || isDirectory != (entry->type == FS_DIRECTORY)){
+                found.danglingEntries++;
+                if(repair){
+                    memset(entry, 0, sizeof(file_record_t));
+                    directoryChanged = true;
+                    found.repaired++;
+                }
+                continue;
+            }
+            names[child]++;
+            if(!reachable[child]){
+                reachable[child] = true;
+                if(isDirectory){
+                    queue[tail++] = child;
+                }
+            }
+        }
+        if(directoryChanged){
+            block_store_write(blockStore, blockId, &directories[directory]);
+        }
+    }
+    for(i = 0; i < 256; i++){
+        if(!bitmap_test(inodeMap, i)){
+            continue;
+        }
+        found.inodesChecked++;
+        if(!reachable[i]){
+            found.orphanInodes++;
+            if(repair){
+                //Its blocks aren't walked, so they turn up as leaks and are freed below.
+                int generation = inodes[i].generation + 1;
+                memset(&inodes[i], 0, sizeof(inode_t));
+                inodes[i].generation = generation;
+                bitmap_reset(inodeMap, i);
+                inodeChanged = true;
+                found.repaired++;
+                continue;
+            }
+        }else if(i != 0 && (inodes[i].linkCount > 0 ? inodes[i].linkCount : 1) != names[i]){
+            found.linkCountErrors++;
+            if(repair){
+                inodes[i].linkCount = names[i];
+                inodeChanged = true;
+                found.repaired++;
+            }
+        }
+        walk[i] = true;
+    }
+
+    //Snapshots are walked too, every inode in their map; their table, headers and inode table copies are in use.
+    size_t trees = 1;
+    uint16_t snapshotBlocks[1 + FS_SNAPSHOT_MAX * 33];
+    size_t snapshotBlockCount = 0;
+    if(root.snapshotTable >= FIRST_DATA_BLOCK && root.snapshotTable < BLOCK_STORE_AVAIL_BLOCKS){
+        snapshotTable_t table;
+        block_store_read(blockStore, root.snapshotTable, &table);
+        snapshotBlocks[snapshotBlockCount++] = root.snapshotTable;
+        for(i = 0; i < FS_SNAPSHOT_MAX; i++){
+            uint16_t headerBlock = table.entries[i].header;
+            if(headerBlock == 0){
+                continue;
+            }
+            if(headerBlock < FIRST_DATA_BLOCK || headerBlock >= BLOCK_STORE_AVAIL_BLOCKS){
+                found.badPointers++;
+                continue;
+            }
+            snapshotHeader_t header;
+            block_store_read(blockStore, headerBlock, &header);
+            snapshotBlocks[snapshotBlockCount++] = headerBlock;
+            bitmap_t* snapshotMap = bitmap_overlay(256, header.freeInodeMap);
+            if(snapshotMap == NULL){
+                goto done;
+            }
+            for(j = 0; j < 256; j++){
+                uint16_t inodeBlock = header.inodeBlocks[j / 8];
+                if(inodeBlock < FIRST_DATA_BLOCK || inodeBlock >= BLOCK_STORE_AVAIL_BLOCKS){
+                    found.badPointers += j % 8 == 0;
+                    continue;
+                }
+                if(j % 8 == 0){
+                    block_store_read(blockStore, inodeBlock, &inodes[trees * 256 + j]);
+                    snapshotBlocks[snapshotBlockCount++] = inodeBlock;
+                }
+                walk[trees * 256 + j] = bitmap_test(snapshotMap, j);
+            }
+            bitmap_destroy(snapshotMap);
+            trees++;
+        }
+    }else if(root.snapshotTable != 0){
+        found.badPointers++;
+    }
+
+    //Blocks next, split by inode range; each thread claims into its own bitmap, merged below.
+    if(threads == 0){
+        long processors = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = processors > 0 ? (size_t)processors : 1;
+    }
+    if(threads > FSCK_MAX_THREADS){
+        threads = FSCK_MAX_THREADS;
+    }
+    fsckWorker_t workers[FSCK_MAX_THREADS];
+    pthread_t workerThreads[FSCK_MAX_THREADS];
+    bool started[FSCK_MAX_THREADS] = {false};
+    memset(workers, 0, sizeof(workers));
+    for(i = 0; i < threads; i++){
+        workers[i].blockStore = blockStore;
+        workers[i].inodes = inodes;
+        workers[i].walk = walk;
+        workers[i].sharedClaims = sharedClaims;
+        workers[i].first = 256 * trees * i / threads;
+        workers[i].last = 256 * trees * (i + 1) / threads;
+        workers[i].claimed = bitmap_create(BLOCK_STORE_NUM_BLOCKS);
+        workers[i].duplicated = bitmap_create(BLOCK_STORE_NUM_BLOCKS);
+        if(workers[i].claimed == NULL || workers[i].duplicated == NULL){
+            threads = i + 1;
+            break;
+        }
+        //The last range is walked on this thread, and so is any range a thread couldn't be started for.
+        started[i] = i + 1 < threads && pthread_create(&workerThreads[i], NULL, fsckWorkerMain, &workers[i]) == 0;
+    }
+    for(i = 0; i < threads; i++){
+        if(workers[i].claimed == NULL || workers[i].duplicated == NULL){
+            continue;
+        }
+        if(started[i]){
+            pthread_join(workerThreads[i], NULL);
+        }else{
+            fsckWorkerMain(&workers[i]);
+        }
+    }
+    bool merged = true;
+    for(i = 0; i < threads; i++){
+        if(workers[i].claimed == NULL || workers[i].duplicated == NULL){
+            merged = false;
+        }else{
+            const uint8_t* claimed = bitmap_export(workers[i].claimed);
+            const uint8_t* duplicates = bitmap_export(workers[i].duplicated);
+            for(j = 0; j < BLOCK_STORE_NUM_BLOCKS / 8; j++){
+                uint8_t both = referencedData[j] & claimed[j];
+                found.doubleAllocated += (size_t)__builtin_popcount(both);
+                duplicatedData[j] |= both | duplicates[j];
+                referencedData[j] |= claimed[j];
+            }
+            found.doubleAllocated += workers[i].doubleAllocated;
+            found.badPointers += workers[i].badPointers;
+        }
+        bitmap_destroy(workers[i].claimed);
+        bitmap_destroy(workers[i].duplicated);
+    }
+    if(!merged){
+        goto done;
+    }
+    //A shared block is fine with as many pointers as it has owners.
+    for(i = 0; i < BLOCK_STORE_NUM_BLOCKS; i++){
+        if(sharedClaims[i] == 0){
+            continue;
+        }
+        bitmap_set(referenced, i);
+        if(block_store_get_refs(blockStore, i) != sharedClaims[i]){
+            found.refcountErrors++;
+            if(repair && block_store_set_refs(blockStore, i, sharedClaims[i])){
+                found.repaired++;
+            }
+        }
+    }
+    found.blocksInUse = bitmap_total_set(referenced);
+    //The superRoot, the inode table and the FBM itself are always in use.
+    for(i = 0; i < FIRST_DATA_BLOCK; i++){
+        bitmap_set(referenced, i);
+    }
+    for(i = BLOCK_STORE_AVAIL_BLOCKS; i < BLOCK_STORE_NUM_BLOCKS; i++){
+        bitmap_set(referenced, i);
+    }
+    for(i = 0; i < snapshotBlockCount; i++){
+        bitmap_set(referenced, snapshotBlocks[i]);
+    }
+    for(i = 0; i < BLOCK_STORE_NUM_BLOCKS; i++){
+        bool used = bitmap_test(fbm, i);
+        bool pointedAt = bitmap_test(referenced, i);
+        if(used && !pointedAt){
+            found.leakedBlocks++;
+        }else if(!used && pointedAt){
+            found.unmarkedBlocks++;
+            //Marked before anything gets copied below, so a copy can't land on it.
+            if(repair && block_store_request(blockStore, i)){
+                found.repaired++;
+            }
+        }
+    }
+
+    //Saved counts are only worth checking when the next mount would trust them.
+    if(root.cleanUnmount == FS_CLEAN_UNMOUNT){
+        size_t freeInodes = 256 - bitmap_total_set(inodeMap);
+        bool countsMatch = root.freeInodes == freeInodes;
+        const uint8_t* bytes = fbmData;
+        for(i = 0; i < 16; i++){
+            size_t used = 0;
+            for(j = 0; j < BLOCK_STORE_NUM_BLOCKS / 16 / 8; j++){
+                used += (size_t)__builtin_popcount(bytes[i * BLOCK_STORE_NUM_BLOCKS / 16 / 8 + j]);
+            }
+            countsMatch = countsMatch && root.groupFree[i] == BLOCK_STORE_NUM_BLOCKS / 16 - used;
+        }
+        if(!countsMatch){
+            found.countErrors++;
+        }
+    }
+
+    if(repair){
+        //Each extra owner of a block gets its own copy, bad pointers are cleared; snapshots are left as they are.
+        if(found.doubleAllocated > 0 || found.badPointers > 0){
+            for(i = 0; i < 256; i++){
+                if(!walk[i]){
+                    continue;
+                }
+                bool changed = false;
+                for(j = 0; j < DIRECT_BLOCKS; j++){
+                    changed |= fsckRepairPointer(blockStore, &inodes[i].directBlocks[j], 0, duplicated, seen, referenced, &found);
+                }
+                changed |= fsckRepairPointer(blockStore, &inodes[i].indirectBlock, 1, duplicated, seen, referenced, &found);
+                changed |= fsckRepairPointer(blockStore, &inodes[i].doubleIndirectBlock, 2, duplicated, seen, referenced, &found);
+                inodeChanged |= changed;
+            }
+        }
+        for(i = 0; i < BLOCK_STORE_NUM_BLOCKS; i++){
+            if(bitmap_test(fbm, i) && !bitmap_test(referenced, i)){
+                //Nobody points at it, whatever its owner count said.
+                block_store_set_refs(blockStore, i, 1);
+                block_store_release(blockStore, i);
+                found.repaired++;
+            }
+        }
+        if(inodeChanged){
+            for(i = 1; i < FIRST_DATA_BLOCK; i++){
+                block_store_write(blockStore, i, (char*)inodes + (i - 1) * BLOCK_SIZE_BYTES);
+            }
+        }
+        //Whatever the saved counts said, the next mount counts again.
+        if(found.repaired > 0 || found.countErrors > 0){
+            if(found.countErrors > 0){
+                found.repaired++;
+            }
+            root.cleanUnmount = 0;
+            block_store_write(blockStore, 0, &root);
+        }
+        block_store_flush(blockStore);
+    }
+    result = (found.leakedBlocks || found.unmarkedBlocks || found.doubleAllocated || found.badPointers || found.danglingEntries
+              || found.orphanInodes || found.linkCountErrors || found.countErrors || found.refcountErrors) ? 1 : 0;
+done:
+    bitmap_destroy(seen);
+    bitmap_destroy(duplicated);
+    bitmap_destroy(referenced);
+    bitmap_destroy(fbm);
+    bitmap_destroy(inodeMap);
+    free(sharedClaims);
+    free(duplicatedData);
+    free(referencedData);
+    free(fbmData);
+    free(directories);
+    free(inodes);
+    block_store_destroy(blockStore);
+    //Not everything can be fixed (snapshots are left as they are), so a repair is checked again to see what's left.
+    if(result == 1 && repair){
+        fs_fsck_report_t after;
+        if(fs_fsck(path, false, threads, &after) < 0){
+            return -1;
+        }
+        found.unrepaired = after.leakedBlocks + after.unmarkedBlocks + after.doubleAllocated + after.badPointers
+                           + after.danglingEntries + after.orphanInodes + after.linkCountErrors + after.countErrors
+                           + after.refcountErrors;
+    }
+    if(result >= 0 && report != NULL){
+        *report = found;
+    }
+    return result;
+}
+
 //HELPER FUNCTIONS!!!
+//Picks up the free counts at mount: straight from the superRoot after a clean unmount, counted otherwise.
+//Either way the flag is cleared and committed right away, so a crash from here on recounts.
+void loadFreeCounts(F17FS_t* fs){
+    superRoot_t* root = &fs->superRoot;
+    bool trusted = root->cleanUnmount == FS_CLEAN_UNMOUNT && root->freeInodes <= 256
+                   && block_store_get_group_count() == 16;
+    size_t groupFree[16];
+    size_t i;
+    for(i = 0; trusted && i < 16; i++){
+        groupFree[i] = root->groupFree[i];
+    }
+    //Refused if replaying the journal already had to count the free block map.
+    if(trusted && block_store_set_free_counts(fs->blockStore, groupFree)){
+        fs->freeInodes = root->freeInodes;
+    }else{
+        fs->freeInodes = 256 - bitmap_total_set(root->bitmap);
+    }
+    //A snapshot mount leaves the superRoot as it found it.
+    if(!fs->readOnly){
+        root->cleanUnmount = 0;
+        writeMetadataBlock(fs, 0, root);
+        journal_commit(fs->journal);
+    }
+}
+
+//Copies the current free counts into a superRoot, ready to be written.
+void saveFreeCounts(block_store_t* blockStore, superRoot_t* root, size_t freeInodes){
+    size_t groupFree[16] = {0};
+    size_t i;
+    block_store_get_free_counts(blockStore, groupFree);
+    for(i = 0; i < 16; i++){
+        root->groupFree[i] = (uint16_t)groupFree[i];
+    }
+    root->freeInodes = (uint32_t)freeInodes;
+    root->freeBlocks = block_store_get_free_blocks(blockStore);
+}
+
+fileDescriptor_t* getFileDescriptor(F17FS_t* fs, int fd){
+    //Pairs with the release that publishes a new chunk, so its pointer is there before the count says so.
+    if(fd < 0 || (size_t)fd >= __atomic_load_n(&fs->fdChunkCount, __ATOMIC_ACQUIRE) * FD_CHUNK_SIZE){
+        return NULL;
+    }
+    fileDescriptor_t* descriptor = FD_AT(fs, fd);
+    if(__atomic_load_n(&descriptor->state, __ATOMIC_ACQUIRE) != FD_OPEN){
+        return NULL;
+    }
+    return descriptor;
+}
+
+//Moves a descriptor from from to FD_OPEN, fails if someone else got to it first.
+bool claimFileDescriptor(F17FS_t* fs, int fd, uint8_t from){
+    return __atomic_compare_exchange_n(&FD_AT(fs, fd)->state, &from, FD_OPEN, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+}
+
+int allocateFileDescriptor(F17FS_t* fs){
+#if FS_FD_CACHE_SIZE
+    //Fast path, a descriptor this thread closed earlier.
+    while(fdCache.mountId == fs->mountId && fdCache.count > 0){
+        int fd = fdCache.fds[--fdCache.count];
+        if(claimFileDescriptor(fs, fd, FD_CACHED)){
+            return fd;
+        }
+    }
+#endif
+    int fd = -1;
+    pthread_mutex_lock(&fs->fdLock);
+    if(fs->fdFreeList < 0 && fs->fdChunkCount < FD_MAX_CHUNKS){
+        //Out of free descriptors, add another chunk to the table.
+        fileDescriptor_t* chunk = calloc(FD_CHUNK_SIZE, sizeof(fileDescriptor_t));
+        if(chunk != NULL){
+            int first = (int)(fs->fdChunkCount * FD_CHUNK_SIZE);
+            int i;
+            for(i = 0; i < FD_CHUNK_SIZE; i++){
+                chunk[i].nextFree = (i + 1 < FD_CHUNK_SIZE) ? first + i + 1 : -1;
+            }
+            fs->fdChunks[fs->fdChunkCount] = chunk;
+            //Publish the chunk before anyone can look it up.
+            __atomic_store_n(&fs->fdChunkCount, fs->fdChunkCount + 1, __ATOMIC_RELEASE);
+            fs->fdFreeList = first;
+        }
+    }
+    if(fs->fdFreeList >= 0){
+        fd = fs->fdFreeList;
+        fs->fdFreeList = FD_AT(fs, fd)->nextFree;
+        __atomic_store_n(&FD_AT(fs, fd)->state, FD_OPEN, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&fs->fdLock);
+#if FS_FD_CACHE_SIZE
+    //Table is full, take back descriptors stranded in other threads' caches.
+    if(fd < 0){
+        int i;
+        int count = (int)(__atomic_load_n(&fs->fdChunkCount, __ATOMIC_ACQUIRE) * FD_CHUNK_SIZE);
+        for(i = 0; i < count; i++){
+            if(claimFileDescriptor(fs, i, FD_CACHED)){
+                return i;
+            }
+        }
+    }
+#endif
+    return fd;
+}
+
+int releaseFileDescriptor(F17FS_t* fs, int fd){
+    fileDescriptor_t* descriptor = FD_AT(fs, fd);
+#if FS_FD_CACHE_SIZE
+    if(fdCache.mountId != fs->mountId){
+        fdCache.mountId = fs->mountId;
+        fdCache.count = 0;
+    }
+    if(fdCache.count < FS_FD_CACHE_SIZE){
+        uint8_t expected = FD_OPEN;
+        if(!__atomic_compare_exchange_n(&descriptor->state, &expected, FD_CACHED, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)){
+            return -1;
+        }
+        fdCache.fds[fdCache.count++] = fd;
+        return 0;
+    }
+#endif
+    pthread_mutex_lock(&fs->fdLock);
+    uint8_t expected = FD_OPEN;
+    if(!__atomic_compare_exchange_n(&descriptor->state, &expected, FD_FREE, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)){
+        pthread_mutex_unlock(&fs->fdLock);
+        return -1;
+    }
+    descriptor->nextFree = fs->fdFreeList;
+    fs->fdFreeList = fd;
+    pthread_mutex_unlock(&fs->fdLock);
+    return 0;
+}
+
 int traverseFilePath(const char *path, F17FS_t *fs, directory_t* parentDirectory ,inode_t* inode, file_record_t* file){
 
     if(path[0] != '/') {
         return -1;
     }
+    return traverseFromDirectory(fs, FS_ROOT_DIR, path + 1, parentDirectory, inode, file);
+}
 
-    if(strlen(path) == 1){
+int traverseFromDirectory(F17FS_t* fs, int directory, const char* path, directory_t* parentDirectory, inode_t* inode, file_record_t* file){
+
+    if(path[0] == '\0' || path[0] == '/'){
+        return -1;
+    }
+    //Starting at the handle's directory instead of walking down from the root.
+    int parentInodeNumber = readDirectoryHandle(fs, directory, inode, parentDirectory);
+    if(parentInodeNumber < 0){
         return -1;
     }
     size_t i;
     //Used to keep track of current location in string.
     int currentIndexOfFileName = 0;
-    //Need to Read blocksize of Inodes to get the first inode off.
-    inode_t* blockSizeOfInodes = calloc(8, sizeof(inode_t));
-    block_store_read(fs->blockStore, 1 , blockSizeOfInodes);
-    //Getting the first Inode.
-    memcpy(inode,&blockSizeOfInodes[0], sizeof(inode_t));
-    //inode = &blockSizeOfInodes[0];
-    //Getting the root directory from the dataBlocks of the first inode.
-    block_store_read(fs->blockStore, inode->directBlocks[0], parentDirectory);
+    memset(file->name, '\0', FS_FNAME_MAX);
 
-    for (i = 1; i < strlen(path); i++) {
+    for (i = 0; path[i] != '\0'; i++) {
 
         if (path[i] == '/') {
             //Appending null terminator.
@@ -997,68 +2203,327 @@ int traverseFilePath(const char *path, F17FS_t *fs, directory_t* parentDirectory
                 getInodeFromDirectory(fs, parentDirectory, indexOfExistingDirectory, inode);
                 //Checking if parentDirectory is a file.
                 if(inode->fileMode < 1000){
-                    free(blockSizeOfInodes);
                     return -1;
                 }
+                parentInodeNumber = parentDirectory->entries[indexOfExistingDirectory].inodeNumber;
                 //Updating the parentDirectory with new inode
-                block_store_read(fs->blockStore, inode->directBlocks[0], parentDirectory);
+                readMetadataBlock(fs, inode->directBlocks[0], parentDirectory);
                 //Resetting the string.
                 currentIndexOfFileName = 0;
                 memset(file->name, '\0',64);
             }else{
                 //Checking if fileName is a directory.
-                free(blockSizeOfInodes);
                 return -1;
             }
 
         } else if(currentIndexOfFileName >= 63) {
             //Checking if fileName is too long.
-            free(blockSizeOfInodes);
             return -1;
         } else {
             file->name[currentIndexOfFileName] = path[i];
             currentIndexOfFileName++;
         }
     }
-    free(blockSizeOfInodes);
+    return parentInodeNumber;
+}
+
+int readDirectoryHandle(F17FS_t* fs, int directory, inode_t* inode, directory_t* entries){
+    //Only good while the inode is a directory and hasn't been freed since the handle was made.
+    if(directory < 0 || directory >= (1 << 24) || !bitmap_test(fs->superRoot.bitmap, HANDLE_INODE(directory))){
+        return -1;
+    }
+    getInodeFromTable(fs, HANDLE_INODE(directory), inode);
+    if(inode->fileMode < 1000 || (inode->generation & 0xffff) != HANDLE_GENERATION(directory)){
+        return -1;
+    }
+    readMetadataBlock(fs, inode->directBlocks[0], entries);
+    return HANDLE_INODE(directory);
+}
+
+int resolveDirectory(F17FS_t* fs, int directory, const char* path){
+    //Scratch space for the walk lives on the stack, nothing to allocate or free.
+    inode_t inodeScratch = {0};
+    directory_t directoryScratch = {0};
+    file_record_t fileScratch = {0};
+    if(path[0] == '\0'){
+        return readDirectoryHandle(fs, directory, &inodeScratch, &directoryScratch) < 0 ? -1 : directory;
+    }
+    if(traverseFromDirectory(fs, directory, path, &directoryScratch, &inodeScratch, &fileScratch) < 0){
+        return -1;
+    }
+    int fileLocation = indexOfNameInDirectoryEntries(directoryScratch, fileScratch.name);
+    if(fileLocation < 0 || directoryScratch.entries[fileLocation].type != FS_DIRECTORY){
+        return -1;
+    }
+    int inodeNumber = directoryScratch.entries[fileLocation].inodeNumber;
+    getInodeFromTable(fs, inodeNumber, &inodeScratch);
+    return MAKE_HANDLE(inodeNumber, inodeScratch.generation);
+}
+
+int openDirectoryCursor(F17FS_t* fs, int directory, const char* path, fs_dir_t* cursor){
+    int handle = resolveDirectory(fs, directory, path);
+    if(handle < 0){
+        return -1;
+    }
+    int inodeNumber = HANDLE_INODE(handle);
+    inode_t inode;
+    getInodeFromTable(fs, inodeNumber, &inode);
+    cursor->inodeNumber = (uint8_t)inodeNumber;
+    cursor->nextEntry = 0;
+    readMetadataBlock(fs, inode.directBlocks[0], &cursor->block);
     return 0;
 }
 
 int checkBlockInDirectory(directory_t* directory, file_record_t* file) {
     int i;
+    int freeEntry = -1;
+    //The whole block is checked, a name can sit past a hole left by a remove.
     for (i = 0; i < 7; i++) {
         if (directory->entries[i].inodeNumber == '\0') {
-            return i;
+            if(freeEntry < 0){
+                freeEntry = i;
+            }
         }
-        if (strcmp(directory->entries[i].name, file->name) == 0)
+        else if (strcmp(directory->entries[i].name, file->name) == 0)
         {
             return -1;
         }
     }
-    return -1;
+    return freeEntry;
 }
 
 void getInodeFromDirectory(F17FS_t* fs,directory_t* parentDirectory, int index, inode_t* inode){
     getInodeFromTable(fs, parentDirectory->entries[index].inodeNumber, inode);
 }
 
+size_t readMetadataBlock(F17FS_t* fs, size_t blockId, void* buffer){
+    return journal_read(fs->journal, blockId, buffer);
+}
+
+size_t writeMetadataBlock(F17FS_t* fs, size_t blockId, const void* buffer){
+    return journal_write(fs->journal, blockId, buffer);
+}
+
+void releaseBlock(F17FS_t* fs, size_t blockId){
+    //Not reusable until the transaction that stops using it has committed.
+    journal_release(fs->journal, blockId);
+}
+
 void getInodeFromTable(F17FS_t* fs, int index, inode_t* inode) {
-    inode_t* blockSizeOfInodes = calloc(8, sizeof(inode_t));
-    size_t inodeBlocks = (size_t) (index/8)+1;
+    inode_t blockSizeOfInodes[8];
+    size_t inodeBlocks = fs->inodeTable[index/8];
     size_t inodeId = (size_t) (index) % 8;
-    block_store_read(fs->blockStore, inodeBlocks, blockSizeOfInodes);
+    readMetadataBlock(fs, inodeBlocks, blockSizeOfInodes);
     memcpy(inode, &blockSizeOfInodes[inodeId], sizeof(inode_t));
-    free(blockSizeOfInodes);
 }
 
 void writeInodeIntoTable(F17FS_t* fs, size_t index, inode_t* inode) {
-    inode_t* blockSizeOfInodes = calloc(8, sizeof(inode_t));
-    size_t inodeBlocks = (size_t) (index/8)+1;
+    inode_t blockSizeOfInodes[8];
+    size_t inodeBlocks = fs->inodeTable[index/8];
     size_t inodeId = (size_t) (index) % 8;
-    block_store_read(fs->blockStore, inodeBlocks, blockSizeOfInodes);
+    readMetadataBlock(fs, inodeBlocks, blockSizeOfInodes);
     memcpy(&blockSizeOfInodes[inodeId], inode, sizeof(inode_t));
-    block_store_write(fs->blockStore, inodeBlocks, blockSizeOfInodes);
-    free(blockSizeOfInodes);
+    writeMetadataBlock(fs, inodeBlocks, blockSizeOfInodes);
+}
+
+void releaseInode(F17FS_t* fs, uint8_t inodeNumber, inode_t* inode){
+    //Staged blocks never got a home, dropping them is all it takes (and closing below won't flush them).
+    pthread_mutex_lock(&fs->stageLock);
+    dropStagedBlocks(fs, inodeNumber);
+    pthread_mutex_unlock(&fs->stageLock);
+    //Nobody can reach the file anymore, so its descriptors go with it.
+    closeDescriptorsForInode(fs, inodeNumber);
+    if(inode->fileMode >= 1000){
+        //Clears out the directory, unless a snapshot still holds it.
+        if(!sharedBlock(fs, inode->directBlocks[0])){
+            directory_t emptyDirectory = {0};
+            writeMetadataBlock(fs, inode->directBlocks[0], &emptyDirectory);
+        }
+        releaseBlock(fs, inode->directBlocks[0]);
+    }else{
+        releaseFileBlocks(fs, inode);
+    }
+    //Clears out the inode, keeping a new generation so handles to it go stale.
+    int generation = inode->generation + 1;
+    memset(inode, 0, sizeof(inode_t));
+    inode->generation = generation;
+    writeInodeIntoTable(fs, inodeNumber, inode);
+    bitmap_reset(fs->superRoot.bitmap, inodeNumber);
+    __atomic_add_fetch(&fs->freeInodes, 1, __ATOMIC_RELAXED);
+    writeMetadataBlock(fs, 0, &fs->superRoot);
+}
+
+void releaseFileBlocks(F17FS_t* fs, inode_t* inode){
+    size_t i;
+    //Data blocks go on their own, pointer blocks take what they point at with them.
+    for(i = 0; i < DIRECT_BLOCKS; i++){
+        releaseTree(fs, inode->directBlocks[i], 0);
+    }
+    releaseTree(fs, inode->indirectBlock, 1);
+    releaseTree(fs, inode->doubleIndirectBlock, 2);
+}
+
+//Lets go of a block, and for a pointer block (level 1 or 2) of the blocks below it once nobody else owns it.
+//A pointer block shared with a snapshot stands for everything below it, so the other owner keeps all of that.
+void releaseTree(F17FS_t* fs, size_t blockId, int level){
+    if(blockId == 0){
+        return;
+    }
+    if(level > 0 && !sharedBlock(fs, blockId)){
+        uint16_t pointers[POINTERS_PER_BLOCK];
+        readMetadataBlock(fs, blockId, pointers);
+        size_t i;
+        for(i = 0; i < POINTERS_PER_BLOCK; i++){
+            releaseTree(fs, pointers[i], level - 1);
+        }
+    }
+    releaseBlock(fs, blockId);
+}
+
+//Counts the data blocks under a block (a pointer block at level 1 or 2): every one in fileBlocks, and in
+//dataBlocks only the first time seen has it.
+void countDataBlocks(F17FS_t* fs, size_t blockId, int level, bitmap_t* seen, size_t* fileBlocks, size_t* dataBlocks){
+    if(blockId == 0){
+        return;
+    }
+    if(level > 0){
+        uint16_t pointers[POINTERS_PER_BLOCK];
+        readMetadataBlock(fs, blockId, pointers);
+        size_t i;
+        for(i = 0; i < POINTERS_PER_BLOCK; i++){
+            countDataBlocks(fs, pointers[i], level - 1, seen, fileBlocks, dataBlocks);
+        }
+        return;
+    }
+    (*fileBlocks)++;
+    if(!bitmap_test(seen, blockId)){
+        bitmap_set(seen, blockId);
+        (*dataBlocks)++;
+    }
+}
+
+//Tells whether a block has owners besides the caller, leaving out the ones whose free only waits on a commit.
+bool sharedBlock(F17FS_t* fs, size_t blockId){
+    size_t refs = block_store_get_refs(fs->blockStore, blockId);
+    return refs > 1 && refs > 1 + journal_get_releases(fs->journal, blockId);
+}
+
+//Makes the block a pointer points at the caller's own before it gets written. A shared block is copied and the
+//pointer moved to the copy; a copied pointer block adds the copy as an owner of every block it points at.
+//The other owners keep the old block. Returns the block to write, SIZE_MAX if there's no room for the copy.
+size_t privateBlock(F17FS_t* fs, uint16_t* pointer, bool isPointerBlock){
+    size_t blockId = *pointer;
+    if(blockId == 0 || !sharedBlock(fs, blockId)){
+        return blockId;
+    }
+    size_t copy = block_store_allocate_near(fs->blockStore, blockId);
+    if(copy == SIZE_MAX){
+        return SIZE_MAX;
+    }
+    uint16_t data[POINTERS_PER_BLOCK];
+    readMetadataBlock(fs, blockId, data);
+    size_t i;
+    for(i = 0; isPointerBlock && i < POINTERS_PER_BLOCK; i++){
+        if(data[i] != 0 && !block_store_ref(fs->blockStore, data[i])){
+            while(i-- > 0){
+                if(data[i] != 0){
+                    block_store_release(fs->blockStore, data[i]);
+                }
+            }
+            block_store_release(fs->blockStore, copy);
+            return SIZE_MAX;
+        }
+    }
+    writeMetadataBlock(fs, copy, data);
+    releaseBlock(fs, blockId);
+    *pointer = (uint16_t)copy;
+    return copy;
+}
+
+//Makes a directory's block its own before it gets written, pointing the directory's inode (the caller's copy,
+//and the table's) at a copy if a snapshot still shares it. Returns false if there's no room for the copy.
+bool privateDirectory(F17FS_t* fs, int inodeNumber, inode_t* inode){
+    uint16_t before = inode->directBlocks[0];
+    if(privateBlock(fs, &inode->directBlocks[0], false) == SIZE_MAX){
+        return false;
+    }
+    if(inode->directBlocks[0] != before){
+        writeInodeIntoTable(fs, inodeNumber, inode);
+    }
+    return true;
+}
+
+//Adds an owner to every block an inode points at itself, a pointer block standing in for the blocks below it.
+//All or nothing: returns false, having added none, if a block can't take another owner.
+bool shareFileBlocks(F17FS_t* fs, const inode_t* inode){
+    uint16_t pointers[DIRECT_BLOCKS + 2];
+    memcpy(pointers, inode->directBlocks, sizeof(inode->directBlocks));
+    pointers[DIRECT_BLOCKS] = inode->indirectBlock;
+    pointers[DIRECT_BLOCKS + 1] = inode->doubleIndirectBlock;
+    size_t i;
+    for(i = 0; i < DIRECT_BLOCKS + 2; i++){
+        if(pointers[i] != 0 && !block_store_ref(fs->blockStore, pointers[i])){
+            while(i-- > 0){
+                if(pointers[i] != 0){
+                    block_store_release(fs->blockStore, pointers[i]);
+                }
+            }
+            return false;
+        }
+    }
+    return true;
+}
+
+//Takes back what shareFileBlocks added, right away.
+void unshareFileBlocks(F17FS_t* fs, const inode_t* inode){
+    size_t i;
+    for(i = 0; i < DIRECT_BLOCKS; i++){
+        if(inode->directBlocks[i] != 0){
+            block_store_release(fs->blockStore, inode->directBlocks[i]);
+        }
+    }
+    if(inode->indirectBlock != 0){
+        block_store_release(fs->blockStore, inode->indirectBlock);
+    }
+    if(inode->doubleIndirectBlock != 0){
+        block_store_release(fs->blockStore, inode->doubleIndirectBlock);
+    }
+}
+
+//Reads the snapshot table, every entry free if the image has none. Returns false if the superRoot points nowhere sane.
+bool readSnapshotTable(F17FS_t* fs, snapshotTable_t* table){
+    memset(table, 0, sizeof(snapshotTable_t));
+    size_t blockId = fs->superRoot.snapshotTable;
+    if(blockId == 0){
+        return true;
+    }
+    if(blockId < FIRST_DATA_BLOCK || blockId >= BLOCK_STORE_AVAIL_BLOCKS){
+        return false;
+    }
+    readMetadataBlock(fs, blockId, table);
+    return true;
+}
+
+//Entry of the snapshot with this name, -1 if there is none.
+int findSnapshot(const snapshotTable_t* table, const char* name){
+    int i;
+    for(i = 0; i < FS_SNAPSHOT_MAX; i++){
+        if(table->entries[i].header != 0 && strncmp(table->entries[i].name, name, FS_FNAME_MAX) == 0){
+            return i;
+        }
+    }
+    return -1;
+}
+
+void closeDescriptorsForInode(F17FS_t* fs, uint8_t inodeNumber){
+    int count = (int)(__atomic_load_n(&fs->fdChunkCount, __ATOMIC_ACQUIRE) * FD_CHUNK_SIZE);
+    int fd;
+    for(fd = 0; fd < count; fd++){
+        fileDescriptor_t* descriptor = FD_AT(fs, fd);
+        if(__atomic_load_n(&descriptor->state, __ATOMIC_ACQUIRE) == FD_OPEN && descriptor->inodeNumber == inodeNumber){
+            fs_close(fs, fd);
+        }
+    }
 }
 
 int indexOfNameInDirectoryEntries(directory_t directory, char* fileName){
@@ -1072,6 +2537,25 @@ int indexOfNameInDirectoryEntries(directory_t directory, char* fileName){
     return -1;
 }
 
+size_t directoryAllocationGoal(F17FS_t* fs, int parentInodeNumber, inode_t* parentInode){
+    //Nested directories stay next to their parent.
+    if(parentInodeNumber != FS_ROOT_DIR){
+        return parentInode->directBlocks[0];
+    }
+    //Top level directories get spread out to the emptiest allocation group.
+    size_t bestGroup = 0;
+    size_t bestFree = 0;
+    size_t group;
+    for(group = 0; group < block_store_get_group_count(); group++){
+        size_t groupFree = block_store_get_group_free_blocks(fs->blockStore, group);
+        if(groupFree > bestFree){
+            bestFree = groupFree;
+            bestGroup = group;
+        }
+    }
+    return bestGroup * block_store_get_group_size();
+}
+
 off_t calculateOffset(int fileSize, off_t seekLocation){
     if(seekLocation <= 0){
         return 0;
@@ -1080,4 +2564,552 @@ off_t calculateOffset(int fileSize, off_t seekLocation){
     }else{
         return seekLocation;
     }
-}
\ No newline at end of file
+}
+
+//Body of the writeback thread: one pass per interval, or sooner when fs_write says too much is dirty.
+void* writebackMain(void* arg){
+    F17FS_t* fs = arg;
+    pthread_mutex_lock(&fs->writebackLock);
+    while(!fs->writebackStop){
+        struct timespec deadline;
+        monotonicDeadline(&deadline, fs->writebackIntervalMs);
+        pthread_cond_timedwait(&fs->writebackWake, &fs->writebackLock, &deadline);
+        if(fs->writebackStop){
+            break;
+        }
+        pthread_mutex_unlock(&fs->writebackLock);
+        writebackPass(fs);
+        pthread_mutex_lock(&fs->writebackLock);
+    }
+    pthread_mutex_unlock(&fs->writebackLock);
+    return NULL;
+}
+
+//Body of the scrubber thread: checks one batch of allocated blocks per interval.
+//Mismatches go to the callback given at mount, straight from the block store.
+void* scrubMain(void* arg){
+    F17FS_t* fs = arg;
+    pthread_mutex_lock(&fs->scrubLock);
+    while(!fs->scrubStop){
+        struct timespec deadline;
+        monotonicDeadline(&deadline, FS_SCRUB_INTERVAL_MS);
+        pthread_cond_timedwait(&fs->scrubWake, &fs->scrubLock, &deadline);
+        if(fs->scrubStop){
+            break;
+        }
+        pthread_mutex_unlock(&fs->scrubLock);
+        block_store_scrub(fs->blockStore, fs->scrubBatchBlocks);
+        pthread_mutex_lock(&fs->scrubLock);
+    }
+    pthread_mutex_unlock(&fs->scrubLock);
+    return NULL;
+}
+
+//Fills in the CLOCK_MONOTONIC time ms milliseconds from now, for the background threads' waits.
+void monotonicDeadline(struct timespec* deadline, unsigned ms){
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    deadline->tv_sec += ms / 1000;
+    deadline->tv_nsec += (long)(ms % 1000) * 1000000;
+    if(deadline->tv_nsec >= 1000000000){
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000;
+    }
+}
+
+//Writes back what is old enough, or everything once too much is dirty, one bounded batch at a time.
+void writebackPass(F17FS_t* fs){
+    //Metadata first: the commit copies it to its home blocks, where the flush below picks it up.
+    journal_commit_expired(fs->journal, fs->dirtyExpireMs);
+    size_t dirty = block_store_get_dirty_blocks(fs->blockStore);
+    if(dirty >= fs->dirtyBackgroundBlocks || (dirty > 0 && block_store_get_dirty_age(fs->blockStore) >= fs->dirtyExpireMs)){
+        block_store_writeback(fs->blockStore, fs->writebackBatchBlocks);
+    }
+}
+
+//Staged block of an inode holding a file block, -1 if there is none. Called with stageLock held.
+int findStagedBlock(F17FS_t* fs, uint8_t inodeNumber, size_t fileBlock){
+    int index;
+    for(index = fs->stagedHead[inodeNumber]; index != -1; index = fs->staged[index].next){
+        if(fs->staged[index].fileBlock == fileBlock){
+            return index;
+        }
+    }
+    return -1;
+}
+
+//Copies part of a staged file block out, false if the block isn't staged.
+bool readStagedBlock(F17FS_t* fs, uint8_t inodeNumber, size_t fileBlock, size_t offset, void* dst, size_t nbyte){
+    if(__atomic_load_n(&fs->stagedCount[inodeNumber], __ATOMIC_RELAXED) == 0){
+        return false;
+    }
+    pthread_mutex_lock(&fs->stageLock);
+    int index = findStagedBlock(fs, inodeNumber, fileBlock);
+    if(index != -1){
+        memcpy(dst, fs->staged[index].data + offset, nbyte);
+    }
+    pthread_mutex_unlock(&fs->stageLock);
+    return index != -1;
+}
+
+//Writes into a file block that has no physical block yet, keeping it in memory.
+//inode is the caller's copy of the file's inode, kept up to date if its blocks have to be flushed to make room.
+//Returns false when the block should be allocated right away instead (free space running low, or no pool).
+bool stageFileBlock(F17FS_t* fs, uint8_t inodeNumber, inode_t* inode, size_t fileBlock, size_t offset, const void* src, size_t nbyte, size_t goal){
+    if(fs->staged == NULL){
+        return false;
+    }
+    pthread_mutex_lock(&fs->stageLock);
+    int index = findStagedBlock(fs, inodeNumber, fileBlock);
+    if(index == -1){
+        //Space running low: everything staged gets placed while it surely fits, from here on writes allocate as they go.
+        if(block_store_get_free_blocks(fs->blockStore) < FS_DELALLOC_RESERVE){
+            size_t i;
+            for(i = 0; i < 256; i++){
+                flushStagedBlocks(fs, (uint8_t)i, i == inodeNumber ? inode : NULL);
+            }
+            pthread_mutex_unlock(&fs->stageLock);
+            return false;
+        }
+        //Pool full: the inode with the most staged blocks gets flushed, that's the longest contiguous run.
+        if(fs->stagedFree == -1){
+            size_t victim = 0;
+            size_t i;
+            for(i = 1; i < 256; i++){
+                if(fs->stagedCount[i] > fs->stagedCount[victim]){
+                    victim = i;
+                }
+            }
+            if(flushStagedBlocks(fs, (uint8_t)victim, victim == inodeNumber ? inode : NULL) < 0 || fs->stagedFree == -1){
+                pthread_mutex_unlock(&fs->stageLock);
+                return false;
+            }
+        }
+        //In a compressed file the block may already hold data, packed in its chunk.
+        char chunkData[FS_COMPRESS_CHUNK_BYTES];
+        bool fromChunk = (inode->flags & INODE_COMPRESSED) && nbyte < BLOCK_SIZE_BYTES
+                         && mapFileBlock(fs, inode, fileBlock - fileBlock % COMPRESS_CHUNK_BLOCKS, false, NULL) != 0;
+        if(fromChunk && !readChunk(fs, inode, fileBlock / COMPRESS_CHUNK_BLOCKS, chunkData)){
+            pthread_mutex_unlock(&fs->stageLock);
+            return false;
+        }
+        if(fs->stagedHead[inodeNumber] == -1){
+            fs->stagedGoal[inodeNumber] = goal;
+        }
+        index = fs->stagedFree;
+        stagedBlock_t* block = &fs->staged[index];
+        fs->stagedFree = block->next;
+        block->inodeNumber = inodeNumber;
+        block->fileBlock = fileBlock;
+        //A new block reads as zeros around whatever this write covers, or as what its chunk held.
+        if(fromChunk){
+            memcpy(block->data, chunkData + fileBlock % COMPRESS_CHUNK_BLOCKS * BLOCK_SIZE_BYTES, BLOCK_SIZE_BYTES);
+        }else{
+            memset(block->data, 0, BLOCK_SIZE_BYTES);
+        }
+        block->next = fs->stagedHead[inodeNumber];
+        fs->stagedHead[inodeNumber] = index;
+        __atomic_add_fetch(&fs->stagedCount[inodeNumber], 1, __ATOMIC_RELAXED);
+    }
+    memcpy(fs->staged[index].data + offset, src, nbyte);
+    pthread_mutex_unlock(&fs->stageLock);
+    return true;
+}
+
+//Gives every staged block of an inode its physical block, in file order and next to each other, then writes them.
+//inode is a copy to update in place, NULL to go through the inode table. Called with stageLock held.
+//Returns the number of blocks flushed, < 0 if some could not be placed.
+int flushStagedBlocks(F17FS_t* fs, uint8_t inodeNumber, inode_t* inode){
+    if(fs->stagedHead[inodeNumber] == -1){
+        return 0;
+    }
+    inode_t tableInode;
+    if(inode == NULL){
+        getInodeFromTable(fs, inodeNumber, &tableInode);
+        inode = &tableInode;
+    }
+    //File order, so the batch lands as one run.
+    int order[FS_DELALLOC_BLOCKS];
+    int count = 0;
+    int index;
+    for(index = fs->stagedHead[inodeNumber]; index != -1; index = fs->staged[index].next){
+        int slot = count++;
+        while(slot > 0 && fs->staged[order[slot - 1]].fileBlock > fs->staged[index].fileBlock){
+            order[slot] = order[slot - 1];
+            slot--;
+        }
+        order[slot] = index;
+    }
+    size_t goal = fs->stagedGoal[inodeNumber];
+    bool placed = true;
+    int i;
+    //Compressed files are placed a chunk at a time, the blocks of a chunk that weren't staged keep what it held.
+    for(i = 0; i < count && (inode->flags & INODE_COMPRESSED); ){
+        size_t chunk = fs->staged[order[i]].fileBlock / COMPRESS_CHUNK_BLOCKS;
+        int end = i;
+        while(end < count && fs->staged[order[end]].fileBlock / COMPRESS_CHUNK_BLOCKS == chunk){
+            end++;
+        }
+        char chunkData[FS_COMPRESS_CHUNK_BYTES];
+        bool loaded = true;
+        if(end - i == COMPRESS_CHUNK_BLOCKS){
+            memset(chunkData, 0, FS_COMPRESS_CHUNK_BYTES);
+        }else{
+            loaded = readChunk(fs, inode, chunk, chunkData);
+        }
+        for(; i < end; i++){
+            stagedBlock_t* block = &fs->staged[order[i]];
+            memcpy(chunkData + block->fileBlock % COMPRESS_CHUNK_BLOCKS * BLOCK_SIZE_BYTES, block->data, BLOCK_SIZE_BYTES);
+            block->next = fs->stagedFree;
+            fs->stagedFree = order[i];
+        }
+        if(!loaded || writeChunk(fs, inode, chunk, chunkData, &goal) < 0){
+            placed = false;
+        }
+    }
+    for(; i < count; i++){
+        stagedBlock_t* block = &fs->staged[order[i]];
+        if(block->fileBlock > 0){
+            size_t previousBlock = mapFileBlock(fs, inode, block->fileBlock - 1, false, NULL);
+            if(previousBlock != 0){
+                goal = previousBlock + 1;
+            }
+        }
+        if(writeFileBlock(fs, inode, block->fileBlock, block->data, &goal) == SIZE_MAX){
+            placed = false;
+        }
+        block->next = fs->stagedFree;
+        fs->stagedFree = order[i];
+    }
+    fs->stagedHead[inodeNumber] = -1;
+    __atomic_store_n(&fs->stagedCount[inodeNumber], 0, __ATOMIC_RELAXED);
+    writeInodeIntoTable(fs, inodeNumber, inode);
+    return placed ? count : -1;
+}
+
+//Flushes the staged blocks of every inode. Called with stageLock held.
+int flushAllStagedBlocks(F17FS_t* fs){
+    int result = 0;
+    size_t i;
+    for(i = 0; i < 256; i++){
+        if(fs->stagedHead[i] != -1 && flushStagedBlocks(fs, (uint8_t)i, NULL) < 0){
+            result = -1;
+        }
+    }
+    return result;
+}
+
+//Forgets the staged blocks of an inode that is going away. Called with stageLock held.
+void dropStagedBlocks(F17FS_t* fs, uint8_t inodeNumber){
+    int index = fs->stagedHead[inodeNumber];
+    while(index != -1){
+        int next = fs->staged[index].next;
+        fs->staged[index].next = fs->stagedFree;
+        fs->stagedFree = index;
+        index = next;
+    }
+    fs->stagedHead[inodeNumber] = -1;
+    __atomic_store_n(&fs->stagedCount[inodeNumber], 0, __ATOMIC_RELAXED);
+}
+
+//Points a file block at a physical block, 0 making it a hole. Pointer blocks are allocated on the way
+//when a block is set (goal is only needed then), and stay when a pointer is cleared, even if they end up empty.
+//Shared pointer blocks on the way are copied either way.
+//Returns the block it pointed at before (0 for a hole), SIZE_MAX if a pointer block couldn't be allocated or copied.
+size_t setFileBlock(F17FS_t* fs, inode_t* inode, size_t fileBlockNumber, size_t blockId, size_t* goal){
+    //Clearing a hole changes nothing; past that every pointer block on the way exists, so asking for them only copies.
+    if(blockId == 0 && mapFileBlock(fs, inode, fileBlockNumber, false, NULL) == 0){
+        return 0;
+    }
+    if(fileBlockNumber < DIRECT_BLOCKS){
+        size_t physicalBlock = inode->directBlocks[fileBlockNumber];
+        inode->directBlocks[fileBlockNumber] = (uint16_t)blockId;
+        return physicalBlock;
+    }
+    size_t pointerBlock;
+    size_t index;
+    if(fileBlockNumber < INDIRECT_END){
+        pointerBlock = resolveBlockPointer(fs, &inode->indirectBlock, true, true, goal);
+        index = fileBlockNumber - DIRECT_BLOCKS;
+    }else if(fileBlockNumber < DOUBLE_INDIRECT_END){
+        index = fileBlockNumber - INDIRECT_END;
+        size_t doubleIndirectBlock = resolveBlockPointer(fs, &inode->doubleIndirectBlock, true, true, goal);
+        if(doubleIndirectBlock == SIZE_MAX){
+            return SIZE_MAX;
+        }
+        pointerBlock = resolvePointerInBlock(fs, doubleIndirectBlock, index / POINTERS_PER_BLOCK, true, true, goal);
+        index %= POINTERS_PER_BLOCK;
+    }else{
+        return SIZE_MAX;
+    }
+    if(pointerBlock == SIZE_MAX){
+        return SIZE_MAX;
+    }
+    uint16_t pointers[POINTERS_PER_BLOCK];
+    readMetadataBlock(fs, pointerBlock, pointers);
+    size_t physicalBlock = pointers[index];
+    if(physicalBlock != blockId){
+        pointers[index] = (uint16_t)blockId;
+        writeMetadataBlock(fs, pointerBlock, pointers);
+    }
+    return physicalBlock;
+}
+
+//Writes one block of file data, the one place file data reaches its block. With dedup a block already holding
+//the same bytes gets shared instead, and a shared block is never written over: the file gets its own copy first.
+//inode is the caller's copy, updated in place. Returns the block holding the data, SIZE_MAX when out of space.
+size_t writeFileBlock(F17FS_t* fs, inode_t* inode, size_t fileBlockNumber, const void* data, size_t* goal){
+    size_t physicalBlock = mapFileBlock(fs, inode, fileBlockNumber, false, NULL);
+    //Below a pointer block a snapshot shares, the data block is shared too though its own count doesn't say so:
+    //copying the pointer blocks on the way first makes the count tell.
+    if(physicalBlock != 0 && fileBlockNumber >= DIRECT_BLOCKS
+       && mapFileBlock(fs, inode, fileBlockNumber, true, goal) == SIZE_MAX){
+        return SIZE_MAX;
+    }
+    uint64_t hash = 0;
+    if(fs->dedup != NULL){
+        hash = dedup_hash(data);
+        size_t match = dedup_share(fs->dedup, hash, data);
+        if(match == physicalBlock && match != SIZE_MAX){
+            //Already holds these bytes.
+            block_store_release(fs->blockStore, match);
+            return match;
+        }
+        if(match != SIZE_MAX){
+            size_t previous = setFileBlock(fs, inode, fileBlockNumber, match, goal);
+            if(previous == SIZE_MAX){
+                block_store_release(fs->blockStore, match);
+                return SIZE_MAX;
+            }
+            if(previous != 0){
+                releaseBlock(fs, previous);
+            }
+            return match;
+        }
+    }
+    if(physicalBlock != 0 && !block_store_make_private(fs->blockStore, physicalBlock)){
+        size_t copy = block_store_allocate_near(fs->blockStore, *goal);
+        if(copy == SIZE_MAX){
+            return SIZE_MAX;
+        }
+        if(setFileBlock(fs, inode, fileBlockNumber, copy, goal) == SIZE_MAX){
+            block_store_release(fs->blockStore, copy);
+            return SIZE_MAX;
+        }
+        //The other owners keep the old bytes.
+        releaseBlock(fs, physicalBlock);
+        physicalBlock = copy;
+        *goal = copy + 1;
+    }
+    if(physicalBlock == 0){
+        physicalBlock = mapFileBlock(fs, inode, fileBlockNumber, true, goal);
+        if(physicalBlock == SIZE_MAX){
+            return SIZE_MAX;
+        }
+    }
+    buffer_cache_write(fs->cache, physicalBlock, data);
+    if(fs->dedup != NULL){
+        dedup_insert(fs->dedup, hash, physicalBlock);
+    }
+    return physicalBlock;
+}
+
+//Reads one chunk of a compressed file into raw (FS_COMPRESS_CHUNK_BYTES), decompressed. Holes read as zeros.
+//Returns false if a block fails to read or the chunk doesn't decompress.
+bool readChunk(F17FS_t* fs, inode_t* inode, size_t chunk, void* raw){
+    size_t firstBlock = chunk * COMPRESS_CHUNK_BLOCKS;
+    size_t physicalBlock = mapFileBlock(fs, inode, firstBlock, false, NULL);
+    if(physicalBlock == 0){
+        memset(raw, 0, FS_COMPRESS_CHUNK_BYTES);
+        return true;
+    }
+    size_t i;
+    //Every block in use means it didn't shrink and is stored as is.
+    if(mapFileBlock(fs, inode, firstBlock + COMPRESS_CHUNK_BLOCKS - 1, false, NULL) != 0){
+        for(i = 0; i < COMPRESS_CHUNK_BLOCKS; i++){
+            physicalBlock = mapFileBlock(fs, inode, firstBlock + i, false, NULL);
+            if(physicalBlock == 0 || buffer_cache_read_stream(fs->cache, physicalBlock, (char*)raw + i * BLOCK_SIZE_BYTES) == 0){
+                return false;
+            }
+        }
+        return true;
+    }
+    char packed[FS_COMPRESS_CHUNK_BYTES];
+    if(buffer_cache_read_stream(fs->cache, physicalBlock, packed) == 0){
+        return false;
+    }
+    uint16_t packedLength;
+    memcpy(&packedLength, packed, sizeof(packedLength));
+    size_t blocks = (sizeof(packedLength) + packedLength + BLOCK_SIZE_BYTES - 1) / BLOCK_SIZE_BYTES;
+    if(blocks >= COMPRESS_CHUNK_BLOCKS){
+        return false;
+    }
+    for(i = 1; i < blocks; i++){
+        physicalBlock = mapFileBlock(fs, inode, firstBlock + i, false, NULL);
+        if(physicalBlock == 0 || buffer_cache_read_stream(fs->cache, physicalBlock, packed + i * BLOCK_SIZE_BYTES) == 0){
+            return false;
+        }
+    }
+    return lz_decompress(packed + sizeof(packedLength), packedLength, raw, FS_COMPRESS_CHUNK_BYTES) == FS_COMPRESS_CHUNK_BYTES;
+}
+
+//Stores one chunk of a compressed file: compressed into as few blocks as that takes, as is if it doesn't shrink,
+//as a hole if it's all zeros. Blocks the chunk already has are written over, the ones it no longer needs released.
+//Returns 0 on success, < 0 if there isn't room for it.
+int writeChunk(F17FS_t* fs, inode_t* inode, size_t chunk, const void* raw, size_t* goal){
+    const char* rawData = raw;
+    char packed[FS_COMPRESS_CHUNK_BYTES];
+    const char* source = packed;
+    size_t blocks = 0;
+    size_t i;
+    for(i = 0; i < FS_COMPRESS_CHUNK_BYTES && rawData[i] == 0; i++){
+    }
+    if(i < FS_COMPRESS_CHUNK_BYTES){
+        //Only worth it if it saves at least a block.
+        size_t capacity = FS_COMPRESS_CHUNK_BYTES - BLOCK_SIZE_BYTES - sizeof(uint16_t);
+        size_t packedLength = lz_compress(raw, FS_COMPRESS_CHUNK_BYTES, packed + sizeof(uint16_t), capacity);
+        if(packedLength == 0){
+            source = rawData;
+            blocks = COMPRESS_CHUNK_BLOCKS;
+        }else{
+            uint16_t header = (uint16_t)packedLength;
+            memcpy(packed, &header, sizeof(header));
+            blocks = (sizeof(header) + packedLength + BLOCK_SIZE_BYTES - 1) / BLOCK_SIZE_BYTES;
+            memset(packed + sizeof(header) + packedLength, 0, blocks * BLOCK_SIZE_BYTES - sizeof(header) - packedLength);
+        }
+    }
+    size_t firstBlock = chunk * COMPRESS_CHUNK_BLOCKS;
+    //New blocks, plus an indirect and a double indirect level at worst.
+    size_t missing = 0;
+    for(i = 0; i < blocks; i++){
+        if(mapFileBlock(fs, inode, firstBlock + i, false, NULL) == 0){
+            missing++;
+        }
+    }
+    if(missing > 0 && block_store_get_free_blocks(fs->blockStore) < missing + 2){
+        return -1;
+    }
+    for(i = 0; i < blocks; i++){
+        if(writeFileBlock(fs, inode, firstBlock + i, source + i * BLOCK_SIZE_BYTES, goal) == SIZE_MAX){
+            return -1;
+        }
+    }
+    for(; i < COMPRESS_CHUNK_BLOCKS; i++){
+        size_t physicalBlock = setFileBlock(fs, inode, firstBlock + i, 0, NULL);
+        if(physicalBlock != 0){
+            releaseBlock(fs, physicalBlock);
+        }
+    }
+    return 0;
+}
+
+//Writes into one block of a compressed file right away, for when it can't be staged: the whole chunk is rewritten.
+//inode is the caller's copy of the file's inode, kept up to date. Returns 0 on success, < 0 on error.
+int rewriteChunk(F17FS_t* fs, uint8_t inodeNumber, inode_t* inode, size_t fileBlock, size_t offset, const void* src, size_t nbyte, size_t* goal){
+    size_t chunk = fileBlock / COMPRESS_CHUNK_BLOCKS;
+    char chunkData[FS_COMPRESS_CHUNK_BYTES];
+    pthread_mutex_lock(&fs->stageLock);
+    //Whatever the file has staged goes first, so the chunk read back is current.
+    int result = -1;
+    if(flushStagedBlocks(fs, inodeNumber, inode) >= 0 && readChunk(fs, inode, chunk, chunkData)){
+        memcpy(chunkData + fileBlock % COMPRESS_CHUNK_BLOCKS * BLOCK_SIZE_BYTES + offset, src, nbyte);
+        result = writeChunk(fs, inode, chunk, chunkData, goal);
+    }
+    pthread_mutex_unlock(&fs->stageLock);
+    return result;
+}
+
+//Body of an fs_fsck thread: claims every block its range of inodes points at.
+void* fsckWorkerMain(void* arg){
+    fsckWorker_t* worker = arg;
+    size_t i;
+    size_t j;
+    for(i = worker->first; i < worker->last; i++){
+        if(!worker->walk[i]){
+            continue;
+        }
+        const inode_t* inode = &worker->inodes[i];
+        for(j = 0; j < DIRECT_BLOCKS; j++){
+            fsckClaimPointer(worker, inode->directBlocks[j], 0);
+        }
+        fsckClaimPointer(worker, inode->indirectBlock, 1);
+        fsckClaimPointer(worker, inode->doubleIndirectBlock, 2);
+    }
+    return NULL;
+}
+
+//Claims a block for the worker's range, and what it points at for pointer blocks (level 1 or 2).
+void fsckClaimPointer(fsckWorker_t* worker, uint16_t blockId, int level){
+    if(blockId == 0){
+        return;
+    }
+    if(blockId < FIRST_DATA_BLOCK || blockId >= BLOCK_STORE_AVAIL_BLOCKS){
+        worker->badPointers++;
+        return;
+    }
+    if(block_store_get_refs(worker->blockStore, blockId) > 1){
+        //A block with several owners is counted rather than claimed, and walked only once.
+        if(__atomic_fetch_add(&worker->sharedClaims[blockId], 1, __ATOMIC_RELAXED) > 0){
+            return;
+        }
+    }else{
+        //A shared pointer block is walked again, so what it points at is shared too and gets copied with it.
+        if(bitmap_test(worker->claimed, blockId)){
+            worker->doubleAllocated++;
+            bitmap_set(worker->duplicated, blockId);
+        }
+        bitmap_set(worker->claimed, blockId);
+    }
+    if(level > 0){
+        uint16_t pointers[POINTERS_PER_BLOCK];
+        block_store_read(worker->blockStore, blockId, pointers);
+        size_t i;
+        for(i = 0; i < POINTERS_PER_BLOCK; i++){
+            fsckClaimPointer(worker, pointers[i], level - 1);
+        }
+    }
+}
+
+//Clears a bad pointer, or points it at a copy if another pointer got to its block first.
+//Pointer blocks are fixed up all the way down. Returns whether the pointer changed.
+bool fsckRepairPointer(block_store_t* blockStore, uint16_t* pointer, int level, const bitmap_t* duplicated, bitmap_t* seen, bitmap_t* referenced, fs_fsck_report_t* report){
+    if(*pointer == 0){
+        return false;
+    }
+    if(*pointer < FIRST_DATA_BLOCK || *pointer >= BLOCK_STORE_AVAIL_BLOCKS){
+        *pointer = 0;
+        report->repaired++;
+        return true;
+    }
+    bool changed = false;
+    if(bitmap_test(duplicated, *pointer)){
+        if(bitmap_test(seen, *pointer)){
+            size_t copy = block_store_allocate_near(blockStore, *pointer);
+            if(copy == SIZE_MAX){
+                return false;
+            }
+            char data[BLOCK_SIZE_BYTES];
+            block_store_read(blockStore, *pointer, data);
+            block_store_write(blockStore, copy, data);
+            bitmap_set(referenced, copy);
+            bitmap_set(seen, copy);
+            *pointer = (uint16_t)copy;
+            changed = true;
+            report->repaired++;
+        }else{
+            bitmap_set(seen, *pointer);
+        }
+    }
+    if(level > 0){
+        uint16_t pointers[POINTERS_PER_BLOCK];
+        bool pointersChanged = false;
+        size_t i;
+        block_store_read(blockStore, *pointer, pointers);
+        for(i = 0; i < POINTERS_PER_BLOCK; i++){
+            pointersChanged |= fsckRepairPointer(blockStore, &pointers[i], level - 1, duplicated, seen, referenced, report);
+        }
+        if(pointersChanged){
+            block_store_write(blockStore, *pointer, pointers);
+        }
+    }
+    return changed;
+}
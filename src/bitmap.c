@@ -59,6 +59,18 @@ static const uint8_t bit_totals[256] = {B6(0), B6(1), B6(1), B6(2)};
 // A place to generalize the creation process and setup
 bitmap_t *bitmap_initialize(size_t n_bits, BITMAP_FLAGS flags);
 
+// The atomic functions work on 64-bit words. Bit n of the bitmap is bit (n & 7) of byte (n >> 3),
+// which is bit (n & 63) of word (n >> 6) on little endian. Big endian needs the bytes swapped.
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define WORD_ORDER(word) __builtin_bswap64(word)
+#else
+#define WORD_ORDER(word) (word)
+#endif
+#define WORD_MASK(bit) WORD_ORDER(((uint64_t) 1) << ((bit) & 0x3F))
+#define WORD_AT(bitmap, bit) (((uint64_t *) (bitmap)->data) + ((bit) >> 6))
+// Storage gets padded to this so the final word is always ours to load
+#define WORD_PADDED_BYTES(bytes) ((((bytes) + 7) >> 3) << 3)
+
 void bitmap_set(bitmap_t *const bitmap, const size_t bit) {
     bitmap->data[bit >> 3] |= mask[bit & 0x07];
 }
@@ -81,6 +93,62 @@ void bitmap_invert(bitmap_t *const bitmap) {
     }
 }
 
+bool bitmap_atomic_test(const bitmap_t *const bitmap, const size_t bit) {
+    return __atomic_load_n(WORD_AT(bitmap, bit), __ATOMIC_ACQUIRE) & WORD_MASK(bit);
+}
+
+bool bitmap_atomic_set(bitmap_t *const bitmap, const size_t bit) {
+    return __atomic_fetch_or(WORD_AT(bitmap, bit), WORD_MASK(bit), __ATOMIC_ACQ_REL) & WORD_MASK(bit);
+}
+
+bool bitmap_atomic_reset(bitmap_t *const bitmap, const size_t bit) {
+    return __atomic_fetch_and(WORD_AT(bitmap, bit), ~WORD_MASK(bit), __ATOMIC_ACQ_REL) & WORD_MASK(bit);
+}
+
+size_t bitmap_atomic_claim_range(bitmap_t *const bitmap, const size_t first, const size_t last) {
+    if (bitmap) {
+        uint64_t *words  = (uint64_t *) bitmap->data;
+        const size_t end = last < bitmap->bit_count ? last : bitmap->bit_count;
+        for (size_t base = first & ~(size_t) 0x3F; base < end; base += 64) {
+            const size_t idx = base >> 6;
+            // Only bits in [first, end) of this word are up for grabs
+            uint64_t range = ~(uint64_t) 0;
+            if (first > base) {
+                range <<= (first - base);
+            }
+            if (end - base < 64) {
+                range &= (((uint64_t) 1) << (end - base)) - 1;
+            }
+
+            uint64_t current = __atomic_load_n(&words[idx], __ATOMIC_RELAXED);
+            uint64_t open    = ~WORD_ORDER(current) & range;
+            while (open) {
+                const unsigned bit    = (unsigned) __builtin_ctzll(open);
+                const uint64_t wanted = current | WORD_ORDER(((uint64_t) 1) << bit);
+                // On failure current is refreshed and we re-pick from whatever is still open
+                if (__atomic_compare_exchange_n(&words[idx], &current, wanted, false, __ATOMIC_ACQ_REL,
+                                                __ATOMIC_RELAXED)) {
+                    return base + bit;
+                }
+                open = ~WORD_ORDER(current) & range;
+            }
+        }
+    }
+    return SIZE_MAX;
+}
+
+size_t bitmap_atomic_claim(bitmap_t *const bitmap, const size_t start) {
+    if (bitmap) {
+        const size_t from = start < bitmap->bit_count ? start : 0;
+        size_t result     = bitmap_atomic_claim_range(bitmap, from, bitmap->bit_count);
+        if (result == SIZE_MAX && from) {
+            result = bitmap_atomic_claim_range(bitmap, 0, from);
+        }
+        return result;
+    }
+    return SIZE_MAX;
+}
+
 size_t bitmap_ffs(const bitmap_t *const bitmap) {
     if (bitmap) {
         size_t result = 0;
@@ -172,6 +240,13 @@ bitmap_t *bitmap_overlay(const size_t n_bits, void *const bitmap_data) {
     return NULL;
 }
 
+bitmap_t *bitmap_overlay_atomic(const size_t n_bits, void *const bitmap_data) {
+    if (bitmap_data && ((uintptr_t) bitmap_data & 0x07) == 0) {
+        return bitmap_overlay(n_bits, bitmap_data);
+    }
+    return NULL;
+}
+
 void bitmap_destroy(bitmap_t *bitmap) {
     if (bitmap) {
         if (!FLAG_CHECK(bitmap, OVERLAY)) {
@@ -209,7 +284,7 @@ bitmap_t *bitmap_initialize(size_t n_bits, BITMAP_FLAGS flags) {
                 bitmap->data = NULL;
                 return bitmap;
             } else {
-                bitmap->data = (uint8_t *) calloc(bitmap->byte_count, 1);
+                bitmap->data = (uint8_t *) calloc(WORD_PADDED_BYTES(bitmap->byte_count), 1);
                 if (bitmap->data) {
                     return bitmap;
                 }
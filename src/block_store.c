@@ -1,11 +1,16 @@
+// copy_file_range, fallocate, memfd_create, MAP_ANONYMOUS
+#define _GNU_SOURCE
 #include <stdint.h>
 #include <errno.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <sys/sendfile.h>
 #include <fcntl.h>
+#include <time.h>
 #include "block_store.h"
 #include "bitmap.h"
+#include "crc32c.h"
 
 
 #define BLOCK_STORE_NUM_BLOCKS 65536   // 2^16 blocks.
@@ -13,20 +18,280 @@
 #define BLOCK_SIZE_BITS 4096         // 2^9 BYTES per block *2^3 BITS per BYTES
 #define BLOCK_SIZE_BYTES 512         // 2^9 BYTES per block
 #define BLOCK_STORE_NUM_BYTES (BLOCK_STORE_NUM_BLOCKS * BLOCK_SIZE_BYTES)  // 2^16 blocks of 2^9 bytes.
+#define BLOCK_STORE_GROUP_BLOCKS BLOCK_SIZE_BITS  // One FBM block's worth of bits per allocation group
+#define BLOCK_STORE_NUM_GROUPS (BLOCK_STORE_NUM_BLOCKS / BLOCK_STORE_GROUP_BLOCKS)  // 16 groups
+#define BLOCK_STORE_FBM_BLOCKS (BLOCK_STORE_NUM_BLOCKS - BLOCK_STORE_AVAIL_BLOCKS)  // 16 blocks of FBM
+#define BLOCK_STORE_EXT_BYTES (BLOCK_STORE_NUM_BYTES / 8)  // Extension area after the blocks, 4MB
+#define BLOCK_STORE_EXT_BLOCKS (BLOCK_STORE_EXT_BYTES / BLOCK_SIZE_BYTES)  // 8192 extension blocks
+#define BLOCK_STORE_FILE_BYTES (BLOCK_STORE_NUM_BYTES + BLOCK_STORE_EXT_BYTES)
+// The top of the extension area holds a CRC-32C per block and, just below, a header saying whether they're current
+#define BLOCK_STORE_CSUM_BLOCKS (BLOCK_STORE_NUM_BLOCKS * sizeof(uint32_t) / BLOCK_SIZE_BYTES)  // 512 blocks
+#define BLOCK_STORE_CSUM_FIRST (BLOCK_STORE_EXT_BLOCKS - BLOCK_STORE_CSUM_BLOCKS)
+#define BLOCK_STORE_CSUM_HEADER (BLOCK_STORE_CSUM_FIRST - 1)
+#define BLOCK_STORE_REF_BLOCKS (BLOCK_STORE_NUM_BLOCKS * sizeof(uint16_t) / BLOCK_SIZE_BYTES)  // 256 blocks
+#define BLOCK_STORE_REF_FIRST (BLOCK_STORE_CSUM_HEADER - BLOCK_STORE_REF_BLOCKS)  // Just below the checksums
+#define BLOCK_STORE_REFS_PER_BLOCK (BLOCK_SIZE_BYTES / sizeof(uint16_t))
+#define BLOCK_STORE_GEN_TRACKED (BLOCK_STORE_NUM_BLOCKS + BLOCK_STORE_REF_BLOCKS)  // The blocks, then the reference table's
+#define BLOCK_STORE_GEN_BLOCKS ((BLOCK_STORE_GEN_TRACKED * sizeof(uint32_t) + BLOCK_SIZE_BYTES - 1) / BLOCK_SIZE_BYTES)  // 514 blocks
+#define BLOCK_STORE_GEN_FIRST (BLOCK_STORE_REF_FIRST - BLOCK_STORE_GEN_BLOCKS)  // Just below the references
+#define BLOCK_STORE_GEN_HEADER (BLOCK_STORE_GEN_FIRST - 1)
+#define BLOCK_STORE_USER_EXT_BLOCKS BLOCK_STORE_GEN_HEADER  // What the layers above get
+#define BLOCK_STORE_REF_SHAREABLE 0x8000u  // Others may share the block, see block_store_mark_shareable
+#define BLOCK_STORE_REF_EXTRA 0x7fffu      // Owners past the first
+#define BLOCK_STORE_CSUM_MAGIC 0x43524343u  // Header value while every checksum matches its block
+#define BLOCK_STORE_CSUM_LOCKS 256  // Stripes ordering a block's data with its checksum
+#define BLOCK_STORE_GEN_MAGIC 0x4e454742u    // Header value once a generation was saved, before that it's 1
+#define BLOCK_STORE_DELTA_MAGIC 0x544c4442u  // First word of an incremental export
+#define BLOCK_STORE_DELTA_BATCH 64           // Blocks read per call when applying one
+#define BLOCK_STORE_HUGE_PAGE_BYTES (2 * 1024 * 1024)  // PMD-sized transparent huge pages (x86-64, 4K-page arm64)
 
 
 
 struct block_store {
     int fd;
     uint8_t *data_blocks;
+    bool private_map;  // Loaded by block_store_deserialize: changes stay in memory, the file keeps the image
+    bool in_memory;    // Made by block_store_create_mem: there's nothing to flush to, only block_store_serialize
     bitmap_t *fbm;
+    // Free-space summary per allocation group, kept with atomics alongside the FBM bits
+    // so full groups can be skipped without touching their bitmap words
+    size_t group_free[BLOCK_STORE_NUM_GROUPS];
+    int counted;  // COUNTS_*, the FBM is only counted if nobody seeded the counters before they were needed
+    // Blocks (FBM included) changed since they were last flushed, set and cleared with atomics
+    bitmap_t *dirty;
+    size_t dirty_count;
+    uint64_t dirty_since;     // Monotonic ms when the device last went from clean to dirty
+    size_t writeback_cursor;  // Where the next rate-limited writeback picks up
+    // Per-block checksums, see block_store_set_checksums
+    block_store_checksum_t csum_mode;
+    uint32_t *csums;            // The table, in the mapping
+    bitmap_t *csum_verified;    // Blocks checked (or written) since checksums were turned on
+    bool csum_saved;            // The header on disk says the table is current
+    bool csum_dirty;            // The table changed since it was last flushed
+    size_t csum_errors;
+    size_t scrub_cursor;
+    block_store_mismatch_t csum_callback;
+    void *csum_arg;
+    uint8_t csum_locks[BLOCK_STORE_CSUM_LOCKS];
+    // Per-block reference words, changed with atomics: BLOCK_STORE_REF_SHAREABLE and the extra owners
+    // Zero (one owner, not shareable) for every block of an image that never shared one
+    uint16_t *refs;  // The table, in the mapping
+    bool refs_dirty;
+    size_t extra_refs;  // Sum of the extra owners, the blocks sharing saves
+    // Per-block generations, see block_store_export_incremental: the one current when each block
+    // (FBM and reference table blocks included) last changed, 0 for never since tracking started
+    uint32_t *gens;       // The table, in the mapping
+    uint32_t generation;  // Stamped on every block changed now, moved on by each export
+    bool gens_dirty;
+    // Hole punching, see block_store_set_hole_punching
+    bool punch_holes;
+    bitmap_t *punch;     // Blocks freed since the last pass, set and cleared with atomics
+    size_t punch_count;  // Frees since the last pass, so a pass with none skips the scan
+    size_t punched;      // Blocks given back so far
 };
 
+// Incremental export: this header, then per run a delta_run_t and its blocks
+//  Block numbers count the device's blocks first, then the blocks of the reference table
+typedef struct {
+    uint32_t magic;
+    uint32_t since;       // Generation the target has to be at, 0 for any
+    uint32_t generation;  // Generation the target is at once it's applied
+    uint32_t runs;
+} delta_header_t;
+
+typedef struct {
+    uint32_t first;
+    uint32_t count;
+} delta_run_t;
+
+static uint64_t monotonic_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000 + (uint64_t) now.tv_nsec / 1000000;
+}
+
+// Records that a tracked block changed in the current generation
+static inline void stamp(block_store_t *const bs, const size_t tracked) {
+    const uint32_t generation = __atomic_load_n(&bs->generation, __ATOMIC_RELAXED);
+    if (__atomic_load_n(&bs->gens[tracked], __ATOMIC_RELAXED) != generation) {
+        __atomic_store_n(&bs->gens[tracked], generation, __ATOMIC_RELAXED);
+        __atomic_store_n(&bs->gens_dirty, true, __ATOMIC_RELAXED);
+    }
+}
+
+// Remembers that a block has to go out with the next flush, and with the next incremental export
+static inline void mark_dirty(block_store_t *const bs, const size_t block_id) {
+    stamp(bs, block_id);
+    if (!bitmap_atomic_set(bs->dirty, block_id)) {
+        if (__atomic_add_fetch(&bs->dirty_count, 1, __ATOMIC_RELAXED) == 1) {
+            __atomic_store_n(&bs->dirty_since, monotonic_ms(), __ATOMIC_RELAXED);
+        }
+    }
+}
+
+// The FBM block holding a block's bit
+#define FBM_BLOCK_OF(block_id) (BLOCK_STORE_AVAIL_BLOCKS + (block_id) / BLOCK_SIZE_BITS)
+
+// Remembers that a block's reference word changed
+static inline void refs_changed(block_store_t *const bs, const size_t block_id) {
+    __atomic_store_n(&bs->refs_dirty, true, __ATOMIC_RELAXED);
+    stamp(bs, BLOCK_STORE_NUM_BLOCKS + block_id / BLOCK_STORE_REFS_PER_BLOCK);
+}
+
+static bool flush_bytes(const block_store_t *const bs, const size_t offset, const size_t length);
+static void flush_gens(block_store_t *const bs, bool *const flushed);
+
+// A block and its checksum change together under its stripe, so a check never sees one without the other
+static inline void csum_lock(const block_store_t *const bs, const size_t block_id) {
+    uint8_t *lock = (uint8_t *) &bs->csum_locks[block_id % BLOCK_STORE_CSUM_LOCKS];
+    while (__atomic_test_and_set(lock, __ATOMIC_ACQUIRE)) {
+    }
+}
+
+static inline void csum_unlock(const block_store_t *const bs, const size_t block_id) {
+    __atomic_clear((uint8_t *) &bs->csum_locks[block_id % BLOCK_STORE_CSUM_LOCKS], __ATOMIC_RELEASE);
+}
+
+// Whether a read of the block has to be checked (FBM blocks change bit by bit and aren't checksummed)
+static inline bool csum_wanted(const block_store_t *const bs, const size_t block_id) {
+    return bs->csum_mode != BLOCK_STORE_CHECKSUM_OFF && block_id < BLOCK_STORE_AVAIL_BLOCKS
+           && (bs->csum_mode == BLOCK_STORE_CHECKSUM_VERIFY || !bitmap_atomic_test(bs->csum_verified, block_id));
+}
+
+// Copies a block out and checks it against its checksum, reporting a mismatch
+static bool check_block(const block_store_t *const const_bs, const size_t block_id, void *buffer) {
+    block_store_t *bs = (block_store_t *) const_bs;
+    csum_lock(bs, block_id);
+    memcpy(buffer, bs->data_blocks + block_id * BLOCK_SIZE_BYTES, BLOCK_SIZE_BYTES);
+    const uint32_t expected = bs->csums[block_id];
+    csum_unlock(bs, block_id);
+    if (crc32c(0, buffer, BLOCK_SIZE_BYTES) != expected) {
+        __atomic_add_fetch(&bs->csum_errors, 1, __ATOMIC_RELAXED);
+        bitmap_atomic_reset(bs->csum_verified, block_id);
+        if (bs->csum_callback) {
+            bs->csum_callback(block_id, bs->csum_arg);
+        }
+        return false;
+    }
+    bitmap_atomic_set(bs->csum_verified, block_id);
+    return true;
+}
+
+// Records on disk whether the checksum table can be trusted by the next open
+static void save_csum_header(block_store_t *const bs, const bool current) {
+    if (__atomic_exchange_n(&bs->csum_saved, current, __ATOMIC_RELAXED) == current) {
+        return;
+    }
+    uint8_t header[BLOCK_SIZE_BYTES] = {0};
+    const uint32_t magic = current ? BLOCK_STORE_CSUM_MAGIC : 0;
+    memcpy(header, &magic, sizeof(magic));
+    memcpy(bs->data_blocks + BLOCK_STORE_NUM_BYTES + BLOCK_STORE_CSUM_HEADER * BLOCK_SIZE_BYTES, header, BLOCK_SIZE_BYTES);
+    flush_bytes(bs, BLOCK_STORE_NUM_BYTES + BLOCK_STORE_CSUM_HEADER * BLOCK_SIZE_BYTES, BLOCK_SIZE_BYTES);
+}
+
+// Each thread gets a home group the first time it allocates without a goal,
+// so unrelated writers start out in different parts of the FBM
+static size_t next_home_group = 0;
+static __thread size_t home_group = SIZE_MAX;
+
+enum { COUNTS_UNKNOWN, COUNTS_PENDING, COUNTS_READY };
+
+// A block just claimed has one owner, whatever a free made by an FBM image (journal replay) left behind
+static inline void reset_refs(block_store_t *const bs, const size_t block_id) {
+    const uint16_t old = __atomic_exchange_n(&bs->refs[block_id], 0, __ATOMIC_RELAXED);
+    if (old != 0) {
+        __atomic_sub_fetch(&bs->extra_refs, old & BLOCK_STORE_REF_EXTRA, __ATOMIC_RELAXED);
+        refs_changed(bs, block_id);
+    }
+}
+
+// Sums the extra owners from the reference table
+static void count_extra_refs(block_store_t *const bs) {
+    size_t extra_refs = 0;
+    for (size_t block_id = 0; block_id < BLOCK_STORE_NUM_BLOCKS; ++block_id) {
+        extra_refs += bs->refs[block_id] & BLOCK_STORE_REF_EXTRA;
+    }
+    __atomic_store_n(&bs->extra_refs, extra_refs, __ATOMIC_RELAXED);
+}
+
+// Moves the device to a generation and saves it in the header, the generation table going out first
+static bool save_generation(block_store_t *const bs, const uint32_t generation) {
+    __atomic_store_n(&bs->generation, generation, __ATOMIC_RELAXED);
+    bool flushed = true;
+    flush_gens(bs, &flushed);
+    uint8_t header[BLOCK_SIZE_BYTES] = {0};
+    const uint32_t gen_header[2] = {BLOCK_STORE_GEN_MAGIC, generation};
+    memcpy(header, gen_header, sizeof(gen_header));
+    memcpy(bs->data_blocks + BLOCK_STORE_NUM_BYTES + BLOCK_STORE_GEN_HEADER * BLOCK_SIZE_BYTES, header, BLOCK_SIZE_BYTES);
+    return flush_bytes(bs, BLOCK_STORE_NUM_BYTES + BLOCK_STORE_GEN_HEADER * BLOCK_SIZE_BYTES, BLOCK_SIZE_BYTES) && flushed;
+}
+
+// Counts the zero bits of every group from the FBM data
+void count_group_free(block_store_t *const bs) {
+    const uint64_t *words = (const uint64_t *) bitmap_export(bs->fbm);
+    for (size_t group = 0; group < BLOCK_STORE_NUM_GROUPS; ++group) {
+        size_t used = 0;
+        for (size_t word = 0; word < BLOCK_STORE_GROUP_BLOCKS / 64; ++word) {
+            used += (size_t) __builtin_popcountll(words[group * (BLOCK_STORE_GROUP_BLOCKS / 64) + word]);
+        }
+        bs->group_free[group] = BLOCK_STORE_GROUP_BLOCKS - used;
+    }
+}
+
+// Makes sure the group counters are there, counting the FBM the first time they're needed
+//  The counters only cache what the FBM says, so even the const getters may fill them in
+static void ensure_counted(const block_store_t *const const_bs) {
+    block_store_t *bs = (block_store_t *) const_bs;
+    if (__atomic_load_n(&bs->counted, __ATOMIC_ACQUIRE) == COUNTS_READY) {
+        return;
+    }
+    int expected = COUNTS_UNKNOWN;
+    if (__atomic_compare_exchange_n(&bs->counted, &expected, COUNTS_PENDING, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        count_group_free(bs);
+        __atomic_store_n(&bs->counted, COUNTS_READY, __ATOMIC_RELEASE);
+        return;
+    }
+    while (__atomic_load_n(&bs->counted, __ATOMIC_ACQUIRE) != COUNTS_READY) {
+        // Someone else is counting or seeding, it's a few microseconds
+    }
+}
+
+// Claims a free block in the goal's group (forward from goal first), then in the following groups
+size_t claim_near(block_store_t *const bs, const size_t goal) {
+    const size_t start = goal < BLOCK_STORE_NUM_BLOCKS ? goal : 0;
+    const size_t first = start / BLOCK_STORE_GROUP_BLOCKS;
+    ensure_counted(bs);
+    for (size_t step = 0; step < BLOCK_STORE_NUM_GROUPS; ++step) {
+        const size_t group = (first + step) % BLOCK_STORE_NUM_GROUPS;
+        if (__atomic_load_n(&bs->group_free[group], __ATOMIC_RELAXED) == 0) {
+            continue;
+        }
+        const size_t group_start = group * BLOCK_STORE_GROUP_BLOCKS;
+        const size_t group_end   = group_start + BLOCK_STORE_GROUP_BLOCKS;
+        size_t id                = SIZE_MAX;
+        if (step == 0 && start > group_start) {
+            id = bitmap_atomic_claim_range(bs->fbm, start, group_end);
+            if (id == SIZE_MAX) {
+                id = bitmap_atomic_claim_range(bs->fbm, group_start, start);
+            }
+        } else {
+            id = bitmap_atomic_claim_range(bs->fbm, group_start, group_end);
+        }
+        if (id != SIZE_MAX) {
+            __atomic_sub_fetch(&bs->group_free[group], 1, __ATOMIC_RELAXED);
+            mark_dirty(bs, FBM_BLOCK_OF(id));
+            reset_refs(bs, id);
+            return id;
+        }
+    }
+    return SIZE_MAX;
+}
+
 int create_file(const char *const fname) {
     if (fname) {
         int fd = open(fname, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
         if (fd != -1) {
-            if (ftruncate(fd, BLOCK_STORE_NUM_BYTES) != -1) {
+            if (ftruncate(fd, BLOCK_STORE_FILE_BYTES) != -1) {
                 return fd;
             }
             close(fd);
@@ -39,9 +304,12 @@ int check_file(const char *const fname) {
         int fd = open(fname, O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
         if (fd != -1) {
             struct stat file_info;
-			if (fstat(fd, &file_info) != -1 && file_info.st_size >= BLOCK_STORE_NUM_BYTES && file_info.st_size <= BLOCK_STORE_NUM_BYTES + BLOCK_STORE_NUM_BYTES/8 ) {
+			if (fstat(fd, &file_info) != -1 && file_info.st_size >= BLOCK_STORE_NUM_BYTES && file_info.st_size <= BLOCK_STORE_FILE_BYTES ) {
             //if (fstat(fd, &file_info) != -1 && file_info.st_size == BLOCK_STORE_NUM_BYTES) {
-                return fd;
+                // Files from before the extension area get it added, zero filled
+                if (file_info.st_size == BLOCK_STORE_FILE_BYTES || ftruncate(fd, BLOCK_STORE_FILE_BYTES) != -1) {
+                    return fd;
+                }
             }
             close(fd);
         }
@@ -49,28 +317,129 @@ int check_file(const char *const fname) {
     return -1;
 }
 
-block_store_t *block_store_init(const bool init, const char *const fname) {
-    if (fname) {
-        block_store_t *bs = (block_store_t *) malloc(sizeof(block_store_t));
-        if (bs) {
-            bs->fd = init ? create_file(fname) : check_file(fname);
-            if (bs->fd != -1) {
-                bs->data_blocks = (uint8_t *) mmap(NULL, BLOCK_STORE_NUM_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, bs->fd, 0);
-                if (bs->data_blocks != (uint8_t *) MAP_FAILED) {
-                         if (init) {
-                                memset(bs->data_blocks, 0X00, BLOCK_STORE_NUM_BYTES);
-								bs->data_blocks[BLOCK_STORE_NUM_BYTES - 1] = 0xff;
-								bs->data_blocks[BLOCK_STORE_NUM_BYTES - 2] = 0xff;
-                          }
-                          bs->fbm = bitmap_overlay(BLOCK_STORE_NUM_BLOCKS, bs->data_blocks + BLOCK_STORE_AVAIL_BLOCKS*BLOCK_SIZE_BYTES);
-                          if (bs->fbm) {
-                                return bs;
-                           }
-                           munmap(bs->data_blocks, BLOCK_STORE_NUM_BYTES);
+// Sets up a device around a mapping of the whole file layout
+//  On error the caller still owns the descriptor and the mapping
+static block_store_t *block_store_setup(const int fd, uint8_t *const mapping, const bool init, const bool private_map) {
+    block_store_t *bs = (block_store_t *) malloc(sizeof(block_store_t));
+    if (bs == NULL) {
+        return NULL;
+    }
+    bs->fd = fd;
+    bs->data_blocks = mapping;
+    bs->private_map = private_map;
+    bs->in_memory = false;
+    if (init) {
+        // The file was just truncated and extended, so it already reads as zeros;
+        // only the FBM's own bits need setting, the rest stays sparse
+        bs->data_blocks[BLOCK_STORE_NUM_BYTES - 1] = 0xff;
+        bs->data_blocks[BLOCK_STORE_NUM_BYTES - 2] = 0xff;
+    }
+    // Atomic overlay so allocate/request/release can run from many threads without a lock
+    bs->fbm = bitmap_overlay_atomic(BLOCK_STORE_NUM_BLOCKS, bs->data_blocks + BLOCK_STORE_AVAIL_BLOCKS*BLOCK_SIZE_BYTES);
+    bs->dirty = bitmap_create(BLOCK_STORE_NUM_BLOCKS);
+    bs->dirty_count = 0;
+    bs->writeback_cursor = 0;
+    bs->csum_mode = BLOCK_STORE_CHECKSUM_OFF;
+    bs->csums = (uint32_t *) (bs->data_blocks + BLOCK_STORE_NUM_BYTES + BLOCK_STORE_CSUM_FIRST * BLOCK_SIZE_BYTES);
+    bs->csum_verified = NULL;
+    uint32_t csum_header;
+    memcpy(&csum_header, bs->data_blocks + BLOCK_STORE_NUM_BYTES + BLOCK_STORE_CSUM_HEADER * BLOCK_SIZE_BYTES, sizeof(csum_header));
+    bs->csum_saved = csum_header == BLOCK_STORE_CSUM_MAGIC;
+    bs->csum_dirty = false;
+    bs->csum_errors = 0;
+    bs->scrub_cursor = 0;
+    bs->csum_callback = NULL;
+    bs->csum_arg = NULL;
+    memset(bs->csum_locks, 0, sizeof(bs->csum_locks));
+    bs->refs = (uint16_t *) (bs->data_blocks + BLOCK_STORE_NUM_BYTES + BLOCK_STORE_REF_FIRST * BLOCK_SIZE_BYTES);
+    bs->refs_dirty = false;
+    bs->extra_refs = 0;
+    if (!init) {
+        count_extra_refs(bs);
+    }
+    bs->gens = (uint32_t *) (bs->data_blocks + BLOCK_STORE_NUM_BYTES + BLOCK_STORE_GEN_FIRST * BLOCK_SIZE_BYTES);
+    uint32_t gen_header[2];
+    memcpy(gen_header, bs->data_blocks + BLOCK_STORE_NUM_BYTES + BLOCK_STORE_GEN_HEADER * BLOCK_SIZE_BYTES, sizeof(gen_header));
+    bs->generation = gen_header[0] == BLOCK_STORE_GEN_MAGIC ? gen_header[1] : 1;
+    bs->gens_dirty = false;
+    bs->punch_holes = false;
+    bs->punch = NULL;
+    bs->punch_count = 0;
+    bs->punched = 0;
+    if (bs->fbm && bs->dirty) {
+        // Counted on first use, unless block_store_set_free_counts gets there first
+        bs->counted = COUNTS_UNKNOWN;
+        // A fresh device only has to get its FBM out, the rest reads back as zeroes anyway
+        for (size_t fbm_block = 0; init && fbm_block < BLOCK_STORE_FBM_BLOCKS; ++fbm_block) {
+            mark_dirty(bs, BLOCK_STORE_AVAIL_BLOCKS + fbm_block);
+        }
+        return bs;
+    }
+    bitmap_destroy(bs->fbm);
+    bitmap_destroy(bs->dirty);
+    free(bs);
+    return NULL;
+}
+
+// Maps the whole file layout of a device file, applying the options' placement and hints
+static uint8_t *map_device(const int fd, const block_store_map_options_t *const options) {
+    const bool huge = options && options->hugepages;
+    const bool populate = options && options->prefault;
+    uint8_t *place = NULL;
+    if (huge) {
+        // Huge pages need huge page aligned addresses: reserve a page's worth more, map at the first boundary in it
+        const size_t reserved = BLOCK_STORE_FILE_BYTES + BLOCK_STORE_HUGE_PAGE_BYTES;
+        uint8_t *reservation = (uint8_t *) mmap(NULL, reserved, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (reservation == (uint8_t *) MAP_FAILED) {
+            return (uint8_t *) MAP_FAILED;
+        }
+        place = (uint8_t *) (((uintptr_t) reservation + BLOCK_STORE_HUGE_PAGE_BYTES - 1) & ~(uintptr_t) (BLOCK_STORE_HUGE_PAGE_BYTES - 1));
+        if (place > reservation) {
+            munmap(reservation, (size_t) (place - reservation));
+        }
+        if (reservation + reserved > place + BLOCK_STORE_FILE_BYTES) {
+            munmap(place + BLOCK_STORE_FILE_BYTES, (size_t) (reservation + reserved - (place + BLOCK_STORE_FILE_BYTES)));
+        }
+    }
+    // With huge pages the prefault waits for the hint, or it would fill the mapping with small pages
+    const int flags = MAP_SHARED | (place ? MAP_FIXED : 0) | (populate && !huge ? MAP_POPULATE : 0);
+    uint8_t *mapping = (uint8_t *) mmap(place, BLOCK_STORE_FILE_BYTES, PROT_READ | PROT_WRITE, flags, fd, 0);
+    if (mapping == (uint8_t *) MAP_FAILED) {
+        if (place) {
+            munmap(place, BLOCK_STORE_FILE_BYTES);
+        }
+        return mapping;
+    }
+    if (huge) {
+        madvise(mapping, BLOCK_STORE_FILE_BYTES, MADV_HUGEPAGE);
+    }
+    if (options && options->access == BLOCK_STORE_ACCESS_RANDOM) {
+        madvise(mapping, BLOCK_STORE_FILE_BYTES, MADV_RANDOM);
+    } else if (options && options->access == BLOCK_STORE_ACCESS_SEQUENTIAL) {
+        madvise(mapping, BLOCK_STORE_FILE_BYTES, MADV_SEQUENTIAL);
+    }
+    if (populate && huge) {
+        const size_t page = (size_t) sysconf(_SC_PAGESIZE);
+        for (size_t offset = 0; offset < BLOCK_STORE_FILE_BYTES; offset += page) {
+            (void) *(volatile uint8_t *) (mapping + offset);
+        }
+    }
+    return mapping;
+}
+
+block_store_t *block_store_init(const bool init, const char *const fname, const block_store_map_options_t *const options) {
+    if (fname && (options == NULL || options->access <= BLOCK_STORE_ACCESS_SEQUENTIAL)) {
+        int fd = init ? create_file(fname) : check_file(fname);
+        if (fd != -1) {
+            uint8_t *mapping = map_device(fd, options);
+            if (mapping != (uint8_t *) MAP_FAILED) {
+                block_store_t *bs = block_store_setup(fd, mapping, init, false);
+                if (bs) {
+                    return bs;
                 }
-                close(bs->fd);
+                munmap(mapping, BLOCK_STORE_FILE_BYTES);
             }
-            free(bs);
+            close(fd);
         }
     }
     return NULL;
@@ -82,11 +451,45 @@ block_store_t *block_store_init(const bool init, const char *const fname) {
 ///-- Return pointer to the new block storage device, NULL on error
 ///
 block_store_t *block_store_create(const char *const fname) {
-    return block_store_init(true, fname);
+    return block_store_init(true, fname, NULL);
     }
 //
 block_store_t *block_store_open(const char *const fname) {
-    return block_store_init(false, fname);
+    return block_store_init(false, fname, NULL);
+}
+
+///
+///-- Creates a new BS device in memory, backed by an anonymous memory file
+/// \return Pointer to the new block storage device, NULL on error
+///
+block_store_t *block_store_create_mem() {
+    int fd = memfd_create("block_store", MFD_CLOEXEC);
+    if (fd == -1) {
+        return NULL;
+    }
+    if (ftruncate(fd, BLOCK_STORE_FILE_BYTES) != -1) {
+        uint8_t *mapping = map_device(fd, NULL);
+        if (mapping != (uint8_t *) MAP_FAILED) {
+            block_store_t *bs = block_store_setup(fd, mapping, true, false);
+            if (bs) {
+                bs->in_memory = true;
+                return bs;
+            }
+            munmap(mapping, BLOCK_STORE_FILE_BYTES);
+        }
+    }
+    close(fd);
+    return NULL;
+}
+
+///
+///-- Opens a BS device file with mapping options
+/// \param fname The file to open
+/// \param options How the file is mapped, NULL for the defaults
+/// \return Pointer to the new block storage device, NULL on error
+///
+block_store_t *block_store_open_with_options(const char *const fname, const block_store_map_options_t *const options) {
+    return block_store_init(false, fname, options);
 }
 
 
@@ -97,7 +500,10 @@ block_store_t *block_store_open(const char *const fname) {
 void block_store_destroy(block_store_t *const bs) {
       if (bs) {
         bitmap_destroy(bs->fbm);
-        munmap(bs->data_blocks, BLOCK_STORE_NUM_BYTES);
+        bitmap_destroy(bs->dirty);
+        bitmap_destroy(bs->csum_verified);
+        bitmap_destroy(bs->punch);
+        munmap(bs->data_blocks, BLOCK_STORE_FILE_BYTES);
         close(bs->fd);
         free(bs);
     }
@@ -113,15 +519,24 @@ size_t block_store_allocate(block_store_t *const bs) {
     if (bs == NULL) {
         return SIZE_MAX; // return SIZE_MAX if the input is a null pointer
     }
-    //-- find first zero in the bitmap
-    size_t id;
-    id = bitmap_ffz(bs->fbm); // index of the first free block
-    if (id == SIZE_MAX) {
-        return SIZE_MAX; // return SIZE_MAX since the last block is not available for storing data
+    if (home_group == SIZE_MAX) {
+        home_group = __atomic_fetch_add(&next_home_group, 1, __ATOMIC_RELAXED) % BLOCK_STORE_NUM_GROUPS;
     }
-    bitmap_set(bs->fbm, id); // mark it as in use
-  //  bitmap_destroy(bs->fbm); // destruct and destroy bitmap object
-    return id;
+    //-- find the first zero starting at this thread's group and mark it as in use in one atomic step
+    return claim_near(bs, home_group * BLOCK_STORE_GROUP_BLOCKS);
+}
+
+///
+///-- Search for a free block close to the goal, marks it as in use, and return the block's id
+/// \param bs BS device
+/// \param goal The block id the caller would like to be near
+/// \return Allocated block's id, SIZE_MAX on error
+///
+size_t block_store_allocate_near(block_store_t *const bs, const size_t goal) {
+    if (bs == NULL) {
+        return SIZE_MAX;
+    }
+    return claim_near(bs, goal);
 }
 
 ///
@@ -134,17 +549,16 @@ bool block_store_request(block_store_t *const bs, const size_t block_id) {
     if (block_id > BLOCK_STORE_AVAIL_BLOCKS || bs == NULL) {
         return false;
     }
+    ensure_counted(bs);
     bool blockUsed = 0;
-    blockUsed = bitmap_test(bs->fbm, block_id); // check if the block is in use
-    if (blockUsed) { // if this block is already in use
-        //bitmap_destroy(bs->fbm); // destruct and destroy bitmap object
+    blockUsed = bitmap_atomic_set(bs->fbm, block_id); // mark the block as in use, getting its old state
+    if (blockUsed) { // if this block was already in use, someone else owns it
         return false;
     }
-    else { // if this block is not in use
-        bitmap_set(bs->fbm, block_id); // mark the block as in use
-        //bitmap_destroy(bs->fbm); // destruct and destroy bitmap object
-        return true;
-    }
+    __atomic_sub_fetch(&bs->group_free[block_id / BLOCK_STORE_GROUP_BLOCKS], 1, __ATOMIC_RELAXED);
+    mark_dirty(bs, FBM_BLOCK_OF(block_id));
+    reset_refs(bs, block_id);
+    return true;
 }
 
 ///
@@ -154,11 +568,30 @@ bool block_store_request(block_store_t *const bs, const size_t block_id) {
 ///
 void block_store_release(block_store_t *const bs, const size_t block_id) {
     if (block_id <= BLOCK_STORE_AVAIL_BLOCKS && bs != NULL) {
-        bool success = 0;
-        success = bitmap_test(bs->fbm, block_id); // check if the block is in use
-        if (success) {
-            bitmap_reset(bs->fbm, block_id); // clear requested bit in bitmap
-    //        bitmap_destroy(bs->fbm); // destruct and destroy bitmap object
+        // A shared block loses an owner, only the last one frees it
+        uint16_t refs = __atomic_load_n(&bs->refs[block_id], __ATOMIC_RELAXED);
+        for (;;) {
+            if (refs & BLOCK_STORE_REF_EXTRA) {
+                if (__atomic_compare_exchange_n(&bs->refs[block_id], &refs, (uint16_t)(refs - 1), false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+                    __atomic_sub_fetch(&bs->extra_refs, 1, __ATOMIC_RELAXED);
+                    refs_changed(bs, block_id);
+                    return;
+                }
+            } else if (refs == 0) {
+                break;
+            } else if (__atomic_compare_exchange_n(&bs->refs[block_id], &refs, 0, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+                refs_changed(bs, block_id);
+                break;
+            }
+        }
+        ensure_counted(bs);
+        if (bitmap_atomic_reset(bs->fbm, block_id)) { // clear requested bit in bitmap (no-op if already free)
+            __atomic_add_fetch(&bs->group_free[block_id / BLOCK_STORE_GROUP_BLOCKS], 1, __ATOMIC_RELAXED);
+            mark_dirty(bs, FBM_BLOCK_OF(block_id));
+            if (__atomic_load_n(&bs->punch_holes, __ATOMIC_RELAXED)) {
+                bitmap_atomic_set(bs->punch, block_id);
+                __atomic_add_fetch(&bs->punch_count, 1, __ATOMIC_RELAXED);
+            }
         }
     }
     //// Some error message here ////
@@ -171,26 +604,27 @@ void block_store_release(block_store_t *const bs, const size_t block_id) {
 ///
 size_t block_store_get_used_blocks(const block_store_t *const bs) {
     if (bs) {
-        size_t numSet = 0;
-        numSet = bitmap_total_set(bs->fbm); // count all bits set
-      //  bitmap_destroy(bs->fbm); // destruct and destroy bitmap object
-        return numSet;
+        // Everything that isn't free, the FBM's own blocks included, without counting a bit
+        return BLOCK_STORE_NUM_BLOCKS - block_store_get_free_blocks(bs);
     }
     return SIZE_MAX;
 }
 
 ///
 ///-- Counts the number of blocks marked free for use
+///  The FBM's own blocks are in use like any other, so free and used blocks add up to the whole device
 /// \param bs BS device
 /// \return Total blocks free, SIZE_MAX on error
 ///
 size_t block_store_get_free_blocks(const block_store_t *const bs) {
     if (bs) {
-        size_t numSet = 0;
+        // Straight from the group counters, which see the FBM's own blocks as used ones sitting past the
+        // addressable blocks rather than taking them off the addressable count
+        ensure_counted(bs);
         size_t numZero = 0;
-        numSet = bitmap_total_set(bs->fbm); // count all bits set
-        //bitmap_destroy(bs->fbm); // destruct and destroy bitmap object
-        numZero = BLOCK_STORE_AVAIL_BLOCKS - numSet; // count zero bits
+        for (size_t group = 0; group < BLOCK_STORE_NUM_GROUPS; ++group) {
+            numZero += __atomic_load_n(&bs->group_free[group], __ATOMIC_RELAXED);
+        }
         return numZero;
     }
     return SIZE_MAX;
@@ -205,6 +639,77 @@ size_t block_store_get_total_blocks() {
     return BLOCK_STORE_AVAIL_BLOCKS;
 }
 
+///
+///-- Returns the number of allocation groups the blocks are split into
+/// \return Total groups
+///
+size_t block_store_get_group_count() {
+    return BLOCK_STORE_NUM_GROUPS;
+}
+
+///
+///-- Returns the number of blocks in each allocation group
+/// \return Blocks per group
+///
+size_t block_store_get_group_size() {
+    return BLOCK_STORE_GROUP_BLOCKS;
+}
+
+///
+///-- Returns the free-space summary of an allocation group
+/// \param bs BS device
+/// \param group The group to query
+/// \return Free blocks in the group, SIZE_MAX on error
+///
+size_t block_store_get_group_free_blocks(const block_store_t *const bs, const size_t group) {
+    if (bs && group < BLOCK_STORE_NUM_GROUPS) {
+        ensure_counted(bs);
+        return __atomic_load_n(&bs->group_free[group], __ATOMIC_RELAXED);
+    }
+    return SIZE_MAX;
+}
+
+///
+///-- Seeds the free-space counters from a trusted copy instead of counting the FBM
+/// \param bs BS device
+/// \param group_free Free blocks of every group, block_store_get_group_count() of them
+/// \return true if the counters were taken, false on error or if they were already known
+///
+bool block_store_set_free_counts(block_store_t *const bs, const size_t *const group_free) {
+    if (bs == NULL || group_free == NULL) {
+        return false;
+    }
+    for (size_t group = 0; group < BLOCK_STORE_NUM_GROUPS; ++group) {
+        if (group_free[group] > BLOCK_STORE_GROUP_BLOCKS) {
+            return false;
+        }
+    }
+    int expected = COUNTS_UNKNOWN;
+    if (!__atomic_compare_exchange_n(&bs->counted, &expected, COUNTS_PENDING, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+    memcpy(bs->group_free, group_free, sizeof(bs->group_free));
+    __atomic_store_n(&bs->counted, COUNTS_READY, __ATOMIC_RELEASE);
+    return true;
+}
+
+///
+///-- Copies out the free-space counters, to be saved somewhere they can be trusted from later
+/// \param bs BS device
+/// \param group_free Where to put the free blocks of every group, block_store_get_group_count() of them
+/// \return true on success, false on error
+///
+bool block_store_get_free_counts(const block_store_t *const bs, size_t *const group_free) {
+    if (bs == NULL || group_free == NULL) {
+        return false;
+    }
+    ensure_counted(bs);
+    for (size_t group = 0; group < BLOCK_STORE_NUM_GROUPS; ++group) {
+        group_free[group] = __atomic_load_n(&bs->group_free[group], __ATOMIC_RELAXED);
+    }
+    return true;
+}
+
 ///
 ///-- Reads data from the specified block and writes it to the designated buffer
 /// \param bs BS device
@@ -214,6 +719,9 @@ size_t block_store_get_total_blocks() {
 ///
 size_t block_store_read(const block_store_t *const bs, const size_t block_id, void *buffer) {
     if (bs && buffer && block_id <= BLOCK_STORE_AVAIL_BLOCKS) {
+        if (csum_wanted(bs, block_id)) {
+            return check_block(bs, block_id, buffer) ? BLOCK_SIZE_BYTES : 0;
+        }
         memcpy(buffer, bs->data_blocks+block_id*BLOCK_SIZE_BYTES, BLOCK_SIZE_BYTES);
         return BLOCK_SIZE_BYTES;
     }
@@ -229,60 +737,864 @@ size_t block_store_read(const block_store_t *const bs, const size_t block_id, vo
 ///
 size_t block_store_write(block_store_t *const bs, const size_t block_id, const void *buffer) {
     if (bs && buffer && block_id <= BLOCK_STORE_AVAIL_BLOCKS) {
-        memcpy(bs->data_blocks+block_id*BLOCK_SIZE_BYTES, buffer, BLOCK_SIZE_BYTES);
+        if (bs->csum_mode != BLOCK_STORE_CHECKSUM_OFF && block_id < BLOCK_STORE_AVAIL_BLOCKS) {
+            const uint32_t sum = crc32c(0, buffer, BLOCK_SIZE_BYTES);
+            csum_lock(bs, block_id);
+            memcpy(bs->data_blocks+block_id*BLOCK_SIZE_BYTES, buffer, BLOCK_SIZE_BYTES);
+            bs->csums[block_id] = sum;
+            csum_unlock(bs, block_id);
+            bitmap_atomic_set(bs->csum_verified, block_id);
+            __atomic_store_n(&bs->csum_dirty, true, __ATOMIC_RELAXED);
+        } else {
+            // Checksums that aren't kept up to date can't be trusted by the next open
+            if (__atomic_load_n(&bs->csum_saved, __ATOMIC_RELAXED)) {
+                save_csum_header(bs, false);
+            }
+            memcpy(bs->data_blocks+block_id*BLOCK_SIZE_BYTES, buffer, BLOCK_SIZE_BYTES);
+        }
+        mark_dirty(bs, block_id);
         return BLOCK_SIZE_BYTES;
     }
     return 0;
 }
 
+// Writes all of a buffer, however many calls it takes
+static bool write_all(const int fd, const void *buffer, size_t length) {
+    const uint8_t *bytes = (const uint8_t *) buffer;
+    while (length) {
+        const ssize_t written = write(fd, bytes, length);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return false;
+        }
+        bytes += written;
+        length -= (size_t) written;
+    }
+    return true;
+}
+
+// Reads all of a buffer, however many calls it takes; running out of file is an error
+static bool read_all(const int fd, void *buffer, size_t length) {
+    uint8_t *bytes = (uint8_t *) buffer;
+    while (length) {
+        const ssize_t got = read(fd, bytes, length);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            return false;
+        }
+        bytes += got;
+        length -= (size_t) got;
+    }
+    return true;
+}
+
+// Copies a byte range of the device to the same offset of a file
+//  The kernel moves it from the backing file when it can (copy_file_range, which may share the extents,
+//  then sendfile), the mapping is written out otherwise. A private mapping always goes from memory,
+//  its backing file doesn't have the changes
+static bool copy_out(const block_store_t *const bs, const int fd, const size_t offset, const size_t length) {
+    size_t done = 0;
+    if (!bs->private_map) {
+        loff_t in = (loff_t) offset;
+        loff_t out = (loff_t) offset;
+        while (done < length) {
+            const ssize_t copied = copy_file_range(bs->fd, &in, fd, &out, length - done, 0);
+            if (copied < 0 && errno == EINTR) {
+                continue;
+            }
+            if (copied <= 0) {
+                break;
+            }
+            done += (size_t) copied;
+        }
+        off_t from = (off_t)(offset + done);
+        if (done < length && lseek(fd, from, SEEK_SET) == from) {
+            while (done < length) {
+                const ssize_t sent = sendfile(fd, bs->fd, &from, length - done);
+                if (sent < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (sent <= 0) {
+                    break;
+                }
+                done += (size_t) sent;
+            }
+        }
+    }
+    while (done < length) {
+        const ssize_t written = pwrite(fd, bs->data_blocks + offset + done, length - done, (off_t)(offset + done));
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return false;
+        }
+        done += (size_t) written;
+    }
+    return true;
+}
+
+// Whether an extension block holds anything; the ones that don't stay holes in a serialized image
+static inline bool ext_block_used(const block_store_t *const bs, const size_t ext_block) {
+    const uint64_t *words = (const uint64_t *) (bs->data_blocks + BLOCK_STORE_NUM_BYTES + ext_block * BLOCK_SIZE_BYTES);
+    for (size_t i = 0; i < BLOCK_SIZE_BYTES / sizeof(uint64_t); ++i) {
+        if (words[i]) {
+            return true;
+        }
+    }
+    return false;
+}
+
 ///
-///-- Imports BS device from the given file - for grads/bonus
+///-- Loads a BS device from an image written by block_store_serialize (or any device file), without copying it
 /// \param filename The file to load
 /// \return Pointer to new BS device, NULL on error
 ///
 block_store_t *block_store_deserialize(const char *const filename) {
-    if (filename) {
-        int fd = open(filename, O_RDONLY); // open file (read only)
-        if (fd < 0) { // if opening file fails
-            return 0;
-        }
-        block_store_t *bs = NULL;
-        bs = block_store_create(filename);
-        int df_read1, df_read2;
-        df_read1 = read(fd, bs->data_blocks, BLOCK_STORE_AVAIL_BLOCKS*BLOCK_SIZE_BYTES); // read bs->Data from the file
-        df_read2 = read(fd, bs->fbm, BLOCK_STORE_NUM_BLOCKS/8); // read bs->FBM from the file
-        if (df_read1 < 0 || df_read2 < 0) { // if the system call returns an error
-            return 0;
+    if (filename == NULL) {
+        return NULL;
+    }
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat file_info;
+    if (fstat(fd, &file_info) == -1 || file_info.st_size < BLOCK_STORE_NUM_BYTES || file_info.st_size > BLOCK_STORE_FILE_BYTES) {
+        close(fd);
+        return NULL;
+    }
+    // Pages come in from the image as they're touched and are copied on the first write; an image from
+    // before the extension area gets it as anonymous zeros past its end
+    uint8_t *mapping = (uint8_t *) mmap(NULL, BLOCK_STORE_FILE_BYTES, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapping != (uint8_t *) MAP_FAILED) {
+        if (mmap(mapping, (size_t) file_info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) != MAP_FAILED) {
+            block_store_t *bs = block_store_setup(fd, mapping, false, true);
+            if (bs) {
+                return bs;
+            }
         }
-        return bs;
+        munmap(mapping, BLOCK_STORE_FILE_BYTES);
     }
-    return 0;
+    close(fd);
+    return NULL;
 }
 
 ///
-///-- Writes the entirety of the BS device to file, overwriting it if it exists - for grads/bonus
+///-- Writes the BS device to file as a sparse device image, overwriting it if it exists
 /// \param bs BS device
 /// \param filename The file to write to
 /// \return Number of bytes written, 0 on error
 ///
 size_t block_store_serialize(const block_store_t *const bs, const char *const filename) {
-    if (bs && filename) {
-        int fd = open(filename, O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR); // open file (write only)
-        if (fd < 0) { // if opening file fails
-            return 0;
+    if (bs == NULL || filename == NULL) {
+        return 0;
+    }
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (fd < 0) {
+        return 0;
+    }
+    // Sized up front, so whatever isn't copied is a hole
+    bool ok = ftruncate(fd, BLOCK_STORE_FILE_BYTES) != -1;
+    size_t written = 0;
+    size_t block_id = 0;
+    // Runs of allocated blocks (the FBM's own blocks are allocated), then runs of extension blocks in use
+    while (ok && block_id < BLOCK_STORE_NUM_BLOCKS + BLOCK_STORE_EXT_BLOCKS) {
+        const size_t end = block_id < BLOCK_STORE_NUM_BLOCKS ? BLOCK_STORE_NUM_BLOCKS : BLOCK_STORE_NUM_BLOCKS + BLOCK_STORE_EXT_BLOCKS;
+        size_t last = block_id;
+        while (last < end && (last < BLOCK_STORE_NUM_BLOCKS ? bitmap_atomic_test(bs->fbm, last)
+                                                             : ext_block_used(bs, last - BLOCK_STORE_NUM_BLOCKS))) {
+            ++last;
+        }
+        if (last == block_id) {
+            ++block_id;
+            continue;
+        }
+        ok = copy_out(bs, fd, block_id * BLOCK_SIZE_BYTES, (last - block_id) * BLOCK_SIZE_BYTES);
+        written += (last - block_id) * BLOCK_SIZE_BYTES;
+        block_id = last;
+    }
+    close(fd);
+    return ok ? written : 0;
+}
+
+// Where a tracked block sits in the mapping
+static inline uint8_t *tracked_block(const block_store_t *const bs, const size_t tracked) {
+    if (tracked < BLOCK_STORE_NUM_BLOCKS) {
+        return bs->data_blocks + tracked * BLOCK_SIZE_BYTES;
+    }
+    return bs->data_blocks + BLOCK_STORE_NUM_BYTES + (BLOCK_STORE_REF_FIRST + tracked - BLOCK_STORE_NUM_BLOCKS) * BLOCK_SIZE_BYTES;
+}
+
+// Whether an export since a generation carries a tracked block; what a free block holds doesn't matter
+static inline bool delta_wanted(const block_store_t *const bs, const size_t tracked, const uint32_t since) {
+    return __atomic_load_n(&bs->gens[tracked], __ATOMIC_RELAXED) >= since
+           && (tracked >= BLOCK_STORE_AVAIL_BLOCKS || bitmap_atomic_test(bs->fbm, tracked));
+}
+
+///
+///-- Returns the generation blocks changed now are stamped with
+/// \param bs BS device
+/// \return Current generation, 0 on error
+///
+uint32_t block_store_get_generation(const block_store_t *const bs) {
+    if (bs) {
+        return __atomic_load_n(&bs->generation, __ATOMIC_RELAXED);
+    }
+    return 0;
+}
+
+///
+///-- Writes the blocks changed since a generation to a delta file and starts a new generation
+/// \param bs BS device
+/// \param since_gen Oldest generation to export, 0 for every allocated block
+/// \param filename The file to write to
+/// \return Number of bytes written, 0 on error
+///
+size_t block_store_export_incremental(block_store_t *const bs, const uint32_t since_gen, const char *const filename) {
+    if (bs == NULL || filename == NULL) {
+        return 0;
+    }
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (fd < 0) {
+        return 0;
+    }
+    // Blocks changed from here on belong to the next export; one changing while it's copied goes in both
+    const uint32_t generation = __atomic_load_n(&bs->generation, __ATOMIC_RELAXED) + 1;
+    delta_header_t header = {BLOCK_STORE_DELTA_MAGIC, since_gen, generation, 0};
+    bool ok = save_generation(bs, generation) && write_all(fd, &header, sizeof(header));
+    size_t written = sizeof(header);
+    size_t tracked = 0;
+    while (ok && tracked < BLOCK_STORE_GEN_TRACKED) {
+        if (!delta_wanted(bs, tracked, since_gen)) {
+            ++tracked;
+            continue;
+        }
+        // A run stops where the blocks stop being contiguous in the mapping
+        const size_t end = tracked < BLOCK_STORE_NUM_BLOCKS ? BLOCK_STORE_NUM_BLOCKS : BLOCK_STORE_GEN_TRACKED;
+        size_t last = tracked + 1;
+        while (last < end && delta_wanted(bs, last, since_gen)) {
+            ++last;
+        }
+        const delta_run_t run = {(uint32_t) tracked, (uint32_t)(last - tracked)};
+        ok = write_all(fd, &run, sizeof(run))
+             && write_all(fd, tracked_block(bs, tracked), run.count * BLOCK_SIZE_BYTES);
+        written += sizeof(run) + run.count * BLOCK_SIZE_BYTES;
+        header.runs++;
+        tracked = last;
+    }
+    ok = ok && pwrite(fd, &header, sizeof(header), 0) == (ssize_t) sizeof(header);
+    close(fd);
+    return ok ? written : 0;
+}
+
+///
+///-- Replays a delta file written by block_store_export_incremental onto an older copy of the device
+/// \param bs BS device, at the generation the delta was exported since
+/// \param filename The file to read
+/// \return Number of blocks applied, SIZE_MAX on error
+///
+size_t block_store_apply_incremental(block_store_t *const bs, const char *const filename) {
+    if (bs == NULL || filename == NULL) {
+        return SIZE_MAX;
+    }
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return SIZE_MAX;
+    }
+    delta_header_t header;
+    if (!read_all(fd, &header, sizeof(header)) || header.magic != BLOCK_STORE_DELTA_MAGIC
+        || (header.since != 0 && header.since != __atomic_load_n(&bs->generation, __ATOMIC_RELAXED))) {
+        close(fd);
+        return SIZE_MAX;
+    }
+    uint8_t batch[BLOCK_STORE_DELTA_BATCH * BLOCK_SIZE_BYTES];
+    size_t applied = 0;
+    bool ok = true;
+    bool refs = false;
+    for (uint32_t i = 0; ok && i < header.runs; ++i) {
+        delta_run_t run;
+        ok = read_all(fd, &run, sizeof(run)) && run.count && run.first < BLOCK_STORE_GEN_TRACKED
+             && run.count <= BLOCK_STORE_GEN_TRACKED - run.first
+             && (run.first >= BLOCK_STORE_NUM_BLOCKS || run.first + run.count <= BLOCK_STORE_NUM_BLOCKS);
+        for (size_t done = 0; ok && done < run.count;) {
+            const size_t count = run.count - done < BLOCK_STORE_DELTA_BATCH ? run.count - done : BLOCK_STORE_DELTA_BATCH;
+            ok = read_all(fd, batch, count * BLOCK_SIZE_BYTES);
+            for (size_t j = 0; ok && j < count; ++j) {
+                const size_t tracked = run.first + done + j;
+                const uint8_t *block = batch + j * BLOCK_SIZE_BYTES;
+                if (tracked < BLOCK_STORE_AVAIL_BLOCKS) {
+                    ok = block_store_write(bs, tracked, block) == BLOCK_SIZE_BYTES;
+                } else if (tracked < BLOCK_STORE_NUM_BLOCKS) {
+                    ok = block_store_write_fbm(bs, tracked - BLOCK_STORE_AVAIL_BLOCKS, block) == BLOCK_SIZE_BYTES;
+                } else {
+                    memcpy(tracked_block(bs, tracked), block, BLOCK_SIZE_BYTES);
+                    refs_changed(bs, (tracked - BLOCK_STORE_NUM_BLOCKS) * BLOCK_STORE_REFS_PER_BLOCK);
+                    refs = true;
+                }
+            }
+            done += count;
+            applied += count;
         }
-        write(fd, bs->data_blocks, BLOCK_STORE_AVAIL_BLOCKS*BLOCK_SIZE_BYTES); // write bs->Data to file
-        write(fd, bs->fbm, BLOCK_STORE_NUM_BLOCKS/8); // write bs->FBM to file
-        close(fd); // close file
-        size_t wr_size = block_store_get_used_blocks(bs); // number of block in use
-        return (wr_size*BLOCK_SIZE_BYTES); // return number of bytes written
+    }
+    close(fd);
+    if (refs) {
+        count_extra_refs(bs);
+    }
+    // The generation only moves once the blocks are out, so a failed apply can be retried
+    if (!ok || !block_store_flush(bs) || !save_generation(bs, header.generation)) {
+        return SIZE_MAX;
+    }
+    return applied;
+}
+
+///
+///-- Reads one of the blocks holding the FBM
+/// \param bs BS device
+/// \param fbm_block Index of the FBM block, 0 to 15
+/// \param buffer Data buffer to write to
+/// \return Number of bytes read, 0 on error
+///
+size_t block_store_read_fbm(const block_store_t *const bs, const size_t fbm_block, void *buffer) {
+    if (bs && buffer && fbm_block < BLOCK_STORE_FBM_BLOCKS) {
+        memcpy(buffer, bs->data_blocks + (BLOCK_STORE_AVAIL_BLOCKS + fbm_block) * BLOCK_SIZE_BYTES, BLOCK_SIZE_BYTES);
+        return BLOCK_SIZE_BYTES;
+    }
+    return 0;
+}
+
+///
+///-- Overwrites one of the blocks holding the FBM and refreshes the free-space summary
+/// \param bs BS device
+/// \param fbm_block Index of the FBM block, 0 to 15
+/// \param buffer Data buffer to read from
+/// \return Number of bytes written, 0 on error
+///
+size_t block_store_write_fbm(block_store_t *const bs, const size_t fbm_block, const void *buffer) {
+    if (bs && buffer && fbm_block < BLOCK_STORE_FBM_BLOCKS) {
+        memcpy(bs->data_blocks + (BLOCK_STORE_AVAIL_BLOCKS + fbm_block) * BLOCK_SIZE_BYTES, buffer, BLOCK_SIZE_BYTES);
+        mark_dirty(bs, BLOCK_STORE_AVAIL_BLOCKS + fbm_block);
+        count_group_free(bs);
+        __atomic_store_n(&bs->counted, COUNTS_READY, __ATOMIC_RELEASE);
+        return BLOCK_SIZE_BYTES;
+    }
+    return 0;
+}
+
+///
+///-- Returns the number of blocks in the extension area
+/// \return Total extension blocks
+///
+size_t block_store_get_ext_blocks() {
+    return BLOCK_STORE_USER_EXT_BLOCKS;
+}
+
+///
+///-- Reads a block of the extension area
+/// \param bs BS device
+/// \param ext_block Source extension block
+/// \param buffer Data buffer to write to
+/// \return Number of bytes read, 0 on error
+///
+size_t block_store_ext_read(const block_store_t *const bs, const size_t ext_block, void *buffer) {
+    if (bs && buffer && ext_block < BLOCK_STORE_USER_EXT_BLOCKS) {
+        memcpy(buffer, bs->data_blocks + BLOCK_STORE_NUM_BYTES + ext_block * BLOCK_SIZE_BYTES, BLOCK_SIZE_BYTES);
+        return BLOCK_SIZE_BYTES;
+    }
+    return 0;
+}
+
+///
+///-- Writes a block of the extension area
+/// \param bs BS device
+/// \param ext_block Destination extension block
+/// \param buffer Data buffer to read from
+/// \return Number of bytes written, 0 on error
+///
+size_t block_store_ext_write(block_store_t *const bs, const size_t ext_block, const void *buffer) {
+    if (bs && buffer && ext_block < BLOCK_STORE_USER_EXT_BLOCKS) {
+        memcpy(bs->data_blocks + BLOCK_STORE_NUM_BYTES + ext_block * BLOCK_SIZE_BYTES, buffer, BLOCK_SIZE_BYTES);
+        return BLOCK_SIZE_BYTES;
     }
     return 0;
 }
 
+// Waits for the byte range of the mapping to reach the file, widened to whole pages
+static bool flush_bytes(const block_store_t *const bs, const size_t offset, const size_t length) {
+    if (bs->private_map || bs->in_memory) {
+        return true;
+    }
+    const size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    const size_t start = offset / page * page;
+    return msync(bs->data_blocks + start, offset + length - start, MS_SYNC) == 0;
+}
+
+// Gets the checksum table out if it changed, ahead of the header saying it's current
+static void flush_checksums(block_store_t *const bs, bool *const flushed) {
+    if (__atomic_exchange_n(&bs->csum_dirty, false, __ATOMIC_RELAXED)) {
+        *flushed &= flush_bytes(bs, BLOCK_STORE_NUM_BYTES + BLOCK_STORE_CSUM_FIRST * BLOCK_SIZE_BYTES,
+                                BLOCK_STORE_CSUM_BLOCKS * BLOCK_SIZE_BYTES);
+    }
+}
+
+// Gets the reference table out if it changed
+static void flush_refs(block_store_t *const bs, bool *const flushed) {
+    if (__atomic_exchange_n(&bs->refs_dirty, false, __ATOMIC_RELAXED)) {
+        *flushed &= flush_bytes(bs, BLOCK_STORE_NUM_BYTES + BLOCK_STORE_REF_FIRST * BLOCK_SIZE_BYTES,
+                                BLOCK_STORE_REF_BLOCKS * BLOCK_SIZE_BYTES);
+    }
+}
+
+// Gets the generation table out if it changed
+static void flush_gens(block_store_t *const bs, bool *const flushed) {
+    if (__atomic_exchange_n(&bs->gens_dirty, false, __ATOMIC_RELAXED)) {
+        *flushed &= flush_bytes(bs, BLOCK_STORE_NUM_BYTES + BLOCK_STORE_GEN_FIRST * BLOCK_SIZE_BYTES,
+                                BLOCK_STORE_GEN_BLOCKS * BLOCK_SIZE_BYTES);
+    }
+}
+
+// Gives a run of free blocks back to the host: a hole in the backing file, or for a private mapping
+// the whole pages of it dropped from memory
+static void punch_run(block_store_t *const bs, const size_t first, const size_t last) {
+    if (bs->private_map) {
+        const size_t page = (size_t) sysconf(_SC_PAGESIZE);
+        const size_t start = (first * BLOCK_SIZE_BYTES + page - 1) / page * page;
+        const size_t end = last * BLOCK_SIZE_BYTES / page * page;
+        if (start < end) {
+            madvise(bs->data_blocks + start, end - start, MADV_DONTNEED);
+        }
+        return;
+    }
+    fallocate(bs->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)(first * BLOCK_SIZE_BYTES),
+              (off_t)((last - first) * BLOCK_SIZE_BYTES));
+}
+
+// Punches the blocks freed since the last pass that are still free, a run at a time
+//  A run's blocks are held (their FBM bits set) while it's punched, so none can be allocated and
+//  written in the meantime; an allocation racing with it just looks elsewhere
+//  Their dirty marks go too, there's nothing in them worth writing back
+static void punch_freed(block_store_t *const bs) {
+    if (!__atomic_load_n(&bs->punch_holes, __ATOMIC_RELAXED) || __atomic_exchange_n(&bs->punch_count, 0, __ATOMIC_RELAXED) == 0) {
+        return;
+    }
+    size_t id = 0;
+    while (id < BLOCK_STORE_AVAIL_BLOCKS) {
+        size_t last = id;
+        while (last < BLOCK_STORE_AVAIL_BLOCKS && bitmap_atomic_test(bs->punch, last) && bitmap_atomic_reset(bs->punch, last)
+               && !bitmap_atomic_set(bs->fbm, last)) {
+            if (bitmap_atomic_test(bs->dirty, last) && bitmap_atomic_reset(bs->dirty, last)) {
+                __atomic_sub_fetch(&bs->dirty_count, 1, __ATOMIC_RELAXED);
+            }
+            ++last;
+        }
+        if (last > id) {
+            punch_run(bs, id, last);
+            for (size_t held = id; held < last; ++held) {
+                bitmap_atomic_reset(bs->fbm, held);
+            }
+            __atomic_add_fetch(&bs->punched, last - id, __ATOMIC_RELAXED);
+        }
+        // The block that ended the run (allocated again, or never freed) is left alone
+        id = last + 1;
+    }
+}
+
+// Flushes the dirty blocks in [first, last), one msync per run of dirty pages
+//  Stops early once *budget blocks went out and returns where the scan stopped
+//  Dirty marks are dropped before the msync, a write racing with it just marks the block again
+static size_t flush_dirty(block_store_t *const bs, const size_t first, const size_t last, size_t *const budget,
+                          bool *const flushed) {
+    const size_t blocks_per_page = (size_t) sysconf(_SC_PAGESIZE) / BLOCK_SIZE_BYTES;
+    size_t run_start = SIZE_MAX;
+    size_t run_end = 0;
+    size_t id = first;
+    while (id < last && *budget) {
+        if (!bitmap_atomic_test(bs->dirty, id) || !bitmap_atomic_reset(bs->dirty, id)) {
+            ++id;
+            continue;
+        }
+        __atomic_sub_fetch(&bs->dirty_count, 1, __ATOMIC_RELAXED);
+        --*budget;
+        // Blocks sharing a page, or on the next page, join the current run
+        if (run_start != SIZE_MAX && id / blocks_per_page > run_end / blocks_per_page + 1) {
+            *flushed &= flush_bytes(bs, run_start * BLOCK_SIZE_BYTES, (run_end + 1 - run_start) * BLOCK_SIZE_BYTES);
+            run_start = SIZE_MAX;
+        }
+        if (run_start == SIZE_MAX) {
+            run_start = id;
+        }
+        run_end = id++;
+    }
+    if (run_start != SIZE_MAX) {
+        *flushed &= flush_bytes(bs, run_start * BLOCK_SIZE_BYTES, (run_end + 1 - run_start) * BLOCK_SIZE_BYTES);
+    }
+    return id;
+}
 
+///
+///-- Flushes the dirty blocks of a run (FBM blocks included) to the file
+/// \param bs BS device
+/// \param first_block First block of the run
+/// \param count Number of blocks in the run
+/// \return true once the blocks are durable, false on error
+///
+bool block_store_flush_range(block_store_t *const bs, const size_t first_block, const size_t count) {
+    if (bs && count && first_block < BLOCK_STORE_NUM_BLOCKS && count <= BLOCK_STORE_NUM_BLOCKS - first_block) {
+        size_t budget = SIZE_MAX;
+        bool flushed = true;
+        flush_dirty(bs, first_block, first_block + count, &budget, &flushed);
+        flush_checksums(bs, &flushed);
+        flush_refs(bs, &flushed);
+        flush_gens(bs, &flushed);
+        return flushed;
+    }
+    return false;
+}
 
+///
+///-- Flushes every dirty block to the file, coalescing neighbouring ones
+/// \param bs BS device
+/// \return true once the blocks are durable, false on error
+///
+bool block_store_flush(block_store_t *const bs) {
+    if (bs) {
+        punch_freed(bs);
+        bool flushed = true;
+        flush_checksums(bs, &flushed);
+        flush_refs(bs, &flushed);
+        flush_gens(bs, &flushed);
+        if (__atomic_load_n(&bs->dirty_count, __ATOMIC_RELAXED) == 0) {
+            return flushed;
+        }
+        size_t budget = SIZE_MAX;
+        flush_dirty(bs, 0, BLOCK_STORE_NUM_BLOCKS, &budget, &flushed);
+        return flushed;
+    }
+    return false;
+}
 
+///
+///-- Flushes at most max_blocks dirty blocks, picking up where the previous call stopped
+/// \param bs BS device
+/// \param max_blocks Most blocks to flush
+/// \return Blocks flushed, SIZE_MAX on error
+///
+size_t block_store_writeback(block_store_t *const bs, const size_t max_blocks) {
+    if (bs == NULL) {
+        return SIZE_MAX;
+    }
+    punch_freed(bs);
+    size_t budget = max_blocks;
+    bool flushed = true;
+    const size_t start = __atomic_load_n(&bs->writeback_cursor, __ATOMIC_RELAXED);
+    size_t stop = flush_dirty(bs, start, BLOCK_STORE_NUM_BLOCKS, &budget, &flushed);
+    if (budget && start) {
+        stop = flush_dirty(bs, 0, start, &budget, &flushed);
+    }
+    if (budget < max_blocks) {
+        flush_checksums(bs, &flushed);
+        flush_refs(bs, &flushed);
+        flush_gens(bs, &flushed);
+    }
+    __atomic_store_n(&bs->writeback_cursor, stop % BLOCK_STORE_NUM_BLOCKS, __ATOMIC_RELAXED);
+    return flushed ? max_blocks - budget : SIZE_MAX;
+}
 
+///
+///-- Tells how long the device has had dirty blocks
+/// \param bs BS device
+/// \return Milliseconds since the device went from clean to dirty, 0 if it is clean or on error
+///
+uint64_t block_store_get_dirty_age(const block_store_t *const bs) {
+    if (bs == NULL || __atomic_load_n(&bs->dirty_count, __ATOMIC_RELAXED) == 0) {
+        return 0;
+    }
+    const uint64_t since = __atomic_load_n(&bs->dirty_since, __ATOMIC_RELAXED);
+    const uint64_t now = monotonic_ms();
+    return now > since ? now - since : 0;
+}
 
+///
+///-- Counts the blocks changed since they were last flushed
+/// \param bs BS device
+/// \return Dirty blocks, SIZE_MAX on error
+///
+size_t block_store_get_dirty_blocks(const block_store_t *const bs) {
+    if (bs) {
+        return __atomic_load_n(&bs->dirty_count, __ATOMIC_RELAXED);
+    }
+    return SIZE_MAX;
+}
 
+///
+///-- Waits for a run of extension blocks to reach the file
+/// \param bs BS device
+/// \param first_block First extension block of the run
+/// \param count Number of extension blocks in the run
+/// \return true once the blocks are durable, false on error
+///
+bool block_store_ext_flush(const block_store_t *const bs, const size_t first_block, const size_t count) {
+    if (bs && count && first_block < BLOCK_STORE_USER_EXT_BLOCKS && count <= BLOCK_STORE_USER_EXT_BLOCKS - first_block) {
+        return flush_bytes(bs, BLOCK_STORE_NUM_BYTES + first_block * BLOCK_SIZE_BYTES, count * BLOCK_SIZE_BYTES);
+    }
+    return false;
+}
+
+///
+///-- Turns per-block checksums on or off
+/// \param bs BS device
+/// \param mode How reads are checked, BLOCK_STORE_CHECKSUM_OFF to stop keeping checksums
+/// \param callback Called with each block that fails its check, may be NULL
+/// \param arg Passed to the callback
+/// \return true on success, false on error
+///
+bool block_store_set_checksums(block_store_t *const bs, const block_store_checksum_t mode, block_store_mismatch_t callback, void *arg) {
+    if (bs == NULL || mode > BLOCK_STORE_CHECKSUM_LAZY) {
+        return false;
+    }
+    bs->csum_callback = callback;
+    bs->csum_arg = arg;
+    if (mode == BLOCK_STORE_CHECKSUM_OFF) {
+        // The header goes stale with the first write that skips its checksum
+        bs->csum_mode = mode;
+        return true;
+    }
+    if (bs->csum_verified == NULL) {
+        bs->csum_verified = bitmap_create(BLOCK_STORE_NUM_BLOCKS);
+        if (bs->csum_verified == NULL) {
+            return false;
+        }
+    }
+    if (!bs->csum_saved) {
+        // Whatever is there now is taken as good, checks start from here
+        for (size_t block_id = 0; block_id < BLOCK_STORE_AVAIL_BLOCKS; ++block_id) {
+            bs->csums[block_id] = crc32c(0, bs->data_blocks + block_id * BLOCK_SIZE_BYTES, BLOCK_SIZE_BYTES);
+            bitmap_atomic_set(bs->csum_verified, block_id);
+        }
+        bs->csum_dirty = true;
+        bool flushed = true;
+        flush_checksums(bs, &flushed);
+        if (!flushed) {
+            return false;
+        }
+        save_csum_header(bs, true);
+    }
+    bs->csum_mode = mode;
+    return true;
+}
+
+///
+///-- Checks up to max_blocks allocated blocks against their checksums, picking up where the previous call stopped
+/// \param bs BS device
+/// \param max_blocks Most allocated blocks to check
+/// \return Mismatches found, SIZE_MAX on error or with checksums off
+///
+size_t block_store_scrub(block_store_t *const bs, const size_t max_blocks) {
+    if (bs == NULL || bs->csum_mode == BLOCK_STORE_CHECKSUM_OFF) {
+        return SIZE_MAX;
+    }
+    size_t mismatches = 0;
+    size_t checked = 0;
+    size_t cursor = __atomic_load_n(&bs->scrub_cursor, __ATOMIC_RELAXED) % BLOCK_STORE_AVAIL_BLOCKS;
+    uint8_t block[BLOCK_SIZE_BYTES];
+    // At most one lap per call, however few blocks are allocated
+    for (size_t scanned = 0; scanned < BLOCK_STORE_AVAIL_BLOCKS && checked < max_blocks; ++scanned) {
+        const size_t block_id = cursor;
+        cursor = (cursor + 1) % BLOCK_STORE_AVAIL_BLOCKS;
+        if (!bitmap_atomic_test(bs->fbm, block_id)) {
+            continue;
+        }
+        ++checked;
+        if (!check_block(bs, block_id, block)) {
+            ++mismatches;
+        }
+    }
+    __atomic_store_n(&bs->scrub_cursor, cursor, __ATOMIC_RELAXED);
+    return mismatches;
+}
+
+///
+///-- Counts the reads and scrubs that found a block not matching its checksum
+/// \param bs BS device
+/// \return Mismatches so far, SIZE_MAX on error
+///
+size_t block_store_get_checksum_errors(const block_store_t *const bs) {
+    if (bs) {
+        return __atomic_load_n(&bs->csum_errors, __ATOMIC_RELAXED);
+    }
+    return SIZE_MAX;
+}
+
+///
+///-- Marks an allocated block as one others may share
+/// \param bs BS device
+/// \param block_id The block
+/// \return true on success, false on error or if the block is free
+///
+bool block_store_mark_shareable(block_store_t *const bs, const size_t block_id) {
+    if (bs == NULL || block_id >= BLOCK_STORE_AVAIL_BLOCKS || !bitmap_atomic_test(bs->fbm, block_id)) {
+        return false;
+    }
+    if (!(__atomic_fetch_or(&bs->refs[block_id], BLOCK_STORE_REF_SHAREABLE, __ATOMIC_ACQ_REL) & BLOCK_STORE_REF_SHAREABLE)) {
+        refs_changed(bs, block_id);
+    }
+    return true;
+}
+
+///
+///-- Adds an owner to a shareable block
+/// \param bs BS device
+/// \param block_id The block
+/// \return true if the block is now shared with the caller, false on error or if it isn't shareable (any more)
+///
+bool block_store_share(block_store_t *const bs, const size_t block_id) {
+    if (bs == NULL || block_id >= BLOCK_STORE_AVAIL_BLOCKS) {
+        return false;
+    }
+    uint16_t refs = __atomic_load_n(&bs->refs[block_id], __ATOMIC_RELAXED);
+    do {
+        if (!(refs & BLOCK_STORE_REF_SHAREABLE) || (refs & BLOCK_STORE_REF_EXTRA) == BLOCK_STORE_REF_EXTRA) {
+            return false;
+        }
+    } while (!__atomic_compare_exchange_n(&bs->refs[block_id], &refs, (uint16_t)(refs + 1), false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+    __atomic_add_fetch(&bs->extra_refs, 1, __ATOMIC_RELAXED);
+    refs_changed(bs, block_id);
+    return true;
+}
+
+///
+///-- Adds an owner to an allocated block, shareable or not
+/// \param bs BS device
+/// \param block_id The block
+/// \return true on success, false on error, if the block is free or if it can't take another owner
+///
+bool block_store_ref(block_store_t *const bs, const size_t block_id) {
+    if (bs == NULL || block_id >= BLOCK_STORE_AVAIL_BLOCKS || !bitmap_atomic_test(bs->fbm, block_id)) {
+        return false;
+    }
+    uint16_t refs = __atomic_load_n(&bs->refs[block_id], __ATOMIC_RELAXED);
+    do {
+        if ((refs & BLOCK_STORE_REF_EXTRA) == BLOCK_STORE_REF_EXTRA) {
+            return false;
+        }
+    } while (!__atomic_compare_exchange_n(&bs->refs[block_id], &refs, (uint16_t)(refs + 1), false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+    __atomic_add_fetch(&bs->extra_refs, 1, __ATOMIC_RELAXED);
+    refs_changed(bs, block_id);
+    return true;
+}
+
+///
+///-- Takes a block its only owner is about to write over out of sharing
+/// \param bs BS device
+/// \param block_id The block
+/// \return true if the caller may write it in place, false on error or if it is shared (copy it instead)
+///
+bool block_store_make_private(block_store_t *const bs, const size_t block_id) {
+    if (bs == NULL || block_id >= BLOCK_STORE_AVAIL_BLOCKS) {
+        return false;
+    }
+    uint16_t refs = __atomic_load_n(&bs->refs[block_id], __ATOMIC_RELAXED);
+    do {
+        if (refs & BLOCK_STORE_REF_EXTRA) {
+            return false;
+        }
+        if (refs == 0) {
+            return true;
+        }
+    } while (!__atomic_compare_exchange_n(&bs->refs[block_id], &refs, 0, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+    refs_changed(bs, block_id);
+    return true;
+}
+
+///
+///-- Tells whether a block may be shared
+/// \param bs BS device
+/// \param block_id The block
+/// \return true if it is allocated and marked shareable
+///
+bool block_store_is_shareable(const block_store_t *const bs, const size_t block_id) {
+    return bs && block_id < BLOCK_STORE_AVAIL_BLOCKS && bitmap_atomic_test(bs->fbm, block_id)
+           && (__atomic_load_n(&bs->refs[block_id], __ATOMIC_RELAXED) & BLOCK_STORE_REF_SHAREABLE);
+}
+
+///
+///-- Counts the owners of a block
+/// \param bs BS device
+/// \param block_id The block
+/// \return Owners, 0 if the block is free or on error
+///
+size_t block_store_get_refs(const block_store_t *const bs, const size_t block_id) {
+    if (bs == NULL || block_id >= BLOCK_STORE_AVAIL_BLOCKS || !bitmap_atomic_test(bs->fbm, block_id)) {
+        return 0;
+    }
+    return 1 + (__atomic_load_n(&bs->refs[block_id], __ATOMIC_RELAXED) & BLOCK_STORE_REF_EXTRA);
+}
+
+///
+///-- Overrides the owner count of an allocated block, for a checker that counted them
+/// \param bs BS device
+/// \param block_id The block
+/// \param refs Owners, at least 1
+/// \return true on success, false on error
+///
+bool block_store_set_refs(block_store_t *const bs, const size_t block_id, const size_t refs) {
+    if (bs == NULL || block_id >= BLOCK_STORE_AVAIL_BLOCKS || refs == 0 || refs - 1 > BLOCK_STORE_REF_EXTRA
+        || !bitmap_atomic_test(bs->fbm, block_id)) {
+        return false;
+    }
+    uint16_t old = __atomic_load_n(&bs->refs[block_id], __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&bs->refs[block_id], &old, (uint16_t)((old & BLOCK_STORE_REF_SHAREABLE) | (refs - 1)),
+                                        false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+    }
+    __atomic_add_fetch(&bs->extra_refs, refs - 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&bs->extra_refs, old & BLOCK_STORE_REF_EXTRA, __ATOMIC_RELAXED);
+    refs_changed(bs, block_id);
+    return true;
+}
+
+///
+///-- Counts the owners past the first of every shared block: the blocks sharing saves
+/// \param bs BS device
+/// \return Extra owners, SIZE_MAX on error
+///
+size_t block_store_get_extra_refs(const block_store_t *const bs) {
+    if (bs) {
+        return __atomic_load_n(&bs->extra_refs, __ATOMIC_RELAXED);
+    }
+    return SIZE_MAX;
+}
+
+///
+///-- Turns giving freed blocks' space back to the host on or off
+/// \param bs BS device
+/// \param enabled Whether blocks freed from now on get punched
+/// \return true on success, false on error
+///
+bool block_store_set_hole_punching(block_store_t *const bs, const bool enabled) {
+    if (bs == NULL) {
+        return false;
+    }
+    if (enabled && bs->punch == NULL) {
+        bs->punch = bitmap_create(BLOCK_STORE_NUM_BLOCKS);
+        if (bs->punch == NULL) {
+            return false;
+        }
+    }
+    __atomic_store_n(&bs->punch_holes, enabled, __ATOMIC_RELAXED);
+    return true;
+}
+
+///
+///-- Counts the blocks whose space was given back to the host
+/// \param bs BS device
+/// \return Blocks punched, SIZE_MAX on error
+///
+size_t block_store_get_punched_blocks(const block_store_t *const bs) {
+    if (bs) {
+        return __atomic_load_n(&bs->punched, __ATOMIC_RELAXED);
+    }
+    return SIZE_MAX;
+}
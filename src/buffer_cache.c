@@ -0,0 +1,404 @@
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include "buffer_cache.h"
+
+#define BUFFER_CACHE_BLOCK_BYTES 512  // Same as the block store's blocks
+
+// Lists a node can be on. LRU and CLOCK only use T1; ARC keeps the recency (T1) and
+// frequency (T2) lists of cached blocks plus the ghosts (B1, B2) of blocks evicted from them.
+enum { LIST_T1, LIST_T2, LIST_B1, LIST_B2, LIST_COUNT, LIST_NONE = -1 };
+
+typedef struct {
+    uint32_t block_id;
+    int8_t list;
+    uint8_t referenced;  // CLOCK's second chance
+    int prev;            // Towards the most recently used end
+    int next;            // Towards the least recently used end
+    int hash_next;
+    int slot;            // Data buffer, -1 for a ghost
+} node_t;
+
+typedef struct {
+    int head;  // Most recently used
+    int tail;  // Least recently used
+    size_t size;
+} list_t;
+
+struct buffer_cache {
+    block_store_t *bs;
+    pthread_mutex_t lock;
+    buffer_cache_policy_t policy;
+    size_t capacity;  // Data buffers, c in the ARC paper
+    size_t target;    // ARC's p, the size T1 is steered towards
+    node_t *nodes;    // 2 * capacity, room for every ghost ARC can keep
+    int free_node;
+    uint8_t (*data)[BUFFER_CACHE_BLOCK_BYTES];
+    int *slot_next;
+    int free_slot;
+    int *buckets;
+    size_t bucket_mask;
+    list_t lists[LIST_COUNT];
+    size_t hits;
+    size_t misses;
+    size_t evictions;
+};
+
+static int *bucket_of(buffer_cache_t *const cache, const size_t block_id) {
+    return &cache->buckets[(block_id * 2654435761u) & cache->bucket_mask];
+}
+
+static int find_node(buffer_cache_t *const cache, const size_t block_id) {
+    int index = *bucket_of(cache, block_id);
+    while (index != -1 && cache->nodes[index].block_id != block_id) {
+        index = cache->nodes[index].hash_next;
+    }
+    return index;
+}
+
+static void hash_remove(buffer_cache_t *const cache, const int index) {
+    int *link = bucket_of(cache, cache->nodes[index].block_id);
+    while (*link != index) {
+        link = &cache->nodes[*link].hash_next;
+    }
+    *link = cache->nodes[index].hash_next;
+}
+
+static void list_remove(buffer_cache_t *const cache, const int index) {
+    node_t *node = &cache->nodes[index];
+    list_t *list = &cache->lists[node->list];
+    if (node->prev != -1) {
+        cache->nodes[node->prev].next = node->next;
+    } else {
+        list->head = node->next;
+    }
+    if (node->next != -1) {
+        cache->nodes[node->next].prev = node->prev;
+    } else {
+        list->tail = node->prev;
+    }
+    list->size--;
+    node->list = LIST_NONE;
+}
+
+// Puts a node on a list, at the hot end unless cold is set
+static void list_insert(buffer_cache_t *const cache, const int list_id, const int index, const bool cold) {
+    node_t *node = &cache->nodes[index];
+    list_t *list = &cache->lists[list_id];
+    node->list = (int8_t) list_id;
+    if (cold) {
+        node->prev = list->tail;
+        node->next = -1;
+        if (list->tail != -1) {
+            cache->nodes[list->tail].next = index;
+        } else {
+            list->head = index;
+        }
+        list->tail = index;
+    } else {
+        node->prev = -1;
+        node->next = list->head;
+        if (list->head != -1) {
+            cache->nodes[list->head].prev = index;
+        } else {
+            list->tail = index;
+        }
+        list->head = index;
+    }
+    list->size++;
+}
+
+static void release_slot(buffer_cache_t *const cache, node_t *const node) {
+    if (node->slot != -1) {
+        cache->slot_next[node->slot] = cache->free_slot;
+        cache->free_slot = node->slot;
+        node->slot = -1;
+    }
+}
+
+// Forgets a node altogether
+static void drop_node(buffer_cache_t *const cache, const int index) {
+    node_t *node = &cache->nodes[index];
+    list_remove(cache, index);
+    hash_remove(cache, index);
+    release_slot(cache, node);
+    node->hash_next = cache->free_node;
+    cache->free_node = index;
+}
+
+// Evicts the coldest block of a list, keeping its id as a ghost on another list (LIST_NONE keeps nothing)
+static void evict_tail(buffer_cache_t *const cache, const int list_id, const int ghost_list) {
+    const int index = cache->lists[list_id].tail;
+    cache->evictions++;
+    if (ghost_list == LIST_NONE) {
+        drop_node(cache, index);
+        return;
+    }
+    list_remove(cache, index);
+    release_slot(cache, &cache->nodes[index]);
+    list_insert(cache, ghost_list, index, false);
+}
+
+// ARC's REPLACE: makes room by evicting from T1 or T2, whichever is over its share
+static void arc_replace(buffer_cache_t *const cache, const bool ghost_in_b2) {
+    const size_t t1 = cache->lists[LIST_T1].size;
+    if (t1 == 0 && cache->lists[LIST_T2].size == 0) {
+        return;
+    }
+    if (cache->lists[LIST_T2].size == 0 || (t1 > 0 && (t1 > cache->target || (ghost_in_b2 && t1 == cache->target)))) {
+        evict_tail(cache, LIST_T1, LIST_B1);
+    } else {
+        evict_tail(cache, LIST_T2, LIST_B2);
+    }
+}
+
+// Makes sure a node and a data buffer are free for a block that isn't cached or remembered
+static void make_room(buffer_cache_t *const cache) {
+    if (cache->policy == BUFFER_CACHE_ARC) {
+        const size_t t1 = cache->lists[LIST_T1].size;
+        const size_t b1 = cache->lists[LIST_B1].size;
+        const size_t total = t1 + b1 + cache->lists[LIST_T2].size + cache->lists[LIST_B2].size;
+        if (t1 + b1 == cache->capacity) {
+            if (t1 < cache->capacity) {
+                drop_node(cache, cache->lists[LIST_B1].tail);
+                arc_replace(cache, false);
+            } else {
+                evict_tail(cache, LIST_T1, LIST_NONE);
+            }
+        } else if (total >= cache->capacity) {
+            if (total == 2 * cache->capacity) {
+                drop_node(cache, cache->lists[LIST_B2].tail);
+            }
+            arc_replace(cache, false);
+        }
+        return;
+    }
+    if (cache->free_slot != -1) {
+        return;
+    }
+    if (cache->policy == BUFFER_CACHE_CLOCK) {
+        // The hand sits at the tail: referenced blocks get their bit cleared and go round once more
+        int index = cache->lists[LIST_T1].tail;
+        while (cache->nodes[index].referenced) {
+            cache->nodes[index].referenced = 0;
+            list_remove(cache, index);
+            list_insert(cache, LIST_T1, index, false);
+            index = cache->lists[LIST_T1].tail;
+        }
+    }
+    evict_tail(cache, LIST_T1, LIST_NONE);
+}
+
+static size_t read_block(buffer_cache_t *const cache, const size_t block_id, void *buffer, const bool stream) {
+    if (cache == NULL || buffer == NULL || block_id >= block_store_get_total_blocks()) {
+        return 0;
+    }
+    pthread_mutex_lock(&cache->lock);
+    int index = find_node(cache, block_id);
+    if (index != -1 && cache->nodes[index].slot != -1) {
+        node_t *node = &cache->nodes[index];
+        cache->hits++;
+        memcpy(buffer, cache->data[node->slot], BUFFER_CACHE_BLOCK_BYTES);
+        if (cache->policy == BUFFER_CACHE_CLOCK) {
+            node->referenced = 1;
+        } else {
+            // LRU moves it to the front, ARC promotes it to the frequency list
+            list_remove(cache, index);
+            list_insert(cache, cache->policy == BUFFER_CACHE_ARC ? LIST_T2 : LIST_T1, index, false);
+        }
+        pthread_mutex_unlock(&cache->lock);
+        return BUFFER_CACHE_BLOCK_BYTES;
+    }
+    cache->misses++;
+    const size_t bytes = block_store_read(cache->bs, block_id, buffer);
+    if (bytes == 0) {
+        pthread_mutex_unlock(&cache->lock);
+        return 0;
+    }
+    int list_id = LIST_T1;
+    if (index != -1) {
+        // A ghost hit: the list it was evicted from should have been bigger
+        const size_t b1 = cache->lists[LIST_B1].size;
+        const size_t b2 = cache->lists[LIST_B2].size;
+        const bool in_b2 = cache->nodes[index].list == LIST_B2;
+        if (in_b2) {
+            const size_t delta = b1 > b2 ? b1 / b2 : 1;
+            cache->target = cache->target > delta ? cache->target - delta : 0;
+        } else {
+            const size_t delta = b2 > b1 ? b2 / b1 : 1;
+            cache->target = cache->target + delta < cache->capacity ? cache->target + delta : cache->capacity;
+        }
+        arc_replace(cache, in_b2);
+        list_remove(cache, index);
+        list_id = LIST_T2;
+    } else {
+        make_room(cache);
+        index = cache->free_node;
+        cache->free_node = cache->nodes[index].hash_next;
+        node_t *node = &cache->nodes[index];
+        node->block_id = (uint32_t) block_id;
+        int *bucket = bucket_of(cache, block_id);
+        node->hash_next = *bucket;
+        *bucket = index;
+    }
+    node_t *node = &cache->nodes[index];
+    node->referenced = 0;
+    node->slot = cache->free_slot;
+    cache->free_slot = cache->slot_next[node->slot];
+    memcpy(cache->data[node->slot], buffer, BUFFER_CACHE_BLOCK_BYTES);
+    list_insert(cache, list_id, index, stream && list_id == LIST_T1);
+    pthread_mutex_unlock(&cache->lock);
+    return bytes;
+}
+
+///
+/// Creates a cache over a block store
+/// \param bs BS device to cache
+/// \param budget_bytes Memory for cached blocks, at least one block's worth
+/// \param policy Eviction policy
+/// \return Pointer to the cache, NULL on error
+///
+buffer_cache_t *buffer_cache_create(block_store_t *const bs, const size_t budget_bytes, const buffer_cache_policy_t policy) {
+    const size_t capacity = budget_bytes / BUFFER_CACHE_BLOCK_BYTES;
+    if (bs == NULL || capacity == 0 || capacity > block_store_get_total_blocks() ||
+        (policy != BUFFER_CACHE_ARC && policy != BUFFER_CACHE_LRU && policy != BUFFER_CACHE_CLOCK)) {
+        return NULL;
+    }
+    size_t buckets = 1;
+    while (buckets < 4 * capacity) {
+        buckets <<= 1;
+    }
+    buffer_cache_t *cache = (buffer_cache_t *) calloc(1, sizeof(buffer_cache_t));
+    if (cache) {
+        cache->nodes = (node_t *) calloc(2 * capacity, sizeof(node_t));
+        cache->data = calloc(capacity, BUFFER_CACHE_BLOCK_BYTES);
+        cache->slot_next = (int *) calloc(capacity, sizeof(int));
+        cache->buckets = (int *) malloc(buckets * sizeof(int));
+        if (cache->nodes && cache->data && cache->slot_next && cache->buckets) {
+            cache->bs = bs;
+            cache->policy = policy;
+            cache->capacity = capacity;
+            cache->bucket_mask = buckets - 1;
+            memset(cache->buckets, 0xFF, buckets * sizeof(int));
+            cache->free_node = -1;
+            for (size_t i = 2 * capacity; i-- > 0;) {
+                cache->nodes[i].hash_next = cache->free_node;
+                cache->nodes[i].list = LIST_NONE;
+                cache->nodes[i].slot = -1;
+                cache->free_node = (int) i;
+            }
+            cache->free_slot = -1;
+            for (size_t i = capacity; i-- > 0;) {
+                cache->slot_next[i] = cache->free_slot;
+                cache->free_slot = (int) i;
+            }
+            for (int i = 0; i < LIST_COUNT; ++i) {
+                cache->lists[i].head = cache->lists[i].tail = -1;
+            }
+            pthread_mutex_init(&cache->lock, NULL);
+            return cache;
+        }
+        free(cache->nodes);
+        free(cache->data);
+        free(cache->slot_next);
+        free(cache->buckets);
+        free(cache);
+    }
+    return NULL;
+}
+
+///
+/// Frees the cache (the block store is left alone)
+/// \param cache The cache to free
+///
+void buffer_cache_destroy(buffer_cache_t *const cache) {
+    if (cache) {
+        pthread_mutex_destroy(&cache->lock);
+        free(cache->nodes);
+        free(cache->data);
+        free(cache->slot_next);
+        free(cache->buckets);
+        free(cache);
+    }
+}
+
+///
+/// Reads a block, from the cache when it is there
+/// \param cache The cache
+/// \param block_id Source block id
+/// \param buffer Data buffer to write to
+/// \return Number of bytes read, 0 on error
+///
+size_t buffer_cache_read(buffer_cache_t *const cache, const size_t block_id, void *buffer) {
+    return read_block(cache, block_id, buffer, false);
+}
+
+///
+/// Reads a block that is unlikely to be read again soon, a miss is cached at the cold end
+/// \param cache The cache
+/// \param block_id Source block id
+/// \param buffer Data buffer to write to
+/// \return Number of bytes read, 0 on error
+///
+size_t buffer_cache_read_stream(buffer_cache_t *const cache, const size_t block_id, void *buffer) {
+    return read_block(cache, block_id, buffer, true);
+}
+
+///
+/// Writes a block through to the block store, refreshing the cached copy if there is one
+/// \param cache The cache
+/// \param block_id Destination block id
+/// \param buffer Data buffer to read from
+/// \return Number of bytes written, 0 on error
+///
+size_t buffer_cache_write(buffer_cache_t *const cache, const size_t block_id, const void *buffer) {
+    if (cache == NULL || buffer == NULL) {
+        return 0;
+    }
+    pthread_mutex_lock(&cache->lock);
+    const size_t bytes = block_store_write(cache->bs, block_id, buffer);
+    if (bytes) {
+        const int index = find_node(cache, block_id);
+        if (index != -1 && cache->nodes[index].slot != -1) {
+            memcpy(cache->data[cache->nodes[index].slot], buffer, BUFFER_CACHE_BLOCK_BYTES);
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return bytes;
+}
+
+///
+/// Drops the cached copy of a block
+/// \param cache The cache
+/// \param block_id The block to forget
+///
+void buffer_cache_invalidate(buffer_cache_t *const cache, const size_t block_id) {
+    if (cache) {
+        pthread_mutex_lock(&cache->lock);
+        const int index = find_node(cache, block_id);
+        if (index != -1 && cache->nodes[index].slot != -1) {
+            drop_node(cache, index);
+        }
+        pthread_mutex_unlock(&cache->lock);
+    }
+}
+
+///
+/// Copies out the counters
+/// \param cache The cache
+/// \param stats Where to put them
+/// \return true on success, false on error
+///
+bool buffer_cache_get_stats(buffer_cache_t *const cache, buffer_cache_stats_t *const stats) {
+    if (cache == NULL || stats == NULL) {
+        return false;
+    }
+    pthread_mutex_lock(&cache->lock);
+    stats->hits = cache->hits;
+    stats->misses = cache->misses;
+    stats->evictions = cache->evictions;
+    stats->capacity = cache->capacity;
+    stats->resident = cache->lists[LIST_T1].size + cache->lists[LIST_T2].size;
+    pthread_mutex_unlock(&cache->lock);
+    return true;
+}
@@ -0,0 +1,115 @@
+#include <string.h>
+#include <pthread.h>
+#include "crc32c.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define CRC32C_X86 1
+#endif
+
+#define CRC32C_POLY 0x82f63b78u  // Castagnoli polynomial, bit reversed
+
+// table[0] is the usual byte-at-a-time table, table[k] advances a byte k more positions,
+// so eight bytes take eight lookups and no dependency between them
+static uint32_t table[8][256];
+static pthread_once_t table_once = PTHREAD_ONCE_INIT;
+
+static void build_table(void) {
+    for (uint32_t byte = 0; byte < 256; ++byte) {
+        uint32_t crc = byte;
+        for (int bit = 0; bit < 8; ++bit) {
+            crc = (crc >> 1) ^ (CRC32C_POLY & (0u - (crc & 1)));
+        }
+        table[0][byte] = crc;
+    }
+    for (uint32_t byte = 0; byte < 256; ++byte) {
+        for (int slice = 1; slice < 8; ++slice) {
+            table[slice][byte] = (table[slice - 1][byte] >> 8) ^ table[0][table[slice - 1][byte] & 0xff];
+        }
+    }
+}
+
+static uint32_t crc32c_slice8(uint32_t crc, const uint8_t *data, size_t length) {
+    while (length && ((uintptr_t) data & 7)) {
+        crc = (crc >> 8) ^ table[0][(crc ^ *data++) & 0xff];
+        --length;
+    }
+    while (length >= 8) {
+        uint32_t low;
+        uint32_t high;
+        memcpy(&low, data, 4);
+        memcpy(&high, data + 4, 4);
+        low ^= crc;
+        crc = table[7][low & 0xff] ^ table[6][(low >> 8) & 0xff] ^ table[5][(low >> 16) & 0xff] ^ table[4][low >> 24]
+              ^ table[3][high & 0xff] ^ table[2][(high >> 8) & 0xff] ^ table[1][(high >> 16) & 0xff] ^ table[0][high >> 24];
+        data += 8;
+        length -= 8;
+    }
+    while (length--) {
+        crc = (crc >> 8) ^ table[0][(crc ^ *data++) & 0xff];
+    }
+    return crc;
+}
+
+#ifdef CRC32C_X86
+__attribute__((target("sse4.2"))) static uint32_t crc32c_sse42(uint32_t crc, const uint8_t *data, size_t length) {
+    while (length && ((uintptr_t) data & 7)) {
+        crc = _mm_crc32_u8(crc, *data++);
+        --length;
+    }
+#ifdef __x86_64__
+    uint64_t wide = crc;
+    while (length >= 8) {
+        uint64_t word;
+        memcpy(&word, data, 8);
+        wide = _mm_crc32_u64(wide, word);
+        data += 8;
+        length -= 8;
+    }
+    crc = (uint32_t) wide;
+#endif
+    while (length >= 4) {
+        uint32_t word;
+        memcpy(&word, data, 4);
+        crc = _mm_crc32_u32(crc, word);
+        data += 4;
+        length -= 4;
+    }
+    while (length--) {
+        crc = _mm_crc32_u8(crc, *data++);
+    }
+    return crc;
+}
+#endif
+
+bool crc32c_hardware(void) {
+#ifdef CRC32C_X86
+    static int supported = -1;
+    int known = __atomic_load_n(&supported, __ATOMIC_RELAXED);
+    if (known < 0) {
+        __builtin_cpu_init();
+        known = __builtin_cpu_supports("sse4.2") ? 1 : 0;
+        __atomic_store_n(&supported, known, __ATOMIC_RELAXED);
+    }
+    return known;
+#else
+    return false;
+#endif
+}
+
+uint32_t crc32c_portable(uint32_t crc, const void *data, size_t length) {
+    if (data == NULL) {
+        return crc;
+    }
+    pthread_once(&table_once, build_table);
+    return ~crc32c_slice8(~crc, (const uint8_t *) data, length);
+}
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t length) {
+#ifdef CRC32C_X86
+    if (data && crc32c_hardware()) {
+        return ~crc32c_sse42(~crc, (const uint8_t *) data, length);
+    }
+#endif
+    return crc32c_portable(crc, data, length);
+}
@@ -0,0 +1,238 @@
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include "dedup.h"
+
+#define DEDUP_BLOCK_BYTES 512                  // Same as the block store's blocks
+#define DEDUP_SLOTS 65536                      // One per block the store can hold, power of 2
+#define DEDUP_PROBE 8                          // Slots looked at past the home slot
+#define DEDUP_ENTRY_BYTES 8
+#define DEDUP_ENTRIES_PER_BLOCK (DEDUP_BLOCK_BYTES / DEDUP_ENTRY_BYTES)
+#define DEDUP_INDEX_BLOCKS (DEDUP_SLOTS / DEDUP_ENTRIES_PER_BLOCK)  // 1024 extension blocks, 512KB
+
+#define XXH_PRIME1 0x9E3779B185EBCA87ull
+#define XXH_PRIME2 0xC2B2AE3D27D4EB4Full
+#define XXH_PRIME3 0x165667B19E3779F9ull
+#define XXH_PRIME4 0x85EBCA77C2B2AE63ull
+
+typedef struct {
+    uint32_t tag;    // Top half of the hash, the bottom half picked the slot
+    uint16_t block;  // 0 when empty (block 0 is never file data)
+    uint16_t unused;
+} dedup_entry_t;
+
+struct dedup {
+    block_store_t *bs;
+    buffer_cache_t *cache;
+    size_t first_ext_block;
+    pthread_mutex_t lock;
+    dedup_entry_t entries[DEDUP_SLOTS];
+    bool dirty[DEDUP_INDEX_BLOCKS];  // Index blocks changed since the last flush
+    dedup_stats_t stats;
+};
+
+static inline uint64_t rotl64(const uint64_t value, const int bits) {
+    return (value << bits) | (value >> (64 - bits));
+}
+
+static inline uint64_t xxh_round(uint64_t acc, const uint64_t input) {
+    acc += input * XXH_PRIME2;
+    return rotl64(acc, 31) * XXH_PRIME1;
+}
+
+static inline uint64_t xxh_merge(uint64_t acc, const uint64_t value) {
+    acc ^= xxh_round(0, value);
+    return acc * XXH_PRIME1 + XXH_PRIME4;
+}
+
+///
+/// Opens the index of a block store, loading it from the extension area
+/// \param bs BS device holding the blocks and the index
+/// \param cache Cache the blocks are read through when comparing
+/// \param first_ext_block Extension block the index starts at
+/// \return Pointer to the index, NULL on error
+///
+dedup_t *dedup_open(block_store_t *const bs, buffer_cache_t *const cache, const size_t first_ext_block) {
+    if (bs == NULL || cache == NULL || first_ext_block + DEDUP_INDEX_BLOCKS > block_store_get_ext_blocks()) {
+        return NULL;
+    }
+    dedup_t *dedup = (dedup_t *) calloc(1, sizeof(dedup_t));
+    if (dedup) {
+        dedup->bs = bs;
+        dedup->cache = cache;
+        dedup->first_ext_block = first_ext_block;
+        for (size_t i = 0; i < DEDUP_INDEX_BLOCKS; ++i) {
+            block_store_ext_read(bs, first_ext_block + i, &dedup->entries[i * DEDUP_ENTRIES_PER_BLOCK]);
+        }
+        pthread_mutex_init(&dedup->lock, NULL);
+    }
+    return dedup;
+}
+
+///
+/// Writes the index back and frees it
+/// \param dedup The index
+///
+void dedup_close(dedup_t *const dedup) {
+    if (dedup) {
+        dedup_flush(dedup);
+        pthread_mutex_destroy(&dedup->lock);
+        free(dedup);
+    }
+}
+
+///
+/// Writes the changed parts of the index back to the extension area and waits for them
+/// \param dedup The index
+/// \return true on success, false on error
+///
+bool dedup_flush(dedup_t *const dedup) {
+    if (dedup == NULL) {
+        return false;
+    }
+    size_t first = SIZE_MAX;
+    size_t last = 0;
+    pthread_mutex_lock(&dedup->lock);
+    for (size_t i = 0; i < DEDUP_INDEX_BLOCKS; ++i) {
+        if (dedup->dirty[i]) {
+            block_store_ext_write(dedup->bs, dedup->first_ext_block + i, &dedup->entries[i * DEDUP_ENTRIES_PER_BLOCK]);
+            dedup->dirty[i] = false;
+            first = first == SIZE_MAX ? i : first;
+            last = i;
+        }
+    }
+    pthread_mutex_unlock(&dedup->lock);
+    return first == SIZE_MAX || block_store_ext_flush(dedup->bs, dedup->first_ext_block + first, last + 1 - first);
+}
+
+///
+/// Returns the number of extension blocks the index takes
+/// \return Index blocks
+///
+size_t dedup_get_index_blocks() {
+    return DEDUP_INDEX_BLOCKS;
+}
+
+///
+/// Hashes a block, XXH64 with seed 0 (a block is a whole number of 32 byte stripes, so there is no tail)
+/// \param block The block's bytes
+/// \return 64-bit hash
+///
+uint64_t dedup_hash(const void *const block) {
+    const uint8_t *bytes = (const uint8_t *) block;
+    uint64_t v1 = XXH_PRIME1 + XXH_PRIME2;
+    uint64_t v2 = XXH_PRIME2;
+    uint64_t v3 = 0;
+    uint64_t v4 = 0 - XXH_PRIME1;
+    for (size_t offset = 0; offset < DEDUP_BLOCK_BYTES; offset += 32) {
+        uint64_t lanes[4];
+        memcpy(lanes, bytes + offset, sizeof(lanes));
+        v1 = xxh_round(v1, lanes[0]);
+        v2 = xxh_round(v2, lanes[1]);
+        v3 = xxh_round(v3, lanes[2]);
+        v4 = xxh_round(v4, lanes[3]);
+    }
+    uint64_t hash = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+    hash = xxh_merge(hash, v1);
+    hash = xxh_merge(hash, v2);
+    hash = xxh_merge(hash, v3);
+    hash = xxh_merge(hash, v4);
+    hash += DEDUP_BLOCK_BYTES;
+    hash ^= hash >> 33;
+    hash *= XXH_PRIME2;
+    hash ^= hash >> 29;
+    hash *= XXH_PRIME3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+///
+/// Finds a block already holding these bytes and adds the caller as an owner
+/// \param dedup The index
+/// \param hash dedup_hash of the bytes
+/// \param block The bytes
+/// \return The shared block, SIZE_MAX if there is none
+///
+size_t dedup_share(dedup_t *const dedup, const uint64_t hash, const void *const block) {
+    if (dedup == NULL || block == NULL) {
+        return SIZE_MAX;
+    }
+    // Candidates are picked under the lock, compared outside it
+    size_t candidates[DEDUP_PROBE];
+    size_t count = 0;
+    const uint32_t tag = (uint32_t)(hash >> 32);
+    pthread_mutex_lock(&dedup->lock);
+    dedup->stats.lookups++;
+    for (size_t probe = 0; probe < DEDUP_PROBE; ++probe) {
+        const dedup_entry_t *entry = &dedup->entries[(hash + probe) & (DEDUP_SLOTS - 1)];
+        if (entry->block != 0 && entry->tag == tag) {
+            candidates[count++] = entry->block;
+        }
+    }
+    pthread_mutex_unlock(&dedup->lock);
+    for (size_t i = 0; i < count; ++i) {
+        // Owned first, so nobody writes over it while (or after) it is compared
+        if (!block_store_share(dedup->bs, candidates[i])) {
+            continue;
+        }
+        uint8_t existing[DEDUP_BLOCK_BYTES];
+        if (buffer_cache_read_stream(dedup->cache, candidates[i], existing) == DEDUP_BLOCK_BYTES
+            && memcmp(existing, block, DEDUP_BLOCK_BYTES) == 0) {
+            __atomic_add_fetch(&dedup->stats.hits, 1, __ATOMIC_RELAXED);
+            return candidates[i];
+        }
+        block_store_release(dedup->bs, candidates[i]);
+    }
+    return SIZE_MAX;
+}
+
+///
+/// Indexes a data block just written, and marks it shareable
+/// \param dedup The index
+/// \param hash dedup_hash of what the block holds
+/// \param block_id The block
+/// \return true on success, false on error
+///
+bool dedup_insert(dedup_t *const dedup, const uint64_t hash, const size_t block_id) {
+    if (dedup == NULL || block_id == 0 || block_id >= block_store_get_total_blocks()
+        || !block_store_mark_shareable(dedup->bs, block_id)) {
+        return false;
+    }
+    const uint32_t tag = (uint32_t)(hash >> 32);
+    pthread_mutex_lock(&dedup->lock);
+    // An empty slot, or one whose block went away or was written over; failing that the home slot
+    size_t slot = hash & (DEDUP_SLOTS - 1);
+    for (size_t probe = 0; probe < DEDUP_PROBE; ++probe) {
+        const size_t candidate = (hash + probe) & (DEDUP_SLOTS - 1);
+        const dedup_entry_t *entry = &dedup->entries[candidate];
+        if (entry->block == 0 || entry->block == block_id || !block_store_is_shareable(dedup->bs, entry->block)) {
+            slot = candidate;
+            break;
+        }
+    }
+    dedup_entry_t *entry = &dedup->entries[slot];
+    if (entry->tag != tag || entry->block != block_id) {
+        entry->tag = tag;
+        entry->block = (uint16_t) block_id;
+        dedup->dirty[slot / DEDUP_ENTRIES_PER_BLOCK] = true;
+    }
+    dedup->stats.inserts++;
+    pthread_mutex_unlock(&dedup->lock);
+    return true;
+}
+
+///
+/// Copies out the lookup counters
+/// \param dedup The index
+/// \param stats Where to put them
+/// \return true on success, false on error
+///
+bool dedup_get_stats(dedup_t *const dedup, dedup_stats_t *const stats) {
+    if (dedup == NULL || stats == NULL) {
+        return false;
+    }
+    pthread_mutex_lock(&dedup->lock);
+    *stats = dedup->stats;
+    pthread_mutex_unlock(&dedup->lock);
+    return true;
+}
@@ -0,0 +1,69 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <F17FS.h>
+
+// Exit codes, the same ones fsck uses
+#define FSCK_CLEAN 0
+#define FSCK_REPAIRED 1
+#define FSCK_UNREPAIRED 4
+#define FSCK_ERROR 8
+
+static void usage(const char *name) {
+    fprintf(stderr, "usage: %s [-y] [-j threads] image\n", name);
+    fprintf(stderr, "  -y          repair what is found\n");
+    fprintf(stderr, "  -j threads  threads to check with (default: one per processor)\n");
+}
+
+int main(int argc, char **argv) {
+    bool repair = false;
+    size_t threads = 0;
+    const char *image = NULL;
+    for (int arg = 1; arg < argc; ++arg) {
+        if (strcmp(argv[arg], "-y") == 0) {
+            repair = true;
+        } else if (strcmp(argv[arg], "-j") == 0 && arg + 1 < argc) {
+            threads = (size_t) strtoul(argv[++arg], NULL, 10);
+        } else if (argv[arg][0] != '-' && image == NULL) {
+            image = argv[arg];
+        } else {
+            usage(argv[0]);
+            return FSCK_ERROR;
+        }
+    }
+    if (image == NULL) {
+        usage(argv[0]);
+        return FSCK_ERROR;
+    }
+
+    fs_fsck_report_t report;
+    int result = fs_fsck(image, repair, threads, &report);
+    if (result < 0) {
+        fprintf(stderr, "%s: cannot check %s\n", argv[0], image);
+        return FSCK_ERROR;
+    }
+    printf("%s: %zu inodes, %zu blocks in use\n", image, report.inodesChecked, report.blocksInUse);
+    if (result == 0) {
+        printf("%s: clean\n", image);
+        return FSCK_CLEAN;
+    }
+    printf("  leaked blocks:          %zu\n", report.leakedBlocks);
+    printf("  unmarked blocks:        %zu\n", report.unmarkedBlocks);
+    printf("  doubly allocated:       %zu\n", report.doubleAllocated);
+    printf("  bad pointers:           %zu\n", report.badPointers);
+    printf("  dangling entries:       %zu\n", report.danglingEntries);
+    printf("  orphan inodes:          %zu\n", report.orphanInodes);
+    printf("  link count errors:      %zu\n", report.linkCountErrors);
+    printf("  saved count errors:     %zu\n", report.countErrors);
+    printf("  reference count errors: %zu\n", report.refcountErrors);
+    if (repair) {
+        printf("%s: %zu problems repaired\n", image, report.repaired);
+        if (report.unrepaired > 0) {
+            printf("%s: %zu problems could not be repaired\n", image, report.unrepaired);
+            return FSCK_UNREPAIRED;
+        }
+        return FSCK_REPAIRED;
+    }
+    printf("%s: not repaired, run with -y to fix\n", image);
+    return FSCK_UNREPAIRED;
+}
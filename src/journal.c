@@ -0,0 +1,483 @@
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include "journal.h"
+
+#define JOURNAL_BLOCK_BYTES 512           // Same as the block store's blocks
+#define JOURNAL_LOG_BLOCKS 4096           // First 2MB of the extension area hold the log
+#define JOURNAL_MAX_BLOCKS 2048           // Block images one transaction holds, room for JOURNAL_OP_BLOCKS twice over
+#define JOURNAL_FBM_BLOCKS 16             // FBM blocks, logged whenever they changed
+#define JOURNAL_HASH_SLOTS 4096           // Open addressing table over the pending images, power of 2
+#define JOURNAL_TARGETS_PER_DESCRIPTOR 248
+#define JOURNAL_NUM_BLOCKS 65536          // Ids a target can take (addressable blocks, then the FBM)
+
+#define JOURNAL_HEADER_MAGIC 0x4C4E524Au      // "JRNL"
+#define JOURNAL_DESCRIPTOR_MAGIC 0x44584E54u  // "TNXD"
+#define JOURNAL_COMMIT_MAGIC 0x43584E54u      // "TNXC"
+#define JOURNAL_VERSION 1
+
+// Log layout: the header in extension block 0, then transactions back to back from block 1.
+// A transaction is one or more descriptor blocks, each followed by the images it lists,
+// and a commit block. Only a commit block with the right sequence and checksum makes it count.
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t sequence;  // Sequence of the first transaction expected at block 1
+    uint8_t padding[JOURNAL_BLOCK_BYTES - 16];
+} journal_header_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t count;
+    uint64_t sequence;
+    uint16_t targets[JOURNAL_TARGETS_PER_DESCRIPTOR];
+} journal_descriptor_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t blocks;
+    uint64_t sequence;
+    uint32_t checksum;  // Over every descriptor and image of the transaction
+    uint8_t padding[JOURNAL_BLOCK_BYTES - 20];
+} journal_commit_t;
+
+struct journal {
+    block_store_t *bs;
+    buffer_cache_t *cache;  // Home blocks are read and written through it when set
+    pthread_mutex_t lock;
+    size_t group_commit;
+    size_t pending_ops;
+    bool op_open;        // An operation has written since the last journal_end_op
+    uint64_t started;    // Monotonic ms of the running transaction's first change
+    uint64_t sequence;  // Sequence of the running transaction
+    size_t head;        // Next free log block
+    size_t count;       // Images in the running transaction
+    uint16_t targets[JOURNAL_MAX_BLOCKS + JOURNAL_FBM_BLOCKS];
+    uint8_t images[JOURNAL_MAX_BLOCKS + JOURNAL_FBM_BLOCKS][JOURNAL_BLOCK_BYTES];
+    int32_t slots[JOURNAL_HASH_SLOTS];  // Image index + 1, 0 when empty
+    size_t free_count;
+    uint16_t frees[JOURNAL_NUM_BLOCKS];  // Deferred until commit; a shared block is in here once per owner letting go
+    uint8_t fbm_logged[JOURNAL_FBM_BLOCKS][JOURNAL_BLOCK_BYTES];  // FBM as of the last commit
+    size_t replayed;
+    size_t commits;
+};
+
+static uint64_t monotonic_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000 + (uint64_t) now.tv_nsec / 1000000;
+}
+
+// FNV-1a, good enough to tell a torn transaction from a whole one
+static uint32_t checksum_block(uint32_t checksum, const void *const block) {
+    const uint8_t *bytes = (const uint8_t *) block;
+    for (size_t i = 0; i < JOURNAL_BLOCK_BYTES; ++i) {
+        checksum = (checksum ^ bytes[i]) * 16777619u;
+    }
+    return checksum;
+}
+
+static int32_t *find_slot(journal_t *const journal, const size_t block_id) {
+    size_t slot = (block_id * 2654435761u) & (JOURNAL_HASH_SLOTS - 1);
+    while (journal->slots[slot] && journal->targets[journal->slots[slot] - 1] != block_id) {
+        slot = (slot + 1) & (JOURNAL_HASH_SLOTS - 1);
+    }
+    return &journal->slots[slot];
+}
+
+static void home_write(journal_t *const journal, const size_t block_id, const void *const image) {
+    if (journal->cache) {
+        buffer_cache_write(journal->cache, block_id, image);
+    } else {
+        block_store_write(journal->bs, block_id, image);
+    }
+}
+
+// Puts an image back where it belongs, FBM images included
+static void write_home(journal_t *const journal, const size_t target, const void *const image) {
+    const size_t total = block_store_get_total_blocks();
+    if (target < total) {
+        home_write(journal, target, image);
+    } else {
+        block_store_write_fbm(journal->bs, target - total, image);
+    }
+}
+
+// Makes every home block durable so the log can start over
+static int checkpoint(journal_t *const journal) {
+    if (!block_store_flush(journal->bs)) {
+        return -1;
+    }
+    journal_header_t header = {JOURNAL_HEADER_MAGIC, JOURNAL_VERSION, journal->sequence, {0}};
+    block_store_ext_write(journal->bs, 0, &header);
+    if (!block_store_ext_flush(journal->bs, 0, 1)) {
+        return -1;
+    }
+    journal->head = 1;
+    return 0;
+}
+
+static int commit_locked(journal_t *const journal) {
+    if (journal->count == 0 && journal->free_count == 0) {
+        journal->pending_ops = 0;
+        return 0;
+    }
+    // Ordered data: file data goes straight to the block store, so it has to be durable before the
+    // metadata pointing at it is, or a replay could hand out pointers to whatever was there before
+    if (!block_store_flush(journal->bs)) {
+        return -1;
+    }
+    // Allocations went straight to the FBM, the blocks holding them ride along
+    const size_t total = block_store_get_total_blocks();
+    size_t count = journal->count;
+    for (size_t i = 0; i < JOURNAL_FBM_BLOCKS; ++i) {
+        block_store_read_fbm(journal->bs, i, journal->images[count]);
+        if (memcmp(journal->images[count], journal->fbm_logged[i], JOURNAL_BLOCK_BYTES) != 0) {
+            journal->targets[count++] = (uint16_t)(total + i);
+        }
+    }
+    const size_t descriptors = (count + JOURNAL_TARGETS_PER_DESCRIPTOR - 1) / JOURNAL_TARGETS_PER_DESCRIPTOR;
+    if (journal->head + descriptors + count + 1 > JOURNAL_LOG_BLOCKS && checkpoint(journal) < 0) {
+        return -1;
+    }
+
+    const size_t start = journal->head;
+    size_t head = start;
+    uint32_t checksum = 2166136261u;
+    for (size_t written = 0; written < count;) {
+        journal_descriptor_t descriptor;
+        memset(&descriptor, 0, sizeof(descriptor));
+        descriptor.magic = JOURNAL_DESCRIPTOR_MAGIC;
+        descriptor.sequence = journal->sequence;
+        descriptor.count = (uint32_t)(count - written < JOURNAL_TARGETS_PER_DESCRIPTOR ? count - written
+                                                                                        : JOURNAL_TARGETS_PER_DESCRIPTOR);
+        memcpy(descriptor.targets, journal->targets + written, descriptor.count * sizeof(uint16_t));
+        block_store_ext_write(journal->bs, head++, &descriptor);
+        checksum = checksum_block(checksum, &descriptor);
+        for (size_t i = 0; i < descriptor.count; ++i, ++written) {
+            block_store_ext_write(journal->bs, head++, journal->images[written]);
+            checksum = checksum_block(checksum, journal->images[written]);
+        }
+    }
+    journal_commit_t commit = {JOURNAL_COMMIT_MAGIC, (uint32_t) count, journal->sequence, checksum, {0}};
+    block_store_ext_write(journal->bs, head++, &commit);
+    // The one flush the whole batch waits on
+    if (!block_store_ext_flush(journal->bs, start, head - start)) {
+        return -1;
+    }
+    journal->head = head;
+
+    // Durable in the log, now the home blocks can change
+    for (size_t i = 0; i < count; ++i) {
+        if (journal->targets[i] < total) {
+            home_write(journal, journal->targets[i], journal->images[i]);
+        } else {
+            memcpy(journal->fbm_logged[journal->targets[i] - total], journal->images[i], JOURNAL_BLOCK_BYTES);
+        }
+    }
+    for (size_t i = 0; i < journal->free_count; ++i) {
+        block_store_release(journal->bs, journal->frees[i]);
+    }
+    memset(journal->slots, 0, sizeof(journal->slots));
+    journal->count = 0;
+    journal->free_count = 0;
+    journal->pending_ops = 0;
+    journal->sequence++;
+    journal->commits++;
+    return 0;
+}
+
+// Called with the lock held before a change joins the running transaction. An operation's first change
+// commits the batch first unless the whole operation is sure to fit behind it, so none spans two commits
+static int begin_change(journal_t *const journal) {
+    if (!journal->op_open && journal->count + JOURNAL_OP_BLOCKS > JOURNAL_MAX_BLOCKS && commit_locked(journal) < 0) {
+        return -1;
+    }
+    if (journal->count == 0 && journal->free_count == 0) {
+        journal->started = monotonic_ms();
+    }
+    journal->op_open = true;
+    return 0;
+}
+
+// Walks the transaction starting at a log block; returns the block after its commit, 0 if it isn't whole
+static size_t check_transaction(journal_t *const journal, const size_t start, const uint64_t sequence) {
+    uint32_t checksum = 2166136261u;
+    size_t blocks = 0;
+    size_t head = start;
+    uint8_t block[JOURNAL_BLOCK_BYTES];
+    while (head < JOURNAL_LOG_BLOCKS) {
+        block_store_ext_read(journal->bs, head++, block);
+        const journal_descriptor_t *descriptor = (const journal_descriptor_t *) block;
+        if (descriptor->magic == JOURNAL_COMMIT_MAGIC) {
+            const journal_commit_t *commit = (const journal_commit_t *) block;
+            if (commit->sequence == sequence && commit->blocks == blocks && commit->checksum == checksum) {
+                return head;
+            }
+            return 0;
+        }
+        if (descriptor->magic != JOURNAL_DESCRIPTOR_MAGIC || descriptor->sequence != sequence ||
+            descriptor->count > JOURNAL_TARGETS_PER_DESCRIPTOR) {
+            return 0;
+        }
+        checksum = checksum_block(checksum, block);
+        const size_t images = descriptor->count;
+        for (size_t i = 0; i < images && head < JOURNAL_LOG_BLOCKS; ++i) {
+            block_store_ext_read(journal->bs, head++, block);
+            checksum = checksum_block(checksum, block);
+        }
+        blocks += images;
+    }
+    return 0;
+}
+
+static void apply_transaction(journal_t *const journal, size_t head, const size_t end) {
+    journal_descriptor_t descriptor;
+    uint8_t image[JOURNAL_BLOCK_BYTES];
+    // The last block before end is the commit
+    while (head + 1 < end) {
+        block_store_ext_read(journal->bs, head++, &descriptor);
+        for (size_t i = 0; i < descriptor.count; ++i) {
+            block_store_ext_read(journal->bs, head++, image);
+            write_home(journal, descriptor.targets[i], image);
+        }
+    }
+}
+
+static int replay(journal_t *const journal) {
+    journal_header_t header;
+    block_store_ext_read(journal->bs, 0, &header);
+    if (header.magic != JOURNAL_HEADER_MAGIC || header.version != JOURNAL_VERSION) {
+        // Never journaled (or from before the journal), start a fresh log
+        journal->sequence = 1;
+        return checkpoint(journal);
+    }
+    journal->sequence = header.sequence;
+    size_t head = 1;
+    size_t end;
+    while ((end = check_transaction(journal, head, journal->sequence)) != 0) {
+        apply_transaction(journal, head, end);
+        head = end;
+        journal->sequence++;
+        journal->replayed++;
+    }
+    return checkpoint(journal);
+}
+
+///
+/// Opens the journal of a block store, replaying every committed transaction found in the log
+/// \param bs BS device the journal protects
+/// \param group_commit Operations batched into one commit, 0 commits every operation
+/// \return Pointer to the journal, NULL on error
+///
+journal_t *journal_open(block_store_t *const bs, const size_t group_commit) {
+    if (bs == NULL || block_store_get_ext_blocks() < JOURNAL_LOG_BLOCKS) {
+        return NULL;
+    }
+    journal_t *journal = (journal_t *) calloc(1, sizeof(journal_t));
+    if (journal) {
+        journal->bs = bs;
+        journal->group_commit = group_commit ? group_commit : 1;
+        if (replay(journal) == 0) {
+            for (size_t i = 0; i < JOURNAL_FBM_BLOCKS; ++i) {
+                block_store_read_fbm(bs, i, journal->fbm_logged[i]);
+            }
+            pthread_mutex_init(&journal->lock, NULL);
+            return journal;
+        }
+        free(journal);
+    }
+    return NULL;
+}
+
+///
+/// Commits whatever is pending, checkpoints the log and frees the journal
+/// \param journal The journal to close
+///
+void journal_close(journal_t *const journal) {
+    if (journal) {
+        commit_locked(journal);
+        checkpoint(journal);
+        pthread_mutex_destroy(&journal->lock);
+        free(journal);
+    }
+}
+
+///
+/// Routes the journal's home block reads and writes through a buffer cache
+/// \param journal The journal
+/// \param cache Cache over the journal's block store, NULL to go straight to the block store
+///
+void journal_set_cache(journal_t *const journal, buffer_cache_t *const cache) {
+    if (journal) {
+        pthread_mutex_lock(&journal->lock);
+        journal->cache = cache;
+        pthread_mutex_unlock(&journal->lock);
+    }
+}
+
+///
+/// Reads a block, as it will be once everything pending commits
+/// \param journal The journal
+/// \param block_id Source block id
+/// \param buffer Data buffer to write to
+/// \return Number of bytes read, 0 on error
+///
+size_t journal_read(journal_t *const journal, const size_t block_id, void *buffer) {
+    if (journal == NULL || buffer == NULL) {
+        return 0;
+    }
+    pthread_mutex_lock(&journal->lock);
+    size_t bytes;
+    const int32_t *slot = find_slot(journal, block_id);
+    if (*slot) {
+        memcpy(buffer, journal->images[*slot - 1], JOURNAL_BLOCK_BYTES);
+        bytes = JOURNAL_BLOCK_BYTES;
+    } else {
+        bytes = journal->cache ? buffer_cache_read(journal->cache, block_id, buffer)
+                               : block_store_read(journal->bs, block_id, buffer);
+    }
+    pthread_mutex_unlock(&journal->lock);
+    return bytes;
+}
+
+///
+/// Adds a new image of a block to the running transaction
+///  Fails, rather than commit half an operation, if the transaction is full (only an operation past JOURNAL_OP_BLOCKS fills it)
+/// \param journal The journal
+/// \param block_id Destination block id
+/// \param buffer Data buffer to read from
+/// \return Number of bytes written, 0 on error
+///
+size_t journal_write(journal_t *const journal, const size_t block_id, const void *buffer) {
+    if (journal == NULL || buffer == NULL || block_id >= block_store_get_total_blocks()) {
+        return 0;
+    }
+    pthread_mutex_lock(&journal->lock);
+    if (begin_change(journal) < 0) {
+        pthread_mutex_unlock(&journal->lock);
+        return 0;
+    }
+    int32_t *slot = find_slot(journal, block_id);
+    if (*slot == 0) {
+        // Only an operation going past JOURNAL_OP_BLOCKS gets here; committing now would split it
+        if (journal->count == JOURNAL_MAX_BLOCKS) {
+            pthread_mutex_unlock(&journal->lock);
+            return 0;
+        }
+        journal->targets[journal->count] = (uint16_t) block_id;
+        *slot = (int32_t) ++journal->count;
+    }
+    memcpy(journal->images[*slot - 1], buffer, JOURNAL_BLOCK_BYTES);
+    pthread_mutex_unlock(&journal->lock);
+    return JOURNAL_BLOCK_BYTES;
+}
+
+///
+/// Frees a block once the running transaction has committed
+/// \param journal The journal
+/// \param block_id The block to free
+///
+void journal_release(journal_t *const journal, const size_t block_id) {
+    if (journal && block_id < block_store_get_total_blocks()) {
+        pthread_mutex_lock(&journal->lock);
+        // Only a shared block freed by several owners could fill the list, commit rather than overrun it
+        if (journal->free_count == JOURNAL_NUM_BLOCKS) {
+            commit_locked(journal);
+        }
+        begin_change(journal);
+        journal->frees[journal->free_count++] = (uint16_t) block_id;
+        pthread_mutex_unlock(&journal->lock);
+    }
+}
+
+///
+/// Counts the frees of a block waiting for the running transaction to commit
+/// \param journal The journal
+/// \param block_id The block
+/// \return Pending frees of the block, 0 on error
+///
+size_t journal_get_releases(journal_t *const journal, const size_t block_id) {
+    size_t releases = 0;
+    if (journal) {
+        pthread_mutex_lock(&journal->lock);
+        for (size_t i = 0; i < journal->free_count; ++i) {
+            releases += journal->frees[i] == block_id;
+        }
+        pthread_mutex_unlock(&journal->lock);
+    }
+    return releases;
+}
+
+///
+/// Marks the end of one operation, committing when enough have been batched
+/// \param journal The journal
+/// \return 0 on success, < 0 if a commit was due and failed
+///
+int journal_end_op(journal_t *const journal) {
+    if (journal == NULL) {
+        return -1;
+    }
+    int result = 0;
+    pthread_mutex_lock(&journal->lock);
+    journal->op_open = false;
+    if (++journal->pending_ops >= journal->group_commit) {
+        result = commit_locked(journal);
+    }
+    pthread_mutex_unlock(&journal->lock);
+    return result;
+}
+
+///
+/// Commits the running transaction right away
+/// \param journal The journal
+/// \return 0 once everything written so far is durable, < 0 on error
+///
+int journal_commit(journal_t *const journal) {
+    if (journal == NULL) {
+        return -1;
+    }
+    pthread_mutex_lock(&journal->lock);
+    int result = commit_locked(journal);
+    pthread_mutex_unlock(&journal->lock);
+    return result;
+}
+
+///
+/// Commits the running transaction if it has been open for long enough and no operation is halfway through it
+/// \param journal The journal
+/// \param expire_ms Age in milliseconds the transaction must have reached
+/// \return 1 if it committed, 0 if nothing was due, < 0 on error
+///
+int journal_commit_expired(journal_t *const journal, const uint64_t expire_ms) {
+    if (journal == NULL) {
+        return -1;
+    }
+    int result = 0;
+    pthread_mutex_lock(&journal->lock);
+    if ((journal->count || journal->free_count) && !journal->op_open &&
+        monotonic_ms() - journal->started >= expire_ms) {
+        result = commit_locked(journal) < 0 ? -1 : 1;
+    }
+    pthread_mutex_unlock(&journal->lock);
+    return result;
+}
+
+///
+/// Returns the number of transactions replayed when the journal was opened
+/// \param journal The journal
+/// \return Transactions replayed, SIZE_MAX on error
+///
+size_t journal_get_replayed(const journal_t *const journal) {
+    return journal ? journal->replayed : SIZE_MAX;
+}
+
+///
+/// Returns the number of commits (log flushes) made since the journal was opened
+/// \param journal The journal
+/// \return Commits made, SIZE_MAX on error
+///
+size_t journal_get_commits(const journal_t *const journal) {
+    return journal ? journal->commits : SIZE_MAX;
+}
@@ -0,0 +1,164 @@
+#include <string.h>
+#include "lz.h"
+
+#define LZ_MIN_MATCH 4
+#define LZ_LAST_LITERALS 5   // The block always ends with at least this many literals
+#define LZ_MATCH_LIMIT 12    // No match starts this close to the end
+#define LZ_HASH_BITS 12
+#define LZ_MAX_OFFSET 65535
+
+static inline uint32_t read32(const uint8_t *p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline uint32_t hash32(const uint32_t sequence) {
+    return (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// Writes the 255-runs that follow a length nibble of 15, false if they don't fit
+static inline int put_length(uint8_t **out, const uint8_t *end, size_t length) {
+    while (length >= 255) {
+        if (*out >= end) {
+            return 0;
+        }
+        *(*out)++ = 255;
+        length -= 255;
+    }
+    if (*out >= end) {
+        return 0;
+    }
+    *(*out)++ = (uint8_t) length;
+    return 1;
+}
+
+// One sequence: token, literals, then (unless it's the last one) offset and match length
+static int put_sequence(uint8_t **out, const uint8_t *end, const uint8_t *literals, size_t literal_length,
+                        size_t offset, size_t match_length) {
+    if (*out >= end) {
+        return 0;
+    }
+    uint8_t *token = (*out)++;
+    *token = (uint8_t)((literal_length >= 15 ? 15 : literal_length) << 4);
+    if (literal_length >= 15 && !put_length(out, end, literal_length - 15)) {
+        return 0;
+    }
+    if ((size_t)(end - *out) < literal_length) {
+        return 0;
+    }
+    memcpy(*out, literals, literal_length);
+    *out += literal_length;
+    if (match_length == 0) {
+        return 1;
+    }
+    if (end - *out < 2) {
+        return 0;
+    }
+    *(*out)++ = (uint8_t)(offset & 0xff);
+    *(*out)++ = (uint8_t)(offset >> 8);
+    match_length -= LZ_MIN_MATCH;
+    *token |= (uint8_t)(match_length >= 15 ? 15 : match_length);
+    return match_length < 15 || put_length(out, end, match_length - 15);
+}
+
+size_t lz_compress(const void *src, size_t length, void *dst, size_t capacity) {
+    if (src == NULL || dst == NULL || length > LZ_MAX_INPUT) {
+        return 0;
+    }
+    const uint8_t *in = (const uint8_t *) src;
+    uint8_t *out = (uint8_t *) dst;
+    const uint8_t *end = out + capacity;
+    // Positions plus one, 0 means empty
+    uint16_t table[1 << LZ_HASH_BITS];
+    memset(table, 0, sizeof(table));
+    size_t position = 0;
+    size_t anchor = 0;
+    if (length > LZ_MATCH_LIMIT) {
+        const size_t limit = length - LZ_MATCH_LIMIT;
+        while (position < limit) {
+            const uint32_t sequence = read32(in + position);
+            const uint32_t slot = hash32(sequence);
+            const size_t candidate = table[slot];
+            table[slot] = (uint16_t)(position + 1);
+            if (candidate == 0 || position - (candidate - 1) > LZ_MAX_OFFSET || read32(in + candidate - 1) != sequence) {
+                ++position;
+                continue;
+            }
+            const size_t reference = candidate - 1;
+            size_t match_length = LZ_MIN_MATCH;
+            while (position + match_length < length - LZ_LAST_LITERALS && in[reference + match_length] == in[position + match_length]) {
+                ++match_length;
+            }
+            if (!put_sequence(&out, end, in + anchor, position - anchor, position - reference, match_length)) {
+                return 0;
+            }
+            position += match_length;
+            anchor = position;
+        }
+    }
+    if (!put_sequence(&out, end, in + anchor, length - anchor, 0, 0)) {
+        return 0;
+    }
+    return (size_t)(out - (uint8_t *) dst);
+}
+
+// Reads the 255-runs after a length nibble of 15
+static inline int get_length(const uint8_t **in, const uint8_t *end, size_t *length) {
+    uint8_t byte;
+    do {
+        if (*in >= end) {
+            return 0;
+        }
+        byte = *(*in)++;
+        *length += byte;
+    } while (byte == 255);
+    return 1;
+}
+
+size_t lz_decompress(const void *src, size_t length, void *dst, size_t capacity) {
+    if (src == NULL || dst == NULL) {
+        return SIZE_MAX;
+    }
+    const uint8_t *in = (const uint8_t *) src;
+    const uint8_t *in_end = in + length;
+    uint8_t *out = (uint8_t *) dst;
+    uint8_t *const out_start = out;
+    const uint8_t *out_end = out + capacity;
+    while (in < in_end) {
+        const uint8_t token = *in++;
+        size_t literal_length = token >> 4;
+        if (literal_length == 15 && !get_length(&in, in_end, &literal_length)) {
+            return SIZE_MAX;
+        }
+        if ((size_t)(in_end - in) < literal_length || (size_t)(out_end - out) < literal_length) {
+            return SIZE_MAX;
+        }
+        memcpy(out, in, literal_length);
+        in += literal_length;
+        out += literal_length;
+        if (in == in_end) {
+            break;  // The last sequence has no match
+        }
+        if (in_end - in < 2) {
+            return SIZE_MAX;
+        }
+        const size_t offset = (size_t) in[0] | (size_t) in[1] << 8;
+        in += 2;
+        size_t match_length = token & 0x0f;
+        if (match_length == 15 && !get_length(&in, in_end, &match_length)) {
+            return SIZE_MAX;
+        }
+        match_length += LZ_MIN_MATCH;
+        if (offset == 0 || offset > (size_t)(out - out_start) || (size_t)(out_end - out) < match_length) {
+            return SIZE_MAX;
+        }
+        // Byte by byte: a match may overlap what it is producing (runs)
+        const uint8_t *match = out - offset;
+        for (size_t i = 0; i < match_length; ++i) {
+            out[i] = match[i];
+        }
+        out += match_length;
+    }
+    return (size_t)(out - out_start);
+}
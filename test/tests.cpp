@@ -1,12 +1,25 @@
 #include <cstdlib>
 #include <iostream>
+#include <chrono>
 #include <new>
+#include <thread>
 #include <vector>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <unistd.h>
 using std::vector;
 using std::string;
 #include <gtest/gtest.h>
 extern "C" {
 #include "F17FS.h"
+#include "bitmap.h"
+#include "buffer_cache.h"
+#include "crc32c.h"
+#include "dedup.h"
+#include "journal.h"
+#include "lz.h"
 }
 
 unsigned int score;
@@ -371,11 +384,17 @@ TEST(c_tests, open_close_file) {
     fs_unmount(fs);
     fs = fs_mount(test_fname);
     ASSERT_NE(fs, nullptr);
-    for (int i = 0; i < 256; ++i) {
-        fd_array[i] = fs_open(fs, filenames[0]);
+    // The table grows past the first 256 descriptors, all the way to FS_FD_MAX
+    for (int i = 0; i < FS_FD_MAX; ++i) {
+        ASSERT_GE(fs_open(fs, filenames[0]), 0);
     }
     int err = fs_open(fs, filenames[0]);
     ASSERT_LT(err, 0);
+    // Closing any descriptor makes exactly one available again
+    ASSERT_EQ(fs_close(fs, 7583), 0);
+    ASSERT_EQ(fs_open(fs, filenames[0]), 7583);
+    ASSERT_LT(fs_open(fs, filenames[0]), 0);
+    ASSERT_LT(fs_close(fs, FS_FD_MAX), 0);
     fs_unmount(fs);
     score += 20;
 }
@@ -644,7 +663,7 @@ TEST(e_tests, remove_file) {
                     "more/bad_req",
             "/folder/withfilethatiswayyyyytoolongwhydoyoumakefilesthataretoobigEXACT!", "/", "/mystery_file"};
     vector<const char *> a_fnames{"/file_a", "/file_b", "/file_c", "/file_d"};
-    const char *(test_fname[2]) = {"e_tests_a.F17FS", "e_tests_b.F17FS"};
+    const char *test_fname[2] = {"e_tests_a.F17FS", "e_tests_b.F17FS"};
     ASSERT_EQ(system("cp d_tests_full.F17FS e_tests_a.F17FS"), 0);
     ASSERT_EQ(system("cp c_tests.F17FS e_tests_b.F17FS"), 0);
     F17FS *fs = fs_mount(test_fname[1]);
@@ -824,162 +843,2602 @@ TEST(h_tests, read) {
     score += 20;
 }
 
-//#ifdef GRAD_TESTS
-///*
-//   int fs_move(F17FS *fs, const char *src, const char *dst);
-//   1. Normal, file, one dir to another (check descriptor)
-//   2. Normal, directory
-//   3. Normal, Rename of file where the directory is full
-//   4. Error, dst exists
-//   5. Error, dst parent does not exist
-//   6. Error, dst parent full
-//   7. Error, src does not exist
-//   8. ?????, src = dst
-//   9. Error, FS null
-//   10. Error, src null
-//   11. Error, src is root
-//   12. Error, dst NULL
-//   13. Error, dst root?
-//   14. Error, Directory into itself
-//   */
-//TEST(i_tests, move) {
-//    vector<const char *> fnames{
-//            "/file", "/folder", "/folder/with_file", "/folder/with_folder", "/DOESNOTEXIST", "/file/BAD_REQUEST",
-//            "/DOESNOTEXIST/with_file", "/folder/with_file/bad_req", "folder/missing_slash", "/folder/new_folder/",
-//            "/folder/withwaytoolongfilenamethattakesupmorespacethanitshould and yet was not enough so I had to add "
-//                    "more/bad_req",
-//            "/folder/withfilethatiswayyyyytoolongwhydoyoumakefilesthataretoobigEXACT!", "/", "/mystery_file"};
-//    const char *test_fname = "g_tests.F17FS";
-//    ASSERT_EQ(system("cp c_tests.F17FS g_tests.F17FS"), 0);
-//    F17FS *fs = fs_mount(test_fname);
-//    ASSERT_NE(fs, nullptr);
-//    int fd = fs_open(fs, fnames[0]);
-//    // FS_MOVE 1
-//    dyn_array_t *record_results = NULL;
-//    ASSERT_EQ(fs_move(fs, fnames[0], "/folder/new_location"), 0);
-//    record_results = fs_get_dir(fs, fnames[1]);
-//    ASSERT_NE(record_results, nullptr);
-//    ASSERT_TRUE(find_in_directory(record_results, "with_file"));
-//    ASSERT_TRUE(find_in_directory(record_results, "with_folder"));
-//    ASSERT_TRUE(find_in_directory(record_results, "new_location"));
-//    ASSERT_EQ(dyn_array_size(record_results), (size_t)3);
-//    dyn_array_destroy(record_results);
-//    record_results = fs_get_dir(fs, "/");
-//    ASSERT_NE(record_results, nullptr);
-//    ASSERT_TRUE(find_in_directory(record_results, "folder"));
-//    ASSERT_EQ(dyn_array_size(record_results), (size_t)1);
-//    dyn_array_destroy(record_results);
-//    // Descriptor still functional?
-//    ASSERT_EQ(fs_write(fs, fd, test_fname, 14), 14);
-//    // FS_MOVE 2
-//    ASSERT_EQ(fs_move(fs, fnames[3], "/with_folder"), 0);
-//    record_results = fs_get_dir(fs, "/");
-//    ASSERT_NE(record_results, nullptr);
-//    ASSERT_TRUE(find_in_directory(record_results, "folder"));
-//    ASSERT_TRUE(find_in_directory(record_results, "with_folder"));
-//    ASSERT_EQ(dyn_array_size(record_results), (size_t)2);
-//    dyn_array_destroy(record_results);
-//    record_results = fs_get_dir(fs, fnames[1]);
-//    ASSERT_NE(record_results, nullptr);
-//    ASSERT_TRUE(find_in_directory(record_results, "with_file"));
-//    ASSERT_TRUE(find_in_directory(record_results, "new_location"));
-//    ASSERT_EQ(dyn_array_size(record_results), (size_t)2);
-//    dyn_array_destroy(record_results);
-//    // FS_MOVE 4
-//    ASSERT_LT(fs_move(fs, "/folder/new_location", fnames[1]), 0);
-//    record_results = fs_get_dir(fs, "/");
-//    ASSERT_NE(record_results, nullptr);
-//    ASSERT_TRUE(find_in_directory(record_results, "folder"));
-//    ASSERT_TRUE(find_in_directory(record_results, "with_folder"));
-//    ASSERT_EQ(dyn_array_size(record_results), (size_t)2);
-//    dyn_array_destroy(record_results);
-//    record_results = fs_get_dir(fs, fnames[1]);
-//    ASSERT_NE(record_results, nullptr);
-//    ASSERT_TRUE(find_in_directory(record_results, "with_file"));
-//    ASSERT_TRUE(find_in_directory(record_results, "new_location"));
-//    ASSERT_EQ(dyn_array_size(record_results), (size_t)2);
-//    dyn_array_destroy(record_results);
-//    // FS_MOVE 5
-//    ASSERT_LT(fs_move(fs, "/folder/new_location", "/folder/noooope/new_location"), 0);
-//    record_results = fs_get_dir(fs, "/");
-//    ASSERT_NE(record_results, nullptr);
-//    ASSERT_TRUE(find_in_directory(record_results, "folder"));
-//    ASSERT_TRUE(find_in_directory(record_results, "with_folder"));
-//    ASSERT_EQ(dyn_array_size(record_results), (size_t)2);
-//    dyn_array_destroy(record_results);
-//    record_results = fs_get_dir(fs, fnames[1]);
-//    ASSERT_NE(record_results, nullptr);
-//    ASSERT_TRUE(find_in_directory(record_results, "with_file"));
-//    ASSERT_TRUE(find_in_directory(record_results, "new_location"));
-//    ASSERT_EQ(dyn_array_size(record_results), (size_t)2);
-//    dyn_array_destroy(record_results);
-//    // FS_MOVE 7
-//    ASSERT_LT(fs_move(fs, "/folder/DNE", "/folder/also_DNE"), 0);
-//    record_results = fs_get_dir(fs, "/");
-//    ASSERT_NE(record_results, nullptr);
-//    ASSERT_TRUE(find_in_directory(record_results, "folder"));
-//    ASSERT_TRUE(find_in_directory(record_results, "with_folder"));
-//    ASSERT_EQ(dyn_array_size(record_results), (size_t)2);
-//    dyn_array_destroy(record_results);
-//    record_results = fs_get_dir(fs, fnames[1]);
-//    ASSERT_NE(record_results, nullptr);
-//    ASSERT_TRUE(find_in_directory(record_results, "with_file"));
-//    ASSERT_TRUE(find_in_directory(record_results, "new_location"));
-//    ASSERT_EQ(dyn_array_size(record_results), (size_t)2);
-//    dyn_array_destroy(record_results);
-//    // FS_MOVE 8
-//    // this one is just weird, so... skipping
-//    // FS_MOVE 9
-//    ASSERT_LT(fs_move(NULL, "/folder/DNE", "/folder/also_DNE"), 0);
-//    // FS_MOVE 10
-//    ASSERT_LT(fs_move(fs, NULL, "/folder/also_DNE"), 0);
-//    // FS_MOVE 11
-//    ASSERT_LT(fs_move(fs, "/", "/folder/root_maybe"), 0);
-//    // FS_MOVE 12
-//    ASSERT_LT(fs_move(fs, "/folder/new_location", NULL), 0);
-//    // FS_MOVE 13
-//    ASSERT_LT(fs_move(fs, "/folder/new_location", "/"), 0);
-//    // FS_MOVE 14
-//    ASSERT_LT(fs_move(fs,"/folder","/folder/oh_no"),0);
-//    // Things still working after all that ?
-//    record_results = fs_get_dir(fs, "/");
-//    ASSERT_NE(record_results, nullptr);
-//    ASSERT_TRUE(find_in_directory(record_results, "folder"));
-//    ASSERT_TRUE(find_in_directory(record_results, "with_folder"));
-//    ASSERT_EQ(dyn_array_size(record_results), (size_t)2);
-//    dyn_array_destroy(record_results);
-//    record_results = fs_get_dir(fs, fnames[1]);
-//    ASSERT_NE(record_results, nullptr);
-//    ASSERT_TRUE(find_in_directory(record_results, "with_file"));
-//    ASSERT_TRUE(find_in_directory(record_results, "new_location"));
-//    ASSERT_EQ(dyn_array_size(record_results), (size_t) 2);
-//    dyn_array_destroy(record_results);
-//    fs_unmount(fs);
-//    score += 15;
-//}
-///*
-//   int fs_link(F17FS *fs, const char *src, const char *dst);
-//   Finish this part, get 20 points!
-//
-//   1. Normal, file, make a link next to it
-//   2. Normal, directory, link next to it
-//   3. Normal, OH BOY, directory will contain itself (check that /folder/itself/itself/itself/itself/with_file exists)
-//   4. Normal, file, wite to hardlink, read the new data from fd to original file
-//   5. Normal, file, delete hardlinked file, make sure original still works
-//   6. Normal, directory, delete a hardlink directory that has contents!
-//   7. Error, dst exists
-//   8. Error, dst parent does not exist
-//   9. Error, dst parent full
-//   10. Error, src does not exist
-//   11. Error, FS null
-//   12. Error, src null
-//   13. Error, dst null
-//   14. Error, dst root
-//   */
-/*TEST(j_tests, link) {
-
-  }*/
-//#endif
+#if GRAD_TESTS
+/*
+   int fs_move(F17FS *fs, const char *src, const char *dst);
+   1. Normal, file, one dir to another (check descriptor)
+   2. Normal, directory
+   3. Normal, Rename of file where the directory is full
+   4. Error, dst exists
+   5. Error, dst parent does not exist
+   6. Error, dst parent full
+   7. Error, src does not exist
+   8. ?????, src = dst
+   9. Error, FS null
+   10. Error, src null
+   11. Error, src is root
+   12. Error, dst NULL
+   13. Error, dst root?
+   14. Error, Directory into itself
+   */
+TEST(i_tests, move) {
+    vector<const char *> fnames{
+            "/file", "/folder", "/folder/with_file", "/folder/with_folder", "/DOESNOTEXIST", "/file/BAD_REQUEST",
+            "/DOESNOTEXIST/with_file", "/folder/with_file/bad_req", "folder/missing_slash", "/folder/new_folder/",
+            "/folder/withwaytoolongfilenamethattakesupmorespacethanitshould and yet was not enough so I had to add "
+                    "more/bad_req",
+            "/folder/withfilethatiswayyyyytoolongwhydoyoumakefilesthataretoobigEXACT!", "/", "/mystery_file"};
+    const char *test_fname = "g_tests.F17FS";
+    ASSERT_EQ(system("cp c_tests.F17FS g_tests.F17FS"), 0);
+    F17FS *fs = fs_mount(test_fname);
+    ASSERT_NE(fs, nullptr);
+    int fd = fs_open(fs, fnames[0]);
+    // FS_MOVE 1
+    dyn_array_t *record_results = NULL;
+    ASSERT_EQ(fs_move(fs, fnames[0], "/folder/new_location"), 0);
+    record_results = fs_get_dir(fs, fnames[1]);
+    ASSERT_NE(record_results, nullptr);
+    ASSERT_TRUE(find_in_directory(record_results, "with_file"));
+    ASSERT_TRUE(find_in_directory(record_results, "with_folder"));
+    ASSERT_TRUE(find_in_directory(record_results, "new_location"));
+    ASSERT_EQ(dyn_array_size(record_results), (size_t)3);
+    dyn_array_destroy(record_results);
+    record_results = fs_get_dir(fs, "/");
+    ASSERT_NE(record_results, nullptr);
+    ASSERT_TRUE(find_in_directory(record_results, "folder"));
+    ASSERT_EQ(dyn_array_size(record_results), (size_t)1);
+    dyn_array_destroy(record_results);
+    // Descriptor still functional?
+    ASSERT_EQ(fs_write(fs, fd, test_fname, 14), 14);
+    // FS_MOVE 2
+    ASSERT_EQ(fs_move(fs, fnames[3], "/with_folder"), 0);
+    record_results = fs_get_dir(fs, "/");
+    ASSERT_NE(record_results, nullptr);
+    ASSERT_TRUE(find_in_directory(record_results, "folder"));
+    ASSERT_TRUE(find_in_directory(record_results, "with_folder"));
+    ASSERT_EQ(dyn_array_size(record_results), (size_t)2);
+    dyn_array_destroy(record_results);
+    record_results = fs_get_dir(fs, fnames[1]);
+    ASSERT_NE(record_results, nullptr);
+    ASSERT_TRUE(find_in_directory(record_results, "with_file"));
+    ASSERT_TRUE(find_in_directory(record_results, "new_location"));
+    ASSERT_EQ(dyn_array_size(record_results), (size_t)2);
+    dyn_array_destroy(record_results);
+    // FS_MOVE 4
+    ASSERT_LT(fs_move(fs, "/folder/new_location", fnames[1]), 0);
+    record_results = fs_get_dir(fs, "/");
+    ASSERT_NE(record_results, nullptr);
+    ASSERT_TRUE(find_in_directory(record_results, "folder"));
+    ASSERT_TRUE(find_in_directory(record_results, "with_folder"));
+    ASSERT_EQ(dyn_array_size(record_results), (size_t)2);
+    dyn_array_destroy(record_results);
+    record_results = fs_get_dir(fs, fnames[1]);
+    ASSERT_NE(record_results, nullptr);
+    ASSERT_TRUE(find_in_directory(record_results, "with_file"));
+    ASSERT_TRUE(find_in_directory(record_results, "new_location"));
+    ASSERT_EQ(dyn_array_size(record_results), (size_t)2);
+    dyn_array_destroy(record_results);
+    // FS_MOVE 5
+    ASSERT_LT(fs_move(fs, "/folder/new_location", "/folder/noooope/new_location"), 0);
+    record_results = fs_get_dir(fs, "/");
+    ASSERT_NE(record_results, nullptr);
+    ASSERT_TRUE(find_in_directory(record_results, "folder"));
+    ASSERT_TRUE(find_in_directory(record_results, "with_folder"));
+    ASSERT_EQ(dyn_array_size(record_results), (size_t)2);
+    dyn_array_destroy(record_results);
+    record_results = fs_get_dir(fs, fnames[1]);
+    ASSERT_NE(record_results, nullptr);
+    ASSERT_TRUE(find_in_directory(record_results, "with_file"));
+    ASSERT_TRUE(find_in_directory(record_results, "new_location"));
+    ASSERT_EQ(dyn_array_size(record_results), (size_t)2);
+    dyn_array_destroy(record_results);
+    // FS_MOVE 7
+    ASSERT_LT(fs_move(fs, "/folder/DNE", "/folder/also_DNE"), 0);
+    record_results = fs_get_dir(fs, "/");
+    ASSERT_NE(record_results, nullptr);
+    ASSERT_TRUE(find_in_directory(record_results, "folder"));
+    ASSERT_TRUE(find_in_directory(record_results, "with_folder"));
+    ASSERT_EQ(dyn_array_size(record_results), (size_t)2);
+    dyn_array_destroy(record_results);
+    record_results = fs_get_dir(fs, fnames[1]);
+    ASSERT_NE(record_results, nullptr);
+    ASSERT_TRUE(find_in_directory(record_results, "with_file"));
+    ASSERT_TRUE(find_in_directory(record_results, "new_location"));
+    ASSERT_EQ(dyn_array_size(record_results), (size_t)2);
+    dyn_array_destroy(record_results);
+    // FS_MOVE 8
+    // this one is just weird, so... skipping
+    // FS_MOVE 9
+    ASSERT_LT(fs_move(NULL, "/folder/DNE", "/folder/also_DNE"), 0);
+    // FS_MOVE 10
+    ASSERT_LT(fs_move(fs, NULL, "/folder/also_DNE"), 0);
+    // FS_MOVE 11
+    ASSERT_LT(fs_move(fs, "/", "/folder/root_maybe"), 0);
+    // FS_MOVE 12
+    ASSERT_LT(fs_move(fs, "/folder/new_location", NULL), 0);
+    // FS_MOVE 13
+    ASSERT_LT(fs_move(fs, "/folder/new_location", "/"), 0);
+    // FS_MOVE 14
+    ASSERT_LT(fs_move(fs,"/folder","/folder/oh_no"),0);
+    // Things still working after all that ?
+    record_results = fs_get_dir(fs, "/");
+    ASSERT_NE(record_results, nullptr);
+    ASSERT_TRUE(find_in_directory(record_results, "folder"));
+    ASSERT_TRUE(find_in_directory(record_results, "with_folder"));
+    ASSERT_EQ(dyn_array_size(record_results), (size_t)2);
+    dyn_array_destroy(record_results);
+    record_results = fs_get_dir(fs, fnames[1]);
+    ASSERT_NE(record_results, nullptr);
+    ASSERT_TRUE(find_in_directory(record_results, "with_file"));
+    ASSERT_TRUE(find_in_directory(record_results, "new_location"));
+    ASSERT_EQ(dyn_array_size(record_results), (size_t) 2);
+    dyn_array_destroy(record_results);
+    fs_unmount(fs);
+    score += 15;
+}
+/*
+   int fs_link(F17FS *fs, const char *src, const char *dst);
+   1. Normal, file, make a link next to it
+   2. Normal, directory, link next to it
+   3. Normal, OH BOY, directory will contain itself (check that /folder/itself/itself/itself/itself/with_file exists)
+   4. Normal, file, wite to hardlink, read the new data from fd to original file
+   5. Normal, file, delete hardlinked file, make sure original still works
+   6. Normal, directory, delete a hardlink directory that has contents!
+   7. Error, dst exists
+   8. Error, dst parent does not exist
+   9. Error, dst parent full
+   10. Error, src does not exist
+   11. Error, FS null
+   12. Error, src null
+   13. Error, dst null
+   14. Error, dst root
+   15. Normal, removing the last name reclaims the inode and closes its descriptors
+   */
+TEST(j_tests, link) {
+    const char *test_fname = "j_tests.F17FS";
+    ASSERT_EQ(system("cp c_tests.F17FS j_tests.F17FS"), 0);
+    F17FS *fs = fs_mount(test_fname);
+    ASSERT_NE(fs, nullptr);
+    dyn_array_t *record_results = NULL;
+    // FS_LINK 1
+    ASSERT_EQ(fs_link(fs, "/file", "/file_link"), 0);
+    record_results = fs_get_dir(fs, "/");
+    ASSERT_NE(record_results, nullptr);
+    ASSERT_TRUE(find_in_directory(record_results, "file"));
+    ASSERT_TRUE(find_in_directory(record_results, "file_link"));
+    ASSERT_EQ(dyn_array_size(record_results), (size_t) 3);
+    dyn_array_destroy(record_results);
+    // FS_LINK 2
+    ASSERT_EQ(fs_link(fs, "/folder", "/folder_link"), 0);
+    record_results = fs_get_dir(fs, "/folder_link");
+    ASSERT_NE(record_results, nullptr);
+    ASSERT_TRUE(find_in_directory(record_results, "with_file"));
+    ASSERT_TRUE(find_in_directory(record_results, "with_folder"));
+    ASSERT_EQ(dyn_array_size(record_results), (size_t) 2);
+    dyn_array_destroy(record_results);
+    // FS_LINK 3
+    ASSERT_EQ(fs_link(fs, "/folder", "/folder/itself"), 0);
+    int fd = fs_open(fs, "/folder/itself/itself/itself/itself/with_file");
+    ASSERT_GE(fd, 0);
+    ASSERT_EQ(fs_close(fs, fd), 0);
+    // FS_LINK 4
+    int link_fd = fs_open(fs, "/file_link");
+    ASSERT_GE(link_fd, 0);
+    fd = fs_open(fs, "/file");
+    ASSERT_GE(fd, 0);
+    ASSERT_EQ(fs_write(fs, link_fd, "hello", 5), 5);
+    char buffer[5];
+    ASSERT_EQ(fs_read(fs, fd, buffer, 5), 5);
+    ASSERT_EQ(memcmp(buffer, "hello", 5), 0);
+    // FS_LINK 5
+    ASSERT_EQ(fs_remove(fs, "/file"), 0);
+    ASSERT_LT(fs_open(fs, "/file"), 0);
+    ASSERT_EQ(fs_seek(fs, fd, 0, FS_SEEK_SET), 0);
+    ASSERT_EQ(fs_read(fs, fd, buffer, 5), 5);
+    ASSERT_EQ(memcmp(buffer, "hello", 5), 0);
+    // FS_LINK 6
+    ASSERT_EQ(fs_remove(fs, "/folder_link"), 0);
+    record_results = fs_get_dir(fs, "/folder");
+    ASSERT_NE(record_results, nullptr);
+    ASSERT_TRUE(find_in_directory(record_results, "with_file"));
+    ASSERT_TRUE(find_in_directory(record_results, "with_folder"));
+    ASSERT_TRUE(find_in_directory(record_results, "itself"));
+    ASSERT_EQ(dyn_array_size(record_results), (size_t) 3);
+    dyn_array_destroy(record_results);
+    // FS_LINK 7
+    ASSERT_LT(fs_link(fs, "/file_link", "/folder/with_file"), 0);
+    // FS_LINK 8
+    ASSERT_LT(fs_link(fs, "/file_link", "/DOESNOTEXIST/file_link"), 0);
+    // FS_LINK 9
+    char name[32];
+    for (int i = 0; i < 7; ++i) {
+        snprintf(name, sizeof(name), "/folder/with_folder/%d", i);
+        ASSERT_EQ(fs_create(fs, name, FS_REGULAR), 0);
+    }
+    ASSERT_LT(fs_link(fs, "/file_link", "/folder/with_folder/full"), 0);
+    // FS_LINK 10
+    ASSERT_LT(fs_link(fs, "/DOESNOTEXIST", "/folder/new_link"), 0);
+    // FS_LINK 11
+    ASSERT_LT(fs_link(NULL, "/file_link", "/folder/new_link"), 0);
+    // FS_LINK 12
+    ASSERT_LT(fs_link(fs, NULL, "/folder/new_link"), 0);
+    // FS_LINK 13
+    ASSERT_LT(fs_link(fs, "/file_link", NULL), 0);
+    // FS_LINK 14
+    ASSERT_LT(fs_link(fs, "/file_link", "/"), 0);
+    // FS_LINK 15
+    ASSERT_EQ(fs_remove(fs, "/file_link"), 0);
+    ASSERT_LT(fs_read(fs, fd, buffer, 5), 0);
+    ASSERT_LT(fs_write(fs, link_fd, buffer, 5), 0);
+    ASSERT_EQ(fs_create(fs, "/file", FS_REGULAR), 0);
+    fd = fs_open(fs, "/file");
+    ASSERT_GE(fd, 0);
+    ASSERT_EQ(fs_read(fs, fd, buffer, 5), 0);
+    fs_unmount(fs);
+    score += 20;
+}
+#endif
+
+/*
+   size_t bitmap_atomic_claim(bitmap_t *const bitmap, const size_t start);
+   1. Normal, claims lowest zero from start
+   2. Normal, wraps around to bits below start
+   3. Normal, full bitmap
+   size_t block_store_allocate(block_store_t *const bs); (concurrent)
+   4. Normal, many threads never get the same block
+   5. Normal, many threads releasing leaves the store empty again
+*/
+TEST(k_tests, concurrent_allocate) {
+    bitmap_t *bitmap = bitmap_create(100);
+    ASSERT_NE(bitmap, nullptr);
+    // ATOMIC_CLAIM 1
+    ASSERT_FALSE(bitmap_atomic_set(bitmap, 70));
+    ASSERT_TRUE(bitmap_atomic_set(bitmap, 70));
+    ASSERT_EQ(bitmap_atomic_claim(bitmap, 70), (size_t) 71);
+    ASSERT_TRUE(bitmap_test(bitmap, 71));
+    // ATOMIC_CLAIM 2
+    for (size_t bit = 72; bit < 100; ++bit) {
+        ASSERT_EQ(bitmap_atomic_claim(bitmap, 72), bit);
+    }
+    ASSERT_EQ(bitmap_atomic_claim(bitmap, 72), (size_t) 0);
+    // ATOMIC_CLAIM 3
+    for (size_t bit = 1; bit < 70; ++bit) {
+        ASSERT_EQ(bitmap_atomic_claim(bitmap, 0), bit);
+    }
+    ASSERT_EQ(bitmap_atomic_claim(bitmap, 0), SIZE_MAX);
+    ASSERT_TRUE(bitmap_atomic_reset(bitmap, 42));
+    ASSERT_EQ(bitmap_atomic_claim(bitmap, 99), (size_t) 42);
+    bitmap_destroy(bitmap);
+
+    // BS_ALLOCATE 4
+    block_store_t *bs = block_store_create("k_tests.bs");
+    ASSERT_NE(bs, nullptr);
+    const size_t free_blocks = block_store_get_free_blocks(bs);
+    const size_t per_thread  = 4000;
+    vector<vector<size_t>> claimed(8);
+    vector<std::thread> workers;
+    for (size_t t = 0; t < claimed.size(); ++t) {
+        workers.emplace_back([bs, per_thread, &claimed, t]() {
+            for (size_t i = 0; i < per_thread; ++i) {
+                claimed[t].push_back(block_store_allocate(bs));
+            }
+        });
+    }
+    for (auto &worker : workers) {
+        worker.join();
+    }
+    workers.clear();
+    vector<bool> seen(block_store_get_total_blocks() + 16, false);
+    for (auto &ids : claimed) {
+        for (size_t id : ids) {
+            ASSERT_LT(id, block_store_get_total_blocks());
+            ASSERT_FALSE(seen[id]);
+            seen[id] = true;
+        }
+    }
+    ASSERT_EQ(block_store_get_free_blocks(bs), free_blocks - claimed.size() * per_thread);
+    // BS_ALLOCATE 5
+    for (size_t t = 0; t < claimed.size(); ++t) {
+        workers.emplace_back([bs, &claimed, t]() {
+            for (size_t id : claimed[t]) {
+                block_store_release(bs, id);
+            }
+        });
+    }
+    for (auto &worker : workers) {
+        worker.join();
+    }
+    ASSERT_EQ(block_store_get_free_blocks(bs), free_blocks);
+    block_store_destroy(bs);
+}
+
+/*
+   size_t block_store_allocate_near(block_store_t *const bs, const size_t goal);
+   1. Normal, lands on the goal when it is free
+   2. Normal, stays in the goal's group when the goal is taken
+   3. Normal, group summaries follow allocate/request/release
+   4. Normal, moves on to the next group once the goal's group is full
+   5. Error, NULL bs
+*/
+TEST(l_tests, allocation_groups) {
+    block_store_t *bs = block_store_create("l_tests.bs");
+    ASSERT_NE(bs, nullptr);
+    const size_t group_size = block_store_get_group_size();
+    ASSERT_EQ(block_store_get_group_count() * group_size, block_store_get_total_blocks() + 16);
+    ASSERT_EQ(block_store_get_group_free_blocks(bs, 3), group_size);
+    // ALLOCATE_NEAR 1
+    ASSERT_EQ(block_store_allocate_near(bs, 3 * group_size + 10), 3 * group_size + 10);
+    // ALLOCATE_NEAR 2
+    ASSERT_EQ(block_store_allocate_near(bs, 3 * group_size + 10), 3 * group_size + 11);
+    ASSERT_TRUE(block_store_request(bs, 3 * group_size + 12));
+    ASSERT_EQ(block_store_allocate_near(bs, 3 * group_size + 10), 3 * group_size + 13);
+    // ALLOCATE_NEAR 3
+    ASSERT_EQ(block_store_get_group_free_blocks(bs, 3), group_size - 4);
+    block_store_release(bs, 3 * group_size + 11);
+    block_store_release(bs, 3 * group_size + 11);
+    ASSERT_EQ(block_store_get_group_free_blocks(bs, 3), group_size - 3);
+    ASSERT_EQ(block_store_get_group_free_blocks(bs, 4), group_size);
+    // ALLOCATE_NEAR 4
+    for (size_t i = 0; i < group_size - 3; ++i) {
+        size_t id = block_store_allocate_near(bs, 3 * group_size + 100);
+        ASSERT_GE(id, 3 * group_size);
+        ASSERT_LT(id, 4 * group_size);
+    }
+    ASSERT_EQ(block_store_get_group_free_blocks(bs, 3), (size_t) 0);
+    ASSERT_EQ(block_store_allocate_near(bs, 3 * group_size + 100), 4 * group_size);
+    // ALLOCATE_NEAR 5
+    ASSERT_EQ(block_store_allocate_near(NULL, 0), SIZE_MAX);
+    ASSERT_EQ(block_store_get_group_free_blocks(bs, block_store_get_group_count()), SIZE_MAX);
+    block_store_destroy(bs);
+}
+
+/*
+   int fs_open(F17FS *fs, const char *path); (descriptor table)
+   1. Normal, descriptors from many threads never collide
+   2. Normal, descriptors closed on one thread are reused on another
+*/
+TEST(m_tests, descriptor_table) {
+    const char *test_fname = "m_tests.F17FS";
+    F17FS *fs = fs_format(test_fname);
+    ASSERT_NE(fs, nullptr);
+    ASSERT_EQ(fs_create(fs, "/file", FS_REGULAR), 0);
+    // DESCRIPTORS 1
+    vector<vector<int>> opened(4);
+    vector<std::thread> workers;
+    for (size_t t = 0; t < opened.size(); ++t) {
+        workers.emplace_back([fs, &opened, t]() {
+            for (int i = 0; i < 1000; ++i) {
+                int fd = fs_open(fs, "/file");
+                opened[t].push_back(fd);
+                // churn the thread's cache as well
+                if (i % 3 == 0) {
+                    fs_close(fs, fd);
+                    opened[t].back() = fs_open(fs, "/file");
+                }
+            }
+        });
+    }
+    for (auto &worker : workers) {
+        worker.join();
+    }
+    workers.clear();
+    vector<bool> seen(FS_FD_MAX, false);
+    for (auto &fds : opened) {
+        for (int fd : fds) {
+            ASSERT_GE(fd, 0);
+            ASSERT_FALSE(seen[fd]);
+            seen[fd] = true;
+        }
+    }
+    // DESCRIPTORS 2
+    for (auto &fds : opened) {
+        for (int fd : fds) {
+            ASSERT_EQ(fs_close(fs, fd), 0);
+        }
+    }
+    for (size_t i = 0; i < 4000; ++i) {
+        ASSERT_GE(fs_open(fs, "/file"), 0);
+    }
+    fs_unmount(fs);
+}
+
+/*
+   int fs_lookup(F17FS *fs, const char *path);
+   int fs_createat / fs_openat / fs_removeat, dyn_array_t *fs_get_dirat
+   1. Normal, root and nested directory handles
+   2. Normal, create/open/list/remove relative to a handle, nested relative paths
+   3. Error, lookup of a file or missing directory, bad handles, absolute relative paths
+   4. Error, handle of a removed directory, also after its inode is reused
+*/
+TEST(o_tests, directory_handles) {
+    const char *test_fname = "o_tests.F17FS";
+    F17FS *fs = fs_format(test_fname);
+    ASSERT_NE(fs, nullptr);
+    ASSERT_EQ(fs_create(fs, "/dir", FS_DIRECTORY), 0);
+    ASSERT_EQ(fs_create(fs, "/dir/sub", FS_DIRECTORY), 0);
+    ASSERT_EQ(fs_create(fs, "/file", FS_REGULAR), 0);
+    // LOOKUP 1
+    ASSERT_EQ(fs_lookup(fs, "/"), FS_ROOT_DIR);
+    int dir = fs_lookup(fs, "/dir");
+    ASSERT_GT(dir, FS_ROOT_DIR);
+    int sub = fs_lookup(fs, "/dir/sub");
+    ASSERT_GT(sub, FS_ROOT_DIR);
+    ASSERT_NE(sub, dir);
+    // AT 2
+    ASSERT_EQ(fs_createat(fs, dir, "a", FS_REGULAR), 0);
+    ASSERT_EQ(fs_createat(fs, dir, "sub/b", FS_REGULAR), 0);
+    ASSERT_LT(fs_createat(fs, dir, "a", FS_REGULAR), 0);
+    int fd = fs_openat(fs, sub, "b");
+    ASSERT_GE(fd, 0);
+    ASSERT_EQ(fs_write(fs, fd, "handle", 6), 6);
+    ASSERT_EQ(fs_close(fs, fd), 0);
+    fd = fs_open(fs, "/dir/sub/b");
+    ASSERT_GE(fd, 0);
+    char buffer[6];
+    ASSERT_EQ(fs_read(fs, fd, buffer, 6), 6);
+    ASSERT_EQ(memcmp(buffer, "handle", 6), 0);
+    ASSERT_EQ(fs_close(fs, fd), 0);
+    dyn_array_t *record_results = fs_get_dirat(fs, dir, "");
+    ASSERT_NE(record_results, nullptr);
+    ASSERT_EQ(dyn_array_size(record_results), (size_t) 2);
+    ASSERT_TRUE(find_in_directory(record_results, "a"));
+    ASSERT_TRUE(find_in_directory(record_results, "sub"));
+    dyn_array_destroy(record_results);
+    record_results = fs_get_dirat(fs, dir, "sub");
+    ASSERT_NE(record_results, nullptr);
+    ASSERT_EQ(dyn_array_size(record_results), (size_t) 1);
+    ASSERT_TRUE(find_in_directory(record_results, "b"));
+    dyn_array_destroy(record_results);
+    ASSERT_EQ(fs_removeat(fs, dir, "a"), 0);
+    ASSERT_LT(fs_open(fs, "/dir/a"), 0);
+    // LOOKUP 3
+    ASSERT_LT(fs_lookup(fs, "/file"), 0);
+    ASSERT_LT(fs_lookup(fs, "/nothing"), 0);
+    ASSERT_LT(fs_lookup(NULL, "/dir"), 0);
+    ASSERT_LT(fs_lookup(fs, "dir"), 0);
+    int file_inode = fs_lookup(fs, "/file");
+    ASSERT_LT(fs_createat(fs, file_inode, "x", FS_REGULAR), 0);
+    ASSERT_LT(fs_createat(fs, -1, "x", FS_REGULAR), 0);
+    ASSERT_LT(fs_createat(fs, 256, "x", FS_REGULAR), 0);
+    ASSERT_LT(fs_createat(fs, dir, "/x", FS_REGULAR), 0);
+    ASSERT_LT(fs_openat(fs, dir, ""), 0);
+    ASSERT_EQ(fs_get_dirat(fs, 200, ""), nullptr);
+    // LOOKUP 4
+    ASSERT_EQ(fs_removeat(fs, sub, "b"), 0);
+    ASSERT_EQ(fs_removeat(fs, dir, "sub"), 0);
+    ASSERT_LT(fs_createat(fs, sub, "c", FS_REGULAR), 0);
+    ASSERT_EQ(fs_get_dirat(fs, sub, ""), nullptr);
+    ASSERT_EQ(fs_createat(fs, dir, "again", FS_DIRECTORY), 0);
+    int again = fs_lookup(fs, "/dir/again");
+    ASSERT_GT(again, FS_ROOT_DIR);
+    ASSERT_NE(again, sub);
+    ASSERT_LT(fs_createat(fs, sub, "c", FS_REGULAR), 0);
+    ASSERT_EQ(fs_get_dirat(fs, sub, ""), nullptr);
+    ASSERT_LT(fs_openat(fs, sub, "c"), 0);
+    ASSERT_EQ(fs_createat(fs, again, "c", FS_REGULAR), 0);
+    record_results = fs_get_dirat(fs, again, "");
+    ASSERT_NE(record_results, nullptr);
+    ASSERT_EQ(dyn_array_size(record_results), (size_t) 1);
+    dyn_array_destroy(record_results);
+    ASSERT_LT(fs_removeat(fs, sub, "c"), 0);
+    fs_unmount(fs);
+}
+
+/*
+   fs_dir_t *fs_opendir(F17FS *fs, const char *path); fs_readdir / fs_readdir_batch / fs_closedir
+   1. Normal, stream every entry of a directory one at a time
+   2. Normal, batch reads split across calls, then end of directory
+   3. Normal, empty directory
+   4. Error, file path, missing path, NULL arguments
+*/
+TEST(p_tests, directory_iterator) {
+    const char *test_fname = "p_tests.F17FS";
+    F17FS *fs = fs_format(test_fname);
+    ASSERT_NE(fs, nullptr);
+    const char *names[] = {"a", "b", "c", "d", "e"};
+    ASSERT_EQ(fs_create(fs, "/dir", FS_DIRECTORY), 0);
+    ASSERT_EQ(fs_create(fs, "/empty", FS_DIRECTORY), 0);
+    int dir = fs_lookup(fs, "/dir");
+    for (const char *name : names) {
+        ASSERT_EQ(fs_createat(fs, dir, name, FS_REGULAR), 0);
+    }
+    // ITERATOR 1
+    fs_dir_t *cursor = fs_opendir(fs, "/dir");
+    ASSERT_NE(cursor, nullptr);
+    file_record_t record;
+    vector<string> seen;
+    int result;
+    while ((result = fs_readdir(fs, cursor, &record)) == 1) {
+        seen.push_back(record.name);
+        ASSERT_EQ(record.type, FS_REGULAR);
+    }
+    ASSERT_EQ(result, 0);
+    ASSERT_EQ(seen, vector<string>(names, names + 5));
+    ASSERT_EQ(fs_closedir(fs, cursor), 0);
+    // ITERATOR 2
+    cursor = fs_opendirat(fs, dir, "");
+    ASSERT_NE(cursor, nullptr);
+    file_record_t records[3];
+    ASSERT_EQ(fs_readdir_batch(fs, cursor, records, 3), 3);
+    ASSERT_STREQ(records[2].name, "c");
+    ASSERT_EQ(fs_readdir_batch(fs, cursor, records, 3), 2);
+    ASSERT_STREQ(records[1].name, "e");
+    ASSERT_EQ(fs_readdir_batch(fs, cursor, records, 3), 0);
+    ASSERT_EQ(fs_closedir(fs, cursor), 0);
+    // ITERATOR 3
+    cursor = fs_opendir(fs, "/empty");
+    ASSERT_NE(cursor, nullptr);
+    ASSERT_EQ(fs_readdir(fs, cursor, &record), 0);
+    ASSERT_EQ(fs_closedir(fs, cursor), 0);
+    dyn_array_t *record_results = fs_get_dir(fs, "/empty");
+    ASSERT_NE(record_results, nullptr);
+    ASSERT_EQ(dyn_array_size(record_results), (size_t) 0);
+    dyn_array_destroy(record_results);
+    // ITERATOR 4
+    ASSERT_EQ(fs_opendir(fs, "/dir/a"), nullptr);
+    ASSERT_EQ(fs_opendir(fs, "/nothing"), nullptr);
+    ASSERT_EQ(fs_opendir(fs, "dir"), nullptr);
+    ASSERT_EQ(fs_opendir(NULL, "/dir"), nullptr);
+    cursor = fs_opendir(fs, "/");
+    ASSERT_NE(cursor, nullptr);
+    ASSERT_LT(fs_readdir(NULL, cursor, &record), 0);
+    ASSERT_LT(fs_readdir(fs, NULL, &record), 0);
+    ASSERT_LT(fs_readdir_batch(fs, cursor, NULL, 1), 0);
+    ASSERT_LT(fs_closedir(fs, NULL), 0);
+    ASSERT_EQ(fs_closedir(fs, cursor), 0);
+    fs_unmount(fs);
+}
+
+/*
+   int fs_move(F17FS *fs, const char *src, const char *dst); (metadata only)
+   1. Normal, rename inside one directory keeps the inode and its data
+   2. Normal, moving a directory carries its whole subtree along
+   3. Error, rename onto a name that sits past a hole in the directory
+*/
+TEST(q_tests, move_metadata_only) {
+    const char *test_fname = "q_tests.F17FS";
+    F17FS *fs = fs_format(test_fname);
+    ASSERT_NE(fs, nullptr);
+    ASSERT_EQ(fs_create(fs, "/a", FS_REGULAR), 0);
+    ASSERT_EQ(fs_create(fs, "/dir", FS_DIRECTORY), 0);
+    ASSERT_EQ(fs_create(fs, "/dir/sub", FS_DIRECTORY), 0);
+    ASSERT_EQ(fs_create(fs, "/dir/sub/deep", FS_REGULAR), 0);
+    ASSERT_EQ(fs_create(fs, "/other", FS_DIRECTORY), 0);
+    int fd = fs_open(fs, "/a");
+    ASSERT_GE(fd, 0);
+    ASSERT_EQ(fs_write(fs, fd, "moved", 5), 5);
+    // MOVE 1
+    ASSERT_EQ(fs_move(fs, "/a", "/b"), 0);
+    ASSERT_LT(fs_open(fs, "/a"), 0);
+    ASSERT_EQ(fs_seek(fs, fd, 0, FS_SEEK_SET), 0);
+    char buffer[5];
+    ASSERT_EQ(fs_read(fs, fd, buffer, 5), 5);
+    int fd2 = fs_open(fs, "/b");
+    ASSERT_GE(fd2, 0);
+    ASSERT_EQ(fs_read(fs, fd2, buffer, 5), 5);
+    ASSERT_EQ(memcmp(buffer, "moved", 5), 0);
+    // MOVE 2
+    ASSERT_EQ(fs_move(fs, "/dir", "/other/dir"), 0);
+    ASSERT_LT(fs_lookup(fs, "/dir"), 0);
+    ASSERT_GE(fs_open(fs, "/other/dir/sub/deep"), 0);
+    ASSERT_LT(fs_move(fs, "/other", "/other/dir/sub/other"), 0);
+    // MOVE 3
+    ASSERT_EQ(fs_create(fs, "/c", FS_REGULAR), 0);
+    ASSERT_EQ(fs_remove(fs, "/b"), 0);
+    ASSERT_LT(fs_move(fs, "/other", "/c"), 0);
+    ASSERT_LT(fs_create(fs, "/c", FS_REGULAR), 0);
+    fs_unmount(fs);
+}
+
+/*
+   journal_t *journal_open(block_store_t *const bs, const size_t group_commit); and friends
+   1. Normal, writes stay out of their home blocks until the batch commits
+   2. Normal, frees are held back until the commit
+   3. Normal, committed transactions are replayed from a crashed image
+   F17FS_t *fs_mount_with_options(const char *path, const fs_mount_options_t *options);
+   4. Normal, a crashed image with damaged metadata comes back through replay
+   5. Normal, a clean unmount leaves nothing to replay
+   6. Normal, an operation that might not fit behind the batch commits it first, one that overflows is refused, not split
+   7. Normal, blocks written straight to the block store are flushed before the commit
+*/
+TEST(r_tests, journal) {
+    block_store_t *bs = block_store_create("r_tests.bs");
+    ASSERT_NE(bs, nullptr);
+    journal_t *journal = journal_open(bs, 4);
+    ASSERT_NE(journal, nullptr);
+    ASSERT_EQ(journal_get_replayed(journal), (size_t) 0);
+    uint8_t block[512], home[512], zeros[512] = {0};
+    // JOURNAL 1
+    memset(block, 0xab, sizeof(block));
+    ASSERT_EQ(journal_write(journal, 100, block), (size_t) 512);
+    for (int i = 0; i < 3; ++i) {
+        ASSERT_EQ(journal_end_op(journal), 0);
+    }
+    ASSERT_EQ(journal_get_commits(journal), (size_t) 0);
+    ASSERT_EQ(block_store_read(bs, 100, home), (size_t) 512);
+    ASSERT_EQ(memcmp(home, zeros, 512), 0);
+    ASSERT_EQ(journal_read(journal, 100, home), (size_t) 512);
+    ASSERT_EQ(memcmp(home, block, 512), 0);
+    ASSERT_EQ(journal_end_op(journal), 0);
+    ASSERT_EQ(journal_get_commits(journal), (size_t) 1);
+    block_store_read(bs, 100, home);
+    ASSERT_EQ(memcmp(home, block, 512), 0);
+    // JOURNAL 2
+    ASSERT_TRUE(block_store_request(bs, 200));
+    const size_t free_blocks = block_store_get_free_blocks(bs);
+    journal_release(journal, 200);
+    ASSERT_EQ(block_store_get_free_blocks(bs), free_blocks);
+    ASSERT_FALSE(block_store_request(bs, 200));
+    ASSERT_EQ(journal_commit(journal), 0);
+    ASSERT_EQ(block_store_get_free_blocks(bs), free_blocks + 1);
+    // JOURNAL 3
+    memset(block, 0xcd, sizeof(block));
+    ASSERT_EQ(journal_write(journal, 101, block), (size_t) 512);
+    ASSERT_EQ(journal_commit(journal), 0);
+    // home blocks lost in the crash, only the log made it
+    block_store_write(bs, 100, zeros);
+    block_store_write(bs, 101, zeros);
+    ASSERT_EQ(system("cp r_tests.bs r_tests_crashed.bs"), 0);
+    journal_close(journal);
+    block_store_destroy(bs);
+    bs = block_store_open("r_tests_crashed.bs");
+    ASSERT_NE(bs, nullptr);
+    journal = journal_open(bs, 4);
+    ASSERT_NE(journal, nullptr);
+    ASSERT_EQ(journal_get_replayed(journal), (size_t) 3);
+    block_store_read(bs, 101, home);
+    ASSERT_EQ(memcmp(home, block, 512), 0);
+    block_store_read(bs, 100, home);
+    memset(block, 0xab, sizeof(block));
+    ASSERT_EQ(memcmp(home, block, 512), 0);
+    journal_close(journal);
+    block_store_destroy(bs);
+
+    // JOURNAL 4
+    F17FS *fs = fs_format("r_tests.F17FS");
+    ASSERT_NE(fs, nullptr);
+    ASSERT_EQ(fs_unmount(fs), 0);
+    fs_mount_options_t options = {};
+    options.journalGroupCommit = 1;
+    fs = fs_mount_with_options("r_tests.F17FS", &options);
+    ASSERT_NE(fs, nullptr);
+    ASSERT_EQ(fs_create(fs, "/dir", FS_DIRECTORY), 0);
+    ASSERT_EQ(fs_create(fs, "/dir/file", FS_REGULAR), 0);
+    ASSERT_EQ(system("cp r_tests.F17FS r_tests_crashed.F17FS"), 0);
+    ASSERT_EQ(fs_unmount(fs), 0);
+    // wipe the inode table and the root directory of the crashed copy
+    bs = block_store_open("r_tests_crashed.F17FS");
+    ASSERT_NE(bs, nullptr);
+    for (size_t id = 1; id <= 33; ++id) {
+        block_store_write(bs, id, zeros);
+    }
+    block_store_destroy(bs);
+    fs = fs_mount("r_tests_crashed.F17FS");
+    ASSERT_NE(fs, nullptr);
+    int fd = fs_open(fs, "/dir/file");
+    ASSERT_GE(fd, 0);
+    ASSERT_EQ(fs_write(fs, fd, "durable", 7), 7);
+    ASSERT_EQ(fs_unmount(fs), 0);
+    // JOURNAL 5
+    bs = block_store_open("r_tests_crashed.F17FS");
+    ASSERT_NE(bs, nullptr);
+    journal = journal_open(bs, 1);
+    ASSERT_NE(journal, nullptr);
+    ASSERT_EQ(journal_get_replayed(journal), (size_t) 0);
+    journal_close(journal);
+    block_store_destroy(bs);
+    // JOURNAL 6
+    bs = block_store_create("r_tests.bs");
+    ASSERT_NE(bs, nullptr);
+    journal = journal_open(bs, 100);
+    ASSERT_NE(journal, nullptr);
+    memset(block, 0x6e, sizeof(block));
+    for (size_t id = 1000; id < 1000 + JOURNAL_OP_BLOCKS + 100; ++id) {
+        ASSERT_EQ(journal_write(journal, id, block), (size_t) 512);
+    }
+    ASSERT_EQ(journal_end_op(journal), 0);
+    ASSERT_EQ(journal_get_commits(journal), (size_t) 0);
+    ASSERT_EQ(journal_write(journal, 3000, block), (size_t) 512);
+    ASSERT_EQ(journal_get_commits(journal), (size_t) 1);
+    block_store_read(bs, 3000, home);
+    ASSERT_EQ(memcmp(home, zeros, 512), 0);
+    size_t id = 3001;
+    while (journal_write(journal, id, block) == 512) {
+        ++id;
+    }
+    ASSERT_GT(id - 3000, (size_t) JOURNAL_OP_BLOCKS);
+    ASSERT_EQ(journal_get_commits(journal), (size_t) 1);
+    ASSERT_EQ(journal_end_op(journal), 0);
+    // JOURNAL 7
+    ASSERT_EQ(journal_commit(journal), 0);
+    ASSERT_EQ(block_store_write(bs, 5000, block), (size_t) 512);
+    ASSERT_GT(block_store_get_dirty_blocks(bs), (size_t) 0);
+    ASSERT_EQ(journal_write(journal, 100, block), (size_t) 512);
+    ASSERT_EQ(journal_end_op(journal), 0);
+    ASSERT_EQ(journal_commit(journal), 0);
+    block_store_read(bs, 100, home);
+    ASSERT_EQ(memcmp(home, block, 512), 0);
+    ASSERT_TRUE(block_store_flush_range(bs, 100, 1));
+    ASSERT_EQ(block_store_get_dirty_blocks(bs), (size_t) 0);
+    journal_close(journal);
+    block_store_destroy(bs);
+}
+
+/*
+   bool block_store_flush(block_store_t *const bs);
+   bool block_store_flush_range(block_store_t *const bs, const size_t first_block, const size_t count);
+   1. Normal, a fresh device only has its FBM to flush
+   2. Normal, writes and requests dirty their block and FBM block, a range flush only clears its own
+   3. Error, NULL device and bad ranges
+   int fs_fsync(F17FS_t *fs, int fd);
+   int fs_sync(F17FS_t *fs);
+   4. Normal, flushing a file with data, an empty file and the whole file system
+   5. Error, NULL fs and bad descriptors
+*/
+TEST(s_tests, sync) {
+    // SYNC 1
+    block_store_t *bs = block_store_create("s_tests.bs");
+    ASSERT_NE(bs, nullptr);
+    ASSERT_EQ(block_store_get_dirty_blocks(bs), (size_t) 16);
+    ASSERT_TRUE(block_store_flush(bs));
+    ASSERT_EQ(block_store_get_dirty_blocks(bs), (size_t) 0);
+    ASSERT_TRUE(block_store_flush(bs));
+    // SYNC 2
+    uint8_t block[512];
+    memset(block, 0x5a, sizeof(block));
+    ASSERT_EQ(block_store_write(bs, 10, block), (size_t) 512);
+    ASSERT_EQ(block_store_write(bs, 11, block), (size_t) 512);
+    ASSERT_EQ(block_store_write(bs, 11, block), (size_t) 512);
+    ASSERT_EQ(block_store_get_dirty_blocks(bs), (size_t) 2);
+    ASSERT_TRUE(block_store_request(bs, 5000));
+    ASSERT_EQ(block_store_get_dirty_blocks(bs), (size_t) 3);
+    ASSERT_TRUE(block_store_flush_range(bs, 10, 2));
+    ASSERT_EQ(block_store_get_dirty_blocks(bs), (size_t) 1);
+    ASSERT_TRUE(block_store_flush_range(bs, 0, 100));
+    ASSERT_EQ(block_store_get_dirty_blocks(bs), (size_t) 1);
+    ASSERT_TRUE(block_store_flush(bs));
+    ASSERT_EQ(block_store_get_dirty_blocks(bs), (size_t) 0);
+    block_store_release(bs, 5000);
+    ASSERT_EQ(block_store_get_dirty_blocks(bs), (size_t) 1);
+    ASSERT_TRUE(block_store_flush_range(bs, 65520, 16));
+    ASSERT_EQ(block_store_get_dirty_blocks(bs), (size_t) 0);
+    // SYNC 3
+    ASSERT_FALSE(block_store_flush(NULL));
+    ASSERT_FALSE(block_store_flush_range(NULL, 0, 1));
+    ASSERT_FALSE(block_store_flush_range(bs, 0, 0));
+    ASSERT_FALSE(block_store_flush_range(bs, 65535, 2));
+    ASSERT_FALSE(block_store_flush_range(bs, 65536, 1));
+    ASSERT_EQ(block_store_get_dirty_blocks(NULL), SIZE_MAX);
+    block_store_destroy(bs);
+
+    // SYNC 4
+    F17FS *fs = fs_format("s_tests.F17FS");
+    ASSERT_NE(fs, nullptr);
+    ASSERT_EQ(fs_create(fs, "/file", FS_REGULAR), 0);
+    ASSERT_EQ(fs_create(fs, "/empty", FS_REGULAR), 0);
+    int fd = fs_open(fs, "/file");
+    ASSERT_GE(fd, 0);
+    uint8_t data[512 * 10];
+    memset(data, 0x33, sizeof(data));
+    ASSERT_EQ(fs_write(fs, fd, data, sizeof(data)), (ssize_t) sizeof(data));
+    ASSERT_EQ(fs_fsync(fs, fd), 0);
+    int empty = fs_open(fs, "/empty");
+    ASSERT_GE(empty, 0);
+    ASSERT_EQ(fs_fsync(fs, empty), 0);
+    ASSERT_EQ(fs_sync(fs), 0);
+    ASSERT_EQ(fs_sync(fs), 0);
+    // SYNC 5
+    ASSERT_LT(fs_fsync(NULL, fd), 0);
+    ASSERT_LT(fs_fsync(fs, -1), 0);
+    ASSERT_LT(fs_fsync(fs, 100000), 0);
+    ASSERT_EQ(fs_close(fs, empty), 0);
+    ASSERT_LT(fs_fsync(fs, empty), 0);
+    ASSERT_LT(fs_sync(NULL), 0);
+    ASSERT_EQ(fs_unmount(fs), 0);
+    // the flushed data is there on the next mount
+    fs = fs_mount("s_tests.F17FS");
+    ASSERT_NE(fs, nullptr);
+    fd = fs_open(fs, "/file");
+    ASSERT_GE(fd, 0);
+    uint8_t back[sizeof(data)];
+    ASSERT_EQ(fs_read(fs, fd, back, sizeof(back)), (ssize_t) sizeof(back));
+    ASSERT_EQ(memcmp(back, data, sizeof(data)), 0);
+    ASSERT_EQ(fs_unmount(fs), 0);
+}
+
+/*
+   size_t block_store_writeback(block_store_t *const bs, const size_t max_blocks);
+   uint64_t block_store_get_dirty_age(const block_store_t *const bs);
+   1. Normal, writeback flushes in bounded batches until nothing is dirty
+   2. Normal, the dirty age grows while dirty and drops to 0 once clean
+   3. Error, NULL device
+   F17FS_t *fs_mount_with_options(const char *path, const fs_mount_options_t *options); with writeback
+   4. Normal, expired data and batched metadata reach the file without a sync
+   5. Normal, crossing the background threshold wakes writeback early
+   6. Normal, unmount stops the thread and the data survives a remount
+*/
+TEST(t_tests, writeback) {
+    // WRITEBACK 1
+    block_store_t *bs = block_store_create("t_tests.bs");
+    ASSERT_NE(bs, nullptr);
+    ASSERT_TRUE(block_store_flush(bs));
+    uint8_t block[512];
+    memset(block, 0x77, sizeof(block));
+    for (size_t id = 100; id < 120; ++id) {
+        ASSERT_EQ(block_store_write(bs, id, block), (size_t) 512);
+    }
+    ASSERT_EQ(block_store_get_dirty_blocks(bs), (size_t) 20);
+    ASSERT_EQ(block_store_writeback(bs, 8), (size_t) 8);
+    ASSERT_EQ(block_store_get_dirty_blocks(bs), (size_t) 12);
+    ASSERT_EQ(block_store_writeback(bs, 8), (size_t) 8);
+    ASSERT_EQ(block_store_writeback(bs, 8), (size_t) 4);
+    ASSERT_EQ(block_store_writeback(bs, 8), (size_t) 0);
+    ASSERT_EQ(block_store_get_dirty_blocks(bs), (size_t) 0);
+    // picks up behind the last batch, then wraps around
+    ASSERT_EQ(block_store_write(bs, 5, block), (size_t) 512);
+    ASSERT_EQ(block_store_write(bs, 500, block), (size_t) 512);
+    ASSERT_EQ(block_store_writeback(bs, 1), (size_t) 1);
+    ASSERT_EQ(block_store_get_dirty_blocks(bs), (size_t) 1);
+    ASSERT_EQ(block_store_writeback(bs, 1), (size_t) 1);
+    ASSERT_EQ(block_store_get_dirty_blocks(bs), (size_t) 0);
+    // WRITEBACK 2
+    ASSERT_EQ(block_store_get_dirty_age(bs), (uint64_t) 0);
+    ASSERT_EQ(block_store_write(bs, 7, block), (size_t) 512);
+    std::this_thread::sleep_for(std::chrono::milliseconds(30));
+    ASSERT_GE(block_store_get_dirty_age(bs), (uint64_t) 25);
+    ASSERT_TRUE(block_store_flush(bs));
+    ASSERT_EQ(block_store_get_dirty_age(bs), (uint64_t) 0);
+    // WRITEBACK 3
+    ASSERT_EQ(block_store_writeback(NULL, 8), SIZE_MAX);
+    ASSERT_EQ(block_store_get_dirty_age(NULL), (uint64_t) 0);
+    block_store_destroy(bs);
+
+    // WRITEBACK 4
+    F17FS *fs = fs_format("t_tests.F17FS");
+    ASSERT_NE(fs, nullptr);
+    ASSERT_EQ(fs_unmount(fs), 0);
+    fs_mount_options_t options = {};
+    options.writeback = true;
+    options.writebackIntervalMs = 5;
+    options.dirtyExpireMs = 20;
+    options.writebackBatchBlocks = 8;
+    fs = fs_mount_with_options("t_tests.F17FS", &options);
+    ASSERT_NE(fs, nullptr);
+    ASSERT_EQ(fs_create(fs, "/file", FS_REGULAR), 0);
+    int fd = fs_open(fs, "/file");
+    ASSERT_GE(fd, 0);
+    uint8_t data[512 * 40];
+    memset(data, 0x42, sizeof(data));
+    ASSERT_EQ(fs_write(fs, fd, data, sizeof(data)), (ssize_t) sizeof(data));
+    // closing places the staged blocks, which leaves them dirty
+    ASSERT_EQ(fs_close(fs, fd), 0);
+    ASSERT_GT(fs_get_dirty_blocks(fs), (size_t) 0);
+    for (int i = 0; i < 400 && fs_get_dirty_blocks(fs) != 0; ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    ASSERT_EQ(fs_get_dirty_blocks(fs), (size_t) 0);
+    ASSERT_EQ(fs_unmount(fs), 0);
+    // WRITEBACK 5
+    options.writebackIntervalMs = 60000;
+    options.dirtyExpireMs = 60000;
+    options.dirtyBackgroundBlocks = 16;
+    options.writebackBatchBlocks = 0;
+    fs = fs_mount_with_options("t_tests.F17FS", &options);
+    ASSERT_NE(fs, nullptr);
+    fd = fs_open(fs, "/file");
+    ASSERT_GE(fd, 0);
+    ASSERT_EQ(fs_write(fs, fd, data, sizeof(data)), (ssize_t) sizeof(data));
+    ASSERT_EQ(fs_write(fs, fd, data, sizeof(data)), (ssize_t) sizeof(data));
+    ASSERT_EQ(fs_close(fs, fd), 0);
+    fd = fs_open(fs, "/file");
+    ASSERT_GE(fd, 0);
+    for (int i = 0; i < 400 && fs_get_dirty_blocks(fs) >= 16; ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        // every write past the threshold wakes it again, in case the first wake-up came too early
+        ASSERT_EQ(fs_seek(fs, fd, 0, FS_SEEK_SET), 0);
+        ASSERT_EQ(fs_write(fs, fd, data, 1), 1);
+    }
+    ASSERT_LT(fs_get_dirty_blocks(fs), (size_t) 16);
+    // WRITEBACK 6
+    ASSERT_EQ(fs_unmount(fs), 0);
+    fs = fs_mount("t_tests.F17FS");
+    ASSERT_NE(fs, nullptr);
+    fd = fs_open(fs, "/file");
+    ASSERT_GE(fd, 0);
+    uint8_t back[sizeof(data)];
+    ASSERT_EQ(fs_read(fs, fd, back, sizeof(back)), (ssize_t) sizeof(back));
+    ASSERT_EQ(memcmp(back, data, sizeof(data)), 0);
+    ASSERT_EQ(fs_unmount(fs), 0);
+}
+
+/*
+   fs_write with delayed allocation
+   1. Normal, interleaved writers still get one contiguous run per file once closed
+   2. Normal, staged blocks read back before they are placed, partial writes included
+   3. Normal, a temp file removed before it is closed never allocates
+   4. Normal, a file larger than the staging pool, read back after a remount
+*/
+TEST(u_tests, delayed_allocation) {
+    F17FS *fs = fs_format("u_tests.F17FS");
+    ASSERT_NE(fs, nullptr);
+    ASSERT_EQ(fs_create(fs, "/a", FS_REGULAR), 0);
+    ASSERT_EQ(fs_create(fs, "/b", FS_REGULAR), 0);
+    int a = fs_open(fs, "/a");
+    int b = fs_open(fs, "/b");
+    ASSERT_GE(a, 0);
+    ASSERT_GE(b, 0);
+    // DELALLOC 1
+    uint8_t block_a[512];
+    uint8_t block_b[512];
+    memset(block_a, 0xaa, sizeof(block_a));
+    memset(block_b, 0xbb, sizeof(block_b));
+    for (int i = 0; i < 12; ++i) {
+        ASSERT_EQ(fs_write(fs, a, block_a, 512), 512);
+        ASSERT_EQ(fs_write(fs, b, block_b, 512), 512);
+    }
+    // DELALLOC 2
+    ASSERT_EQ(fs_seek(fs, a, 100, FS_SEEK_SET), 100);
+    ASSERT_EQ(fs_write(fs, a, "staged", 6), 6);
+    ASSERT_EQ(fs_seek(fs, a, 0, FS_SEEK_SET), 0);
+    uint8_t back[512];
+    ASSERT_EQ(fs_read(fs, a, back, 512), 512);
+    memcpy(block_a + 100, "staged", 6);
+    ASSERT_EQ(memcmp(back, block_a, 512), 0);
+    ASSERT_EQ(fs_close(fs, a), 0);
+    ASSERT_EQ(fs_close(fs, b), 0);
+    // DELALLOC 3
+    ASSERT_EQ(fs_sync(fs), 0);
+    ASSERT_EQ(fs_get_dirty_blocks(fs), (size_t) 0);
+    ASSERT_EQ(fs_create(fs, "/tmp", FS_REGULAR), 0);
+    int tmp = fs_open(fs, "/tmp");
+    ASSERT_GE(tmp, 0);
+    ASSERT_EQ(fs_write(fs, tmp, block_b, 512), 512);
+    ASSERT_EQ(fs_write(fs, tmp, block_b, 512), 512);
+    ASSERT_EQ(fs_remove(fs, "/tmp"), 0);
+    ASSERT_EQ(fs_get_dirty_blocks(fs), (size_t) 0);
+    // DELALLOC 4
+    ASSERT_EQ(fs_create(fs, "/big", FS_REGULAR), 0);
+    int big = fs_open(fs, "/big");
+    ASSERT_GE(big, 0);
+    std::vector<uint8_t> data(512 * 300);
+    for (size_t i = 0; i < data.size(); ++i) {
+        data[i] = (uint8_t)(i / 512);
+    }
+    ASSERT_EQ(fs_write(fs, big, data.data(), data.size()), (ssize_t) data.size());
+    ASSERT_EQ(fs_unmount(fs), 0);
+
+    // placement, straight from the inode table: inodes 1 and 2 are /a and /b
+    block_store_t *bs = block_store_open("u_tests.F17FS");
+    ASSERT_NE(bs, nullptr);
+    uint8_t inodes[512];
+    ASSERT_EQ(block_store_read(bs, 1, inodes), (size_t) 512);
+    for (int inode = 1; inode <= 2; ++inode) {
+        uint16_t direct[6];
+        memcpy(direct, inodes + inode * 64 + 48, sizeof(direct));
+        for (int i = 1; i < 6; ++i) {
+            ASSERT_EQ(direct[i], direct[0] + i);
+        }
+    }
+    block_store_destroy(bs);
+
+    fs = fs_mount("u_tests.F17FS");
+    ASSERT_NE(fs, nullptr);
+    big = fs_open(fs, "/big");
+    ASSERT_GE(big, 0);
+    std::vector<uint8_t> big_back(data.size());
+    ASSERT_EQ(fs_read(fs, big, big_back.data(), big_back.size()), (ssize_t) big_back.size());
+    ASSERT_EQ(big_back, data);
+    b = fs_open(fs, "/b");
+    ASSERT_GE(b, 0);
+    ASSERT_EQ(fs_seek(fs, b, 512 * 11, FS_SEEK_SET), 512 * 11);
+    ASSERT_EQ(fs_read(fs, b, back, 512), 512);
+    ASSERT_EQ(memcmp(back, block_b, 512), 0);
+    ASSERT_EQ(fs_unmount(fs), 0);
+}
+
+/*
+   buffer_cache_t *buffer_cache_create(block_store_t *const bs, const size_t budget_bytes, const buffer_cache_policy_t policy);
+   size_t buffer_cache_read / buffer_cache_read_stream / buffer_cache_write, buffer_cache_get_stats
+   1. Normal, LRU evicts the least recently used block
+   2. Normal, CLOCK gives a referenced block a second chance
+   3. Normal, ARC keeps twice-read blocks through a long one-off scan, LRU does with streamed reads
+   4. Normal, writes go through and refresh the cached copy, invalidate drops it
+   5. Error, bad arguments
+   int fs_get_cache_stats(F17FS_t *fs, buffer_cache_stats_t *stats);
+   6. Normal, re-reading a file hits the cache, every policy mounts
+*/
+TEST(v_tests, buffer_cache) {
+    block_store_t *bs = block_store_create("v_tests.bs");
+    ASSERT_NE(bs, nullptr);
+    uint8_t block[512];
+    for (size_t id = 1; id <= 200; ++id) {
+        memset(block, (int) id, sizeof(block));
+        ASSERT_EQ(block_store_write(bs, id, block), (size_t) 512);
+    }
+    buffer_cache_stats_t stats;
+    // CACHE 1
+    buffer_cache_t *cache = buffer_cache_create(bs, 4 * 512, BUFFER_CACHE_LRU);
+    ASSERT_NE(cache, nullptr);
+    for (size_t id = 1; id <= 4; ++id) {
+        ASSERT_EQ(buffer_cache_read(cache, id, block), (size_t) 512);
+        ASSERT_EQ(block[0], (uint8_t) id);
+    }
+    buffer_cache_read(cache, 1, block);
+    buffer_cache_read(cache, 5, block);
+    ASSERT_TRUE(buffer_cache_get_stats(cache, &stats));
+    ASSERT_EQ(stats.hits, (size_t) 1);
+    ASSERT_EQ(stats.misses, (size_t) 5);
+    ASSERT_EQ(stats.evictions, (size_t) 1);
+    ASSERT_EQ(stats.capacity, (size_t) 4);
+    ASSERT_EQ(stats.resident, (size_t) 4);
+    buffer_cache_read(cache, 1, block);
+    buffer_cache_read(cache, 2, block);
+    ASSERT_TRUE(buffer_cache_get_stats(cache, &stats));
+    ASSERT_EQ(stats.hits, (size_t) 2);
+    ASSERT_EQ(stats.misses, (size_t) 6);
+    buffer_cache_destroy(cache);
+    // CACHE 2
+    cache = buffer_cache_create(bs, 4 * 512, BUFFER_CACHE_CLOCK);
+    ASSERT_NE(cache, nullptr);
+    for (size_t id = 1; id <= 4; ++id) {
+        buffer_cache_read(cache, id, block);
+    }
+    buffer_cache_read(cache, 1, block);
+    buffer_cache_read(cache, 5, block);
+    buffer_cache_read(cache, 1, block);
+    ASSERT_TRUE(buffer_cache_get_stats(cache, &stats));
+    ASSERT_EQ(stats.hits, (size_t) 2);
+    buffer_cache_read(cache, 2, block);
+    ASSERT_TRUE(buffer_cache_get_stats(cache, &stats));
+    ASSERT_EQ(stats.misses, (size_t) 6);
+    buffer_cache_destroy(cache);
+    // CACHE 3
+    cache = buffer_cache_create(bs, 8 * 512, BUFFER_CACHE_ARC);
+    ASSERT_NE(cache, nullptr);
+    for (int pass = 0; pass < 2; ++pass) {
+        for (size_t id = 1; id <= 4; ++id) {
+            buffer_cache_read(cache, id, block);
+        }
+    }
+    for (size_t id = 10; id < 200; ++id) {
+        buffer_cache_read(cache, id, block);
+    }
+    ASSERT_TRUE(buffer_cache_get_stats(cache, &stats));
+    size_t hits = stats.hits;
+    for (size_t id = 1; id <= 4; ++id) {
+        ASSERT_EQ(buffer_cache_read(cache, id, block), (size_t) 512);
+        ASSERT_EQ(block[0], (uint8_t) id);
+    }
+    ASSERT_TRUE(buffer_cache_get_stats(cache, &stats));
+    ASSERT_EQ(stats.hits, hits + 4);
+    ASSERT_LE(stats.resident, (size_t) 8);
+    buffer_cache_destroy(cache);
+    cache = buffer_cache_create(bs, 8 * 512, BUFFER_CACHE_LRU);
+    ASSERT_NE(cache, nullptr);
+    for (size_t id = 1; id <= 4; ++id) {
+        buffer_cache_read(cache, id, block);
+    }
+    for (size_t id = 10; id < 200; ++id) {
+        buffer_cache_read_stream(cache, id, block);
+    }
+    ASSERT_TRUE(buffer_cache_get_stats(cache, &stats));
+    hits = stats.hits;
+    for (size_t id = 1; id <= 4; ++id) {
+        buffer_cache_read(cache, id, block);
+    }
+    ASSERT_TRUE(buffer_cache_get_stats(cache, &stats));
+    ASSERT_EQ(stats.hits, hits + 4);
+    // CACHE 4
+    memset(block, 0xee, sizeof(block));
+    ASSERT_EQ(buffer_cache_write(cache, 1, block), (size_t) 512);
+    uint8_t back[512];
+    ASSERT_EQ(buffer_cache_read(cache, 1, back), (size_t) 512);
+    ASSERT_EQ(memcmp(back, block, 512), 0);
+    ASSERT_EQ(block_store_read(bs, 1, back), (size_t) 512);
+    ASSERT_EQ(memcmp(back, block, 512), 0);
+    memset(block, 0x11, sizeof(block));
+    ASSERT_EQ(block_store_write(bs, 1, block), (size_t) 512);
+    buffer_cache_invalidate(cache, 1);
+    ASSERT_EQ(buffer_cache_read(cache, 1, back), (size_t) 512);
+    ASSERT_EQ(memcmp(back, block, 512), 0);
+    // CACHE 5
+    ASSERT_EQ(buffer_cache_create(NULL, 4096, BUFFER_CACHE_ARC), nullptr);
+    ASSERT_EQ(buffer_cache_create(bs, 511, BUFFER_CACHE_ARC), nullptr);
+    ASSERT_EQ(buffer_cache_create(bs, 4096, (buffer_cache_policy_t) 7), nullptr);
+    ASSERT_EQ(buffer_cache_read(NULL, 1, back), (size_t) 0);
+    ASSERT_EQ(buffer_cache_read(cache, 1, NULL), (size_t) 0);
+    ASSERT_EQ(buffer_cache_read(cache, 65536, back), (size_t) 0);
+    ASSERT_EQ(buffer_cache_write(NULL, 1, back), (size_t) 0);
+    ASSERT_FALSE(buffer_cache_get_stats(cache, NULL));
+    ASSERT_FALSE(buffer_cache_get_stats(NULL, &stats));
+    buffer_cache_destroy(cache);
+    block_store_destroy(bs);
+
+    // CACHE 6
+    F17FS *fs = fs_format("v_tests.F17FS");
+    ASSERT_NE(fs, nullptr);
+    ASSERT_EQ(fs_create(fs, "/file", FS_REGULAR), 0);
+    int fd = fs_open(fs, "/file");
+    ASSERT_GE(fd, 0);
+    uint8_t data[512 * 8];
+    memset(data, 0x21, sizeof(data));
+    ASSERT_EQ(fs_write(fs, fd, data, sizeof(data)), (ssize_t) sizeof(data));
+    ASSERT_EQ(fs_close(fs, fd), 0);
+    ASSERT_EQ(fs_unmount(fs), 0);
+    const buffer_cache_policy_t policies[] = {BUFFER_CACHE_ARC, BUFFER_CACHE_LRU, BUFFER_CACHE_CLOCK};
+    for (buffer_cache_policy_t policy : policies) {
+        fs_mount_options_t options = {};
+        options.cachePolicy = policy;
+        options.cacheBytes = 64 * 512;
+        fs = fs_mount_with_options("v_tests.F17FS", &options);
+        ASSERT_NE(fs, nullptr);
+        uint8_t read_back[sizeof(data)];
+        for (int pass = 0; pass < 2; ++pass) {
+            fd = fs_open(fs, "/file");
+            ASSERT_GE(fd, 0);
+            ASSERT_EQ(fs_read(fs, fd, read_back, sizeof(read_back)), (ssize_t) sizeof(read_back));
+            ASSERT_EQ(memcmp(read_back, data, sizeof(data)), 0);
+            ASSERT_EQ(fs_close(fs, fd), 0);
+        }
+        ASSERT_EQ(fs_get_cache_stats(fs, &stats), 0);
+        ASSERT_GE(stats.hits, (size_t) 8);
+        ASSERT_GT(stats.misses, (size_t) 0);
+        ASSERT_LT(fs_get_cache_stats(NULL, &stats), 0);
+        ASSERT_LT(fs_get_cache_stats(fs, NULL), 0);
+        ASSERT_EQ(fs_unmount(fs), 0);
+    }
+}
+
+/*
+   F17FS_t *fs_format(const char *path); (fast format)
+   1. Normal, a fresh image stays sparse, only the touched pages take up space
+   2. Normal, the superRoot, inode table and root directory are reserved
+   3. Normal, the lazily initialized inode table hands out every inode
+*/
+TEST(w_tests, fast_format) {
+    // FORMAT 1
+    F17FS *fs = fs_format("w_tests.F17FS");
+    ASSERT_NE(fs, nullptr);
+    ASSERT_EQ(fs_unmount(fs), 0);
+    struct stat info;
+    ASSERT_EQ(stat("w_tests.F17FS", &info), 0);
+    ASSERT_GT(info.st_size, 32 * 1024 * 1024);
+    ASSERT_LT((size_t) info.st_blocks * 512, (size_t) 1024 * 1024);
+    // FORMAT 2
+    block_store_t *bs = block_store_open("w_tests.F17FS");
+    ASSERT_NE(bs, nullptr);
+    for (size_t id = 0; id <= 33; ++id) {
+        ASSERT_FALSE(block_store_request(bs, id));
+    }
+    ASSERT_TRUE(block_store_request(bs, 34));
+    block_store_destroy(bs);
+    // FORMAT 3
+    fs = fs_mount("w_tests.F17FS");
+    ASSERT_NE(fs, nullptr);
+    char name[16];
+    for (int dir = 0; dir < 7; ++dir) {
+        sprintf(name, "/%c", 'a' + dir);
+        ASSERT_EQ(fs_create(fs, name, FS_DIRECTORY), 0);
+        for (int file = 0; file < 7; ++file) {
+            sprintf(name, "/%c/%c", 'a' + dir, 'a' + file);
+            ASSERT_EQ(fs_create(fs, name, FS_REGULAR), 0);
+        }
+    }
+    int fd = fs_open(fs, "/g/g");
+    ASSERT_GE(fd, 0);
+    ASSERT_EQ(fs_write(fs, fd, "last", 4), 4);
+    ASSERT_EQ(fs_close(fs, fd), 0);
+    ASSERT_EQ(fs_unmount(fs), 0);
+    fs = fs_mount("w_tests.F17FS");
+    ASSERT_NE(fs, nullptr);
+    fd = fs_open(fs, "/g/g");
+    ASSERT_GE(fd, 0);
+    char back[4];
+    ASSERT_EQ(fs_read(fs, fd, back, 4), 4);
+    ASSERT_EQ(memcmp(back, "last", 4), 0);
+    ASSERT_EQ(fs_unmount(fs), 0);
+}
+
+/*
+   size_t fs_get_free_blocks(F17FS_t *fs);
+   size_t fs_get_free_inodes(F17FS_t *fs);
+   1. Normal, the counters follow creates, writes and removes and match a fresh count of the image
+   2. Normal, a clean unmount leaves counts the next mount takes as they are
+   3. Normal, an image copied while mounted isn't clean, so its counts are recounted
+   4. Error, NULL F17FS
+*/
+TEST(x_tests, free_counts) {
+    // The superRoot keeps its clean flag at byte 288, the free inode count at 292
+    const size_t clean_offset = 288;
+    const size_t free_inodes_offset = 292;
+    uint8_t super_root[512];
+    uint32_t value;
+    // COUNTS 1
+    F17FS *fs = fs_format("x_tests.F17FS");
+    ASSERT_NE(fs, nullptr);
+    ASSERT_EQ(fs_get_free_inodes(fs), (size_t) 255);
+    const size_t formatted_free = fs_get_free_blocks(fs);
+    ASSERT_EQ(fs_create(fs, "/dir", FS_DIRECTORY), 0);
+    ASSERT_EQ(fs_create(fs, "/dir/file", FS_REGULAR), 0);
+    ASSERT_EQ(fs_create(fs, "/gone", FS_REGULAR), 0);
+    ASSERT_EQ(fs_get_free_inodes(fs), (size_t) 252);
+    uint8_t data[2048];
+    memset(data, 'x', sizeof(data));
+    int fd = fs_open(fs, "/dir/file");
+    ASSERT_GE(fd, 0);
+    ASSERT_EQ(fs_write(fs, fd, data, sizeof(data)), (ssize_t) sizeof(data));
+    ASSERT_EQ(fs_close(fs, fd), 0);
+    ASSERT_EQ(fs_remove(fs, "/gone"), 0);
+    ASSERT_EQ(fs_get_free_inodes(fs), (size_t) 253);
+    ASSERT_EQ(fs_sync(fs), 0);
+    const size_t synced_free = fs_get_free_blocks(fs);
+    ASSERT_EQ(synced_free, formatted_free - 5);
+    ASSERT_EQ(fs_unmount(fs), 0);
+    block_store_t *bs = block_store_open("x_tests.F17FS");
+    ASSERT_NE(bs, nullptr);
+    ASSERT_EQ(block_store_get_free_blocks(bs), synced_free);
+    ASSERT_EQ(block_store_read(bs, 0, super_root), (size_t) 512);
+    memcpy(&value, super_root + clean_offset, sizeof(value));
+    ASSERT_NE(value, (uint32_t) 0);
+    memcpy(&value, super_root + free_inodes_offset, sizeof(value));
+    ASSERT_EQ(value, (uint32_t) 253);
+    // COUNTS 2
+    value = 0;
+    memcpy(super_root + free_inodes_offset, &value, sizeof(value));
+    ASSERT_EQ(block_store_write(bs, 0, super_root), (size_t) 512);
+    block_store_destroy(bs);
+    fs = fs_mount("x_tests.F17FS");
+    ASSERT_NE(fs, nullptr);
+    ASSERT_EQ(fs_get_free_inodes(fs), (size_t) 0);
+    ASSERT_EQ(fs_get_free_blocks(fs), synced_free);
+    ASSERT_LT(fs_create(fs, "/turned_away", FS_REGULAR), 0);
+    // COUNTS 3
+    ASSERT_EQ(fs_sync(fs), 0);
+    ASSERT_EQ(system("cp x_tests.F17FS x_tests_crashed.F17FS"), 0);
+    ASSERT_EQ(fs_unmount(fs), 0);
+    F17FS *crashed = fs_mount("x_tests_crashed.F17FS");
+    ASSERT_NE(crashed, nullptr);
+    ASSERT_EQ(fs_get_free_inodes(crashed), (size_t) 253);
+    ASSERT_EQ(fs_get_free_blocks(crashed), synced_free);
+    ASSERT_EQ(fs_create(crashed, "/let_in", FS_REGULAR), 0);
+    ASSERT_EQ(fs_get_free_inodes(crashed), (size_t) 252);
+    ASSERT_EQ(fs_unmount(crashed), 0);
+    // COUNTS 4
+    ASSERT_EQ(fs_get_free_blocks(NULL), SIZE_MAX);
+    ASSERT_EQ(fs_get_free_inodes(NULL), SIZE_MAX);
+}
+
+/*
+   int fs_fsck(const char *path, bool repair, size_t threads, fs_fsck_report_t *report);
+   1. Normal, an image with direct, indirect and double indirect files checks clean on 1 and 8 threads
+   2. Normal, a leaked and an unmarked block are found, and repaired
+   3. Normal, two files pointing at one block are found, and the second gets its own copy
+   4. Normal, an entry naming a free inode dangles and an inode no directory names is an orphan, both repaired
+   5. Normal, f17fs_fsck exits 4 when it leaves problems, 1 when it repairs them and 0 when clean
+   6. Normal, a bad snapshot table pointer isn't repaired, so it is counted as unrepaired and -y exits 4
+   7. Error, NULL path, missing image
+*/
+TEST(y_tests, fsck) {
+    const char *image = "y_tests.F17FS";
+    // Raw inode access: block 1 + n / 8, 64 bytes each, direct block pointers at byte 48
+    auto inode_at = [](uint8_t *table_block, size_t inode) { return table_block + (inode % 8) * 64; };
+    uint8_t table_block[512];
+    uint8_t directory_block[512];
+    uint16_t pointer;
+    fs_fsck_report_t report;
+    // FSCK 1
+    F17FS *fs = fs_format(image);
+    ASSERT_NE(fs, nullptr);
+    ASSERT_EQ(fs_create(fs, "/d", FS_DIRECTORY), 0);      // inode 1
+    ASSERT_EQ(fs_create(fs, "/d/small", FS_REGULAR), 0);  // inode 2
+    ASSERT_EQ(fs_create(fs, "/d/big", FS_REGULAR), 0);    // inode 3
+    ASSERT_EQ(fs_create(fs, "/a", FS_REGULAR), 0);        // inode 4
+    ASSERT_EQ(fs_create(fs, "/b", FS_REGULAR), 0);        // inode 5
+    std::vector<uint8_t> big(300 * 512, 'g');
+    int fd = fs_open(fs, "/d/big");
+    ASSERT_GE(fd, 0);
+    ASSERT_EQ(fs_write(fs, fd, big.data(), big.size()), (ssize_t) big.size());
+    ASSERT_EQ(fs_close(fs, fd), 0);
+    const char *files[] = {"/d/small", "/a", "/b"};
+    const char contents[] = {'s', 'A', 'B'};
+    for (int file = 0; file < 3; ++file) {
+        uint8_t data[512];
+        memset(data, contents[file], sizeof(data));
+        fd = fs_open(fs, files[file]);
+        ASSERT_GE(fd, 0);
+        ASSERT_EQ(fs_write(fs, fd, data, sizeof(data)), (ssize_t) sizeof(data));
+        ASSERT_EQ(fs_close(fs, fd), 0);
+    }
+    ASSERT_EQ(fs_unmount(fs), 0);
+    ASSERT_EQ(fs_fsck(image, false, 1, &report), 0);
+    ASSERT_EQ(report.inodesChecked, (size_t) 6);
+    // Root and /d, 3 small files, 300 data blocks, the indirect, the double indirect and one block under it
+    ASSERT_EQ(report.blocksInUse, (size_t) 2 + 3 + 300 + 3);
+    ASSERT_EQ(report.countErrors, (size_t) 0);
+    ASSERT_EQ(report.repaired, (size_t) 0);
+    fs_fsck_report_t threaded;
+    ASSERT_EQ(fs_fsck(image, false, 8, &threaded), 0);
+    ASSERT_EQ(threaded.blocksInUse, report.blocksInUse);
+    // FSCK 2
+    block_store_t *bs = block_store_open(image);
+    ASSERT_NE(bs, nullptr);
+    ASSERT_NE(block_store_allocate(bs), SIZE_MAX);
+    ASSERT_EQ(block_store_read(bs, 1, table_block), (size_t) 512);
+    memcpy(&pointer, inode_at(table_block, 4) + 48, sizeof(pointer));
+    block_store_release(bs, pointer);
+    block_store_destroy(bs);
+    ASSERT_EQ(fs_fsck(image, false, 4, &report), 1);
+    ASSERT_EQ(report.leakedBlocks, (size_t) 1);
+    ASSERT_EQ(report.unmarkedBlocks, (size_t) 1);
+    ASSERT_EQ(report.doubleAllocated + report.badPointers + report.danglingEntries + report.orphanInodes, (size_t) 0);
+    ASSERT_EQ(report.repaired, (size_t) 0);
+    ASSERT_EQ(fs_fsck(image, false, 4, &report), 1);
+    ASSERT_EQ(fs_fsck(image, true, 4, &report), 1);
+    ASSERT_GE(report.repaired, (size_t) 2);
+    ASSERT_EQ(report.unrepaired, (size_t) 0);
+    ASSERT_EQ(fs_fsck(image, false, 4, &report), 0);
+    // FSCK 3
+    bs = block_store_open(image);
+    ASSERT_NE(bs, nullptr);
+    ASSERT_EQ(block_store_read(bs, 1, table_block), (size_t) 512);
+    memcpy(&pointer, inode_at(table_block, 4) + 48, sizeof(pointer));
+    memcpy(inode_at(table_block, 5) + 48, &pointer, sizeof(pointer));
+    ASSERT_EQ(block_store_write(bs, 1, table_block), (size_t) 512);
+    block_store_destroy(bs);
+    ASSERT_EQ(fs_fsck(image, false, 2, &report), 1);
+    ASSERT_EQ(report.doubleAllocated, (size_t) 1);
+    ASSERT_EQ(report.leakedBlocks, (size_t) 1);
+    ASSERT_EQ(fs_fsck(image, true, 2, &report), 1);
+    ASSERT_EQ(fs_fsck(image, false, 2, &report), 0);
+    fs = fs_mount(image);
+    ASSERT_NE(fs, nullptr);
+    char back[512];
+    fd = fs_open(fs, "/b");
+    ASSERT_GE(fd, 0);
+    ASSERT_EQ(fs_read(fs, fd, back, sizeof(back)), (ssize_t) sizeof(back));
+    ASSERT_EQ(back[0], 'A');
+    ASSERT_EQ(fs_seek(fs, fd, 0, FS_SEEK_SET), 0);
+    ASSERT_EQ(fs_write(fs, fd, "B", 1), 1);
+    ASSERT_EQ(fs_close(fs, fd), 0);
+    fd = fs_open(fs, "/a");
+    ASSERT_GE(fd, 0);
+    ASSERT_EQ(fs_read(fs, fd, back, sizeof(back)), (ssize_t) sizeof(back));
+    ASSERT_EQ(back[0], 'A');
+    ASSERT_EQ(fs_close(fs, fd), 0);
+    ASSERT_EQ(fs_unmount(fs), 0);
+    // FSCK 4
+    bs = block_store_open(image);
+    ASSERT_NE(bs, nullptr);
+    uint8_t super_root[512];
+    ASSERT_EQ(block_store_read(bs, 0, super_root), (size_t) 512);
+    super_root[32] &= (uint8_t) ~(1 << 2);  // inode 2, /d/small
+    ASSERT_EQ(block_store_write(bs, 0, super_root), (size_t) 512);
+    ASSERT_EQ(block_store_read(bs, 1, table_block), (size_t) 512);
+    memcpy(&pointer, inode_at(table_block, 0) + 48, sizeof(pointer));
+    ASSERT_EQ(block_store_read(bs, pointer, directory_block), (size_t) 512);
+    file_record_t *entries = (file_record_t *) directory_block;
+    for (int entry = 0; entry < 7; ++entry) {
+        if (strcmp(entries[entry].name, "a") == 0) {
+            entries[entry].inodeNumber = 0;
+        }
+    }
+    ASSERT_EQ(block_store_write(bs, pointer, directory_block), (size_t) 512);
+    block_store_destroy(bs);
+    ASSERT_EQ(fs_fsck(image, false, 3, &report), 1);
+    ASSERT_EQ(report.danglingEntries, (size_t) 1);
+    ASSERT_EQ(report.orphanInodes, (size_t) 1);
+    ASSERT_EQ(report.leakedBlocks, (size_t) 1);
+    ASSERT_EQ(fs_fsck(image, true, 3, &report), 1);
+    ASSERT_EQ(fs_fsck(image, false, 3, &report), 0);
+    fs = fs_mount(image);
+    ASSERT_NE(fs, nullptr);
+    ASSERT_LT(fs_open(fs, "/d/small"), 0);
+    ASSERT_EQ(fs_get_free_inodes(fs), (size_t) 256 - 4);
+    ASSERT_EQ(fs_unmount(fs), 0);
+    ASSERT_EQ(fs_fsck(image, false, 0, &report), 0);
+    // FSCK 5
+    bs = block_store_open(image);
+    ASSERT_NE(bs, nullptr);
+    ASSERT_NE(block_store_allocate(bs), SIZE_MAX);
+    block_store_destroy(bs);
+    int status = system("./f17fs_fsck y_tests.F17FS > /dev/null");
+    ASSERT_TRUE(WIFEXITED(status));
+    ASSERT_EQ(WEXITSTATUS(status), 4);
+    status = system("./f17fs_fsck -y -j 4 y_tests.F17FS > /dev/null");
+    ASSERT_EQ(WEXITSTATUS(status), 1);
+    status = system("./f17fs_fsck y_tests.F17FS > /dev/null");
+    ASSERT_EQ(WEXITSTATUS(status), 0);
+    // FSCK 6
+    // The snapshot table pointer sits at byte 328 of the superRoot, past the free counts; block 1 is the inode table
+    bs = block_store_open(image);
+    ASSERT_NE(bs, nullptr);
+    ASSERT_EQ(block_store_read(bs, 0, super_root), (size_t) 512);
+    pointer = 1;
+    memcpy(super_root + 328, &pointer, sizeof(pointer));
+    ASSERT_NE(block_store_allocate(bs), SIZE_MAX);
+    ASSERT_EQ(block_store_write(bs, 0, super_root), (size_t) 512);
+    block_store_destroy(bs);
+    ASSERT_EQ(fs_fsck(image, true, 2, &report), 1);
+    ASSERT_EQ(report.badPointers, (size_t) 1);
+    ASSERT_EQ(report.leakedBlocks, (size_t) 1);
+    ASSERT_GE(report.repaired, (size_t) 1);
+    ASSERT_EQ(report.unrepaired, (size_t) 1);
+    status = system("./f17fs_fsck -y y_tests.F17FS > /dev/null");
+    ASSERT_EQ(WEXITSTATUS(status), 4);
+    ASSERT_EQ(fs_fsck(image, false, 2, &report), 1);
+    ASSERT_EQ(report.badPointers, (size_t) 1);
+    ASSERT_EQ(report.leakedBlocks, (size_t) 0);
+    // FSCK 7
+    ASSERT_LT(fs_fsck(NULL, false, 1, &report), 0);
+    ASSERT_LT(fs_fsck("y_tests_missing.F17FS", false, 1, &report), 0);
+}
+
+/*
+   uint32_t crc32c(uint32_t crc, const void *data, size_t length);
+   bool block_store_set_checksums(block_store_t *const bs, const block_store_checksum_t mode, block_store_mismatch_t callback, void *arg);
+   size_t block_store_scrub(block_store_t *const bs, const size_t max_blocks);
+   1. Normal, the check value, piecewise and table-driven CRCs agree
+   2. Normal, every read is checked, a corrupted block fails and is reported until rewritten
+   3. Normal, a table left current is trusted on open; lazily a block is only checked on its first read, the scrubber finds the rest
+   4. Normal, a write with checksums off makes the next open recompute the table
+   5. Normal, a mount with checksums and a scrubber reports a corrupted file block, and the read fails
+   6. Error, NULL device, bad mode, scrubbing with checksums off
+*/
+static void count_mismatch(size_t block_id, void *arg) {
+    std::vector<size_t> *found = (std::vector<size_t> *) arg;
+    found->push_back(block_id);
+}
+
+static void corrupt_block(const char *path, size_t block_id) {
+    int fd = open(path, O_RDWR);
+    ASSERT_GE(fd, 0);
+    uint8_t byte = 0;
+    ASSERT_EQ(pread(fd, &byte, 1, (off_t) block_id * 512 + 100), 1);
+    byte ^= 0x5a;
+    ASSERT_EQ(pwrite(fd, &byte, 1, (off_t) block_id * 512 + 100), 1);
+    close(fd);
+}
+
+TEST(z_tests, checksums) {
+    // CHECKSUM 1
+    ASSERT_EQ(crc32c(0, "123456789", 9), (uint32_t) 0xe3069283);
+    ASSERT_EQ(crc32c_portable(0, "123456789", 9), (uint32_t) 0xe3069283);
+    ASSERT_EQ(crc32c(crc32c(0, "1234", 4), "56789", 5), (uint32_t) 0xe3069283);
+    uint8_t block[512];
+    for (size_t i = 0; i < sizeof(block); ++i) {
+        block[i] = (uint8_t)(i * 131 + 7);
+    }
+    ASSERT_EQ(crc32c(0, block + 3, 509), crc32c_portable(0, block + 3, 509));
+    // CHECKSUM 2
+    std::vector<size_t> found;
+    uint8_t back[512];
+    block_store_t *bs = block_store_create("z_tests.bs");
+    ASSERT_NE(bs, nullptr);
+    ASSERT_TRUE(block_store_set_checksums(bs, BLOCK_STORE_CHECKSUM_VERIFY, count_mismatch, &found));
+    ASSERT_TRUE(block_store_request(bs, 40));
+    ASSERT_TRUE(block_store_request(bs, 41));
+    ASSERT_EQ(block_store_write(bs, 40, block), (size_t) 512);
+    ASSERT_EQ(block_store_write(bs, 41, block), (size_t) 512);
+    ASSERT_EQ(block_store_read(bs, 40, back), (size_t) 512);
+    ASSERT_EQ(memcmp(back, block, sizeof(block)), 0);
+    corrupt_block("z_tests.bs", 40);
+    ASSERT_EQ(block_store_read(bs, 40, back), (size_t) 0);
+    ASSERT_EQ(block_store_read(bs, 40, back), (size_t) 0);
+    ASSERT_EQ(found.size(), (size_t) 2);
+    ASSERT_EQ(found[0], (size_t) 40);
+    ASSERT_EQ(block_store_get_checksum_errors(bs), (size_t) 2);
+    ASSERT_EQ(block_store_write(bs, 40, block), (size_t) 512);
+    ASSERT_EQ(block_store_read(bs, 40, back), (size_t) 512);
+    ASSERT_TRUE(block_store_flush(bs));
+    block_store_destroy(bs);
+    // CHECKSUM 3
+    corrupt_block("z_tests.bs", 40);
+    found.clear();
+    bs = block_store_open("z_tests.bs");
+    ASSERT_NE(bs, nullptr);
+    ASSERT_TRUE(block_store_set_checksums(bs, BLOCK_STORE_CHECKSUM_LAZY, count_mismatch, &found));
+    ASSERT_EQ(block_store_read(bs, 40, back), (size_t) 0);
+    ASSERT_EQ(block_store_read(bs, 41, back), (size_t) 512);
+    corrupt_block("z_tests.bs", 41);
+    ASSERT_EQ(block_store_read(bs, 41, back), (size_t) 512);
+    ASSERT_EQ(block_store_scrub(bs, block_store_get_total_blocks()), (size_t) 2);
+    ASSERT_EQ(found.size(), (size_t) 3);
+    ASSERT_EQ(found[2], (size_t) 41);
+    ASSERT_EQ(block_store_read(bs, 41, back), (size_t) 0);
+    block_store_destroy(bs);
+    // CHECKSUM 4
+    bs = block_store_open("z_tests.bs");
+    ASSERT_NE(bs, nullptr);
+    ASSERT_EQ(block_store_write(bs, 42, block), (size_t) 512);
+    block_store_destroy(bs);
+    bs = block_store_open("z_tests.bs");
+    ASSERT_NE(bs, nullptr);
+    ASSERT_TRUE(block_store_set_checksums(bs, BLOCK_STORE_CHECKSUM_VERIFY, NULL, NULL));
+    ASSERT_EQ(block_store_read(bs, 40, back), (size_t) 512);
+    ASSERT_EQ(block_store_read(bs, 41, back), (size_t) 512);
+    ASSERT_EQ(block_store_scrub(bs, block_store_get_total_blocks()), (size_t) 0);
+    block_store_destroy(bs);
+    // CHECKSUM 5
+    F17FS *fs = fs_format("z_tests.F17FS");
+    ASSERT_NE(fs, nullptr);
+    ASSERT_EQ(fs_unmount(fs), 0);
+    found.clear();
+    fs_mount_options_t options = {};
+    options.checksums = BLOCK_STORE_CHECKSUM_VERIFY;
+    options.scrubBlocksPerSecond = 100000;
+    options.checksumCallback = count_mismatch;
+    options.checksumArg = &found;
+    fs = fs_mount_with_options("z_tests.F17FS", &options);
+    ASSERT_NE(fs, nullptr);
+    ASSERT_EQ(fs_create(fs, "/file", FS_REGULAR), 0);
+    int fd = fs_open(fs, "/file");
+    ASSERT_GE(fd, 0);
+    ASSERT_EQ(fs_write(fs, fd, block, sizeof(block)), (ssize_t) sizeof(block));
+    ASSERT_EQ(fs_close(fs, fd), 0);
+    ASSERT_EQ(fs_sync(fs), 0);
+    // Inode 1 sits in block 1 at byte 64, its first direct block pointer 48 bytes in
+    uint16_t data_block = 0;
+    int image = open("z_tests.F17FS", O_RDONLY);
+    ASSERT_GE(image, 0);
+    ASSERT_EQ(pread(image, &data_block, sizeof(data_block), 512 + 64 + 48), (ssize_t) sizeof(data_block));
+    close(image);
+    ASSERT_NE(data_block, 0);
+    corrupt_block("z_tests.F17FS", data_block);
+    for (int wait = 0; wait < 200 && fs_get_checksum_errors(fs) == 0; ++wait) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    ASSERT_GE(fs_get_checksum_errors(fs), (size_t) 1);
+    fd = fs_open(fs, "/file");
+    ASSERT_GE(fd, 0);
+    ASSERT_LT(fs_read(fs, fd, back, sizeof(back)), 0);
+    ASSERT_EQ(fs_close(fs, fd), 0);
+    ASSERT_EQ(fs_unmount(fs), 0);
+    ASSERT_GE(found.size(), (size_t) 1);
+    ASSERT_EQ(found[0], (size_t) data_block);
+    // CHECKSUM 6
+    ASSERT_FALSE(block_store_set_checksums(NULL, BLOCK_STORE_CHECKSUM_VERIFY, NULL, NULL));
+    bs = block_store_open("z_tests.bs");
+    ASSERT_NE(bs, nullptr);
+    ASSERT_FALSE(block_store_set_checksums(bs, (block_store_checksum_t) 7, NULL, NULL));
+    ASSERT_EQ(block_store_scrub(bs, 10), SIZE_MAX);
+    ASSERT_EQ(block_store_scrub(NULL, 10), SIZE_MAX);
+    ASSERT_EQ(block_store_get_checksum_errors(NULL), SIZE_MAX);
+    ASSERT_EQ(fs_get_checksum_errors(NULL), SIZE_MAX);
+    block_store_destroy(bs);
+}
+
+/*
+   size_t lz_compress(const void *src, size_t length, void *dst, size_t capacity);
+   size_t lz_decompress(const void *src, size_t length, void *dst, size_t capacity);
+   int fs_set_compressed(F17FS_t *fs, int fd, bool compressed);
+   1. Normal, the codec round trips text, runs and noise, noise doesn't fit in less than it takes
+   2. Normal, a compressed log file takes a fraction of the blocks and reads back, also after a remount
+   3. Normal, small overwrites across chunk boundaries of a file already on disk land in the right place
+   4. Normal, incompressible data is stored as is and zeros take no blocks
+   5. Normal, a checked image of compressed files is clean
+   6. Error, NULL fs, bad descriptor, a file that already has data, malformed compressed data
+*/
+static void fill_noise(std::vector<uint8_t> &buffer, uint32_t seed) {
+    for (size_t i = 0; i < buffer.size(); ++i) {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        buffer[i] = (uint8_t) seed;
+    }
+}
+
+TEST(za_tests, compression) {
+    // COMPRESSION 1
+    std::string text;
+    for (int line = 0; text.size() < 65536; ++line) {
+        text += "2026-10-18 12:" + std::to_string(line % 60) + " INFO request " + std::to_string(line) + " served in "
+                + std::to_string(line * 7 % 100) + " ms\n";
+    }
+    std::vector<uint8_t> packed(70000);
+    std::vector<uint8_t> unpacked(65535);
+    size_t packed_length = lz_compress(text.data(), 65535, packed.data(), packed.size());
+    ASSERT_GT(packed_length, (size_t) 0);
+    ASSERT_LT(packed_length, (size_t) 65535 / 3);
+    ASSERT_EQ(lz_decompress(packed.data(), packed_length, unpacked.data(), unpacked.size()), (size_t) 65535);
+    ASSERT_EQ(memcmp(unpacked.data(), text.data(), 65535), 0);
+    std::vector<uint8_t> runs(5000, 'a');
+    packed_length = lz_compress(runs.data(), runs.size(), packed.data(), packed.size());
+    ASSERT_GT(packed_length, (size_t) 0);
+    ASSERT_LT(packed_length, (size_t) 64);
+    ASSERT_EQ(lz_decompress(packed.data(), packed_length, unpacked.data(), unpacked.size()), runs.size());
+    ASSERT_EQ(memcmp(unpacked.data(), runs.data(), runs.size()), 0);
+    std::vector<uint8_t> noise(4096);
+    fill_noise(noise, 12345);
+    ASSERT_EQ(lz_compress(noise.data(), noise.size(), packed.data(), 3582), (size_t) 0);
+    packed_length = lz_compress(noise.data(), noise.size(), packed.data(), packed.size());
+    ASSERT_GT(packed_length, noise.size());
+    ASSERT_EQ(lz_decompress(packed.data(), packed_length, unpacked.data(), unpacked.size()), noise.size());
+    ASSERT_EQ(memcmp(unpacked.data(), noise.data(), noise.size()), 0);
+    ASSERT_EQ(lz_compress("tiny", 4, packed.data(), packed.size()), (size_t) 5);
+    ASSERT_EQ(lz_decompress(packed.data(), 5, unpacked.data(), unpacked.size()), (size_t) 4);
+    // COMPRESSION 2
+    F17FS *fs = fs_format("za_tests.F17FS");
+    ASSERT_NE(fs, nullptr);
+    ASSERT_EQ(fs_create(fs, "/log", FS_REGULAR), 0);
+    int fd = fs_open(fs, "/log");
+    ASSERT_GE(fd, 0);
+    ASSERT_EQ(fs_set_compressed(fs, fd, true), 0);
+    size_t free_before = fs_get_free_blocks(fs);
+    // 256KB, 512 blocks uncompressed, written a line at a time
+    std::string log;
+    while (log.size() < 262144) {
+        log += text.substr(log.size() % 60000, 80);
+    }
+    for (size_t offset = 0; offset < log.size(); offset += 80) {
+        ASSERT_EQ(fs_write(fs, fd, log.data() + offset, 80), (ssize_t) 80);
+    }
+    ASSERT_EQ(fs_close(fs, fd), 0);
+    size_t used = free_before - fs_get_free_blocks(fs);
+    ASSERT_LT(used, (size_t) 512 / 2);
+    std::vector<char> back(log.size() + 100);
+    fd = fs_open(fs, "/log");
+    ASSERT_EQ(fs_read(fs, fd, back.data(), back.size()), (ssize_t) log.size());
+    ASSERT_EQ(memcmp(back.data(), log.data(), log.size()), 0);
+    ASSERT_EQ(fs_close(fs, fd), 0);
+    ASSERT_EQ(fs_unmount(fs), 0);
+    fs = fs_mount("za_tests.F17FS");
+    ASSERT_NE(fs, nullptr);
+    fd = fs_open(fs, "/log");
+    ASSERT_GE(fd, 0);
+    // Starting mid chunk, ending mid chunk
+    ASSERT_EQ(fs_seek(fs, fd, 5000, FS_SEEK_SET), (off_t) 5000);
+    ASSERT_EQ(fs_read(fs, fd, back.data(), 10000), (ssize_t) 10000);
+    ASSERT_EQ(memcmp(back.data(), log.data() + 5000, 10000), 0);
+    // COMPRESSION 3
+    const size_t overwrites[] = {0, 4090, 8191, 100000, 262000};
+    for (size_t offset : overwrites) {
+        ASSERT_EQ(fs_seek(fs, fd, (off_t) offset, FS_SEEK_SET), (off_t) offset);
+        ASSERT_EQ(fs_write(fs, fd, "OVERWRITTEN", 11), (ssize_t) 11);
+        log.replace(offset, 11, "OVERWRITTEN");
+    }
+    ASSERT_EQ(fs_seek(fs, fd, 0, FS_SEEK_SET), (off_t) 0);
+    ASSERT_EQ(fs_read(fs, fd, back.data(), back.size()), (ssize_t) log.size());
+    ASSERT_EQ(memcmp(back.data(), log.data(), log.size()), 0);
+    ASSERT_EQ(fs_close(fs, fd), 0);
+    ASSERT_EQ(fs_unmount(fs), 0);
+    fs = fs_mount("za_tests.F17FS");
+    ASSERT_NE(fs, nullptr);
+    fd = fs_open(fs, "/log");
+    ASSERT_EQ(fs_read(fs, fd, back.data(), back.size()), (ssize_t) log.size());
+    ASSERT_EQ(memcmp(back.data(), log.data(), log.size()), 0);
+    ASSERT_EQ(fs_close(fs, fd), 0);
+    // COMPRESSION 4
+    ASSERT_EQ(fs_create(fs, "/noise", FS_REGULAR), 0);
+    fd = fs_open(fs, "/noise");
+    ASSERT_EQ(fs_set_compressed(fs, fd, true), 0);
+    std::vector<uint8_t> data(8192);
+    fill_noise(data, 777);
+    free_before = fs_get_free_blocks(fs);
+    ASSERT_EQ(fs_write(fs, fd, data.data(), data.size()), (ssize_t) data.size());
+    // Two chunks of zeros, then a block of noise in the chunk after them
+    std::vector<uint8_t> zeros(4096, 0);
+    ASSERT_EQ(fs_write(fs, fd, zeros.data(), zeros.size()), (ssize_t) zeros.size());
+    ASSERT_EQ(fs_write(fs, fd, zeros.data(), zeros.size()), (ssize_t) zeros.size());
+    ASSERT_EQ(fs_write(fs, fd, data.data(), 512), (ssize_t) 512);
+    ASSERT_EQ(fs_close(fs, fd), 0);
+    // Two raw chunks and one packed block of noise, plus two pointer blocks
+    used = free_before - fs_get_free_blocks(fs);
+    ASSERT_GE(used, (size_t) 16 + 2);
+    ASSERT_LE(used, (size_t) 16 + 2 + 2);
+    fd = fs_open(fs, "/noise");
+    std::vector<uint8_t> read_back(16896);
+    ASSERT_EQ(fs_read(fs, fd, read_back.data(), read_back.size()), (ssize_t) read_back.size());
+    ASSERT_EQ(memcmp(read_back.data(), data.data(), 8192), 0);
+    ASSERT_EQ(memcmp(read_back.data() + 8192, zeros.data(), 4096), 0);
+    ASSERT_EQ(memcmp(read_back.data() + 12288, zeros.data(), 4096), 0);
+    ASSERT_EQ(memcmp(read_back.data() + 16384, data.data(), 512), 0);
+    // COMPRESSION 6
+    ASSERT_LT(fs_set_compressed(NULL, fd, true), 0);
+    ASSERT_LT(fs_set_compressed(fs, -1, true), 0);
+    ASSERT_LT(fs_set_compressed(fs, fd, false), 0);
+    ASSERT_EQ(fs_close(fs, fd), 0);
+    ASSERT_LT(fs_set_compressed(fs, fd, true), 0);
+    ASSERT_EQ(lz_decompress("\xf0", 1, unpacked.data(), unpacked.size()), SIZE_MAX);
+    ASSERT_EQ(lz_decompress("\x10" "a" "\x05\x00", 4, unpacked.data(), unpacked.size()), SIZE_MAX);
+    ASSERT_EQ(lz_decompress(packed.data(), packed_length, unpacked.data(), 10), SIZE_MAX);
+    ASSERT_EQ(fs_unmount(fs), 0);
+    // COMPRESSION 5
+    fs_fsck_report_t report;
+    ASSERT_EQ(fs_fsck("za_tests.F17FS", false, 2, &report), 0);
+}
+
+/*
+   uint64_t dedup_hash(const void *const block);
+   bool block_store_share(block_store_t *const bs, const size_t block_id);
+   int fs_get_dedup_stats(F17FS_t *fs, fs_dedup_stats_t *stats);
+   1. Normal, the hash tells blocks apart, a block is only shared once marked shareable and only freed by its last owner
+   2. Normal, a copy of a file takes no data blocks, and the stats say so
+   3. Normal, writing into a shared block copies it, the other file keeps its bytes, also on a mount without dedup
+   4. Normal, removing the files gives every block back
+   5. Normal, fsck accepts shared blocks, and finds and repairs a wrong owner count
+   6. Normal, a snapshot on a mount without dedup doesn't count as sharing
+   7. Error, NULL fs and stats, blocks that aren't shareable
+*/
+static void fill_pattern(std::vector<uint8_t> &buffer, size_t seed) {
+    for (size_t i = 0; i < buffer.size(); ++i) {
+        buffer[i] = (uint8_t)((i / 512 + seed) * 37 + i % 512);
+    }
+}
+
+TEST(zb_tests, dedup) {
+    // DEDUP 1
+    std::vector<uint8_t> block(512, 1);
+    uint64_t hash = dedup_hash(block.data());
+    ASSERT_EQ(dedup_hash(block.data()), hash);
+    block[511] = 2;
+    ASSERT_NE(dedup_hash(block.data()), hash);
+    block_store_t *bs = block_store_create("zb_tests.bs");
+    ASSERT_NE(bs, nullptr);
+    ASSERT_TRUE(block_store_request(bs, 100));
+    ASSERT_EQ(block_store_get_refs(bs, 100), (size_t) 1);
+    ASSERT_FALSE(block_store_share(bs, 100));
+    ASSERT_TRUE(block_store_mark_shareable(bs, 100));
+    ASSERT_TRUE(block_store_share(bs, 100));
+    ASSERT_EQ(block_store_get_refs(bs, 100), (size_t) 2);
+    ASSERT_EQ(block_store_get_extra_refs(bs), (size_t) 1);
+    ASSERT_FALSE(block_store_make_private(bs, 100));
+    size_t free_blocks = block_store_get_free_blocks(bs);
+    block_store_release(bs, 100);
+    ASSERT_EQ(block_store_get_refs(bs, 100), (size_t) 1);
+    ASSERT_EQ(block_store_get_free_blocks(bs), free_blocks);
+    ASSERT_TRUE(block_store_make_private(bs, 100));
+    ASSERT_FALSE(block_store_share(bs, 100));
+    block_store_release(bs, 100);
+    ASSERT_EQ(block_store_get_refs(bs, 100), (size_t) 0);
+    ASSERT_EQ(block_store_get_free_blocks(bs), free_blocks + 1);
+    block_store_destroy(bs);
+    // DEDUP 2
+    F17FS *fs = fs_format("zb_tests.F17FS");
+    ASSERT_NE(fs, nullptr);
+    ASSERT_EQ(fs_unmount(fs), 0);
+    fs_mount_options_t options = {};
+    options.dedup = true;
+    fs = fs_mount_with_options("zb_tests.F17FS", &options);
+    ASSERT_NE(fs, nullptr);
+    size_t free_before = fs_get_free_blocks(fs);
+    // 40 different blocks, one indirect block
+    std::vector<uint8_t> data(40 * 512);
+    fill_pattern(data, 0);
+    ASSERT_EQ(fs_create(fs, "/original", FS_REGULAR), 0);
+    int fd = fs_open(fs, "/original");
+    ASSERT_EQ(fs_write(fs, fd, data.data(), data.size()), (ssize_t) data.size());
+    ASSERT_EQ(fs_close(fs, fd), 0);
+    ASSERT_EQ(free_before - fs_get_free_blocks(fs), (size_t) 41);
+    ASSERT_EQ(fs_create(fs, "/copy", FS_REGULAR), 0);
+    fd = fs_open(fs, "/copy");
+    // Unaligned, so some blocks are staged and some written through
+    ASSERT_EQ(fs_write(fs, fd, data.data(), 1000), (ssize_t) 1000);
+    ASSERT_EQ(fs_write(fs, fd, data.data() + 1000, data.size() - 1000), (ssize_t) data.size() - 1000);
+    ASSERT_EQ(fs_close(fs, fd), 0);
+    ASSERT_EQ(free_before - fs_get_free_blocks(fs), (size_t) 42);
+    fs_dedup_stats_t stats;
+    ASSERT_EQ(fs_get_dedup_stats(fs, &stats), 0);
+    ASSERT_EQ(stats.lookups, (size_t) 80);
+    ASSERT_EQ(stats.hits, (size_t) 40);
+    ASSERT_EQ(stats.sharedBlocks, (size_t) 40);
+    ASSERT_EQ(stats.dataBlocks, (size_t) 40);
+    ASSERT_EQ(stats.ratio, 2.0);
+    std::vector<uint8_t> back(data.size());
+    fd = fs_open(fs, "/copy");
+    ASSERT_EQ(fs_read(fs, fd, back.data(), back.size()), (ssize_t) back.size());
+    ASSERT_EQ(memcmp(back.data(), data.data(), data.size()), 0);
+    // DEDUP 3
+    ASSERT_EQ(fs_seek(fs, fd, 512 * 10 + 3, FS_SEEK_SET), (off_t)(512 * 10 + 3));
+    ASSERT_EQ(fs_write(fs, fd, "changed", 7), (ssize_t) 7);
+    ASSERT_EQ(fs_close(fs, fd), 0);
+    ASSERT_EQ(free_before - fs_get_free_blocks(fs), (size_t) 43);
+    ASSERT_EQ(fs_unmount(fs), 0);
+    fs = fs_mount("zb_tests.F17FS");
+    ASSERT_NE(fs, nullptr);
+    fd = fs_open(fs, "/copy");
+    ASSERT_EQ(fs_seek(fs, fd, 512 * 20, FS_SEEK_SET), (off_t)(512 * 20));
+    ASSERT_EQ(fs_write(fs, fd, "again", 5), (ssize_t) 5);
+    ASSERT_EQ(fs_seek(fs, fd, 0, FS_SEEK_SET), (off_t) 0);
+    ASSERT_EQ(fs_read(fs, fd, back.data(), back.size()), (ssize_t) back.size());
+    std::vector<uint8_t> expected = data;
+    memcpy(expected.data() + 512 * 10 + 3, "changed", 7);
+    memcpy(expected.data() + 512 * 20, "again", 5);
+    ASSERT_EQ(memcmp(back.data(), expected.data(), expected.size()), 0);
+    ASSERT_EQ(fs_close(fs, fd), 0);
+    fd = fs_open(fs, "/original");
+    ASSERT_EQ(fs_read(fs, fd, back.data(), back.size()), (ssize_t) back.size());
+    ASSERT_EQ(memcmp(back.data(), data.data(), data.size()), 0);
+    ASSERT_EQ(fs_close(fs, fd), 0);
+    ASSERT_EQ(fs_unmount(fs), 0);
+    // DEDUP 5
+    fs_fsck_report_t report;
+    ASSERT_EQ(fs_fsck("zb_tests.F17FS", false, 2, &report), 0);
+    bs = block_store_open("zb_tests.F17FS");
+    ASSERT_NE(bs, nullptr);
+    size_t shared = 0;
+    for (size_t id = 0; id < block_store_get_total_blocks() && shared == 0; ++id) {
+        if (block_store_get_refs(bs, id) == 2) {
+            shared = id;
+        }
+    }
+    ASSERT_NE(shared, (size_t) 0);
+    ASSERT_TRUE(block_store_set_refs(bs, shared, 3));
+    ASSERT_TRUE(block_store_flush(bs));
+    block_store_destroy(bs);
+    ASSERT_EQ(fs_fsck("zb_tests.F17FS", true, 2, &report), 1);
+    ASSERT_EQ(report.refcountErrors, (size_t) 1);
+    ASSERT_EQ(fs_fsck("zb_tests.F17FS", false, 2, &report), 0);
+    // DEDUP 4
+    fs = fs_mount_with_options("zb_tests.F17FS", &options);
+    ASSERT_NE(fs, nullptr);
+    ASSERT_EQ(fs_remove(fs, "/original"), 0);
+    fd = fs_open(fs, "/copy");
+    ASSERT_EQ(fs_read(fs, fd, back.data(), back.size()), (ssize_t) back.size());
+    ASSERT_EQ(memcmp(back.data(), expected.data(), expected.size()), 0);
+    ASSERT_EQ(fs_close(fs, fd), 0);
+    ASSERT_EQ(fs_remove(fs, "/copy"), 0);
+    ASSERT_EQ(fs_sync(fs), 0);
+    ASSERT_EQ(fs_get_free_blocks(fs), free_before);
+    ASSERT_EQ(fs_get_dedup_stats(fs, &stats), 0);
+    ASSERT_EQ(stats.sharedBlocks, (size_t) 0);
+    ASSERT_EQ(stats.dataBlocks, (size_t) 0);
+    ASSERT_EQ(stats.ratio, 1.0);
+    ASSERT_EQ(fs_unmount(fs), 0);
+    // DEDUP 6
+    fs = fs_mount("zb_tests.F17FS");
+    ASSERT_NE(fs, nullptr);
+    ASSERT_EQ(fs_create(fs, "/original", FS_REGULAR), 0);
+    fd = fs_open(fs, "/original");
+    ASSERT_EQ(fs_write(fs, fd, data.data(), data.size()), (ssize_t) data.size());
+    ASSERT_EQ(fs_close(fs, fd), 0);
+    ASSERT_EQ(fs_snapshot_create(fs, "before"), 0);
+    ASSERT_EQ(fs_get_dedup_stats(fs, &stats), 0);
+    ASSERT_EQ(stats.sharedBlocks, (size_t) 0);
+    ASSERT_EQ(stats.dataBlocks, (size_t) 40);
+    ASSERT_EQ(stats.ratio, 1.0);
+    ASSERT_EQ(fs_snapshot_delete(fs, "before"), 0);
+    ASSERT_EQ(fs_remove(fs, "/original"), 0);
+    // DEDUP 7
+    ASSERT_LT(fs_get_dedup_stats(NULL, &stats), 0);
+    ASSERT_LT(fs_get_dedup_stats(fs, NULL), 0);
+    ASSERT_EQ(fs_unmount(fs), 0);
+    ASSERT_EQ(dedup_open(NULL, NULL, 0), nullptr);
+    ASSERT_FALSE(block_store_share(NULL, 100));
+    ASSERT_FALSE(block_store_mark_shareable(NULL, 100));
+    ASSERT_EQ(block_store_get_refs(NULL, 100), (size_t) 0);
+    ASSERT_FALSE(block_store_set_refs(NULL, 100, 1));
+    ASSERT_EQ(block_store_get_extra_refs(NULL), SIZE_MAX);
+    bs = block_store_open("zb_tests.bs");
+    ASSERT_NE(bs, nullptr);
+    ASSERT_FALSE(block_store_mark_shareable(bs, 200));
+    ASSERT_FALSE(block_store_set_refs(bs, 200, 2));
+    ASSERT_TRUE(block_store_request(bs, 200));
+    ASSERT_FALSE(block_store_set_refs(bs, 200, 0));
+    block_store_destroy(bs);
+}
+
+/*
+   int fs_snapshot_create(F17FS_t *fs, const char *name);
+   int fs_snapshot_delete(F17FS_t *fs, const char *name);
+   dyn_array_t *fs_snapshot_list(F17FS_t *fs);
+   F17FS_t *fs_mount_with_options(const char *path, const fs_mount_options_t *options);
+   1. Normal, a snapshot takes the same few blocks whatever the files hold, and is listed
+   2. Normal, the live tree changes after it (direct, indirect and double indirect blocks, directories), the snapshot mounts as it was
+   3. Normal, fsck walks the snapshots too
+   4. Normal, deleting snapshots gives back what only they held, and everything once the files go too
+   5. Error, a snapshot mount refuses every change
+   6. Error, NULL fs and names, bad and taken names, unknown snapshots, too many of them
+*/
+TEST(zc_tests, snapshot) {
+    // SNAPSHOT 1
+    F17FS *fs = fs_format("zc_tests.F17FS");
+    ASSERT_NE(fs, nullptr);
+    size_t free_empty = fs_get_free_blocks(fs);
+    ASSERT_EQ(fs_create(fs, "/dir", FS_DIRECTORY), 0);
+    ASSERT_EQ(fs_create(fs, "/dir/big", FS_REGULAR), 0);
+    ASSERT_EQ(fs_create(fs, "/small", FS_REGULAR), 0);
+    // Past INDIRECT_END, so it has a double indirect block
+    std::vector<uint8_t> big(300 * 512);
+    fill_pattern(big, 1);
+    int fd = fs_open(fs, "/dir/big");
+    ASSERT_EQ(fs_write(fs, fd, big.data(), big.size()), (ssize_t) big.size());
+    ASSERT_EQ(fs_close(fs, fd), 0);
+    fd = fs_open(fs, "/small");
+    ASSERT_EQ(fs_write(fs, fd, "before", 6), (ssize_t) 6);
+    ASSERT_EQ(fs_close(fs, fd), 0);
+    size_t free_before = fs_get_free_blocks(fs);
+    ASSERT_EQ(fs_snapshot_create(fs, "monday"), 0);
+    // The table, a header and a copy of the inode table
+    ASSERT_EQ(free_before - fs_get_free_blocks(fs), (size_t) 34);
+    free_before = fs_get_free_blocks(fs);
+    ASSERT_EQ(fs_snapshot_create(fs, "tuesday"), 0);
+    ASSERT_EQ(free_before - fs_get_free_blocks(fs), (size_t) 33);
+    dyn_array_t *snapshots = fs_snapshot_list(fs);
+    ASSERT_NE(snapshots, nullptr);
+    ASSERT_EQ(dyn_array_size(snapshots), (size_t) 2);
+    ASSERT_STREQ(((fs_snapshot_t *) dyn_array_at(snapshots, 0))->name, "monday");
+    ASSERT_STREQ(((fs_snapshot_t *) dyn_array_at(snapshots, 1))->name, "tuesday");
+    ASSERT_NE(((fs_snapshot_t *) dyn_array_at(snapshots, 0))->createTime, (time_t) 0);
+    dyn_array_destroy(snapshots);
+    // SNAPSHOT 2
+    std::vector<uint8_t> changed = big;
+    std::vector<uint8_t> block(512, 'C');
+    fd = fs_open(fs, "/dir/big");
+    ASSERT_EQ(fs_seek(fs, fd, 5 * 512, FS_SEEK_SET), (off_t)(5 * 512));
+    ASSERT_EQ(fs_write(fs, fd, "AAAA", 4), (ssize_t) 4);
+    memcpy(changed.data() + 5 * 512, "AAAA", 4);
+    ASSERT_EQ(fs_seek(fs, fd, 100 * 512 + 7, FS_SEEK_SET), (off_t)(100 * 512 + 7));
+    ASSERT_EQ(fs_write(fs, fd, "BBBB", 4), (ssize_t) 4);
+    memcpy(changed.data() + 100 * 512 + 7, "BBBB", 4);
+    ASSERT_EQ(fs_seek(fs, fd, 290 * 512, FS_SEEK_SET), (off_t)(290 * 512));
+    ASSERT_EQ(fs_write(fs, fd, block.data(), 512), (ssize_t) 512);
+    memcpy(changed.data() + 290 * 512, block.data(), 512);
+    ASSERT_EQ(fs_close(fs, fd), 0);
+    ASSERT_EQ(fs_remove(fs, "/small"), 0);
+    ASSERT_EQ(fs_create(fs, "/dir/new", FS_REGULAR), 0);
+    std::vector<uint8_t> back(big.size());
+    fd = fs_open(fs, "/dir/big");
+    ASSERT_EQ(fs_read(fs, fd, back.data(), back.size()), (ssize_t) back.size());
+    ASSERT_EQ(memcmp(back.data(), changed.data(), changed.size()), 0);
+    ASSERT_EQ(fs_close(fs, fd), 0);
+    ASSERT_LT(fs_open(fs, "/small"), 0);
+    ASSERT_EQ(fs_unmount(fs), 0);
+    fs_mount_options_t options = {};
+    options.snapshot = "monday";
+    fs = fs_mount_with_options("zc_tests.F17FS", &options);
+    ASSERT_NE(fs, nullptr);
+    fd = fs_open(fs, "/dir/big");
+    ASSERT_GE(fd, 0);
+    ASSERT_EQ(fs_read(fs, fd, back.data(), back.size()), (ssize_t) back.size());
+    ASSERT_EQ(memcmp(back.data(), big.data(), big.size()), 0);
+    // SNAPSHOT 5
+    ASSERT_LT(fs_write(fs, fd, "x", 1), 0);
+    ASSERT_LT(fs_set_compressed(fs, fd, true), 0);
+    ASSERT_EQ(fs_close(fs, fd), 0);
+    ASSERT_LT(fs_open(fs, "/dir/new"), 0);
+    char text[6];
+    fd = fs_open(fs, "/small");
+    ASSERT_EQ(fs_read(fs, fd, text, 6), (ssize_t) 6);
+    ASSERT_EQ(memcmp(text, "before", 6), 0);
+    ASSERT_EQ(fs_close(fs, fd), 0);
+    ASSERT_LT(fs_create(fs, "/other", FS_REGULAR), 0);
+    ASSERT_LT(fs_remove(fs, "/small"), 0);
+    ASSERT_LT(fs_link(fs, "/small", "/dir/small"), 0);
+    ASSERT_LT(fs_move(fs, "/small", "/dir/small"), 0);
+    ASSERT_LT(fs_snapshot_create(fs, "wednesday"), 0);
+    ASSERT_LT(fs_snapshot_delete(fs, "tuesday"), 0);
+    ASSERT_EQ(fs_unmount(fs), 0);
+    options.snapshot = "sunday";
+    ASSERT_EQ(fs_mount_with_options("zc_tests.F17FS", &options), nullptr);
+    // SNAPSHOT 3
+    fs_fsck_report_t report;
+    ASSERT_EQ(fs_fsck("zc_tests.F17FS", false, 2, &report), 0);
+    ASSERT_EQ(report.inodesChecked, (size_t) 4);
+    // SNAPSHOT 4
+    fs = fs_mount("zc_tests.F17FS");
+    ASSERT_NE(fs, nullptr);
+    free_before = fs_get_free_blocks(fs);
+    ASSERT_EQ(fs_snapshot_delete(fs, "tuesday"), 0);
+    // Everything else tuesday had, monday has too
+    ASSERT_EQ(fs_get_free_blocks(fs) - free_before, (size_t) 33);
+    free_before = fs_get_free_blocks(fs);
+    ASSERT_EQ(fs_snapshot_delete(fs, "monday"), 0);
+    // Its metadata and the table, then the old data blocks, pointer blocks and directories, and /small
+    ASSERT_EQ(fs_get_free_blocks(fs) - free_before, (size_t)(34 + 3 + 3 + 2 + 1));
+    snapshots = fs_snapshot_list(fs);
+    ASSERT_NE(snapshots, nullptr);
+    ASSERT_EQ(dyn_array_size(snapshots), (size_t) 0);
+    dyn_array_destroy(snapshots);
+    fd = fs_open(fs, "/dir/big");
+    ASSERT_EQ(fs_read(fs, fd, back.data(), back.size()), (ssize_t) back.size());
+    ASSERT_EQ(memcmp(back.data(), changed.data(), changed.size()), 0);
+    ASSERT_EQ(fs_close(fs, fd), 0);
+    ASSERT_EQ(fs_unmount(fs), 0);
+    ASSERT_EQ(fs_fsck("zc_tests.F17FS", false, 2, &report), 0);
+    fs = fs_mount("zc_tests.F17FS");
+    ASSERT_NE(fs, nullptr);
+    ASSERT_EQ(fs_snapshot_create(fs, "again"), 0);
+    ASSERT_EQ(fs_remove(fs, "/dir/big"), 0);
+    ASSERT_EQ(fs_remove(fs, "/dir/new"), 0);
+    ASSERT_EQ(fs_remove(fs, "/dir"), 0);
+    ASSERT_EQ(fs_snapshot_delete(fs, "again"), 0);
+    ASSERT_EQ(fs_sync(fs), 0);
+    ASSERT_EQ(fs_get_free_blocks(fs), free_empty);
+    // SNAPSHOT 6
+    ASSERT_LT(fs_snapshot_create(NULL, "name"), 0);
+    ASSERT_LT(fs_snapshot_create(fs, NULL), 0);
+    ASSERT_LT(fs_snapshot_create(fs, ""), 0);
+    ASSERT_LT(fs_snapshot_create(fs, std::string(FS_FNAME_MAX, 'n').c_str()), 0);
+    ASSERT_LT(fs_snapshot_delete(NULL, "name"), 0);
+    ASSERT_LT(fs_snapshot_delete(fs, NULL), 0);
+    ASSERT_LT(fs_snapshot_delete(fs, "name"), 0);
+    ASSERT_EQ(fs_snapshot_list(NULL), nullptr);
+    for (int i = 0; i < FS_SNAPSHOT_MAX; ++i) {
+        ASSERT_EQ(fs_snapshot_create(fs, std::to_string(i).c_str()), 0);
+    }
+    ASSERT_LT(fs_snapshot_create(fs, "one more"), 0);
+    ASSERT_LT(fs_snapshot_create(fs, "0"), 0);
+    for (int i = 0; i < FS_SNAPSHOT_MAX; ++i) {
+        ASSERT_EQ(fs_snapshot_delete(fs, std::to_string(i).c_str()), 0);
+    }
+    ASSERT_EQ(fs_get_free_blocks(fs), free_empty);
+    ASSERT_EQ(fs_unmount(fs), 0);
+    ASSERT_EQ(fs_fsck("zc_tests.F17FS", false, 2, &report), 0);
+}
+
+/*
+   uint32_t block_store_get_generation(const block_store_t *const bs);
+   size_t block_store_export_incremental(block_store_t *const bs, const uint32_t since_gen, const char *const filename);
+   size_t block_store_apply_incremental(block_store_t *const bs, const char *const filename);
+   size_t block_store_serialize(const block_store_t *const bs, const char *const filename);
+   1. Normal, an export since 0 carries the allocated blocks, FBM and reference table, and makes a copy
+   2. Normal, an incremental export carries only what changed, freed blocks going as FBM changes
+   3. Normal, generations and stamps survive reopening, an export with nothing changed is just its header
+   4. Normal, a block gaining an owner sends its reference word along
+   5. Normal, serialize writes the FBM's bits, not the bitmap's struct
+   6. Error, a delta for another generation, a garbage file, NULL arguments, missing files
+*/
+static size_t file_size(const char *path) {
+    struct stat info;
+    return stat(path, &info) == 0 ? (size_t) info.st_size : SIZE_MAX;
+}
+
+TEST(zd_tests, incremental) {
+    uint8_t block[512];
+    uint8_t back[512];
+    // INCREMENTAL 1
+    block_store_t *bs = block_store_create("zd_tests.bs");
+    ASSERT_NE(bs, nullptr);
+    ASSERT_EQ(block_store_get_generation(bs), (uint32_t) 1);
+    for (size_t i = 40; i < 50; ++i) {
+        memset(block, (int) i, sizeof(block));
+        ASSERT_TRUE(block_store_request(bs, i));
+        ASSERT_EQ(block_store_write(bs, i, block), (size_t) 512);
+    }
+    // Blocks 40-49, the 16 FBM blocks and the 256 reference table blocks, in three runs
+    ASSERT_EQ(block_store_export_incremental(bs, 0, "zd_tests_full.delta"), (size_t) (16 + 3 * 8 + 282 * 512));
+    ASSERT_EQ(file_size("zd_tests_full.delta"), (size_t) (16 + 3 * 8 + 282 * 512));
+    ASSERT_EQ(block_store_get_generation(bs), (uint32_t) 2);
+    block_store_t *backup = block_store_create("zd_tests_backup.bs");
+    ASSERT_NE(backup, nullptr);
+    ASSERT_EQ(block_store_apply_incremental(backup, "zd_tests_full.delta"), (size_t) 282);
+    ASSERT_EQ(block_store_get_generation(backup), (uint32_t) 2);
+    ASSERT_EQ(block_store_get_used_blocks(backup), block_store_get_used_blocks(bs));
+    ASSERT_EQ(block_store_read(backup, 45, back), (size_t) 512);
+    memset(block, 45, sizeof(block));
+    ASSERT_EQ(memcmp(back, block, sizeof(block)), 0);
+    // INCREMENTAL 2
+    memset(block, 0xa5, sizeof(block));
+    ASSERT_EQ(block_store_write(bs, 45, block), (size_t) 512);
+    ASSERT_TRUE(block_store_request(bs, 60));
+    ASSERT_EQ(block_store_write(bs, 60, block), (size_t) 512);
+    block_store_release(bs, 41);
+    // Blocks 45 and 60 and the first FBM block; block 41 only as its bit
+    ASSERT_EQ(block_store_export_incremental(bs, 2, "zd_tests_1.delta"), (size_t) (16 + 3 * 8 + 3 * 512));
+    ASSERT_EQ(block_store_get_generation(bs), (uint32_t) 3);
+    ASSERT_EQ(block_store_apply_incremental(backup, "zd_tests_1.delta"), (size_t) 3);
+    ASSERT_EQ(block_store_get_generation(backup), (uint32_t) 3);
+    ASSERT_EQ(block_store_read(backup, 45, back), (size_t) 512);
+    ASSERT_EQ(memcmp(back, block, sizeof(block)), 0);
+    ASSERT_EQ(block_store_read(backup, 60, back), (size_t) 512);
+    ASSERT_EQ(memcmp(back, block, sizeof(block)), 0);
+    ASSERT_EQ(block_store_get_used_blocks(backup), block_store_get_used_blocks(bs));
+    ASSERT_EQ(block_store_get_free_blocks(backup), block_store_get_free_blocks(bs));
+    ASSERT_TRUE(block_store_request(backup, 41));
+    block_store_release(backup, 41);
+    ASSERT_TRUE(block_store_flush(bs));
+    block_store_destroy(bs);
+    block_store_destroy(backup);
+    // INCREMENTAL 3
+    bs = block_store_open("zd_tests.bs");
+    backup = block_store_open("zd_tests_backup.bs");
+    ASSERT_NE(bs, nullptr);
+    ASSERT_NE(backup, nullptr);
+    ASSERT_EQ(block_store_get_generation(bs), (uint32_t) 3);
+    ASSERT_EQ(block_store_get_generation(backup), (uint32_t) 3);
+    ASSERT_EQ(block_store_export_incremental(bs, 3, "zd_tests_2.delta"), (size_t) 16);
+    ASSERT_EQ(block_store_apply_incremental(backup, "zd_tests_2.delta"), (size_t) 0);
+    ASSERT_EQ(block_store_get_generation(backup), (uint32_t) 4);
+    // An export since an older generation still has everything after it
+    ASSERT_EQ(block_store_export_incremental(bs, 2, "zd_tests_3.delta"), (size_t) (16 + 3 * 8 + 3 * 512));
+    ASSERT_EQ(block_store_get_generation(bs), (uint32_t) 5);
+    // INCREMENTAL 4
+    ASSERT_TRUE(block_store_mark_shareable(bs, 45));
+    ASSERT_TRUE(block_store_share(bs, 45));
+    ASSERT_EQ(block_store_export_incremental(bs, 5, "zd_tests_4.delta"), (size_t) (16 + 8 + 512));
+    // The backup skipped generation 4's (empty) delta, so it has to be brought up with the full one
+    ASSERT_EQ(block_store_apply_incremental(backup, "zd_tests_4.delta"), SIZE_MAX);
+    ASSERT_EQ(block_store_apply_incremental(backup, "zd_tests_3.delta"), SIZE_MAX);
+    // Blocks 40, 42-49 and 60 now, five runs
+    ASSERT_EQ(block_store_export_incremental(bs, 0, "zd_tests_full.delta"), (size_t) (16 + 5 * 8 + 282 * 512));
+    ASSERT_EQ(block_store_apply_incremental(backup, "zd_tests_full.delta"), (size_t) 282);
+    ASSERT_EQ(block_store_get_generation(backup), (uint32_t) 7);
+    ASSERT_EQ(block_store_get_refs(backup, 45), (size_t) 2);
+    ASSERT_EQ(block_store_get_extra_refs(backup), (size_t) 1);
+    block_store_release(bs, 45);
+    ASSERT_EQ(block_store_export_incremental(bs, 7, "zd_tests_5.delta"), (size_t) (16 + 8 + 512));
+    ASSERT_EQ(block_store_apply_incremental(backup, "zd_tests_5.delta"), (size_t) 1);
+    ASSERT_EQ(block_store_get_refs(backup, 45), (size_t) 1);
+    ASSERT_EQ(block_store_get_extra_refs(backup), (size_t) 0);
+    // INCREMENTAL 5
+    ASSERT_NE(block_store_serialize(bs, "zd_tests.img"), (size_t) 0);
+    ASSERT_EQ(file_size("zd_tests.img"), (size_t) 65536 * 512 * 9 / 8);
+    uint8_t fbm[512];
+    ASSERT_EQ(block_store_read_fbm(bs, 0, fbm), (size_t) 512);
+    int fd = open("zd_tests.img", O_RDONLY);
+    ASSERT_GE(fd, 0);
+    ASSERT_EQ(pread(fd, back, sizeof(back), (off_t) 65520 * 512), (ssize_t) sizeof(back));
+    close(fd);
+    ASSERT_EQ(memcmp(back, fbm, sizeof(fbm)), 0);
+    // INCREMENTAL 6
+    ASSERT_EQ(block_store_apply_incremental(backup, "zd_tests_5.delta"), SIZE_MAX);
+    ASSERT_EQ(block_store_apply_incremental(backup, "zd_tests.img"), SIZE_MAX);
+    ASSERT_EQ(block_store_apply_incremental(backup, "zd_tests_missing.delta"), SIZE_MAX);
+    ASSERT_EQ(block_store_apply_incremental(NULL, "zd_tests_5.delta"), SIZE_MAX);
+    ASSERT_EQ(block_store_apply_incremental(backup, NULL), SIZE_MAX);
+    ASSERT_EQ(block_store_export_incremental(NULL, 0, "zd_tests_6.delta"), (size_t) 0);
+    ASSERT_EQ(block_store_export_incremental(bs, 0, NULL), (size_t) 0);
+    ASSERT_EQ(block_store_export_incremental(bs, 0, "zd_tests_missing/x.delta"), (size_t) 0);
+    ASSERT_EQ(block_store_get_generation(NULL), (uint32_t) 0);
+    block_store_destroy(bs);
+    block_store_destroy(backup);
+}
+
+/*
+   size_t block_store_serialize(const block_store_t *const bs, const char *const filename);
+   block_store_t *block_store_deserialize(const char *const filename);
+   1. Normal, only allocated blocks and extension blocks in use are written, the rest of the image is holes
+   2. Normal, a loaded image reads back, and changes to it stay in memory
+   3. Normal, serializing a loaded device writes its changes, the image opens as a device file
+   4. Normal, a formatted F17FS round-trips and mounts from the image
+   5. Normal, an image without the extension area loads with it zeroed
+   6. Error, NULL arguments, missing and short files, unwritable destination
+*/
+TEST(ze_tests, serialize) {
+    uint8_t block[512];
+    uint8_t back[512];
+    // SERIALIZE 1
+    block_store_t *bs = block_store_create("ze_tests.bs");
+    ASSERT_NE(bs, nullptr);
+    for (size_t i = 40; i < 50; ++i) {
+        memset(block, (int) i, sizeof(block));
+        ASSERT_TRUE(block_store_request(bs, i));
+        ASSERT_EQ(block_store_write(bs, i, block), (size_t) 512);
+    }
+    // The ten blocks, the FBM, and the two generation table blocks their stamps landed in
+    ASSERT_EQ(block_store_serialize(bs, "ze_tests.img"), (size_t) (10 + 16 + 2) * 512);
+    ASSERT_EQ(file_size("ze_tests.img"), (size_t) 65536 * 512 * 9 / 8);
+    int fd = open("ze_tests.img", O_RDONLY);
+    ASSERT_GE(fd, 0);
+    ASSERT_EQ(lseek(fd, 0, SEEK_DATA), (off_t) 40 * 512);
+    struct stat info;
+    ASSERT_EQ(fstat(fd, &info), 0);
+    ASSERT_LT((size_t) info.st_blocks * 512, (size_t) 1024 * 1024);
+    close(fd);
+    block_store_destroy(bs);
+    // SERIALIZE 2
+    bs = block_store_deserialize("ze_tests.img");
+    ASSERT_NE(bs, nullptr);
+    ASSERT_EQ(block_store_get_used_blocks(bs), (size_t) 26);
+    ASSERT_EQ(block_store_read(bs, 45, back), (size_t) 512);
+    memset(block, 45, sizeof(block));
+    ASSERT_EQ(memcmp(back, block, sizeof(block)), 0);
+    memset(block, 0x3c, sizeof(block));
+    ASSERT_EQ(block_store_write(bs, 45, block), (size_t) 512);
+    ASSERT_TRUE(block_store_request(bs, 70));
+    ASSERT_EQ(block_store_write(bs, 70, block), (size_t) 512);
+    ASSERT_TRUE(block_store_flush(bs));
+    // SERIALIZE 3
+    ASSERT_EQ(block_store_serialize(bs, "ze_tests_2.img"), (size_t) (11 + 16 + 2) * 512);
+    block_store_destroy(bs);
+    bs = block_store_deserialize("ze_tests.img");
+    ASSERT_NE(bs, nullptr);
+    ASSERT_EQ(block_store_get_used_blocks(bs), (size_t) 26);
+    ASSERT_EQ(block_store_read(bs, 45, back), (size_t) 512);
+    ASSERT_NE(memcmp(back, block, sizeof(block)), 0);
+    block_store_destroy(bs);
+    bs = block_store_open("ze_tests_2.img");
+    ASSERT_NE(bs, nullptr);
+    ASSERT_EQ(block_store_get_used_blocks(bs), (size_t) 27);
+    ASSERT_EQ(block_store_read(bs, 45, back), (size_t) 512);
+    ASSERT_EQ(memcmp(back, block, sizeof(block)), 0);
+    ASSERT_EQ(block_store_read(bs, 70, back), (size_t) 512);
+    ASSERT_EQ(memcmp(back, block, sizeof(block)), 0);
+    block_store_destroy(bs);
+    // SERIALIZE 4
+    F17FS_t *fs = fs_format("ze_tests.F17FS");
+    ASSERT_NE(fs, nullptr);
+    ASSERT_EQ(fs_create(fs, "/file", FS_REGULAR), 0);
+    int fd_file = fs_open(fs, "/file");
+    ASSERT_GE(fd_file, 0);
+    std::vector<uint8_t> data(40 * 512);
+    fill_pattern(data, 3);
+    ASSERT_EQ(fs_write(fs, fd_file, data.data(), data.size()), (ssize_t) data.size());
+    ASSERT_EQ(fs_close(fs, fd_file), 0);
+    ASSERT_EQ(fs_unmount(fs), 0);
+    bs = block_store_open("ze_tests.F17FS");
+    ASSERT_NE(bs, nullptr);
+    ASSERT_NE(block_store_serialize(bs, "ze_tests_fs.img"), (size_t) 0);
+    block_store_destroy(bs);
+    fs = fs_mount("ze_tests_fs.img");
+    ASSERT_NE(fs, nullptr);
+    fd_file = fs_open(fs, "/file");
+    ASSERT_GE(fd_file, 0);
+    std::vector<uint8_t> read_back(data.size());
+    ASSERT_EQ(fs_read(fs, fd_file, read_back.data(), read_back.size()), (ssize_t) read_back.size());
+    ASSERT_EQ(memcmp(read_back.data(), data.data(), data.size()), 0);
+    ASSERT_EQ(fs_close(fs, fd_file), 0);
+    ASSERT_EQ(fs_unmount(fs), 0);
+    // SERIALIZE 5
+    ASSERT_EQ(truncate("ze_tests_2.img", 65536 * 512), 0);
+    bs = block_store_deserialize("ze_tests_2.img");
+    ASSERT_NE(bs, nullptr);
+    ASSERT_EQ(block_store_get_used_blocks(bs), (size_t) 27);
+    ASSERT_EQ(block_store_read(bs, 70, back), (size_t) 512);
+    ASSERT_EQ(memcmp(back, block, sizeof(block)), 0);
+    ASSERT_EQ(block_store_get_generation(bs), (uint32_t) 1);
+    ASSERT_EQ(block_store_ext_read(bs, 0, back), (size_t) 512);
+    memset(block, 0, sizeof(block));
+    ASSERT_EQ(memcmp(back, block, sizeof(block)), 0);
+    block_store_destroy(bs);
+    ASSERT_EQ(file_size("ze_tests_2.img"), (size_t) 65536 * 512);
+    // SERIALIZE 6
+    ASSERT_EQ(block_store_deserialize(NULL), nullptr);
+    ASSERT_EQ(block_store_deserialize("ze_tests_missing.img"), nullptr);
+    ASSERT_EQ(truncate("ze_tests_2.img", 4096), 0);
+    ASSERT_EQ(block_store_deserialize("ze_tests_2.img"), nullptr);
+    bs = block_store_open("ze_tests.img");
+    ASSERT_NE(bs, nullptr);
+    ASSERT_EQ(block_store_serialize(NULL, "ze_tests_3.img"), (size_t) 0);
+    ASSERT_EQ(block_store_serialize(bs, NULL), (size_t) 0);
+    ASSERT_EQ(block_store_serialize(bs, "ze_tests_missing/x.img"), (size_t) 0);
+    block_store_destroy(bs);
+}
+
+/*
+   bool block_store_set_hole_punching(block_store_t *const bs, const bool enabled);
+   size_t block_store_get_punched_blocks(const block_store_t *const bs);
+   1. Normal, freed blocks are punched out of the file by the next flush and read back as zeros
+   2. Normal, a block allocated again before the flush keeps its data
+   3. Normal, blocks freed with punching off are left alone
+   4. Normal, removing a file from a mount with punchHoles shrinks the image on disk
+   5. Normal, a loaded image drops freed pages from memory and leaves the file alone
+   6. Error, NULL device
+*/
+static size_t disk_bytes(const char *path) {
+    struct stat info;
+    return stat(path, &info) == 0 ? (size_t) info.st_blocks * 512 : SIZE_MAX;
+}
+
+TEST(zf_tests, hole_punching) {
+    uint8_t block[512];
+    uint8_t back[512];
+    uint8_t zeros[512] = {0};
+    memset(block, 0x6b, sizeof(block));
+    // PUNCH 1
+    block_store_t *bs = block_store_create("zf_tests.bs");
+    ASSERT_NE(bs, nullptr);
+    ASSERT_TRUE(block_store_set_hole_punching(bs, true));
+    for (size_t i = 1000; i < 1256; ++i) {
+        ASSERT_TRUE(block_store_request(bs, i));
+        ASSERT_EQ(block_store_write(bs, i, block), (size_t) 512);
+    }
+    ASSERT_TRUE(block_store_flush(bs));
+    const size_t written = disk_bytes("zf_tests.bs");
+    for (size_t i = 1000; i < 1256; ++i) {
+        block_store_release(bs, i);
+    }
+    ASSERT_EQ(block_store_get_punched_blocks(bs), (size_t) 0);
+    ASSERT_TRUE(block_store_flush(bs));
+    ASSERT_EQ(block_store_get_punched_blocks(bs), (size_t) 256);
+    ASSERT_LE(disk_bytes("zf_tests.bs") + 256 * 512, written);
+    ASSERT_TRUE(block_store_request(bs, 1100));
+    ASSERT_EQ(block_store_read(bs, 1100, back), (size_t) 512);
+    ASSERT_EQ(memcmp(back, zeros, sizeof(zeros)), 0);
+    // PUNCH 2
+    ASSERT_EQ(block_store_write(bs, 1100, block), (size_t) 512);
+    block_store_release(bs, 1100);
+    ASSERT_TRUE(block_store_request(bs, 1100));
+    ASSERT_EQ(block_store_write(bs, 1100, block), (size_t) 512);
+    ASSERT_EQ(block_store_writeback(bs, 1000), (size_t) 2);
+    ASSERT_EQ(block_store_get_punched_blocks(bs), (size_t) 256);
+    ASSERT_EQ(block_store_read(bs, 1100, back), (size_t) 512);
+    ASSERT_EQ(memcmp(back, block, sizeof(block)), 0);
+    // PUNCH 3
+    ASSERT_TRUE(block_store_set_hole_punching(bs, false));
+    block_store_release(bs, 1100);
+    ASSERT_TRUE(block_store_flush(bs));
+    ASSERT_EQ(block_store_get_punched_blocks(bs), (size_t) 256);
+    ASSERT_EQ(block_store_read(bs, 1100, back), (size_t) 512);
+    ASSERT_EQ(memcmp(back, block, sizeof(block)), 0);
+    block_store_destroy(bs);
+    // PUNCH 4
+    F17FS_t *fs = fs_format("zf_tests.F17FS");
+    ASSERT_NE(fs, nullptr);
+    ASSERT_EQ(fs_unmount(fs), 0);
+    fs_mount_options_t options;
+    memset(&options, 0, sizeof(options));
+    options.punchHoles = true;
+    fs = fs_mount_with_options("zf_tests.F17FS", &options);
+    ASSERT_NE(fs, nullptr);
+    ASSERT_EQ(fs_create(fs, "/big", FS_REGULAR), 0);
+    int fd = fs_open(fs, "/big");
+    ASSERT_GE(fd, 0);
+    std::vector<uint8_t> data(2048 * 512);
+    fill_pattern(data, 5);
+    ASSERT_EQ(fs_write(fs, fd, data.data(), data.size()), (ssize_t) data.size());
+    ASSERT_EQ(fs_close(fs, fd), 0);
+    ASSERT_EQ(fs_sync(fs), 0);
+    const size_t full = disk_bytes("zf_tests.F17FS");
+    ASSERT_EQ(fs_remove(fs, "/big"), 0);
+    ASSERT_EQ(fs_sync(fs), 0);
+    ASSERT_LE(disk_bytes("zf_tests.F17FS") + 2000 * 512, full);
+    ASSERT_EQ(fs_unmount(fs), 0);
+    fs = fs_mount("zf_tests.F17FS");
+    ASSERT_NE(fs, nullptr);
+    ASSERT_EQ(fs_open(fs, "/big"), -1);
+    ASSERT_EQ(fs_unmount(fs), 0);
+    // PUNCH 5
+    bs = block_store_create("zf_tests.bs");
+    ASSERT_NE(bs, nullptr);
+    for (size_t i = 1024; i < 1088; ++i) {
+        ASSERT_TRUE(block_store_request(bs, i));
+        ASSERT_EQ(block_store_write(bs, i, block), (size_t) 512);
+    }
+    ASSERT_NE(block_store_serialize(bs, "zf_tests.img"), (size_t) 0);
+    block_store_destroy(bs);
+    const size_t image = disk_bytes("zf_tests.img");
+    bs = block_store_deserialize("zf_tests.img");
+    ASSERT_NE(bs, nullptr);
+    ASSERT_TRUE(block_store_set_hole_punching(bs, true));
+    for (size_t i = 1024; i < 1088; ++i) {
+        ASSERT_EQ(block_store_write(bs, i, zeros), (size_t) 512);
+        block_store_release(bs, i);
+    }
+    ASSERT_TRUE(block_store_flush(bs));
+    ASSERT_EQ(block_store_get_punched_blocks(bs), (size_t) 64);
+    ASSERT_TRUE(block_store_request(bs, 1024));
+    ASSERT_EQ(block_store_read(bs, 1024, back), (size_t) 512);
+    ASSERT_EQ(memcmp(back, block, sizeof(block)), 0);
+    block_store_destroy(bs);
+    ASSERT_EQ(disk_bytes("zf_tests.img"), image);
+    // PUNCH 6
+    ASSERT_FALSE(block_store_set_hole_punching(NULL, true));
+    ASSERT_EQ(block_store_get_punched_blocks(NULL), SIZE_MAX);
+}
+
+/*
+   block_store_t *block_store_open_with_options(const char *const fname, const block_store_map_options_t *const options);
+   1. Normal, a prefaulted device reads every block without taking page faults, a plain one takes them
+   2. Normal, a huge page mapping starts on a huge page boundary and keeps what's written
+   3. Normal, random and sequential hints, alone and with the others
+   4. Normal, a mount with prefault, huge pages and a random hint reads a file back
+   5. Error, NULL name, missing file, bad access hint
+*/
+static size_t minor_faults() {
+    struct rusage usage;
+    getrusage(RUSAGE_THREAD, &usage);
+    return (size_t) usage.ru_minflt;
+}
+
+static size_t faults_reading_all(block_store_t *bs) {
+    uint8_t back[512];
+    const size_t before = minor_faults();
+    for (size_t i = 0; i < block_store_get_total_blocks(); ++i) {
+        block_store_read(bs, i, back);
+    }
+    return minor_faults() - before;
+}
+
+TEST(zg_tests, mapping) {
+    uint8_t block[512];
+    uint8_t back[512];
+    memset(block, 0x47, sizeof(block));
+    block_store_t *bs = block_store_create("zg_tests.bs");
+    ASSERT_NE(bs, nullptr);
+    for (size_t i = 0; i < block_store_get_total_blocks(); i += 97) {
+        ASSERT_TRUE(block_store_request(bs, i));
+        ASSERT_EQ(block_store_write(bs, i, block), (size_t) 512);
+    }
+    ASSERT_TRUE(block_store_flush(bs));
+    block_store_destroy(bs);
+    // MAPPING 1
+    block_store_map_options_t options;
+    memset(&options, 0, sizeof(options));
+    options.prefault = true;
+    bs = block_store_open_with_options("zg_tests.bs", &options);
+    ASSERT_NE(bs, nullptr);
+    ASSERT_LT(faults_reading_all(bs), (size_t) 64);
+    block_store_destroy(bs);
+    bs = block_store_open("zg_tests.bs");
+    ASSERT_NE(bs, nullptr);
+    ASSERT_GT(faults_reading_all(bs), (size_t) 256);
+    block_store_destroy(bs);
+    // MAPPING 2
+    memset(&options, 0, sizeof(options));
+    options.hugepages = true;
+    bs = block_store_open_with_options("zg_tests.bs", &options);
+    ASSERT_NE(bs, nullptr);
+    FILE *maps = fopen("/proc/self/maps", "r");
+    ASSERT_NE(maps, nullptr);
+    char line[512];
+    size_t start = SIZE_MAX;
+    while (fgets(line, sizeof(line), maps)) {
+        if (strstr(line, "zg_tests.bs")) {
+            start = (size_t) strtoull(line, NULL, 16);
+            break;
+        }
+    }
+    fclose(maps);
+    ASSERT_NE(start, SIZE_MAX);
+    ASSERT_EQ(start % (2 * 1024 * 1024), (size_t) 0);
+    ASSERT_EQ(block_store_read(bs, 97, back), (size_t) 512);
+    ASSERT_EQ(memcmp(back, block, sizeof(block)), 0);
+    ASSERT_TRUE(block_store_request(bs, 98));
+    ASSERT_EQ(block_store_write(bs, 98, block), (size_t) 512);
+    ASSERT_TRUE(block_store_flush(bs));
+    block_store_destroy(bs);
+    bs = block_store_open("zg_tests.bs");
+    ASSERT_NE(bs, nullptr);
+    ASSERT_EQ(block_store_read(bs, 98, back), (size_t) 512);
+    ASSERT_EQ(memcmp(back, block, sizeof(block)), 0);
+    block_store_destroy(bs);
+    // MAPPING 3
+    const block_store_access_t hints[] = {BLOCK_STORE_ACCESS_RANDOM, BLOCK_STORE_ACCESS_SEQUENTIAL};
+    for (size_t i = 0; i < 4; ++i) {
+        memset(&options, 0, sizeof(options));
+        options.access = hints[i % 2];
+        options.prefault = options.hugepages = i >= 2;
+        bs = block_store_open_with_options("zg_tests.bs", &options);
+        ASSERT_NE(bs, nullptr);
+        ASSERT_EQ(block_store_read(bs, 97 * 3, back), (size_t) 512);
+        ASSERT_EQ(memcmp(back, block, sizeof(block)), 0);
+        if (options.prefault) {
+            ASSERT_LT(faults_reading_all(bs), (size_t) 64);
+        }
+        block_store_destroy(bs);
+    }
+    // MAPPING 4
+    F17FS_t *fs = fs_format("zg_tests.F17FS");
+    ASSERT_NE(fs, nullptr);
+    ASSERT_EQ(fs_create(fs, "/file", FS_REGULAR), 0);
+    int fd = fs_open(fs, "/file");
+    ASSERT_GE(fd, 0);
+    std::vector<uint8_t> data(300 * 512);
+    fill_pattern(data, 7);
+    ASSERT_EQ(fs_write(fs, fd, data.data(), data.size()), (ssize_t) data.size());
+    ASSERT_EQ(fs_close(fs, fd), 0);
+    ASSERT_EQ(fs_unmount(fs), 0);
+    fs_mount_options_t mount_options;
+    memset(&mount_options, 0, sizeof(mount_options));
+    mount_options.prefault = true;
+    mount_options.hugePages = true;
+    mount_options.access = BLOCK_STORE_ACCESS_RANDOM;
+    fs = fs_mount_with_options("zg_tests.F17FS", &mount_options);
+    ASSERT_NE(fs, nullptr);
+    fd = fs_open(fs, "/file");
+    ASSERT_GE(fd, 0);
+    std::vector<uint8_t> read_back(data.size());
+    ASSERT_EQ(fs_read(fs, fd, read_back.data(), read_back.size()), (ssize_t) read_back.size());
+    ASSERT_EQ(memcmp(read_back.data(), data.data(), data.size()), 0);
+    ASSERT_EQ(fs_close(fs, fd), 0);
+    ASSERT_EQ(fs_unmount(fs), 0);
+    // MAPPING 5
+    memset(&options, 0, sizeof(options));
+    ASSERT_EQ(block_store_open_with_options(NULL, &options), nullptr);
+    ASSERT_EQ(block_store_open_with_options("zg_tests_missing.bs", &options), nullptr);
+    options.access = (block_store_access_t) 7;
+    ASSERT_EQ(block_store_open_with_options("zg_tests.bs", &options), nullptr);
+    bs = block_store_open_with_options("zg_tests.bs", NULL);
+    ASSERT_NE(bs, nullptr);
+    block_store_destroy(bs);
+}
+
+/*
+   block_store_t *block_store_create_mem();
+   F17FS_t *fs_format_mem();
+   int fs_serialize(F17FS_t *fs, const char *path);
+   1. Normal, an in-memory device reads back what's written, flushes have nothing left dirty
+   2. Normal, it serializes to a file that opens and loads as a device
+   3. Normal, hole punching and incremental export work in memory too
+   4. Normal, an in-memory F17FS saves to an image that mounts and checks clean
+   5. Normal, in-memory file systems are independent of each other
+   6. Error, NULL file system, NULL and empty paths, unwritable destination
+*/
+TEST(zh_tests, memory) {
+    uint8_t block[512];
+    uint8_t back[512];
+    memset(block, 0x5d, sizeof(block));
+    // MEMORY 1
+    block_store_t *bs = block_store_create_mem();
+    ASSERT_NE(bs, nullptr);
+    ASSERT_EQ(block_store_get_used_blocks(bs), (size_t) 16);
+    for (size_t i = 200; i < 264; ++i) {
+        ASSERT_TRUE(block_store_request(bs, i));
+        ASSERT_EQ(block_store_write(bs, i, block), (size_t) 512);
+    }
+    ASSERT_EQ(block_store_read(bs, 231, back), (size_t) 512);
+    ASSERT_EQ(memcmp(back, block, sizeof(block)), 0);
+    ASSERT_NE(block_store_get_dirty_blocks(bs), (size_t) 0);
+    ASSERT_TRUE(block_store_flush(bs));
+    ASSERT_EQ(block_store_get_dirty_blocks(bs), (size_t) 0);
+    // MEMORY 2
+    // The blocks, the FBM, and three generation table blocks (the blocks' stamps straddle two)
+    ASSERT_EQ(block_store_serialize(bs, "zh_tests.img"), (size_t) (64 + 16 + 3) * 512);
+    block_store_t *copy = block_store_open("zh_tests.img");
+    ASSERT_NE(copy, nullptr);
+    ASSERT_EQ(block_store_get_used_blocks(copy), (size_t) 80);
+    ASSERT_EQ(block_store_read(copy, 263, back), (size_t) 512);
+    ASSERT_EQ(memcmp(back, block, sizeof(block)), 0);
+    block_store_destroy(copy);
+    copy = block_store_deserialize("zh_tests.img");
+    ASSERT_NE(copy, nullptr);
+    ASSERT_EQ(block_store_read(copy, 200, back), (size_t) 512);
+    ASSERT_EQ(memcmp(back, block, sizeof(block)), 0);
+    block_store_destroy(copy);
+    // MEMORY 3
+    ASSERT_TRUE(block_store_set_hole_punching(bs, true));
+    for (size_t i = 200; i < 232; ++i) {
+        block_store_release(bs, i);
+    }
+    ASSERT_TRUE(block_store_flush(bs));
+    ASSERT_EQ(block_store_get_punched_blocks(bs), (size_t) 32);
+    ASSERT_TRUE(block_store_request(bs, 200));
+    ASSERT_EQ(block_store_read(bs, 200, back), (size_t) 512);
+    uint8_t zeros[512] = {0};
+    ASSERT_EQ(memcmp(back, zeros, sizeof(zeros)), 0);
+    ASSERT_NE(block_store_export_incremental(bs, 0, "zh_tests.delta"), (size_t) 0);
+    copy = block_store_create_mem();
+    ASSERT_NE(copy, nullptr);
+    ASSERT_EQ(block_store_apply_incremental(copy, "zh_tests.delta"), (size_t) (33 + 16 + 256));
+    ASSERT_EQ(block_store_get_used_blocks(copy), block_store_get_used_blocks(bs));
+    ASSERT_EQ(block_store_read(copy, 240, back), (size_t) 512);
+    ASSERT_EQ(memcmp(back, block, sizeof(block)), 0);
+    block_store_destroy(copy);
+    block_store_destroy(bs);
+    // MEMORY 4
+    F17FS_t *fs = fs_format_mem();
+    ASSERT_NE(fs, nullptr);
+    ASSERT_EQ(fs_create(fs, "/dir", FS_DIRECTORY), 0);
+    ASSERT_EQ(fs_create(fs, "/dir/file", FS_REGULAR), 0);
+    int fd = fs_open(fs, "/dir/file");
+    ASSERT_GE(fd, 0);
+    std::vector<uint8_t> data(500 * 512 + 77);
+    fill_pattern(data, 11);
+    ASSERT_EQ(fs_write(fs, fd, data.data(), data.size()), (ssize_t) data.size());
+    ASSERT_EQ(fs_close(fs, fd), 0);
+    ASSERT_EQ(fs_serialize(fs, "zh_tests.F17FS"), 0);
+    ASSERT_EQ(fs_unmount(fs), 0);
+    fs_fsck_report_t report;
+    ASSERT_EQ(fs_fsck("zh_tests.F17FS", false, 1, &report), 0);
+    fs = fs_mount("zh_tests.F17FS");
+    ASSERT_NE(fs, nullptr);
+    fd = fs_open(fs, "/dir/file");
+    ASSERT_GE(fd, 0);
+    std::vector<uint8_t> read_back(data.size());
+    ASSERT_EQ(fs_read(fs, fd, read_back.data(), read_back.size()), (ssize_t) read_back.size());
+    ASSERT_EQ(memcmp(read_back.data(), data.data(), data.size()), 0);
+    ASSERT_EQ(fs_close(fs, fd), 0);
+    ASSERT_EQ(fs_unmount(fs), 0);
+    // MEMORY 5
+    F17FS_t *first = fs_format_mem();
+    F17FS_t *second = fs_format_mem();
+    ASSERT_NE(first, nullptr);
+    ASSERT_NE(second, nullptr);
+    ASSERT_EQ(fs_create(first, "/only_first", FS_REGULAR), 0);
+    ASSERT_EQ(fs_open(second, "/only_first"), -1);
+    ASSERT_EQ(fs_create(second, "/only_first", FS_REGULAR), 0);
+    ASSERT_EQ(fs_unmount(first), 0);
+    ASSERT_EQ(fs_unmount(second), 0);
+    // MEMORY 6
+    fs = fs_format_mem();
+    ASSERT_NE(fs, nullptr);
+    ASSERT_LT(fs_serialize(NULL, "zh_tests_2.F17FS"), 0);
+    ASSERT_LT(fs_serialize(fs, NULL), 0);
+    ASSERT_LT(fs_serialize(fs, ""), 0);
+    ASSERT_LT(fs_serialize(fs, "zh_tests_missing/x.F17FS"), 0);
+    ASSERT_EQ(fs_unmount(fs), 0);
+}
 
 int main(int argc, char **argv) {
     ::testing::InitGoogleTest(&argc, argv);
@@ -0,0 +1,81 @@
+#include <cstdlib>
+#include <gtest/gtest.h>
+extern "C" {
+#include "F17FS.h"
+}
+
+// Built on its own: the malloc/calloc/realloc below replace the allocator for the whole binary, and only
+// this test should run under them.
+
+// Counts heap allocations made by the calling thread while counting_allocations is set
+static thread_local bool counting_allocations = false;
+static thread_local size_t allocation_count = 0;
+#ifdef __GLIBC__
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void *malloc(size_t size) noexcept {
+    allocation_count += counting_allocations;
+    return __libc_malloc(size);
+}
+void *calloc(size_t count, size_t size) noexcept {
+    allocation_count += counting_allocations;
+    return __libc_calloc(count, size);
+}
+void *realloc(void *ptr, size_t size) noexcept {
+    allocation_count += counting_allocations;
+    return __libc_realloc(ptr, size);
+}
+}
+#endif
+
+// Runs call and returns how many allocations it made
+template <typename Call>
+static size_t allocations_in(Call call) {
+    allocation_count = 0;
+    counting_allocations = true;
+    call();
+    counting_allocations = false;
+    return allocation_count;
+}
+
+/*
+   fs_create / fs_open / fs_write / fs_seek / fs_read / fs_close (steady state)
+   1. Normal, no heap allocation in any of them once the mount is warm
+*/
+TEST(n_tests, zero_malloc) {
+    const char *test_fname = "n_tests.F17FS";
+    F17FS *fs = fs_format(test_fname);
+    ASSERT_NE(fs, nullptr);
+    uint8_t buffer[1024] = {0};
+    ASSERT_EQ(fs_create(fs, "/dir", FS_DIRECTORY), 0);
+    ASSERT_EQ(fs_create(fs, "/dir/warm", FS_REGULAR), 0);
+    int fd = fs_open(fs, "/dir/warm");
+    ASSERT_GE(fd, 0);
+    ASSERT_EQ(fs_close(fs, fd), 0);
+    // ZERO_MALLOC 1
+    int created = -1;
+    ASSERT_EQ(allocations_in([&] { created = fs_create(fs, "/dir/file", FS_REGULAR); }), (size_t) 0);
+    ASSERT_EQ(created, 0);
+    ASSERT_EQ(allocations_in([&] { fd = fs_open(fs, "/dir/file"); }), (size_t) 0);
+    ASSERT_GE(fd, 0);
+    ssize_t written = -1;
+    ASSERT_EQ(allocations_in([&] { written = fs_write(fs, fd, buffer, sizeof(buffer)); }), (size_t) 0);
+    ASSERT_EQ(written, (ssize_t) sizeof(buffer));
+    off_t position = -1;
+    ASSERT_EQ(allocations_in([&] { position = fs_seek(fs, fd, 0, FS_SEEK_SET); }), (size_t) 0);
+    ASSERT_EQ(position, 0);
+    ssize_t read = -1;
+    ASSERT_EQ(allocations_in([&] { read = fs_read(fs, fd, buffer, sizeof(buffer)); }), (size_t) 0);
+    ASSERT_EQ(read, (ssize_t) sizeof(buffer));
+    int closed = -1;
+    ASSERT_EQ(allocations_in([&] { closed = fs_close(fs, fd); }), (size_t) 0);
+    ASSERT_EQ(closed, 0);
+    fs_unmount(fs);
+}
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}